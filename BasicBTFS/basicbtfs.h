@@ -1,6 +1,13 @@
 #ifndef BASICBTFS_H
 #define BASICBTFS_H
 
+#include <linux/types.h>
+
+#ifdef __KERNEL__
+#include <linux/completion.h>
+#include <linux/kobject.h>
+#endif
+
 #define BASICBTFS_MAGIC_NUMBER         0x1DEADBAD
 #define BASICBTFS_IOCTL_MAGIC          0x94
 #define BASICBTFS_BLOCKSIZE            (1 << 12)
@@ -19,6 +26,10 @@
 #define BASICBTFS_EMPTY_NAME_TREE      ((BASICBTFS_BLOCKSIZE - BASICBTFS_NAME_ENTRY_S_OFFSET))
 #define BASICBTFS_NAME_ENTRY_S_OFFSET  ((sizeof(struct basicbtfs_name_list_hdr) + sizeof(uint32_t)))
 #define BASICBTFS_WORDS_PER_BLOCK      ((BASICBTFS_BLOCKSIZE / sizeof(struct basicbtfs_fileblock_info)))
+#define BASICBTFS_INLINE_DIR_DATA_SIZE (BASICBTFS_BLOCKSIZE - 4 * sizeof(uint32_t))
+#define BASICBTFS_INLINE_DIR_MAX_FILES (2 * BASICBTFS_MIN_DEGREE - 1) /* converts into a single btree leaf */
+#define BASICBTFS_DT_TYPE(mode)        (((mode) & S_IFMT) >> 12) /* DT_* value of an inode mode */
+#define BASICBTFS_READAHEAD_INODES     256 /* inode numbers a readdir collects before reading their blocks ahead */
 
 
 #define BASICBTFS_MAX_CACHE_DIR_ENTRIES    100
@@ -27,8 +38,45 @@
 #define BASICBTFS_BLOCKTYPE_BTREE_NODE    0x01
 #define BASICBTFS_BLOCKTYPE_NAMETREE      0x02
 #define BASICBTFS_BLOCKTYPE_CLUSTER_TABLE 0x03
+#define BASICBTFS_BLOCKTYPE_INLINE_DIR    0x04
+
+#define BASICBTFS_DEFRAG_DIR_CHURN    256 /* namespace operations in a directory after which it is queued for defrag */
+#define BASICBTFS_DEFRAG_FILE_EXTENTS 8 /* clusters a file got away from its previous one before it is queued */
+#define BASICBTFS_DEFRAG_MAX_COST     256 /* blocks a queued inode may copy per run it gets rid of */
+#define BASICBTFS_DEFRAG_THRESHOLD 20 /* percentage of free blocks in the allocated area that starts a background pass */
+#define BASICBTFS_DEFRAG_DELAY_MS  100 /* pause between two slices of a background pass */
+#define BASICBTFS_DEFRAG_RATE      2560 /* blocks per second a background pass moves at most */
+#define BASICBTFS_DEFRAG_POLL_MS   5000 /* how often an idle defragmenter checks the score on its own */
+
+#define BASICBTFS_BGDEFRAG_IDLE    0
+#define BASICBTFS_BGDEFRAG_RUNNING 1
+#define BASICBTFS_BGDEFRAG_PAUSED  2
+
+/* how BASICBTFS_IOC_DEFRAG packs the disk, see defrag.c */
+#define BASICBTFS_DEFRAG_MODE_PLAN 0
+#define BASICBTFS_DEFRAG_MODE_SWAP 1
+#define BASICBTFS_DEFRAG_BATCH     256 /* blocks a planned pass reads with one submission */
+
+#define BASICBTFS_NAMELIST_COMPACT_PERCENT 25 /* live bytes below which a name list block is compacted */
+#define BASICBTFS_NAMELIST_MAX_WALK        16 /* full blocks an insert looks at before it links in a new one */
+
+#define BASICBTFS_FEATURE_BPTREE  0x1 /* directories are B+-trees with linked leaves */
+#define BASICBTFS_FEATURE_JOURNAL 0x2 /* metadata goes through a jbd2 journal, see journal.h */
 
-#define BASICBTFS_DEFRAG_PERIOD 100
+#define BASICBTFS_JOURNAL_BLOCKS         8192 /* size of the journal mkfs -j reserves at the end of the disk */
+#define BASICBTFS_JOURNAL_INODE_CREDITS  4    /* inode bitmap, inode table, first block and its bitmap block of a new inode */
+#define BASICBTFS_JOURNAL_FREE_CREDITS(sbi) ((sbi)->s_bmap_blocks + 2) /* bitmap and inode table blocks freeing an inode touches */
+#define BASICBTFS_JOURNAL_ALLOC_CREDITS  8    /* cluster table, file map, bitmap and inode blocks of a cluster allocation */
+
+#define BASICBTFS_FSYNC_SHARED_BLOCKS 8 /* file map and bitmap blocks a file remembers for its fsync */
+
+#define BASICBTFS_BTREE_MAX_HEIGHT  8
+#define BASICBTFS_BTREE_FILL_FACTOR 90 /* percentage of a node filled by the bulk loader */
+#define BASICBTFS_BTREE_LOW_WATER   (BASICBTFS_MIN_DEGREE / 4) /* keys below which relaxed deletion rebalances */
+
+#define BASICBTFS_BLOOM_BITS_PER_FILE 10 /* about 1% false positives with 4 hashes */
+#define BASICBTFS_BLOOM_HASHES        4
+#define BASICBTFS_BLOOM_MIN_FILES     1024
 
 struct basicbtfs_ioctl_vol_args {
     int fd;
@@ -36,6 +84,35 @@ struct basicbtfs_ioctl_vol_args {
 };
 
 #define BASICBTFS_IOC_DEFRAG _IOW(BASICBTFS_IOCTL_MAGIC, 1, struct basicbtfs_ioctl_vol_args)
+#define BASICBTFS_IOC_DEFRAG_FILE _IO(BASICBTFS_IOCTL_MAGIC, 2) /* on a regular file, returns the number of blocks moved */
+
+#define BASICBTFS_STAT_BUCKETS 24 /* bucket i of a histogram counts values from 2^i to 2^(i + 1) - 1, the last one everything above */
+
+/*
+ * Layout of the disk, filled in by BASICBTFS_IOC_FRAG_STAT on any file or directory of the
+ * filesystem, for CAP_SYS_ADMIN only. The 64-bit counters come first, so the layout has no padding and is the same
+ * for 32-bit and 64-bit callers.
+ */
+struct basicbtfs_ioctl_frag_stat {
+    __u64 nr_of_file_extents;
+    __u64 nr_of_free_extents;
+    __u64 nr_of_free_blocks;
+    __u64 nr_of_btree_nodes;
+    __u64 nr_of_btree_keys; /* the fill factor is keys over nodes times 2 * BASICBTFS_MIN_DEGREE - 1 */
+    __u64 nr_of_name_list_blocks;
+    __u64 dir_distance_sum;
+    __u64 nr_of_dir_distances;
+    __u32 nr_of_files;
+    __u32 nr_of_dirs;
+    __u32 nr_of_inline_dirs;
+    __u32 largest_free_extent;
+    __u32 file_extents[BASICBTFS_STAT_BUCKETS]; /* files by the number of runs their cluster table and clusters take */
+    __u32 free_extents[BASICBTFS_STAT_BUCKETS]; /* runs of free blocks behind the file map by length */
+    __u32 name_list_chains[BASICBTFS_STAT_BUCKETS]; /* btree directories by the number of name list blocks */
+    __u32 dir_distances[BASICBTFS_STAT_BUCKETS]; /* distance between two consecutive metadata blocks of a directory */
+};
+
+#define BASICBTFS_IOC_FRAG_STAT _IOR(BASICBTFS_IOCTL_MAGIC, 3, struct basicbtfs_ioctl_frag_stat)
 
 struct basicbtfs_inode {
     uint32_t i_mode;
@@ -60,6 +137,51 @@ struct basicbtfs_fileblock_info {
 #define BASICBTFS_INODES_PER_BLOCK (BASICBTFS_BLOCKSIZE / sizeof(struct basicbtfs_inode))
 #define BASICBTFS_FBLOCK_INFO_PER_BLOCK (BASICBTFS_BLOCKSIZE / sizeof(struct basicbtfs_fileblock_info))
 
+#ifdef __KERNEL__
+/* Counters of a mount, see stats.h and /sys/fs/basicbtfs/<dev>/stats */
+enum basicbtfs_stat_item {
+    BASICBTFS_STAT_LOOKUPS,
+    BASICBTFS_STAT_BLOOM_NEGATIVES, /* lookups the bloom filter answered */
+    BASICBTFS_STAT_CACHE_NEGATIVES, /* misses of fully cached directories, answered without reading the disk */
+    BASICBTFS_STAT_NODE_HITS, /* btree nodes a lookup found in memory */
+    BASICBTFS_STAT_NODE_MISSES, /* btree nodes a lookup read from disk */
+    BASICBTFS_STAT_SPLITS,
+    BASICBTFS_STAT_MERGES,
+    BASICBTFS_STAT_NAME_INSERTS,
+    BASICBTFS_STAT_NAME_BLOCKS_WALKED,
+    BASICBTFS_STAT_BLOCKS_ALLOCATED,
+    BASICBTFS_STAT_BLOCKS_FREED,
+    BASICBTFS_STAT_BITMAP_SCANS,
+    BASICBTFS_STAT_BITMAP_SCANNED, /* bits the scans went past before finding a free area */
+    BASICBTFS_STAT_DEFRAG_MOVES,
+    BASICBTFS_STAT_DEFRAG_MOVED_BLOCKS,
+    BASICBTFS_STAT_GET_BLOCKS,
+    BASICBTFS_NR_STATS,
+};
+
+/* Latency histograms of a mount, see /sys/kernel/debug/basicbtfs/<dev>/latency */
+enum basicbtfs_lat_item {
+    BASICBTFS_LAT_LOOKUP,
+    BASICBTFS_LAT_INSERT,
+    BASICBTFS_LAT_GET_BLOCK,
+    BASICBTFS_LAT_ALLOC,
+    BASICBTFS_LAT_CREATE, /* create and mkdir */
+    BASICBTFS_LAT_UNLINK,
+    BASICBTFS_LAT_RENAME,
+    BASICBTFS_LAT_ITERATE,
+    BASICBTFS_LAT_WRITE_INODE,
+    BASICBTFS_NR_LATS,
+};
+
+/* bucket i counts the calls that took [2^i, 2^(i+1)) ns, the last one everything slower */
+#define BASICBTFS_LAT_BUCKETS 32
+
+struct basicbtfs_stats {
+    uint64_t count[BASICBTFS_NR_STATS];
+    uint64_t latency[BASICBTFS_NR_LATS][BASICBTFS_LAT_BUCKETS];
+};
+#endif
+
 struct basicbtfs_sb_info {
     uint32_t s_magic;
     uint32_t s_nblocks;
@@ -72,19 +194,61 @@ struct basicbtfs_sb_info {
     uint32_t s_nfree_blocks;
     uint32_t s_cache_dir_entries;
     uint32_t s_unused_area;
+    uint32_t s_features;
+    uint32_t s_journal_bno;
+    uint32_t s_journal_blocks;
 
 #ifdef __KERNEL__
+    struct super_block *s_sb;
+    struct journal_s *s_journal; /* NULL without BASICBTFS_FEATURE_JOURNAL */
+
     unsigned long *s_ifree_bitmap;
     unsigned long *s_bfree_bitmap;
-#endif
-};
 
-#ifdef __KERNEL__
-
-struct basicbtfs_inode_info {
-    uint32_t i_bno;
-    char i_data[32];
-    struct inode vfs_inode;
+    /* mount options */
+    bool s_relaxed_delete;
+    uint32_t s_low_water;
+
+    /* bumped by every defrag run, which moves name list blocks under open readdirs */
+    uint32_t s_defrag_runs;
+
+    /* directories whose blocks are pinned in memory, see cache.h, and the lock of all their lists */
+    struct list_head s_dir_cache;
+    struct mutex s_dir_cache_lock;
+
+    /*
+     * Background defragmenter, see defrag.c. Every operation that reads or changes where blocks
+     * are holds s_defrag_lock shared, a slice that moves blocks holds it exclusively.
+     */
+    struct rw_semaphore s_defrag_lock;
+    struct task_struct *s_defrag_task;
+    uint32_t s_defrag_state;
+    uint32_t s_defrag_ino; /* inode the running or paused pass continues at */
+    uint32_t s_defrag_threshold;
+    uint32_t s_defrag_delay_ms;
+    uint32_t s_defrag_rate;
+    uint64_t s_defrag_moved_blocks;
+    uint32_t s_defrag_passes;
+    uint32_t s_defrag_mode;
+
+    /* inodes whose churn reached s_defrag_dir_churn or s_defrag_file_extents, see init.h */
+    unsigned long *s_defrag_queue;
+    uint32_t s_defrag_dir_churn;
+    uint32_t s_defrag_file_extents;
+    uint32_t s_defrag_max_cost;
+    uint32_t s_defrag_targeted; /* queued inodes that were defragmented */
+    uint32_t s_defrag_skipped; /* queued inodes that were left alone, too few runs for their size */
+
+    /* per cpu, summed up when read */
+    struct basicbtfs_stats __percpu *s_stats;
+
+    /* /sys/fs/basicbtfs/<dev>, see sysfs.c */
+    struct kobject s_kobj;
+    struct completion s_kobj_unregister;
+
+    /* /sys/kernel/debug/basicbtfs/<dev>, see sysfs.c */
+    struct dentry *s_debugfs;
+#endif
 };
 
 struct basicbtfs_entry {
@@ -96,7 +260,9 @@ struct basicbtfs_entry {
 
 struct basicbtfs_name_entry {
     uint32_t ino;
-    uint32_t name_length;
+    uint16_t name_length;
+    uint8_t file_type; /* DT_* type of ino, so readdir does not need to read the inode */
+    uint8_t reserved;
 };
 
 struct basicbtfs_name_list_hdr {
@@ -105,6 +271,7 @@ struct basicbtfs_name_list_hdr {
     uint32_t nr_of_entries;
     uint32_t next_block;
     uint32_t prev_block;
+    uint32_t free_hint; /* first block only: block of the list where the next insert starts looking */
     bool first_list;
 };
 
@@ -139,17 +306,28 @@ struct basicbtfs_btree_node {
     uint32_t nr_times_done;
     bool leaf;
     bool root;
+    uint32_t next_leaf; /* B+-tree leaves only */
+    uint32_t prev_leaf;
 };
 
-struct basicbtfs_btree_node_cache {
-    struct list_head list;
-    struct basicbtfs_entry entries[2 * BASICBTFS_MIN_DEGREE - 1];
-    struct basicbtfs_btree_node_cache *children[2 * BASICBTFS_MIN_DEGREE];
-    uint32_t tree_name_bno;
-    uint32_t nr_of_keys;
+/*
+ * Small directories keep their entries in the root block itself: records of
+ * basicbtfs_inline_dir_entry followed by the name, sorted on hash and packed
+ * without holes. The directory becomes a btree with a name list once it overflows.
+ */
+struct basicbtfs_inline_dir_entry {
+    uint32_t ino;
+    uint32_t hash;
+    uint16_t name_length;
+    uint8_t file_type;
+    uint8_t reserved;
+};
+
+struct basicbtfs_inline_dir {
     uint32_t nr_of_files;
-    uint32_t nr_times_done;
-    bool leaf;
+    uint32_t ino;
+    uint32_t used_bytes;
+    char data[BASICBTFS_INLINE_DIR_DATA_SIZE];
 };
 
 struct basicbtfs_disk_block {
@@ -158,6 +336,7 @@ struct basicbtfs_disk_block {
         struct basicbtfs_btree_node btree_node;
         struct basicbtfs_cluster_table cluster_table;
         struct basicbtfs_name_list_hdr name_list_hdr;
+        struct basicbtfs_inline_dir inline_dir;
     } block_type;
 };
 
@@ -165,23 +344,143 @@ struct basicbtfs_block {
     char block[BASICBTFS_BLOCKSIZE];
 };
 
-struct basicbtfs_btree_dir_cache_list {
-    struct list_head list;
-    uint32_t bno;
-    uint32_t nr_of_blocks;
-    struct basicbtfs_btree_node_cache *root_node_cache;
-    struct basicbtfs_name_tree_cache *name_tree_cache;
+/*
+ * Shape of a bulk loaded btree. Level 0 holds the leaves, level height - 1 the root.
+ * Nodes are numbered top down, so the root is node 0 and every level follows the
+ * one above it; first_node[level] is the number of the first node of a level.
+ */
+struct basicbtfs_btree_bulk_plan {
+    bool linked_leaves;
+    uint32_t height;
+    uint32_t total_nodes;
+    uint32_t nr_of_keys[BASICBTFS_BTREE_MAX_HEIGHT];
+    uint32_t nr_of_nodes[BASICBTFS_BTREE_MAX_HEIGHT];
+    uint32_t first_node[BASICBTFS_BTREE_MAX_HEIGHT];
+};
+
+/*
+ * Returns the amount of nodes needed to store nr_of_keys keys on one level. With separators
+ * set, one key between every two nodes moves up to the next level; B+-tree leaves keep all
+ * their keys and only copy one up.
+ */
+static inline uint32_t basicbtfs_btree_bulk_nr_of_nodes(uint32_t nr_of_keys, uint32_t fill_factor, uint32_t separators) {
+    uint32_t max_keys = 2 * BASICBTFS_MIN_DEGREE - 1;
+    uint32_t target = max_keys * fill_factor / 100;
+    uint32_t nr_of_nodes = 0, max_nodes = 0;
+
+    if (nr_of_keys <= max_keys) {
+        return 1;
+    }
+
+    if (target < BASICBTFS_MIN_DEGREE - 1) {
+        target = BASICBTFS_MIN_DEGREE - 1;
+    } else if (target > max_keys) {
+        target = max_keys;
+    }
+
+    nr_of_nodes = (nr_of_keys + separators + target + separators - 1) / (target + separators);
+    max_nodes = (nr_of_keys + separators) / (BASICBTFS_MIN_DEGREE - 1 + separators);
+
+    return nr_of_nodes > max_nodes ? max_nodes : nr_of_nodes;
+}
+
+/* Returns the amount of keys stored in node index of level */
+static inline uint32_t basicbtfs_btree_bulk_nr_of_keys(struct basicbtfs_btree_bulk_plan *plan, uint32_t level, uint32_t index) {
+    uint32_t nr_of_nodes = plan->nr_of_nodes[level];
+    uint32_t nr_of_keys = plan->nr_of_keys[level];
+
+    if (level > 0 || !plan->linked_leaves) {
+        nr_of_keys -= nr_of_nodes - 1;
+    }
+
+    return nr_of_keys / nr_of_nodes + (index < nr_of_keys % nr_of_nodes ? 1 : 0);
+}
+
+static inline int basicbtfs_btree_bulk_plan(struct basicbtfs_btree_bulk_plan *plan, uint32_t nr_of_entries, uint32_t fill_factor, bool linked_leaves) {
+    uint32_t nr_of_keys = nr_of_entries, offset = 0;
+    int level = 0;
+
+    plan->linked_leaves = linked_leaves;
+    plan->height = 0;
+    plan->total_nodes = 0;
+
+    do {
+        if (plan->height == BASICBTFS_BTREE_MAX_HEIGHT) {
+            return -1;
+        }
+
+        level = plan->height++;
+        plan->nr_of_keys[level] = nr_of_keys;
+        plan->nr_of_nodes[level] = basicbtfs_btree_bulk_nr_of_nodes(nr_of_keys, fill_factor, level > 0 || !linked_leaves);
+        plan->total_nodes += plan->nr_of_nodes[level];
+        nr_of_keys = plan->nr_of_nodes[level] - 1;
+    } while (plan->nr_of_nodes[level] > 1);
+
+    for (level = plan->height - 1; level >= 0; level--) {
+        plan->first_node[level] = offset;
+        offset += plan->nr_of_nodes[level];
+    }
+
+    return 0;
+}
+
+#ifdef __KERNEL__
+
+struct basicbtfs_bloom {
+    uint32_t bits_shift; /* the filter has 1 << bits_shift bits */
+    uint32_t capacity;
+    uint32_t nr_of_hashes;
+    unsigned long bits[];
 };
 
-struct basicbtfs_name_tree_cache {
+struct basicbtfs_inode_info {
+    uint32_t i_bno;
+    char i_data[32];
+    struct basicbtfs_bloom *i_bloom; /* directories only, see bloom.h */
+    uint32_t i_sync_tid; /* transaction that last journaled the inode or its blocks, fsync waits for it */
+    uint32_t i_shared_bnos[BASICBTFS_FSYNC_SHARED_BLOCKS]; /* without a journal, blocks shared with other files that fsync writes */
+    uint32_t i_nr_shared_bnos; /* BASICBTFS_FSYNC_SHARED_BLOCKS + 1 once more were dirtied */
+    uint32_t i_churn; /* namespace operations of a directory or scattered clusters of a file since its last defrag */
+    struct rw_semaphore i_defrag_sem; /* regular files only, get_block reads the cluster table under it, see defrag.c */
+    struct inode vfs_inode;
+};
+
+/*
+ * Readdir state of a directory file, kept in file->private_data. For btree directories it
+ * holds where the last getdents call stopped. That position is only used when ctx->pos, the
+ * directory version and the defrag run still match, otherwise the position is looked up
+ * again by counting names from the start. For hash based positions it holds the hash the
+ * last call stopped at, as one position can hold more than one hash.
+ */
+struct basicbtfs_dir_cursor {
+    loff_t pos;
+    u64 version;
+    uint32_t defrag_runs;
+    uint32_t name_bno; /* 0 once the whole name list has been emitted */
+    uint32_t offset;
+    uint32_t hash;
+
+    /* inodes emitted by the current getdents call, see basicbtfs_readahead_actor */
+    uint32_t nr_of_inos;
+    uint32_t inos[BASICBTFS_READAHEAD_INODES];
+};
+
+/*
+ * A cached directory. Its btree nodes and name list blocks stay in the buffer cache for as
+ * long as the directory is cached, as every one of them is held by a basicbtfs_cached_block.
+ */
+struct basicbtfs_btree_dir_cache_list {
     struct list_head list;
-    uint32_t name_bno;
-    struct basicbtfs_block *name_tree_block;
+    uint32_t bno; /* root of the directory tree */
+    uint32_t nr_of_blocks;
+    bool complete; /* every block of the directory is pinned, a lookup never reads the disk */
+    struct list_head blocks;
 };
 
-struct basicbtfs_btree_node_hdr_cache {
+struct basicbtfs_cached_block {
     struct list_head list;
-    struct basicbtfs_btree_node_cache *node;
+    uint32_t bno;
+    struct buffer_head *bh;
 };
 
 struct basicbtfs_file_cache {
@@ -200,26 +499,18 @@ struct basicbtfs_file_cache_list {
 /* Cache functions for basic_inode_info*/
 int basicbtfs_init_inode_cache(void);
 int basicbtfs_init_btree_dir_cache(void);
-int basicbtfs_init_btree_node_data_cache(void);
-int basicbtfs_init_nametree_hdr_cache(void);
-int basicbtfs_init_file_cache(void);
+int basicbtfs_init_cached_block_cache(void);
 
 void basicbtfs_destroy_inode_cache(void);
 void basicbtfs_destroy_btree_dir_cache(void);
-void basicbtfs_destroy_btree_node_data_cache(void);
-void basicbtfs_destroy_nametree_hdr_cache(void);
-void basicbtfs_destroy_file_cache(void);
+void basicbtfs_destroy_cached_block_cache(void);
 
 
-void basicbtfs_destroy_btree_node_data(struct basicbtfs_btree_node_cache *cache_node);
-void basicbtfs_destroy_nametree_hdr(struct basicbtfs_name_tree_cache *cache_node);
+void basicbtfs_destroy_cached_block(struct basicbtfs_cached_block *cached_block);
 void basicbtfs_destroy_btree_dir(struct basicbtfs_btree_dir_cache_list *cache_dir);
-void basicbtfs_destroy_file_block(struct basicbtfs_block *cache_file_block);
 
 struct basicbtfs_btree_dir_cache_list *basicbtfs_alloc_btree_dir(struct super_block *sb);
-struct basicbtfs_btree_node_cache *basicbtfs_alloc_btree_node_data(struct super_block *sb);
-struct basicbtfs_name_tree_cache *basicbtfs_alloc_nametree_hdr(struct super_block *sb);
-struct basicbtfs_block *basicbtfs_alloc_file(struct super_block *sb);
+struct basicbtfs_cached_block *basicbtfs_alloc_cached_block(struct super_block *sb);
 
 int basicbtfs_btree_free_dir(struct super_block *sb, struct inode *inode, uint32_t bno);
 int basicbtfs_nametree_free_namelist_blocks(struct super_block *sb, uint32_t name_bno);
@@ -237,27 +528,37 @@ int basicbtfs_add_entry(struct inode *dir, struct inode *inode, struct dentry *d
 struct dentry *basicbtfs_search_entry(struct inode *dir, struct dentry *dentry);
 int basicbtfs_delete_entry(struct inode *dir, struct dentry *dentry);
 int basicbtfs_update_entry(struct inode *old_dir, struct inode *new_dir, struct dentry *old_dentry, struct dentry *new_dentry, unsigned int flags);
+int basicbtfs_dir_credits(struct inode *dir);
 int clean_file_block(struct inode *inode);
 
 long basicbtfs_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
 
 int basicbtfs_file_update_root(struct inode *inode, uint32_t bno);
 
+/* Background defragmentation and sysfs */
+int basicbtfs_bgdefrag_start(struct super_block *sb);
+void basicbtfs_bgdefrag_stop(struct super_block *sb);
+void basicbtfs_bgdefrag_wake(struct super_block *sb);
+int basicbtfs_defrag_file(struct inode *inode);
+int basicbtfs_defrag_plan_disk(struct super_block *sb, struct inode *root);
+int basicbtfs_defrag_stat(struct super_block *sb, struct basicbtfs_ioctl_frag_stat *stat);
+int basicbtfs_sysfs_register(struct super_block *sb);
+void basicbtfs_sysfs_unregister(struct super_block *sb);
+int basicbtfs_sysfs_init(void);
+void basicbtfs_sysfs_exit(void);
+
 /* Operation structs*/
 extern const struct file_operations basicbtfs_file_ops;
 extern const struct file_operations basicbtfs_dir_ops;
 extern const struct address_space_operations basicbtfs_aops;
 extern const struct inode_operations basicbtfs_inode_ops;
-extern struct list_head dir_cache_list;
-extern bool should_defrag;
-extern bool defrag_now;
-extern uint32_t nr_of_inode_operations;
 
 
 
 /* Getter functions for disk info*/
 #define BASICBTFS_SB(sb) (sb->s_fs_info)
 #define BASICBTFS_INODE(inode) (container_of(inode, struct basicbtfs_inode_info, vfs_inode))
+#define BASICBTFS_HAS_BPTREE(sb) (((struct basicbtfs_sb_info *) BASICBTFS_SB(sb))->s_features & BASICBTFS_FEATURE_BPTREE)
 
 #define BASICBTFS_GET_INODE_BLOCK(ino, inode_bmap_bsize, blocks_bmap_bsize) ((ino / BASICBTFS_INODES_PER_BLOCK) + inode_bmap_bsize + blocks_bmap_bsize + 1)
 #define BASICBTFS_GET_INODE_BLOCK_IDX(ino) (ino % BASICBTFS_INODES_PER_BLOCK)
@@ -20,7 +20,9 @@ do
 
         ./clean.sh && ./test.sh
         cd test/mnt
+        ../../collect_stats.sh . ../../../$tmp_dir/$j/btfsbw${tmp}K_stats_before.json
         sudo fio --output-format=json+  --output=../../../$tmp_dir/$j/btfsbw${tmp}K.output --size=${tmp}K ../../perfbw.fio
+        ../../collect_stats.sh . ../../../$tmp_dir/$j/btfsbw${tmp}K_stats_after.json
 
         fio_jsonplus_clat2csv ../../../$tmp_dir/$j/btfsbw${tmp}K.output ../../../$tmp_dir/$j/btfsbw${tmp}K.csv
         cd ../../../$tmp_dir
@@ -42,7 +44,9 @@ do
 
         ./clean.sh && ./test.sh
         cd test/mnt
+        ../../collect_stats.sh . ../../../$tmp_dir/$j/btfsbw${tmp}M_stats_before.json
         sudo fio --output-format=json+  --output=../../../$tmp_dir/$j/btfsbw${tmp}M.output --size=${tmp}M ../../perfbw.fio
+        ../../collect_stats.sh . ../../../$tmp_dir/$j/btfsbw${tmp}M_stats_after.json
 
         fio_jsonplus_clat2csv ../../../$tmp_dir/$j/btfsbw${tmp}M.output ../../../$tmp_dir/$j/btfsbw${tmp}M.csv
         cd ../../../$tmp_dir
@@ -67,7 +71,9 @@ do
 
         ./clean.sh && ./test.sh
         cd test/mnt
+        ../../collect_stats.sh . ../../../$tmp_dir/$j/btfslat${tmp}K_stats_before.json
         sudo fio --output-format=json+  --output=../../../$tmp_dir/$j/btfslat${tmp}K.output --size=${tmp}K ../../perflatency.fio
+        ../../collect_stats.sh . ../../../$tmp_dir/$j/btfslat${tmp}K_stats_after.json
 
 
         fio_jsonplus_clat2csv ../../../$tmp_dir/$j/btfslat${tmp}K.output ../../../$tmp_dir/$j/btfslat${tmp}K.csv
@@ -90,7 +96,9 @@ do
 
         ./clean.sh && ./test.sh
         cd test/mnt
+        ../../collect_stats.sh . ../../../$tmp_dir/$j/btfslat${tmp}M_stats_before.json
         sudo fio --output-format=json+  --output=../../../$tmp_dir/$j/btfslat${tmp}M.output --size=${tmp}M ../../perflatency.fio
+        ../../collect_stats.sh . ../../../$tmp_dir/$j/btfslat${tmp}M_stats_after.json
 
         fio_jsonplus_clat2csv ../../../$tmp_dir/$j/btfslat${tmp}M.output ../../../$tmp_dir/$j/btfslat${tmp}M.csv
         cd ../../../$tmp_dir
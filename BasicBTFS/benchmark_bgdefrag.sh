@@ -0,0 +1,104 @@
+#!/usr/bin/env bash
+#!/bin/bash
+
+# Foreground latency while the background defragmenter runs. The image is
+# fragmented by creating files and directories and removing every other
+# one, then small file creates are timed once with the defragmenter idle
+# and once while a pass runs, started through sysfs. The pass is throttled
+# with defrag_delay_ms and defrag_rate, see sysfs.c.
+# Results end up in ../Results/tmpfs/bgdefrag/bgdefrag.csv
+
+OUT_DIR=Results/tmpfs/bgdefrag
+CSV=../$OUT_DIR/bgdefrag.csv
+ROOT_DIR="test/mnt"
+NR_OF_DIRS=200
+FILES_PER_DIR=200
+NR_OF_CREATES=20000
+RUNS=3
+
+init() {
+    make
+    sudo insmod basicbtfs.ko
+    mkdir -p test
+    sudo mount -t tmpfs -o size=20G tmpfs test
+    sudo chown $USER test
+    mkdir $ROOT_DIR
+    dd if=/dev/zero of=test/test.img bs=1 count=0 seek=15G
+}
+
+sysfs_dir() {
+    echo /sys/fs/basicbtfs/$(basename $(losetup -j test/test.img | cut -d: -f1))
+}
+
+fragment() {
+    for (( d=0 ; d<$NR_OF_DIRS ; d++ ));
+    do
+        mkdir $ROOT_DIR/dir_$d
+        (cd $ROOT_DIR/dir_$d && seq -f "file_%.0f" 0 $(( FILES_PER_DIR - 1 )) | xargs touch)
+        head -c 200K /dev/urandom > $ROOT_DIR/data_$d
+    done
+
+    for (( d=0 ; d<$NR_OF_DIRS ; d+=2 ));
+    do
+        rm -rf $ROOT_DIR/dir_$d $ROOT_DIR/data_$d
+    done
+
+    for (( d=1 ; d<$NR_OF_DIRS ; d+=2 ));
+    do
+        (cd $ROOT_DIR/dir_$d && seq -f "file_%.0f" 0 2 $(( FILES_PER_DIR - 1 )) | xargs rm -f)
+    done
+    sync
+}
+
+# Prints p50, p99 and max create latency in microseconds
+time_creates() {
+    python3 - "$ROOT_DIR/creates_$1" $NR_OF_CREATES << 'EOF'
+import os, sys, time
+path, nr_of_creates = sys.argv[1], int(sys.argv[2])
+os.mkdir(path)
+latencies = []
+for i in range(nr_of_creates):
+    start = time.perf_counter_ns()
+    os.close(os.open("%s/f_%d" % (path, i), os.O_CREAT | os.O_WRONLY))
+    latencies.append((time.perf_counter_ns() - start) // 1000)
+latencies.sort()
+print(latencies[len(latencies) // 2], latencies[len(latencies) * 99 // 100], latencies[-1])
+EOF
+}
+
+sudo rm -rf ../$OUT_DIR
+mkdir -p ../$OUT_DIR
+echo "mode,run,score_before,score_after,p50_us,p99_us,max_us,moved_blocks" > $CSV
+
+init
+
+for mode in idle running;
+do
+    for (( run=0 ; run<$RUNS ; run++ ));
+    do
+        ./mkfs.basicbtfs test/test.img > /dev/null
+        sudo mount -o loop -t basicbtfs test/test.img $ROOT_DIR
+        sudo chown $USER $ROOT_DIR
+        SYSFS=$(sysfs_dir)
+        echo 0 | sudo tee $SYSFS/defrag_threshold > /dev/null
+
+        fragment
+        score_before=$(cat $SYSFS/frag_score)
+
+        if [ "$mode" == "running" ]; then
+            echo start | sudo tee $SYSFS/defrag > /dev/null
+        fi
+
+        read p50 p99 max <<< $(time_creates $run)
+
+        while [ "$(cat $SYSFS/defrag)" == "running" ]; do sleep 1; done
+
+        score_after=$(cat $SYSFS/frag_score)
+        moved=$(awk '{print $4}' $SYSFS/defrag_progress)
+        echo "$mode,$run,$score_before,$score_after,$p50,$p99,$max,$moved" >> $CSV
+        echo "$mode, run $run: score $score_before -> $score_after, creates p50 $p50 us p99 $p99 us max $max us, $moved blocks moved"
+        sudo umount $ROOT_DIR
+    done
+done
+
+./clean.sh
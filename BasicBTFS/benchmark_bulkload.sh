@@ -0,0 +1,80 @@
+#!/usr/bin/env bash
+#!/bin/bash
+
+# Compares building directory btrees one entry at a time (create through the
+# mounted filesystem) against the bottom-up bulk loader (mkfs -d and defrag).
+# Results end up in ../Results/tmpfs/bulkload/bulkload.csv
+
+OUT_DIR=Results/tmpfs/bulkload
+CSV=../$OUT_DIR/bulkload.csv
+ROOT_DIR="test/mnt"
+SRC_DIR="test/src"
+
+init() {
+    make
+    sudo insmod basicbtfs.ko
+    mkdir -p test
+    sudo mount -t tmpfs -o size=20G tmpfs test
+    sudo chown $USER test
+    mkdir $ROOT_DIR
+    dd if=/dev/zero of=test/test.img bs=1 count=0 seek=15G
+}
+
+create_src() {
+    local nr_of_files=$1
+
+    rm -rf $SRC_DIR
+    mkdir -p $SRC_DIR
+    for (( k=0 ; k<$nr_of_files ; k++ ));
+    do
+        echo -n > $SRC_DIR/file_$k
+    done
+}
+
+sudo rm -rf ../$OUT_DIR
+mkdir -p ../$OUT_DIR
+echo "files,fill_factor,method,seconds,nodes,height" > $CSV
+
+init
+
+for nr_of_files in 1000 10000 50000 100000;
+do
+    create_src $nr_of_files
+
+    # Bulk load in mkfs with different fill factors
+    for fill in 50 70 90 100;
+    do
+        start=`date +%s.%N`
+        output=$(./mkfs.basicbtfs -d $SRC_DIR -f $fill test/test.img | grep "Btree build")
+        end=`date +%s.%N`
+        runtime=$( echo "$end - $start" | bc -l )
+        nodes=$(echo "$output" | sed -E 's/.*: ([0-9]+) nodes.*/\1/')
+        height=$(echo "$output" | sed -E 's/.*max height ([0-9]+).*/\1/')
+        echo "$nr_of_files,$fill,mkfs,$runtime,$nodes,$height" >> $CSV
+        echo "$nr_of_files files, fill $fill%: $output"
+    done
+
+    # One insert at a time through the kernel, then rebuild the tree with defrag
+    ./mkfs.basicbtfs test/test.img > /dev/null
+    sudo mount -o loop -t basicbtfs test/test.img $ROOT_DIR
+    start=`date +%s.%N`
+    sudo bash -c "cd $ROOT_DIR && for (( k=0 ; k<$nr_of_files ; k++ )); do touch file_\$k; done"
+    end=`date +%s.%N`
+    runtime=$( echo "$end - $start" | bc -l )
+    echo "$nr_of_files,,insert,$runtime,," >> $CSV
+
+    sudo dmesg -C
+    start=`date +%s.%N`
+    sudo ./btfs defrag $ROOT_DIR
+    end=`date +%s.%N`
+    runtime=$( echo "$end - $start" | bc -l )
+    output=$(sudo dmesg | grep "rebuilt directory" | tail -1)
+    nodes=$(echo "$output" | sed -E 's/.* in ([0-9]+) nodes.*/\1/')
+    height=$(echo "$output" | sed -E 's/.*height ([0-9]+).*/\1/')
+    echo "$nr_of_files,90,defrag,$runtime,$nodes,$height" >> $CSV
+    echo "$nr_of_files files, defrag: $output"
+
+    sudo umount $ROOT_DIR
+done
+
+./clean.sh
@@ -0,0 +1,95 @@
+#!/usr/bin/env bash
+#!/bin/bash
+
+# Create/unlink churn in a single directory that stays at a steady size.
+# Every round unlinks the oldest files and creates as many new ones, so
+# the time per round and the space in use should stay flat over time.
+# Results end up in ../Results/tmpfs/churn/churn.csv
+
+OUT_DIR=Results/tmpfs/churn
+CSV=../$OUT_DIR/churn.csv
+ROOT_DIR="test/mnt"
+DIR="$ROOT_DIR/churn"
+NR_OF_FILES=20000
+FILES_PER_ROUND=2000
+NR_OF_ROUNDS=100
+
+init() {
+    make
+    sudo insmod basicbtfs.ko
+    mkdir -p test
+    sudo mount -t tmpfs -o size=20G tmpfs test
+    sudo chown $USER test
+    mkdir $ROOT_DIR
+    dd if=/dev/zero of=test/test.img bs=1 count=0 seek=15G
+}
+
+# Names of varying length, so the holes left behind do not all fit the next name
+file_name() {
+    local i=$1
+
+    if (( i % 3 == 0 )); then
+        echo "a_considerably_longer_file_name_$i"
+    else
+        echo "file_$i"
+    fi
+}
+
+create_range() {
+    for (( i=$1 ; i<$2 ; i++ ));
+    do
+        echo $DIR/$(file_name $i)
+    done | xargs touch
+}
+
+unlink_range() {
+    for (( i=$1 ; i<$2 ; i++ ));
+    do
+        echo $DIR/$(file_name $i)
+    done | xargs rm -f
+}
+
+sudo rm -rf ../$OUT_DIR
+mkdir -p ../$OUT_DIR
+echo "filesystem,round,files,seconds,ops_per_second,used_kb" > $CSV
+
+init
+
+for fs in basicbtfs ext4;
+do
+    if [ "$fs" == "basicbtfs" ]; then
+        ./mkfs.basicbtfs test/test.img > /dev/null
+    else
+        mkfs.$fs -q -F test/test.img
+    fi
+
+    sudo mount -o loop -t $fs test/test.img $ROOT_DIR
+    sudo chown $USER $ROOT_DIR
+    mkdir $DIR
+    create_range 0 $NR_OF_FILES
+    sync
+
+    oldest=0
+    newest=$NR_OF_FILES
+
+    for (( round=0 ; round<$NR_OF_ROUNDS ; round++ ));
+    do
+        start=`date +%s.%N`
+        unlink_range $oldest $(( oldest + FILES_PER_ROUND ))
+        create_range $newest $(( newest + FILES_PER_ROUND ))
+        sync
+        end=`date +%s.%N`
+
+        oldest=$(( oldest + FILES_PER_ROUND ))
+        newest=$(( newest + FILES_PER_ROUND ))
+        used=$(df -k --output=used $ROOT_DIR | tail -1)
+        runtime=$( echo "$end - $start" | bc -l )
+        throughput=$( echo "2 * $FILES_PER_ROUND / $runtime" | bc -l )
+        echo "$fs,$round,$NR_OF_FILES,$runtime,$throughput,$used" >> $CSV
+        echo "$fs round $round: $runtime s, $used KB used"
+    done
+
+    sudo umount $ROOT_DIR
+done
+
+./clean.sh
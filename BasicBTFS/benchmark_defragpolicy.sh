@@ -0,0 +1,125 @@
+#!/usr/bin/env bash
+#!/bin/bash
+
+# Write amplification of the defrag triggers. The same workload, rounds of creating and
+# removing files in a set of directories while a set of files grows a cluster at a time in
+# turns, runs three times: without any defrag, with a whole-disk `btfs defrag` after every
+# round, and with the workload statistics queueing directories and files for the background
+# defragmenter. The blocks written to the loop device over the whole run are compared with
+# the ones of the run without defrag, the layout at the end is taken from `btfs stat`.
+# Results end up in ../Results/tmpfs/defragpolicy/defragpolicy.csv
+
+OUT_DIR=Results/tmpfs/defragpolicy
+CSV=../$OUT_DIR/defragpolicy.csv
+ROOT_DIR="test/mnt"
+NR_OF_DIRS=32
+FILES_PER_ROUND=64
+NR_OF_GROWN=32
+ROUNDS=16
+RUNS=3
+
+init() {
+    make
+    sudo insmod basicbtfs.ko
+    mkdir -p test
+    sudo mount -t tmpfs -o size=20G tmpfs test
+    sudo chown $USER test
+    mkdir $ROOT_DIR
+    dd if=/dev/zero of=test/test.img bs=1 count=0 seek=10G
+}
+
+sysfs_dir() {
+    echo /sys/fs/basicbtfs/$(basename $(losetup -j test/test.img | cut -d: -f1))
+}
+
+# 4K blocks written to the loop device backing the mount
+device_writes() {
+    local loop=$(basename $(losetup -j test/test.img | cut -d: -f1))
+    awk '{print int($7 / 8)}' /sys/block/$loop/stat
+}
+
+# One round: every directory gets new files and loses half of the ones from the round before
+round() {
+    for (( d=0 ; d<$NR_OF_DIRS ; d++ ));
+    do
+        mkdir -p $ROOT_DIR/dir_$d
+        (cd $ROOT_DIR/dir_$d && seq -f "file_$1_%.0f" 0 $(( FILES_PER_ROUND - 1 )) | xargs touch)
+
+        if [ $1 -gt 0 ]; then
+            (cd $ROOT_DIR/dir_$d && seq -f "file_$(( $1 - 1 ))_%.0f" 0 2 $(( FILES_PER_ROUND - 1 )) | xargs rm -f)
+        fi
+    done
+
+    for (( f=0 ; f<$NR_OF_GROWN ; f++ ));
+    do
+        dd if=/dev/urandom of=$ROOT_DIR/grown_$f bs=64K count=1 seek=$1 conv=notrunc status=none
+    done
+    sync
+}
+
+# Waits until the background defragmenter worked through its queue
+drain() {
+    for (( i=0 ; i<600 ; i++ ));
+    do
+        if grep -q "^queued 0 " $1/defrag_queue; then break; fi
+        sleep 0.1
+    done
+}
+
+sudo rm -rf ../$OUT_DIR
+mkdir -p ../$OUT_DIR
+echo "trigger,run,seconds,written_blocks,amplification,targeted,skipped,file_extents,dir_distance" > $CSV
+
+init
+
+for trigger in none periodic workload;
+do
+    for (( run=0 ; run<$RUNS ; run++ ));
+    do
+        ./mkfs.basicbtfs test/test.img > /dev/null
+        sudo mount -o loop -t basicbtfs test/test.img $ROOT_DIR
+        sudo chown $USER $ROOT_DIR
+        SYSFS=$(sysfs_dir)
+
+        # only the trigger under test may start a defrag
+        echo 0 | sudo tee $SYSFS/defrag_threshold > /dev/null
+        echo 0 | sudo tee $SYSFS/defrag_delay_ms > /dev/null
+
+        if [ "$trigger" != "workload" ]; then
+            echo 0 | sudo tee $SYSFS/defrag_dir_churn > /dev/null
+            echo 0 | sudo tee $SYSFS/defrag_file_extents > /dev/null
+        fi
+
+        writes_before=$(device_writes)
+        start=`date +%s.%N`
+
+        for (( r=0 ; r<$ROUNDS ; r++ ));
+        do
+            round $r
+
+            if [ "$trigger" == "periodic" ]; then
+                ./btfs defrag $ROOT_DIR > /dev/null
+            elif [ "$trigger" == "workload" ]; then
+                drain $SYSFS
+            fi
+        done
+
+        sync
+        end=`date +%s.%N`
+        written=$(( $(device_writes) - writes_before ))
+        seconds=$( echo "$end - $start" | bc -l )
+
+        if [ "$trigger" == "none" ]; then baseline=$written; fi
+
+        amplification=$( echo "$written / $baseline" | bc -l )
+        read targeted skipped <<< $(awk '{print $4, $6}' $SYSFS/defrag_queue)
+        ./btfs stat $ROOT_DIR > ../$OUT_DIR/stat_${trigger}_${run}.json
+        read file_extents dir_distance <<< $(python3 -c "import json; s = json.load(open('../$OUT_DIR/stat_${trigger}_${run}.json')); print(s['file_extents']['average'], s['directory_distance']['average'])")
+
+        echo "$trigger,$run,$seconds,$written,$amplification,$targeted,$skipped,$file_extents,$dir_distance" >> $CSV
+        echo "$trigger, run $run: $written blocks written (x$amplification), $targeted targeted, $skipped skipped, $file_extents extents per file, $dir_distance blocks between directory blocks"
+        sudo umount $ROOT_DIR
+    done
+done
+
+./clean.sh
@@ -0,0 +1,65 @@
+#!/usr/bin/env bash
+#!/bin/bash
+
+# Create throughput in the root directory, which is the directory that is
+# cached on mount, and the memory the directory cache takes while doing so.
+# slab_kb is what the basicbtfs slabs hold, buffers_kb how much the buffer
+# cache grew. Run it once per revision with a label to compare designs:
+#   ./benchmark_dircache.sh pinned
+# Results end up in ../Results/tmpfs/dircache/dircache_<label>.csv
+
+LABEL=${1:-pinned}
+OUT_DIR=Results/tmpfs/dircache
+CSV=../$OUT_DIR/dircache_$LABEL.csv
+ROOT_DIR="test/mnt"
+RUNS=5
+
+init() {
+    make
+    sudo insmod basicbtfs.ko
+    mkdir -p test
+    sudo mount -t tmpfs -o size=20G tmpfs test
+    sudo chown $USER test
+    mkdir $ROOT_DIR
+    dd if=/dev/zero of=test/test.img bs=1 count=0 seek=15G
+}
+
+slab_kb() {
+    sudo awk '$1 ~ /^basicbtfs/ {sum += $3 * $4} END {print int(sum / 1024)}' /proc/slabinfo
+}
+
+buffers_kb() {
+    awk '$1 == "Buffers:" {print $2}' /proc/meminfo
+}
+
+mkdir -p ../$OUT_DIR
+echo "label,files,run,seconds,creates_per_second,slab_kb,buffers_kb" > $CSV
+
+init
+
+for nr_of_files in 10000 50000 100000;
+do
+    for (( run=0 ; run<$RUNS ; run++ ));
+    do
+        ./mkfs.basicbtfs test/test.img > /dev/null
+        sudo sh -c "echo 3 > /proc/sys/vm/drop_caches"
+        sudo mount -o loop -t basicbtfs test/test.img $ROOT_DIR
+        sudo chown $USER $ROOT_DIR
+        buffers_before=$(buffers_kb)
+
+        start=`date +%s.%N`
+        (cd $ROOT_DIR && seq -f "file_%.0f" 0 $(( nr_of_files - 1 )) | xargs touch)
+        sync
+        end=`date +%s.%N`
+
+        slab=$(slab_kb)
+        buffers=$(( $(buffers_kb) - buffers_before ))
+        runtime=$( echo "$end - $start" | bc -l )
+        throughput=$( echo "$nr_of_files / $runtime" | bc -l )
+        echo "$LABEL,$nr_of_files,$run,$runtime,$throughput,$slab,$buffers" >> $CSV
+        echo "$LABEL, $nr_of_files files, run $run: $throughput creates/s, $slab KB in slabs, $buffers KB buffers"
+        sudo umount $ROOT_DIR
+    done
+done
+
+./clean.sh
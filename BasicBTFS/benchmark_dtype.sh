@@ -0,0 +1,92 @@
+#!/usr/bin/env bash
+#!/bin/bash
+
+# find -type d over a tree of 1M files. With the file type in the directory
+# entries find no longer has to stat every entry, which shows up as fewer
+# stat calls and fewer reads from the device while it runs.
+# Results end up in ../Results/tmpfs/dtype/dtype.csv
+
+OUT_DIR=Results/tmpfs/dtype
+CSV=../$OUT_DIR/dtype.csv
+ROOT_DIR="test/mnt"
+SRC_DIR="test/src"
+NR_OF_DIRS=1000
+FILES_PER_DIR=1000
+RUNS=5
+
+init() {
+    make
+    sudo insmod basicbtfs.ko
+    mkdir -p test
+    sudo mount -t tmpfs -o size=20G tmpfs test
+    sudo chown $USER test
+    mkdir $ROOT_DIR
+    dd if=/dev/zero of=test/test.img bs=1 count=0 seek=15G
+}
+
+create_src() {
+    rm -rf $SRC_DIR
+    mkdir -p $SRC_DIR
+    for (( d=0 ; d<$NR_OF_DIRS ; d++ ));
+    do
+        mkdir -p $SRC_DIR/dir_$(( d % 10 ))/dir_$d
+        (cd $SRC_DIR/dir_$(( d % 10 ))/dir_$d && seq -f "file_%.0f" 0 $(( FILES_PER_DIR - 1 )) | xargs touch)
+    done
+}
+
+# Read requests and sectors read from the loop device backing the mount
+device_reads() {
+    local loop=$(basename $(losetup -j test/test.img | cut -d: -f1))
+    awk '{print $1 "," $3}' /sys/block/$loop/stat
+}
+
+remount_fs() {
+    local fs=$1
+
+    sudo umount $ROOT_DIR
+    sudo sh -c "echo 3 > /proc/sys/vm/drop_caches"
+    sudo mount -o loop -t $fs test/test.img $ROOT_DIR
+}
+
+sudo rm -rf ../$OUT_DIR
+mkdir -p ../$OUT_DIR
+echo "filesystem,run,seconds,dirs,stat_calls,read_ios,sectors_read" > $CSV
+
+init
+create_src
+
+for fs in basicbtfs ext4;
+do
+    if [ "$fs" == "basicbtfs" ]; then
+        ./mkfs.basicbtfs -d $SRC_DIR test/test.img > /dev/null
+        sudo mount -o loop -t $fs test/test.img $ROOT_DIR
+    else
+        mkfs.$fs -q -F test/test.img
+        sudo mount -o loop -t $fs test/test.img $ROOT_DIR
+        sudo cp -a $SRC_DIR/. $ROOT_DIR
+    fi
+
+    for (( run=0 ; run<$RUNS ; run++ ));
+    do
+        remount_fs $fs
+        IFS=, read ios_before sectors_before <<< "$(device_reads)"
+
+        start=`date +%s.%N`
+        dirs=$(find $ROOT_DIR -type d | wc -l)
+        end=`date +%s.%N`
+
+        IFS=, read ios_after sectors_after <<< "$(device_reads)"
+        runtime=$( echo "$end - $start" | bc -l )
+
+        # Count the stat calls find makes in a separate run, strace slows it down
+        remount_fs $fs
+        stat_calls=$(strace -f -c -e trace=%stat find $ROOT_DIR -type d 2>&1 > /dev/null | awk '$NF ~ /stat/ {sum += $4} END {print sum + 0}')
+
+        echo "$fs,$run,$runtime,$dirs,$stat_calls,$(( ios_after - ios_before )),$(( sectors_after - sectors_before ))" >> $CSV
+        echo "$fs run $run: $dirs dirs in $runtime s, $stat_calls stat calls, $(( sectors_after - sectors_before )) sectors read"
+    done
+
+    sudo umount $ROOT_DIR
+done
+
+./clean.sh
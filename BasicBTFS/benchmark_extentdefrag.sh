@@ -0,0 +1,102 @@
+#!/usr/bin/env bash
+#!/bin/bash
+
+# Defrag throughput on a 10G image. A set of files is written a cluster at a time in turns,
+# so the clusters of every file are spread over the disk, then the files are defragmented
+# one by one with `btfs defrag <file>`, and on a fresh copy of the image the whole disk is
+# defragmented in swap and in plan mode. The throughput is the file data divided by the
+# wall time of the defrag and the sync after it.
+# Results end up in ../Results/tmpfs/extentdefrag/extentdefrag.csv
+
+OUT_DIR=Results/tmpfs/extentdefrag
+CSV=../$OUT_DIR/extentdefrag.csv
+ROOT_DIR="test/mnt"
+NR_OF_FILES=32
+FILE_MB=32
+RUNS=3
+
+init() {
+    make
+    sudo insmod basicbtfs.ko
+    mkdir -p test
+    sudo mount -t tmpfs -o size=30G tmpfs test
+    sudo chown $USER test
+    mkdir $ROOT_DIR
+    dd if=/dev/zero of=test/test.img bs=1 count=0 seek=10G
+}
+
+sysfs_dir() {
+    echo /sys/fs/basicbtfs/$(basename $(losetup -j test/test.img | cut -d: -f1))
+}
+
+fragment() {
+    python3 - "$ROOT_DIR" $NR_OF_FILES $FILE_MB << 'EOF'
+import os, sys
+root, nr_of_files, file_mb = sys.argv[1], int(sys.argv[2]), int(sys.argv[3])
+fds = [os.open("%s/file_%d" % (root, f), os.O_CREAT | os.O_WRONLY) for f in range(nr_of_files)]
+for chunk in range(file_mb * 16):
+    for fd in fds:
+        os.write(fd, os.urandom(64 * 1024))
+for fd in fds:
+    os.close(fd)
+EOF
+    sync
+}
+
+checksums() {
+    (cd $ROOT_DIR && find . -type f | sort | xargs md5sum)
+}
+
+# Runs the defrag of the given kind, prints the seconds it took
+defrag() {
+    local start=`date +%s.%N`
+
+    if [ "$1" == "file" ]; then
+        for (( f=0 ; f<$NR_OF_FILES ; f++ ));
+        do
+            ./btfs defrag $ROOT_DIR/file_$f > /dev/null
+        done
+    else
+        echo $1 | sudo tee $(sysfs_dir)/defrag_mode > /dev/null
+        ./btfs defrag $ROOT_DIR > /dev/null
+    fi
+
+    sync
+    local end=`date +%s.%N`
+    echo "$end - $start" | bc -l
+}
+
+sudo rm -rf ../$OUT_DIR
+mkdir -p ../$OUT_DIR
+echo "kind,run,seconds,mb_per_second,intact" > $CSV
+
+init
+
+./mkfs.basicbtfs test/test.img > /dev/null
+sudo mount -o loop -t basicbtfs test/test.img $ROOT_DIR
+sudo chown $USER $ROOT_DIR
+fragment
+checksums > test/checksums
+sudo umount $ROOT_DIR
+cp --sparse=always test/test.img test/fragmented.img
+
+for kind in file swap plan;
+do
+    for (( run=0 ; run<$RUNS ; run++ ));
+    do
+        cp --sparse=always test/fragmented.img test/test.img
+        sudo mount -o loop -t basicbtfs test/test.img $ROOT_DIR
+        sudo sh -c "echo 3 > /proc/sys/vm/drop_caches"
+
+        seconds=$(defrag $kind)
+        throughput=$( echo "$NR_OF_FILES * $FILE_MB / $seconds" | bc -l )
+
+        if checksums | cmp -s - test/checksums; then intact=yes; else intact=no; fi
+
+        echo "$kind,$run,$seconds,$throughput,$intact" >> $CSV
+        echo "$kind, run $run: $seconds s, $throughput MB/s, files intact: $intact"
+        sudo umount $ROOT_DIR
+    done
+done
+
+./clean.sh
@@ -0,0 +1,79 @@
+#!/usr/bin/env bash
+#!/bin/bash
+
+# Sequential read of a fragmented file before and after `btfs defrag <file>`.
+# The file is written one cluster at a time, alternating with a filler file
+# that is removed afterwards, so every cluster of it sits on its own. Next to
+# the throughput the read requests of the loop device are counted, reads of
+# neighbouring blocks are merged into one request.
+# Results end up in ../Results/tmpfs/filedefrag/filedefrag.csv
+
+OUT_DIR=Results/tmpfs/filedefrag
+CSV=../$OUT_DIR/filedefrag.csv
+ROOT_DIR="test/mnt"
+FILE_MB=24
+RUNS=5
+
+init() {
+    make
+    sudo insmod basicbtfs.ko
+    mkdir -p test
+    sudo mount -t tmpfs -o size=20G tmpfs test
+    sudo chown $USER test
+    mkdir $ROOT_DIR
+    dd if=/dev/zero of=test/test.img bs=1 count=0 seek=15G
+}
+
+# Read requests from the loop device backing the mount
+device_reads() {
+    local loop=$(basename $(losetup -j test/test.img | cut -d: -f1))
+    awk '{print $1}' /sys/block/$loop/stat
+}
+
+fragment() {
+    for (( i=0 ; i<$FILE_MB * 16 ; i++ ));
+    do
+        dd if=/dev/urandom of=$ROOT_DIR/file bs=64K count=1 seek=$i conv=notrunc status=none
+        dd if=/dev/zero of=$ROOT_DIR/filler bs=64K count=1 seek=$i conv=notrunc status=none
+    done
+    rm $ROOT_DIR/filler
+    sync
+}
+
+# Prints the read throughput in MB/s and the number of read requests
+read_file() {
+    sudo sh -c "echo 3 > /proc/sys/vm/drop_caches"
+    local ios_before=$(device_reads)
+    local start=`date +%s.%N`
+    cat $ROOT_DIR/file > /dev/null
+    local end=`date +%s.%N`
+    local ios_after=$(device_reads)
+    echo "$( echo "$FILE_MB / ($end - $start)" | bc -l ) $(( ios_after - ios_before ))"
+}
+
+sudo rm -rf ../$OUT_DIR
+mkdir -p ../$OUT_DIR
+echo "run,state,mb_per_second,read_ios,moved_blocks" > $CSV
+
+init
+
+for (( run=0 ; run<$RUNS ; run++ ));
+do
+    ./mkfs.basicbtfs test/test.img > /dev/null
+    sudo mount -o loop -t basicbtfs test/test.img $ROOT_DIR
+    sudo chown $USER $ROOT_DIR
+    fragment
+
+    read throughput ios <<< $(read_file)
+    echo "$run,fragmented,$throughput,$ios,0" >> $CSV
+    echo "run $run, fragmented: $throughput MB/s, $ios read requests"
+
+    moved=$(./btfs defrag $ROOT_DIR/file | awk '/blocks moved/ {print $1}')
+
+    read throughput ios <<< $(read_file)
+    echo "$run,defragmented,$throughput,$ios,$moved" >> $CSV
+    echo "run $run, defragmented: $throughput MB/s, $ios read requests, $moved blocks moved"
+    sudo umount $ROOT_DIR
+done
+
+./clean.sh
@@ -0,0 +1,60 @@
+#!/usr/bin/env bash
+#!/bin/bash
+
+# Latency of 4K random writes that are each followed by an fsync, on an image
+# without a journal and on one made by mkfs -j. Measured once on a fresh
+# image, where most fsyncs also write a new cluster, and once after an
+# unmeasured run of the same job, where fsync only writes data and the inode.
+# Results end up in ../Results/tmpfs/fsync/, one fio json+ output and clat csv
+# per image, layout and run.
+
+OUT_DIR=Results/tmpfs/fsync
+ROOT_DIR="test/mnt"
+RUNS=5
+
+init() {
+    make
+    sudo insmod basicbtfs.ko
+    mkdir -p test
+    sudo mount -t tmpfs -o size=20G tmpfs test
+    sudo chown $USER test
+    mkdir $ROOT_DIR
+    dd if=/dev/zero of=test/test.img bs=1 count=0 seek=15G
+}
+
+sudo rm -rf ../$OUT_DIR
+mkdir -p ../$OUT_DIR
+
+init
+
+for mode in nojournal journal;
+do
+    for layout in allocating overwriting;
+    do
+        for (( run=0 ; run<$RUNS ; run++ ));
+        do
+            if [ "$mode" == "journal" ]; then
+                ./mkfs.basicbtfs -j test/test.img > /dev/null
+            else
+                ./mkfs.basicbtfs test/test.img > /dev/null
+            fi
+
+            sudo mount -o loop -t basicbtfs test/test.img $ROOT_DIR
+            sudo chown $USER $ROOT_DIR
+
+            if [ "$layout" == "overwriting" ]; then
+                fio --directory=$ROOT_DIR --size=1M perffsync.fio > /dev/null
+            fi
+
+            output=../$OUT_DIR/${mode}_${layout}_$run
+            ./collect_stats.sh $ROOT_DIR ${output}_stats_before.json
+            fio --output-format=json+ --output=$output.output --directory=$ROOT_DIR --size=1M perffsync.fio
+            ./collect_stats.sh $ROOT_DIR ${output}_stats_after.json
+            fio_jsonplus_clat2csv $output.output $output.csv
+            echo "$mode, $layout, run $run done"
+            sudo umount $ROOT_DIR
+        done
+    done
+done
+
+./clean.sh
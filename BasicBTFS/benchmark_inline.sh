@@ -0,0 +1,103 @@
+#!/usr/bin/env bash
+#!/bin/bash
+
+# mkdir -p and find throughput on a deep, narrow tree, where nearly every
+# directory is small enough to stay inline. ext4 on the same image is the reference.
+# Results end up in ../Results/tmpfs/inline/inline.csv
+
+OUT_DIR=Results/tmpfs/inline
+CSV=../$OUT_DIR/inline.csv
+ROOT_DIR="test/mnt"
+NR_OF_CHAINS=200
+DEPTH=50
+FILES_PER_DIR=3
+
+init() {
+    make
+    sudo insmod basicbtfs.ko
+    mkdir -p test
+    sudo mount -t tmpfs -o size=20G tmpfs test
+    sudo chown $USER test
+    mkdir $ROOT_DIR
+    dd if=/dev/zero of=test/test.img bs=1 count=0 seek=15G
+}
+
+mount_fs() {
+    local fs=$1
+
+    if [ "$fs" == "basicbtfs" ]; then
+        ./mkfs.basicbtfs test/test.img > /dev/null
+    else
+        mkfs.$fs -q -F test/test.img
+    fi
+
+    sudo mount -o loop -t $fs test/test.img $ROOT_DIR
+    sudo chown $USER $ROOT_DIR
+}
+
+remount_fs() {
+    local fs=$1
+
+    sudo umount $ROOT_DIR
+    sudo sh -c "echo 3 > /proc/sys/vm/drop_caches"
+    sudo mount -o loop -t $fs test/test.img $ROOT_DIR
+}
+
+# Path of a chain of DEPTH nested directories
+chain_path() {
+    local chain=$1
+    local path="$ROOT_DIR/chain_$chain"
+
+    for (( d=0 ; d<$DEPTH ; d++ ));
+    do
+        path="$path/d_$d"
+    done
+
+    echo $path
+}
+
+sudo rm -rf ../$OUT_DIR
+mkdir -p ../$OUT_DIR
+echo "filesystem,dirs,files,mkdir_seconds,mkdir_dirs_per_second,find_seconds,find_entries_per_second,used_kb" > $CSV
+
+init
+nr_of_dirs=$(( NR_OF_CHAINS * DEPTH ))
+nr_of_files=$(( nr_of_dirs * FILES_PER_DIR ))
+
+for fs in basicbtfs ext4;
+do
+    mount_fs $fs
+    sync
+    used_before=$(df -k --output=used $ROOT_DIR | tail -1)
+
+    start=`date +%s.%N`
+    for (( c=0 ; c<$NR_OF_CHAINS ; c++ ));
+    do
+        mkdir -p $(chain_path $c)
+    done
+    sync
+    end=`date +%s.%N`
+    mkdir_runtime=$( echo "$end - $start" | bc -l )
+
+    # A few files in every directory keeps them small but not empty
+    for (( c=0 ; c<$NR_OF_CHAINS ; c++ ));
+    do
+        find $ROOT_DIR/chain_$c -type d -exec sh -c 'for f in $(seq 1 '$FILES_PER_DIR'); do echo -n > "$0/file_$f"; done' {} \;
+    done
+    sync
+    used_after=$(df -k --output=used $ROOT_DIR | tail -1)
+
+    remount_fs $fs
+    start=`date +%s.%N`
+    entries=$(find $ROOT_DIR | wc -l)
+    end=`date +%s.%N`
+    find_runtime=$( echo "$end - $start" | bc -l )
+
+    mkdir_throughput=$( echo "$nr_of_dirs / $mkdir_runtime" | bc -l )
+    find_throughput=$( echo "$entries / $find_runtime" | bc -l )
+    echo "$fs,$nr_of_dirs,$nr_of_files,$mkdir_runtime,$mkdir_throughput,$find_runtime,$find_throughput,$(( used_after - used_before ))" >> $CSV
+    echo "$fs: mkdir -p $nr_of_dirs dirs in $mkdir_runtime s, find $entries entries in $find_runtime s, $(( used_after - used_before )) KB used"
+    sudo umount $ROOT_DIR
+done
+
+./clean.sh
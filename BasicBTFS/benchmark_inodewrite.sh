@@ -0,0 +1,49 @@
+#!/usr/bin/env bash
+#!/bin/bash
+
+# Latency of small buffered writes, each of which dirties the inode. Run it
+# once per revision with a label to compare inode writeback designs, every
+# run mounts once without and once with lazytime:
+#   ./benchmark_inodewrite.sh lazy
+# Results end up in ../Results/tmpfs/inodewrite/<label>/, one fio json+ output
+# and clat csv per mount option and run.
+
+LABEL=${1:-lazy}
+OUT_DIR=Results/tmpfs/inodewrite/$LABEL
+ROOT_DIR="test/mnt"
+RUNS=5
+
+init() {
+    make
+    sudo insmod basicbtfs.ko
+    mkdir -p test
+    sudo mount -t tmpfs -o size=20G tmpfs test
+    sudo chown $USER test
+    mkdir $ROOT_DIR
+    dd if=/dev/zero of=test/test.img bs=1 count=0 seek=15G
+}
+
+sudo rm -rf ../$OUT_DIR
+mkdir -p ../$OUT_DIR
+
+init
+
+for opts in defaults lazytime;
+do
+    for (( run=0 ; run<$RUNS ; run++ ));
+    do
+        ./mkfs.basicbtfs test/test.img > /dev/null
+        sudo mount -o loop,$opts -t basicbtfs test/test.img $ROOT_DIR
+        sudo chown $USER $ROOT_DIR
+
+        output=../$OUT_DIR/${opts}_$run
+        ./collect_stats.sh $ROOT_DIR ${output}_stats_before.json
+        fio --output-format=json+ --output=$output.output --directory=$ROOT_DIR --size=1M perfsmallwrite.fio
+        ./collect_stats.sh $ROOT_DIR ${output}_stats_after.json
+        fio_jsonplus_clat2csv $output.output $output.csv
+        echo "$LABEL, $opts, run $run done"
+        sudo umount $ROOT_DIR
+    done
+done
+
+./clean.sh
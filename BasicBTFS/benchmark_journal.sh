@@ -0,0 +1,79 @@
+#!/usr/bin/env bash
+#!/bin/bash
+
+# Creates that are each followed by an fsync, the way a mail server or a
+# package manager stores files. Compares an image without a journal, where
+# every inode write is synced on its own, with one made by mkfs -j, where the
+# fsyncs of concurrent writers share a journal commit.
+# Results end up in ../Results/tmpfs/journal/journal.csv
+
+OUT_DIR=Results/tmpfs/journal
+CSV=../$OUT_DIR/journal.csv
+ROOT_DIR="test/mnt"
+NR_OF_FILES=20000
+RUNS=5
+
+init() {
+    make
+    sudo insmod basicbtfs.ko
+    mkdir -p test
+    sudo mount -t tmpfs -o size=20G tmpfs test
+    sudo chown $USER test
+    mkdir $ROOT_DIR
+    dd if=/dev/zero of=test/test.img bs=1 count=0 seek=15G
+}
+
+# Creates $NR_OF_FILES files split over $1 writers, fsyncing each file
+create_fsync() {
+    python3 - "$ROOT_DIR" $NR_OF_FILES $1 << 'PYEOF'
+import os, sys, threading
+path, nr_of_files, nr_of_threads = sys.argv[1], int(sys.argv[2]), int(sys.argv[3])
+
+def writer(t):
+    for i in range(t, nr_of_files, nr_of_threads):
+        fd = os.open("%s/file_%d" % (path, i), os.O_CREAT | os.O_WRONLY, 0o644)
+        os.write(fd, b"x" * 100)
+        os.fsync(fd)
+        os.close(fd)
+
+threads = [threading.Thread(target=writer, args=(t,)) for t in range(nr_of_threads)]
+for t in threads: t.start()
+for t in threads: t.join()
+PYEOF
+}
+
+sudo rm -rf ../$OUT_DIR
+mkdir -p ../$OUT_DIR
+echo "mode,threads,run,files,seconds,creates_per_second" > $CSV
+
+init
+
+for mode in nojournal journal;
+do
+    for nr_of_threads in 1 4 16;
+    do
+        for (( run=0 ; run<$RUNS ; run++ ));
+        do
+            if [ "$mode" == "journal" ]; then
+                ./mkfs.basicbtfs -j test/test.img > /dev/null
+            else
+                ./mkfs.basicbtfs test/test.img > /dev/null
+            fi
+
+            sudo mount -o loop -t basicbtfs test/test.img $ROOT_DIR
+            sudo chown $USER $ROOT_DIR
+
+            start=`date +%s.%N`
+            create_fsync $nr_of_threads
+            end=`date +%s.%N`
+
+            runtime=$( echo "$end - $start" | bc -l )
+            throughput=$( echo "$NR_OF_FILES / $runtime" | bc -l )
+            echo "$mode,$nr_of_threads,$run,$NR_OF_FILES,$runtime,$throughput" >> $CSV
+            echo "$mode, $nr_of_threads threads, run $run: $throughput creates/s"
+            sudo umount $ROOT_DIR
+        done
+    done
+done
+
+./clean.sh
@@ -0,0 +1,78 @@
+#!/usr/bin/env bash
+#!/bin/bash
+
+# Cold cache ls -l on a single directory. Every entry is stat'ed after the
+# readdir, so this mostly measures how the inode table blocks are read.
+# Results end up in ../Results/tmpfs/lsl/lsl.csv
+
+OUT_DIR=Results/tmpfs/lsl
+CSV=../$OUT_DIR/lsl.csv
+ROOT_DIR="test/mnt"
+SRC_DIR="test/src"
+RUNS=5
+
+init() {
+    make
+    sudo insmod basicbtfs.ko
+    mkdir -p test
+    sudo mount -t tmpfs -o size=20G tmpfs test
+    sudo chown $USER test
+    mkdir $ROOT_DIR
+    dd if=/dev/zero of=test/test.img bs=1 count=0 seek=15G
+}
+
+create_src() {
+    local nr_of_files=$1
+
+    rm -rf $SRC_DIR
+    mkdir -p $SRC_DIR/dir
+    (cd $SRC_DIR/dir && seq -f "file_%.0f" 0 $(( nr_of_files - 1 )) | xargs touch)
+}
+
+# Read requests and sectors read from the loop device backing the mount
+device_reads() {
+    local loop=$(basename $(losetup -j test/test.img | cut -d: -f1))
+    awk '{print $1 "," $3}' /sys/block/$loop/stat
+}
+
+sudo rm -rf ../$OUT_DIR
+mkdir -p ../$OUT_DIR
+echo "filesystem,files,run,seconds,read_ios,sectors_read" > $CSV
+
+init
+
+for nr_of_files in 10000 100000;
+do
+    create_src $nr_of_files
+
+    for fs in basicbtfs ext4;
+    do
+        if [ "$fs" == "basicbtfs" ]; then
+            ./mkfs.basicbtfs -d $SRC_DIR test/test.img > /dev/null
+        else
+            mkfs.$fs -q -F test/test.img
+            sudo mount -o loop -t $fs test/test.img $ROOT_DIR
+            sudo cp -a $SRC_DIR/. $ROOT_DIR
+            sudo umount $ROOT_DIR
+        fi
+
+        for (( run=0 ; run<$RUNS ; run++ ));
+        do
+            sudo sh -c "echo 3 > /proc/sys/vm/drop_caches"
+            sudo mount -o loop -t $fs test/test.img $ROOT_DIR
+            IFS=, read ios_before sectors_before <<< "$(device_reads)"
+
+            start=`date +%s.%N`
+            ls -l $ROOT_DIR/dir > /dev/null
+            end=`date +%s.%N`
+
+            IFS=, read ios_after sectors_after <<< "$(device_reads)"
+            runtime=$( echo "$end - $start" | bc -l )
+            echo "$fs,$nr_of_files,$run,$runtime,$(( ios_after - ios_before )),$(( sectors_after - sectors_before ))" >> $CSV
+            echo "$fs, $nr_of_files files, run $run: $runtime s, $(( ios_after - ios_before )) read requests"
+            sudo umount $ROOT_DIR
+        done
+    done
+done
+
+./clean.sh
@@ -0,0 +1,95 @@
+#!/usr/bin/env bash
+#!/bin/bash
+
+# Lookups of names that do not exist, the way a compiler probes its include
+# path: every probe is a new name, so the dcache never has a negative
+# dentry for it and each one ends up in the filesystem's lookup.
+# Results end up in ../Results/tmpfs/negative/negative.csv
+
+OUT_DIR=Results/tmpfs/negative
+CSV=../$OUT_DIR/negative.csv
+ROOT_DIR="test/mnt"
+SRC_DIR="test/src"
+NR_OF_PROBES=200000
+RUNS=5
+
+init() {
+    make
+    sudo insmod basicbtfs.ko
+    mkdir -p test
+    sudo mount -t tmpfs -o size=20G tmpfs test
+    sudo chown $USER test
+    mkdir $ROOT_DIR
+    dd if=/dev/zero of=test/test.img bs=1 count=0 seek=15G
+}
+
+create_src() {
+    local nr_of_files=$1
+
+    rm -rf $SRC_DIR
+    mkdir -p $SRC_DIR/dir
+    (cd $SRC_DIR/dir && seq -f "file_%.0f.h" 0 $(( nr_of_files - 1 )) | xargs touch)
+}
+
+# Read requests from the loop device backing the mount
+device_reads() {
+    local loop=$(basename $(losetup -j test/test.img | cut -d: -f1))
+    awk '{print $1}' /sys/block/$loop/stat
+}
+
+probe() {
+    python3 - "$ROOT_DIR/dir" $NR_OF_PROBES $1 << 'EOF'
+import os, sys
+path, nr_of_probes, run = sys.argv[1], int(sys.argv[2]), sys.argv[3]
+for i in range(nr_of_probes):
+    try:
+        os.stat("%s/missing_%s_%d.h" % (path, run, i))
+    except FileNotFoundError:
+        pass
+EOF
+}
+
+sudo rm -rf ../$OUT_DIR
+mkdir -p ../$OUT_DIR
+echo "filesystem,files,run,probes,seconds,probes_per_second,read_ios" > $CSV
+
+init
+
+for nr_of_files in 10000 100000;
+do
+    create_src $nr_of_files
+
+    for fs in basicbtfs basicbtfs-bptree ext4;
+    do
+        if [ "$fs" == "basicbtfs" ]; then
+            ./mkfs.basicbtfs -d $SRC_DIR test/test.img > /dev/null
+        elif [ "$fs" == "basicbtfs-bptree" ]; then
+            ./mkfs.basicbtfs -b -d $SRC_DIR test/test.img > /dev/null
+        else
+            mkfs.ext4 -q -F test/test.img
+            sudo mount -o loop -t ext4 test/test.img $ROOT_DIR
+            sudo cp -a $SRC_DIR/. $ROOT_DIR
+            sudo umount $ROOT_DIR
+        fi
+
+        for (( run=0 ; run<$RUNS ; run++ ));
+        do
+            sudo sh -c "echo 3 > /proc/sys/vm/drop_caches"
+            sudo mount -o loop -t ${fs%-bptree} test/test.img $ROOT_DIR
+            ios_before=$(device_reads)
+
+            start=`date +%s.%N`
+            probe $run
+            end=`date +%s.%N`
+
+            ios_after=$(device_reads)
+            runtime=$( echo "$end - $start" | bc -l )
+            throughput=$( echo "$NR_OF_PROBES / $runtime" | bc -l )
+            echo "$fs,$nr_of_files,$run,$NR_OF_PROBES,$runtime,$throughput,$(( ios_after - ios_before ))" >> $CSV
+            echo "$fs, $nr_of_files files, run $run: $throughput probes/s, $(( ios_after - ios_before )) read requests"
+            sudo umount $ROOT_DIR
+        done
+    done
+done
+
+./clean.sh
@@ -0,0 +1,136 @@
+#!/usr/bin/env bash
+#!/bin/bash
+
+# Offline against in-kernel defrag of the same aged image. The image is aged once like in
+# benchmark_plandefrag.sh, every run starts from a copy of it. The offline runs time
+# `defrag.basicbtfs` on the unmounted image with 1 and with all cores, the kernel runs time
+# `btfs defrag` and the sync after it in swap and in plan mode. Afterwards every image is
+# mounted to compare the checksums of all files with the ones from before the defrag and
+# to keep the layout from `btfs stat` next to the csv.
+# Results end up in ../Results/tmpfs/offlinedefrag/offlinedefrag.csv
+
+OUT_DIR=Results/tmpfs/offlinedefrag
+CSV=../$OUT_DIR/offlinedefrag.csv
+ROOT_DIR="test/mnt"
+NR_OF_DIRS=100
+FILES_PER_DIR=100
+NR_OF_GROWN=64
+RUNS=3
+
+init() {
+    make
+    sudo insmod basicbtfs.ko
+    mkdir -p test
+    sudo mount -t tmpfs -o size=40G tmpfs test
+    sudo chown $USER test
+    mkdir $ROOT_DIR
+    dd if=/dev/zero of=test/test.img bs=1 count=0 seek=15G
+}
+
+sysfs_dir() {
+    echo /sys/fs/basicbtfs/$(basename $(losetup -j test/test.img | cut -d: -f1))
+}
+
+age() {
+    for (( d=0 ; d<$NR_OF_DIRS ; d++ ));
+    do
+        mkdir $ROOT_DIR/dir_$d
+        (cd $ROOT_DIR/dir_$d && seq -f "file_%.0f" 0 $(( FILES_PER_DIR - 1 )) | xargs touch)
+    done
+
+    for (( i=0 ; i<16 ; i++ ));
+    do
+        for (( f=0 ; f<$NR_OF_GROWN ; f++ ));
+        do
+            dd if=/dev/urandom of=$ROOT_DIR/grown_$f bs=64K count=1 seek=$i conv=notrunc status=none
+        done
+    done
+
+    for (( d=0 ; d<$NR_OF_DIRS ; d+=2 ));
+    do
+        rm -rf $ROOT_DIR/dir_$d
+    done
+
+    for (( f=0 ; f<$NR_OF_GROWN ; f+=2 ));
+    do
+        rm $ROOT_DIR/grown_$f
+    done
+
+    for (( d=1 ; d<$NR_OF_DIRS ; d+=2 ));
+    do
+        (cd $ROOT_DIR/dir_$d && seq -f "file_%.0f" 0 2 $(( FILES_PER_DIR - 1 )) | xargs rm -f)
+    done
+    sync
+}
+
+checksums() {
+    (cd $ROOT_DIR && find . -type f | sort | xargs md5sum)
+}
+
+# Runs the defrag of the given kind on test/test.img, prints the seconds it took and the
+# blocks that were moved
+defrag() {
+    local start end moved
+
+    case $1 in
+    offline_1)
+        start=`date +%s.%N`
+        moved=$(./defrag.basicbtfs -t 1 test/test.img | awk '/blocks moved/ {print $1}')
+        end=`date +%s.%N`
+        ;;
+    offline_all)
+        start=`date +%s.%N`
+        moved=$(./defrag.basicbtfs test/test.img | awk '/blocks moved/ {print $1}')
+        end=`date +%s.%N`
+        ;;
+    *)
+        sudo mount -o loop -t basicbtfs test/test.img $ROOT_DIR
+        echo $1 | sudo tee $(sysfs_dir)/defrag_mode > /dev/null
+        sudo sh -c "echo 3 > /proc/sys/vm/drop_caches"
+        start=`date +%s.%N`
+        moved=$(./btfs defrag $ROOT_DIR | awk '/blocks moved/ {print $1}')
+        sync
+        end=`date +%s.%N`
+        sudo umount $ROOT_DIR
+        ;;
+    esac
+
+    echo "$( echo "$end - $start" | bc -l ) ${moved:-0}"
+}
+
+sudo rm -rf ../$OUT_DIR
+mkdir -p ../$OUT_DIR
+echo "kind,run,seconds,moved_blocks,score_before,score_after,intact" > $CSV
+
+init
+
+./mkfs.basicbtfs test/test.img > /dev/null
+sudo mount -o loop -t basicbtfs test/test.img $ROOT_DIR
+sudo chown $USER $ROOT_DIR
+age
+checksums > test/checksums
+score_before=$(cat $(sysfs_dir)/frag_score)
+./btfs stat $ROOT_DIR > ../$OUT_DIR/stat_aged.json
+sudo umount $ROOT_DIR
+cp --sparse=always test/test.img test/aged.img
+
+for kind in offline_1 offline_all swap plan;
+do
+    for (( run=0 ; run<$RUNS ; run++ ));
+    do
+        cp --sparse=always test/aged.img test/test.img
+        read seconds moved <<< $(defrag $kind)
+
+        sudo mount -o loop -t basicbtfs test/test.img $ROOT_DIR
+        score_after=$(cat $(sysfs_dir)/frag_score)
+        ./btfs stat $ROOT_DIR > ../$OUT_DIR/stat_${kind}_${run}.json
+
+        if checksums | cmp -s - test/checksums; then intact=yes; else intact=no; fi
+
+        echo "$kind,$run,$seconds,$moved,$score_before,$score_after,$intact" >> $CSV
+        echo "$kind, run $run: $seconds s, $moved moved, score $score_before -> $score_after, files intact: $intact"
+        sudo umount $ROOT_DIR
+    done
+done
+
+./clean.sh
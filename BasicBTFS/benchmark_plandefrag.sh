@@ -0,0 +1,123 @@
+#!/usr/bin/env bash
+#!/bin/bash
+
+# Whole-disk defrag of an aged image, once with the block by block swap pass and once with
+# the planned pass, chosen through defrag_mode in sysfs. The image is aged once by growing
+# files a cluster at a time next to each other and removing half of the files and
+# directories, every run starts from a copy of it. Next to the wall time of `btfs defrag`
+# and the sync after it, the blocks written to the loop device are counted, and the
+# checksums of all files are compared with the ones from before the defrag. The report of
+# `btfs stat` before and after every run is kept next to the csv.
+# Results end up in ../Results/tmpfs/plandefrag/plandefrag.csv
+
+OUT_DIR=Results/tmpfs/plandefrag
+CSV=../$OUT_DIR/plandefrag.csv
+ROOT_DIR="test/mnt"
+NR_OF_DIRS=100
+FILES_PER_DIR=100
+NR_OF_GROWN=64
+RUNS=3
+
+init() {
+    make
+    sudo insmod basicbtfs.ko
+    mkdir -p test
+    sudo mount -t tmpfs -o size=40G tmpfs test
+    sudo chown $USER test
+    mkdir $ROOT_DIR
+    dd if=/dev/zero of=test/test.img bs=1 count=0 seek=15G
+}
+
+sysfs_dir() {
+    echo /sys/fs/basicbtfs/$(basename $(losetup -j test/test.img | cut -d: -f1))
+}
+
+# 4K blocks written to the loop device backing the mount
+device_writes() {
+    local loop=$(basename $(losetup -j test/test.img | cut -d: -f1))
+    awk '{print int($7 / 8)}' /sys/block/$loop/stat
+}
+
+age() {
+    for (( d=0 ; d<$NR_OF_DIRS ; d++ ));
+    do
+        mkdir $ROOT_DIR/dir_$d
+        (cd $ROOT_DIR/dir_$d && seq -f "file_%.0f" 0 $(( FILES_PER_DIR - 1 )) | xargs touch)
+    done
+
+    for (( i=0 ; i<16 ; i++ ));
+    do
+        for (( f=0 ; f<$NR_OF_GROWN ; f++ ));
+        do
+            dd if=/dev/urandom of=$ROOT_DIR/grown_$f bs=64K count=1 seek=$i conv=notrunc status=none
+        done
+    done
+
+    for (( d=0 ; d<$NR_OF_DIRS ; d+=2 ));
+    do
+        rm -rf $ROOT_DIR/dir_$d
+    done
+
+    for (( f=0 ; f<$NR_OF_GROWN ; f+=2 ));
+    do
+        rm $ROOT_DIR/grown_$f
+    done
+
+    for (( d=1 ; d<$NR_OF_DIRS ; d+=2 ));
+    do
+        (cd $ROOT_DIR/dir_$d && seq -f "file_%.0f" 0 2 $(( FILES_PER_DIR - 1 )) | xargs rm -f)
+    done
+    sync
+}
+
+checksums() {
+    (cd $ROOT_DIR && find . -type f | sort | xargs md5sum)
+}
+
+sudo rm -rf ../$OUT_DIR
+mkdir -p ../$OUT_DIR
+echo "mode,run,seconds,written_blocks,moved_blocks,score_before,score_after,intact" > $CSV
+
+init
+
+./mkfs.basicbtfs test/test.img > /dev/null
+sudo mount -o loop -t basicbtfs test/test.img $ROOT_DIR
+sudo chown $USER $ROOT_DIR
+age
+checksums > test/checksums
+sudo umount $ROOT_DIR
+cp --sparse=always test/test.img test/aged.img
+
+for mode in swap plan;
+do
+    for (( run=0 ; run<$RUNS ; run++ ));
+    do
+        cp --sparse=always test/aged.img test/test.img
+        sudo mount -o loop -t basicbtfs test/test.img $ROOT_DIR
+        SYSFS=$(sysfs_dir)
+        echo $mode | sudo tee $SYSFS/defrag_mode > /dev/null
+        score_before=$(cat $SYSFS/frag_score)
+        ./btfs stat $ROOT_DIR > ../$OUT_DIR/stat_${mode}_${run}_before.json
+        sudo sh -c "echo 3 > /proc/sys/vm/drop_caches"
+
+        writes_before=$(device_writes)
+        start=`date +%s.%N`
+        moved=$(./btfs defrag $ROOT_DIR | awk '/blocks moved/ {print $1}')
+        sync
+        end=`date +%s.%N`
+        writes_after=$(device_writes)
+
+        seconds=$( echo "$end - $start" | bc -l )
+        written=$(( writes_after - writes_before ))
+        score_after=$(cat $SYSFS/frag_score)
+        ./btfs stat $ROOT_DIR > ../$OUT_DIR/stat_${mode}_${run}_after.json
+
+        if checksums | cmp -s - test/checksums; then intact=yes; else intact=no; fi
+
+        echo "$mode,$run,$seconds,$written,${moved:-0},$score_before,$score_after,$intact" >> $CSV
+        echo "$mode, run $run: $seconds s, $written blocks written, ${moved:-?} moved, score $score_before -> $score_after, files intact: $intact"
+        sudo umount $ROOT_DIR
+    done
+done
+
+./clean.sh
@@ -0,0 +1,73 @@
+#!/usr/bin/env bash
+#!/bin/bash
+
+# Compares readdir on the classic btree directories against the B+-tree
+# format (mkfs -b) that walks the linked leaves in hash order. Every run
+# lists the directory twice: cold after a remount and warm straight after,
+# when the cost is mostly the getdents calls themselves.
+# Results end up in ../Results/tmpfs/readdir/readdir.csv
+
+OUT_DIR=Results/tmpfs/readdir
+CSV=../$OUT_DIR/readdir.csv
+ROOT_DIR="test/mnt"
+SRC_DIR="test/src"
+RUNS=5
+
+init() {
+    make
+    sudo insmod basicbtfs.ko
+    mkdir -p test
+    sudo mount -t tmpfs -o size=20G tmpfs test
+    sudo chown $USER test
+    mkdir $ROOT_DIR
+    dd if=/dev/zero of=test/test.img bs=1 count=0 seek=15G
+}
+
+create_src() {
+    local nr_of_files=$1
+
+    rm -rf $SRC_DIR
+    mkdir -p $SRC_DIR
+    (cd $SRC_DIR && seq -f "file_%.0f" 0 $(( nr_of_files - 1 )) | xargs touch)
+}
+
+sudo rm -rf ../$OUT_DIR
+mkdir -p ../$OUT_DIR
+echo "files,format,run,seconds,warm_seconds,entries" > $CSV
+
+init
+
+for nr_of_files in 10000 100000 1000000;
+do
+    create_src $nr_of_files
+
+    for format in btree bptree;
+    do
+        if [ "$format" = "bptree" ]; then
+            ./mkfs.basicbtfs -b -d $SRC_DIR test/test.img > /dev/null
+        else
+            ./mkfs.basicbtfs -d $SRC_DIR test/test.img > /dev/null
+        fi
+
+        for (( run=0 ; run<$RUNS ; run++ ));
+        do
+            # Remount so every run starts with a cold buffer cache
+            sudo mount -o loop -t basicbtfs test/test.img $ROOT_DIR
+            start=`date +%s.%N`
+            entries=$(ls -f $ROOT_DIR | wc -l)
+            end=`date +%s.%N`
+            runtime=$( echo "$end - $start" | bc -l )
+
+            start=`date +%s.%N`
+            ls -f $ROOT_DIR > /dev/null
+            end=`date +%s.%N`
+            warm_runtime=$( echo "$end - $start" | bc -l )
+
+            echo "$nr_of_files,$format,$run,$runtime,$warm_runtime,$entries" >> $CSV
+            echo "$nr_of_files files, $format, run $run: $runtime s cold, $warm_runtime s warm ($entries entries)"
+            sudo umount $ROOT_DIR
+        done
+    done
+done
+
+./clean.sh
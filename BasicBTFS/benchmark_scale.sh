@@ -0,0 +1,60 @@
+#!/usr/bin/env bash
+#!/bin/bash
+
+# Scaling of BasicBTFS with concurrency. perfscale.fio runs 4K random reads and writes
+# with 1, 2, 4, 8 and 16 jobs, each job on its own file or all of them on one shared file,
+# at several read percentages. Every combination starts on a fresh filesystem.
+# Results end up in ../Results/tmpfs/scale/btfsscale/<files>_<read percentage>/<jobs>/,
+# one fio json+ output and clat csv per run.
+
+OUT_DIR=Results/tmpfs/scale/btfsscale
+ROOT_DIR="test/mnt"
+SIZE=64M
+RUNS=3
+
+init() {
+    make
+    sudo insmod basicbtfs.ko
+    mkdir -p test
+    sudo mount -t tmpfs -o size=20G tmpfs test
+    mkdir $ROOT_DIR
+    dd if=/dev/zero of=test/test.img bs=1 count=0 seek=15G
+}
+
+mount_fs() {
+    ./mkfs.basicbtfs test/test.img > /dev/null
+    sudo mount -o loop -t basicbtfs test/test.img $ROOT_DIR
+}
+
+sudo rm -rf ../$OUT_DIR
+mkdir -p ../$OUT_DIR
+
+init
+
+for files in perjob shared;
+do
+    if [ "$files" == "shared" ]; then
+        file_format=shared
+    else
+        file_format='$jobname.$jobnum.$filenum'
+    fi
+
+    for mix in 100 70 50 0;
+    do
+        for jobs in 1 2 4 8 16;
+        do
+            mkdir -p ../$OUT_DIR/${files}_$mix/$jobs
+
+            for (( run=0 ; run<$RUNS ; run++ ));
+            do
+                output=../$OUT_DIR/${files}_$mix/$jobs/$run
+                mount_fs
+                sudo env JOBS=$jobs RWMIX=$mix FILE_FORMAT=$file_format fio --output-format=json+ --output=$output.output --directory=$ROOT_DIR --size=$SIZE perfscale.fio
+                fio_jsonplus_clat2csv $output.output $output.csv
+                sudo umount $ROOT_DIR
+            done
+        done
+    done
+done
+
+./clean.sh
@@ -0,0 +1,96 @@
+#!/usr/bin/env bash
+#!/bin/bash
+
+# Cost of the debug output on the hot paths. The module of the commit before the tracepoints,
+# which still printk'ed every inserted name, unlink and ioctl, is built in a git worktree and
+# compared with the current module, once with the basicbtfs tracepoints disabled and once with
+# all of them enabled. Every run creates and unlinks a storm of empty files and runs
+# perflatency.fio on a fresh image, the console log level is left as it is.
+# Results end up in ../Results/tmpfs/tracing/tracing.csv
+
+OUT_DIR=Results/tmpfs/tracing
+CSV=../$OUT_DIR/tracing.csv
+ROOT_DIR="test/mnt"
+PRINTK_DIR=test/printk
+NR_OF_FILES=20000
+FIO_SIZE=64M
+RUNS=5
+EVENTS=/sys/kernel/tracing/events/basicbtfs/enable
+
+init() {
+    make
+    mkdir -p test
+    sudo mount -t tmpfs -o size=20G tmpfs test
+    sudo chown $USER test
+    mkdir $ROOT_DIR
+    dd if=/dev/zero of=test/test.img bs=1 count=0 seek=10G
+
+    # the module as it was before trace.h was added
+    local rev=$(git log -1 --format=%H -- trace.h)
+    git worktree add --detach $PRINTK_DIR $rev^ > /dev/null
+    (cd $PRINTK_DIR/BasicBTFS && make)
+}
+
+cleanup() {
+    git worktree remove --force $PRINTK_DIR
+}
+
+# Prints the seconds one storm of the given command over all files took
+storm() {
+    local start=`date +%s.%N`
+    (cd $ROOT_DIR/storm && seq -f "file_%.0f" 0 $(( NR_OF_FILES - 1 )) | xargs $1)
+    sync
+    local end=`date +%s.%N`
+    echo "$end - $start" | bc -l
+}
+
+# Prints the read and write iops and the mean completion latency in us of perflatency.fio
+fio_run() {
+    (cd $ROOT_DIR && sudo fio --output-format=json --output=../../../$OUT_DIR/fio_$1_$2.json --size=$FIO_SIZE ../../perflatency.fio > /dev/null)
+    python3 -c "import json; j = json.load(open('../$OUT_DIR/fio_$1_$2.json'))['jobs'][0]; print(j['read']['iops'], j['write']['iops'], (j['read']['clat_ns']['mean'] + j['write']['clat_ns']['mean']) / 2000)"
+}
+
+sudo rm -rf ../$OUT_DIR
+mkdir -p ../$OUT_DIR
+echo "config,run,creates_per_second,unlinks_per_second,read_iops,write_iops,clat_mean_us" > $CSV
+
+init
+
+for config in printk tracepoints_off tracepoints_on;
+do
+    if [ "$config" == "printk" ]; then
+        sudo insmod $PRINTK_DIR/BasicBTFS/basicbtfs.ko
+    else
+        sudo insmod basicbtfs.ko
+    fi
+
+    if [ "$config" == "tracepoints_on" ]; then
+        echo 1 | sudo tee $EVENTS > /dev/null
+    fi
+
+    for (( run=0 ; run<$RUNS ; run++ ));
+    do
+        ./mkfs.basicbtfs test/test.img > /dev/null
+        sudo mount -o loop -t basicbtfs test/test.img $ROOT_DIR
+        sudo chown $USER $ROOT_DIR
+        mkdir $ROOT_DIR/storm
+
+        creates=$( echo "$NR_OF_FILES / $(storm touch)" | bc -l )
+        unlinks=$( echo "$NR_OF_FILES / $(storm "rm -f")" | bc -l )
+        read read_iops write_iops clat <<< $(fio_run $config $run)
+
+        echo "$config,$run,$creates,$unlinks,$read_iops,$write_iops,$clat" >> $CSV
+        echo "$config, run $run: $creates creates/s, $unlinks unlinks/s, $read_iops read and $write_iops write iops, $clat us mean latency"
+        sudo umount $ROOT_DIR
+    done
+
+    if [ "$config" == "tracepoints_on" ]; then
+        echo 0 | sudo tee $EVENTS > /dev/null
+    fi
+
+    sudo rmmod basicbtfs
+done
+
+cleanup
+sudo insmod basicbtfs.ko
+./clean.sh
@@ -0,0 +1,69 @@
+#!/usr/bin/env bash
+#!/bin/bash
+
+# Unlink throughput of eager btree rebalancing against the relaxed_delete
+# mount option, removing 1M files spread over 100 directories.
+# Results end up in ../Results/tmpfs/unlink/unlink.csv
+
+OUT_DIR=Results/tmpfs/unlink
+CSV=../$OUT_DIR/unlink.csv
+ROOT_DIR="test/mnt"
+SRC_DIR="test/src"
+NR_OF_DIRS=100
+FILES_PER_DIR=10000
+
+init() {
+    make
+    sudo insmod basicbtfs.ko
+    mkdir -p test
+    sudo mount -t tmpfs -o size=20G tmpfs test
+    sudo chown $USER test
+    mkdir $ROOT_DIR
+    dd if=/dev/zero of=test/test.img bs=1 count=0 seek=15G
+}
+
+create_src() {
+    rm -rf $SRC_DIR
+    mkdir -p $SRC_DIR
+    for (( d=0 ; d<$NR_OF_DIRS ; d++ ));
+    do
+        mkdir $SRC_DIR/dir_$d
+        (cd $SRC_DIR/dir_$d && seq -f "file_%.0f" 0 $(( FILES_PER_DIR - 1 )) | xargs touch)
+    done
+}
+
+# Sectors written to the loop device backing the mount
+sectors_written() {
+    local loop=$(basename $(losetup -j test/test.img | cut -d: -f1))
+    awk '{print $7}' /sys/block/$loop/stat
+}
+
+sudo rm -rf ../$OUT_DIR
+mkdir -p ../$OUT_DIR
+echo "files,options,seconds,files_per_second,sectors_written" > $CSV
+
+init
+create_src
+nr_of_files=$(( NR_OF_DIRS * FILES_PER_DIR ))
+
+for options in "defaults" "relaxed_delete" "relaxed_delete,low_water=1";
+do
+    ./mkfs.basicbtfs -d $SRC_DIR test/test.img > /dev/null
+    sudo mount -o loop,$options -t basicbtfs test/test.img $ROOT_DIR
+    sync
+    before=$(sectors_written)
+
+    start=`date +%s.%N`
+    sudo rm -rf $ROOT_DIR/dir_*
+    sync
+    end=`date +%s.%N`
+
+    after=$(sectors_written)
+    runtime=$( echo "$end - $start" | bc -l )
+    throughput=$( echo "$nr_of_files / $runtime" | bc -l )
+    echo "$nr_of_files,\"$options\",$runtime,$throughput,$(( after - before ))" >> $CSV
+    echo "$options: $nr_of_files files removed in $runtime s ($(( after - before )) sectors written)"
+    sudo umount $ROOT_DIR
+done
+
+./clean.sh
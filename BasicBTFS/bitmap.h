@@ -3,6 +3,8 @@
 
 #include <linux/bitmap.h>
 #include "basicbtfs.h"
+#include "journal.h"
+#include "stats.h"
 
 static inline uint32_t get_first_free_bits(unsigned long *freemap, unsigned long size, uint32_t len) {
     unsigned long start_no = bitmap_find_next_zero_area(freemap, size, 1, len, 0);
@@ -48,8 +50,12 @@ static inline uint32_t get_offset(struct basicbtfs_sb_info *sbi, unsigned long *
         printk(KERN_ERR "no free area has been found: %ld\n", start_no);
         return -1;
     }
-    
+
+    basicbtfs_stat_inc(sbi, BASICBTFS_STAT_BITMAP_SCANS);
+    basicbtfs_stat_add(sbi, BASICBTFS_STAT_BITMAP_SCANNED, start_no - start);
+    basicbtfs_stat_add(sbi, BASICBTFS_STAT_BLOCKS_ALLOCATED, len);
     bitmap_set(freemap, start_no, len);
+    basicbtfs_journal_bitmap(sbi, freemap, sbi->s_imap_blocks + 1, start_no, len);
 
     if (start_no >= sbi->s_unused_area) {
         sbi->s_unused_area = start_no + len;
@@ -72,8 +78,12 @@ static inline uint32_t get_first_free_bits_from_start(unsigned long *freemap, un
 static inline uint32_t get_free_inode(struct basicbtfs_sb_info *sbi) {
     uint32_t start_ino = get_first_free_bits(sbi->s_ifree_bitmap, sbi->s_ninodes, 1);
 
+    basicbtfs_stat_inc(sbi, BASICBTFS_STAT_BITMAP_SCANS);
+
     if (start_ino > 0) {
+        basicbtfs_stat_add(sbi, BASICBTFS_STAT_BITMAP_SCANNED, start_ino);
         sbi->s_nfree_inodes--;
+        basicbtfs_journal_bitmap(sbi, sbi->s_ifree_bitmap, 1, start_ino, 1);
     }
 
     return start_ino;
@@ -81,8 +91,18 @@ static inline uint32_t get_free_inode(struct basicbtfs_sb_info *sbi) {
 
 static inline uint32_t get_free_blocks(struct basicbtfs_sb_info *sbi, uint32_t len) {
     uint32_t start_bno = get_first_free_bits(sbi->s_bfree_bitmap, sbi->s_nblocks, len);
+
+    basicbtfs_stat_inc(sbi, BASICBTFS_STAT_BITMAP_SCANS);
+
+    if (start_bno == -1) {
+        return -1;
+    }
+
     if (start_bno > 0) {
+        basicbtfs_stat_add(sbi, BASICBTFS_STAT_BITMAP_SCANNED, start_bno);
+        basicbtfs_stat_add(sbi, BASICBTFS_STAT_BLOCKS_ALLOCATED, len);
         sbi->s_nfree_blocks -= len;
+        basicbtfs_journal_bitmap(sbi, sbi->s_bfree_bitmap, sbi->s_imap_blocks + 1, start_bno, len);
     }
 
     if (start_bno >= sbi->s_unused_area) {
@@ -104,14 +124,24 @@ static inline void put_inode(struct basicbtfs_sb_info *sbi, uint32_t ino) {
     if (ret != 0) return;
 
     sbi->s_nfree_inodes++;
+    basicbtfs_journal_bitmap(sbi, sbi->s_ifree_bitmap, 1, ino, 1);
 }
 
-static inline void put_blocks(struct basicbtfs_sb_info *sbi,uint32_t bno, uint32_t len) {
+/* Frees blocks of file data, which never went through the journal and have nothing to revoke */
+static inline int put_data_blocks(struct basicbtfs_sb_info *sbi, uint32_t bno, uint32_t len) {
     int ret = put_free_bits(sbi->s_bfree_bitmap, sbi->s_nblocks, bno, len);
 
-    if (ret != 0) return;
+    if (ret != 0) return ret;
 
+    basicbtfs_stat_add(sbi, BASICBTFS_STAT_BLOCKS_FREED, len);
     sbi->s_nfree_blocks += len;
+    basicbtfs_journal_bitmap(sbi, sbi->s_bfree_bitmap, sbi->s_imap_blocks + 1, bno, len);
+    return 0;
+}
+
+/* Frees metadata blocks, see basicbtfs_journal_revoke */
+static inline void put_blocks(struct basicbtfs_sb_info *sbi,uint32_t bno, uint32_t len) {
+    if (put_data_blocks(sbi, bno, len) == 0) basicbtfs_journal_revoke(sbi, bno, len);
 }
 
 #endif /* BASICBTFS_BITMAP_H */
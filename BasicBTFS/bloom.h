@@ -0,0 +1,135 @@
+#ifndef BASICBTFS_BLOOM_H
+#define BASICBTFS_BLOOM_H
+
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/hash.h>
+#include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+
+#include "basicbtfs.h"
+
+/*
+ * In-memory Bloom filter over the name hashes of a btree or B+-tree directory, so a lookup
+ * of a name that does not exist is answered without descending the tree. It is built on the
+ * first lookup that needs it and hangs off the inode until the inode is evicted.
+ * Names added later set their bits as well. Deleted names keep theirs, which only costs
+ * false positives. Once more names went in than the filter was sized for, it is dropped
+ * and built again on a later lookup, which also clears the bits of deleted names.
+ */
+static inline uint32_t basicbtfs_bloom_bit(struct basicbtfs_bloom *bloom, uint32_t hash, int k) {
+    uint32_t h1 = hash_32(hash, bloom->bits_shift);
+    uint32_t h2 = hash_32(hash ^ 0x5bd1e995, bloom->bits_shift) | 1;
+
+    return (h1 + k * h2) & (BIT(bloom->bits_shift) - 1);
+}
+
+static inline void basicbtfs_bloom_add(struct basicbtfs_bloom *bloom, uint32_t hash) {
+    int k = 0;
+
+    for (k = 0; k < BASICBTFS_BLOOM_HASHES; k++) {
+        set_bit(basicbtfs_bloom_bit(bloom, hash, k), bloom->bits);
+    }
+
+    bloom->nr_of_hashes++;
+}
+
+static inline bool basicbtfs_bloom_may_contain(struct basicbtfs_bloom *bloom, uint32_t hash) {
+    int k = 0;
+
+    for (k = 0; k < BASICBTFS_BLOOM_HASHES; k++) {
+        if (!test_bit(basicbtfs_bloom_bit(bloom, hash, k), bloom->bits)) return false;
+    }
+
+    return true;
+}
+
+/* Adds every key of the subtree at bno. B+-tree separators are added too, they are only extra bits */
+static inline int basicbtfs_bloom_fill(struct super_block *sb, struct basicbtfs_bloom *bloom, uint32_t bno, int depth) {
+    struct buffer_head *bh = NULL;
+    struct basicbtfs_btree_node *node = NULL;
+    int index = 0, ret = 0;
+
+    if (depth > BASICBTFS_BTREE_MAX_HEIGHT) return -EIO;
+
+    bh = sb_bread(sb, bno);
+
+    if (!bh) return -EIO;
+
+    node = &((struct basicbtfs_disk_block *) bh->b_data)->block_type.btree_node;
+
+    for (index = 0; index < node->nr_of_keys; index++) {
+        basicbtfs_bloom_add(bloom, node->entries[index].hash);
+    }
+
+    if (!node->leaf) {
+        for (index = 0; index <= node->nr_of_keys && ret == 0; index++) {
+            ret = basicbtfs_bloom_fill(sb, bloom, node->children[index], depth + 1);
+        }
+    }
+
+    brelse(bh);
+    return ret;
+}
+
+/*
+ * Returns the filter of the directory with root root_bno, building it first if there is none.
+ * Lookups only hold the directory lock shared, so a filter is published with cmpxchg and the
+ * loser of a race frees its own copy. Returns NULL if no filter could be built.
+ */
+static inline struct basicbtfs_bloom *basicbtfs_bloom_get(struct inode *dir, uint32_t root_bno, uint32_t nr_of_files) {
+    struct basicbtfs_inode_info *inode_info = BASICBTFS_INODE(dir);
+    struct basicbtfs_bloom *bloom = READ_ONCE(inode_info->i_bloom), *old = NULL;
+    uint32_t capacity = max_t(uint32_t, nr_of_files + nr_of_files / 2, BASICBTFS_BLOOM_MIN_FILES);
+    unsigned int bits_shift = ilog2(roundup_pow_of_two(capacity * BASICBTFS_BLOOM_BITS_PER_FILE));
+
+    if (bloom) return bloom;
+
+    bloom = kvzalloc(sizeof(struct basicbtfs_bloom) + BITS_TO_LONGS(BIT(bits_shift)) * sizeof(unsigned long), GFP_KERNEL);
+
+    if (!bloom) return NULL;
+
+    bloom->bits_shift = bits_shift;
+    bloom->capacity = capacity;
+
+    if (basicbtfs_bloom_fill(dir->i_sb, bloom, root_bno, 0) < 0) {
+        kvfree(bloom);
+        return NULL;
+    }
+
+    old = cmpxchg(&inode_info->i_bloom, NULL, bloom);
+
+    if (old) {
+        kvfree(bloom);
+        return old;
+    }
+
+    return bloom;
+}
+
+/* Called with the directory locked exclusively, after hash has been added to it */
+static inline void basicbtfs_bloom_add_entry(struct inode *dir, uint32_t hash) {
+    struct basicbtfs_inode_info *inode_info = BASICBTFS_INODE(dir);
+    struct basicbtfs_bloom *bloom = inode_info->i_bloom;
+
+    if (!bloom) return;
+
+    if (bloom->nr_of_hashes >= bloom->capacity) {
+        inode_info->i_bloom = NULL;
+        kvfree(bloom);
+        return;
+    }
+
+    basicbtfs_bloom_add(bloom, hash);
+}
+
+static inline void basicbtfs_bloom_free(struct inode *inode) {
+    struct basicbtfs_inode_info *inode_info = BASICBTFS_INODE(inode);
+
+    kvfree(inode_info->i_bloom);
+    inode_info->i_bloom = NULL;
+}
+
+#endif
@@ -0,0 +1,600 @@
+#ifndef BASICBTFS_BPTREE_H
+#define BASICBTFS_BPTREE_H
+
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+
+#include "basicbtfs.h"
+#include "bitmap.h"
+#include "btree.h"
+#include "stats.h"
+
+/*
+ * B+-tree directory format (BASICBTFS_FEATURE_BPTREE). The nodes use the same layout as
+ * the btree: every entry lives in a leaf, internal nodes only hold copies of the first
+ * hash of their right subtrees and the leaves are chained through next_leaf/prev_leaf.
+ * children[i] holds the hashes in [entries[i - 1].hash, entries[i].hash).
+ *
+ * Deletion is lazy: a leaf is only removed once it is empty, defrag repacks the tree.
+ *
+ * readdir positions are hash based cookies, so they stay valid while entries are added
+ * or removed. They have to fit in the 32-bit f_pos of compat getdents, so hash h is at
+ * BASICBTFS_BPTREE_POS(h), its top 31 bits, moved up to 2 past the dots and down to below
+ * BASICBTFS_BPTREE_POS_EOF. A position can therefore hold a few hashes. When a getdents call
+ * stops inside one, the dir cursor keeps the hash to go on from.
+ */
+#define BASICBTFS_BPTREE_POS_EOF   ((loff_t) 0x7fffffff)
+#define BASICBTFS_BPTREE_POS(hash) clamp_t(loff_t, (hash) >> 1, 2, BASICBTFS_BPTREE_POS_EOF - 1)
+
+/* First hash to emit at ctx->pos, which is below BASICBTFS_BPTREE_POS_EOF */
+static inline uint32_t basicbtfs_bptree_pos_hash(struct dir_context *ctx, struct basicbtfs_dir_cursor *cursor) {
+    uint32_t hash = ctx->pos <= 2 ? 0 : (uint32_t) ctx->pos << 1;
+
+    if (cursor->pos == ctx->pos && cursor->hash > hash) {
+        hash = cursor->hash;
+    }
+
+    return hash;
+}
+
+static inline int basicbtfs_bptree_find_child(struct basicbtfs_btree_node *node, uint32_t hash) {
+    int index = 0;
+
+    while (index < node->nr_of_keys && hash >= node->entries[index].hash) {
+        index++;
+    }
+
+    return index;
+}
+
+/* Returns the leaf that holds hash, or would hold it */
+static inline uint32_t basicbtfs_bptree_find_leaf(struct super_block *sb, uint32_t root_bno, uint32_t hash) {
+    struct buffer_head *bh = NULL;
+    struct basicbtfs_disk_block *disk_block = NULL;
+    struct basicbtfs_btree_node *node = NULL;
+    uint32_t bno = root_bno;
+
+    while (true) {
+        basicbtfs_stat_node(sb, bno);
+        bh = basicbtfs_bread(sb, bno);
+
+        if (!bh) return 0;
+
+        disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+        node = &disk_block->block_type.btree_node;
+
+        if (node->leaf) {
+            brelse(bh);
+            return bno;
+        }
+
+        bno = node->children[basicbtfs_bptree_find_child(node, hash)];
+        brelse(bh);
+    }
+}
+
+static inline int basicbtfs_bptree_find_entry(struct basicbtfs_btree_node *node, uint32_t hash) {
+    int index = 0;
+
+    for (index = 0; index < node->nr_of_keys; index++) {
+        if (node->entries[index].hash == hash) {
+            return index;
+        }
+    }
+
+    return -1;
+}
+
+/* Returns the ino of hash or 0, entry is filled in when it is not NULL */
+static inline uint32_t basicbtfs_bptree_lookup(struct super_block *sb, uint32_t root_bno, uint32_t hash, struct basicbtfs_entry *entry) {
+    struct buffer_head *bh = NULL;
+    struct basicbtfs_disk_block *disk_block = NULL;
+    struct basicbtfs_btree_node *node = NULL;
+    uint32_t bno = basicbtfs_bptree_find_leaf(sb, root_bno, hash), ino = 0;
+    int index = 0;
+
+    if (bno == 0) return 0;
+
+    bh = basicbtfs_bread(sb, bno);
+
+    if (!bh) return 0;
+
+    disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+    node = &disk_block->block_type.btree_node;
+    index = basicbtfs_bptree_find_entry(node, hash);
+
+    if (index >= 0) {
+        ino = node->entries[index].ino;
+
+        if (entry) {
+            memcpy(entry, &node->entries[index], sizeof(struct basicbtfs_entry));
+        }
+    }
+
+    brelse(bh);
+    return ino;
+}
+
+static inline int basicbtfs_bptree_update_namelist_info(struct super_block *sb, uint32_t root_bno, uint32_t hash, uint32_t name_bno, uint32_t block_index) {
+    struct buffer_head *bh = NULL;
+    struct basicbtfs_disk_block *disk_block = NULL;
+    struct basicbtfs_btree_node *node = NULL;
+    uint32_t bno = basicbtfs_bptree_find_leaf(sb, root_bno, hash);
+    int index = 0;
+
+    if (bno == 0) return -1;
+
+    bh = basicbtfs_bread(sb, bno);
+
+    if (!bh) return -EIO;
+
+    disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+    node = &disk_block->block_type.btree_node;
+    index = basicbtfs_bptree_find_entry(node, hash);
+
+    if (index < 0) {
+        brelse(bh);
+        return -1;
+    }
+
+    node->entries[index].name_bno = name_bno;
+    node->entries[index].block_index = block_index;
+    basicbtfs_mark_dirty(bh);
+    brelse(bh);
+    return 0;
+}
+
+static inline int basicbtfs_bptree_set_link(struct super_block *sb, uint32_t bno, uint32_t *parent, uint32_t *next_leaf, uint32_t *prev_leaf) {
+    struct buffer_head *bh = NULL;
+    struct basicbtfs_disk_block *disk_block = NULL;
+    struct basicbtfs_btree_node *node = NULL;
+
+    if (bno == 0) return 0;
+
+    bh = basicbtfs_bread(sb, bno);
+
+    if (!bh) return -EIO;
+
+    disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+    node = &disk_block->block_type.btree_node;
+
+    if (parent) node->parent = *parent;
+    if (next_leaf) node->next_leaf = *next_leaf;
+    if (prev_leaf) node->prev_leaf = *prev_leaf;
+
+    basicbtfs_mark_dirty(bh);
+    brelse(bh);
+    return 0;
+}
+
+/* Splits the full child lhs of par at index, a leaf keeps its entries and copies the first one of rhs up */
+static inline int basicbtfs_bptree_split_child(struct super_block *sb, uint32_t par, uint32_t lhs, int index) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct buffer_head *bh_par = NULL, *bh_lhs = NULL, *bh_rhs = NULL;
+    struct basicbtfs_disk_block *disk_block = NULL;
+    struct basicbtfs_btree_node *node_par = NULL, *node_lhs = NULL, *node_rhs = NULL;
+    struct basicbtfs_entry separator;
+    uint32_t rhs = get_free_blocks(sbi, 1), lhs_keys = 0;
+    int i = 0, ret = 0;
+
+    if (rhs == -1) {
+        return -ENOSPC;
+    }
+
+    basicbtfs_stat_inc(sbi, BASICBTFS_STAT_SPLITS);
+
+    bh_par = basicbtfs_bread(sb, par);
+    bh_lhs = basicbtfs_bread(sb, lhs);
+    bh_rhs = basicbtfs_bread(sb, rhs);
+
+    if (!bh_par || !bh_lhs || !bh_rhs) {
+        brelse(bh_par);
+        brelse(bh_lhs);
+        brelse(bh_rhs);
+        put_blocks(sbi, rhs, 1);
+        return -EIO;
+    }
+
+    disk_block = (struct basicbtfs_disk_block *) bh_par->b_data;
+    node_par = &disk_block->block_type.btree_node;
+    disk_block = (struct basicbtfs_disk_block *) bh_lhs->b_data;
+    node_lhs = &disk_block->block_type.btree_node;
+
+    disk_block = (struct basicbtfs_disk_block *) bh_rhs->b_data;
+    memset(disk_block, 0, BASICBTFS_BLOCKSIZE);
+    disk_block->block_type_id = BASICBTFS_BLOCKTYPE_BTREE_NODE;
+    node_rhs = &disk_block->block_type.btree_node;
+    node_rhs->leaf = node_lhs->leaf;
+    node_rhs->parent = par;
+
+    if (node_lhs->leaf) {
+        lhs_keys = BASICBTFS_MIN_DEGREE;
+        node_rhs->nr_of_keys = node_lhs->nr_of_keys - lhs_keys;
+        memcpy(node_rhs->entries, &node_lhs->entries[lhs_keys], node_rhs->nr_of_keys * sizeof(struct basicbtfs_entry));
+        separator = node_rhs->entries[0];
+
+        node_rhs->next_leaf = node_lhs->next_leaf;
+        node_rhs->prev_leaf = lhs;
+        ret = basicbtfs_bptree_set_link(sb, node_lhs->next_leaf, NULL, NULL, &rhs);
+        node_lhs->next_leaf = rhs;
+    } else {
+        lhs_keys = BASICBTFS_MIN_DEGREE - 1;
+        node_rhs->nr_of_keys = node_lhs->nr_of_keys - lhs_keys - 1;
+        memcpy(node_rhs->entries, &node_lhs->entries[lhs_keys + 1], node_rhs->nr_of_keys * sizeof(struct basicbtfs_entry));
+        memcpy(node_rhs->children, &node_lhs->children[lhs_keys + 1], (node_rhs->nr_of_keys + 1) * sizeof(uint32_t));
+        separator = node_lhs->entries[lhs_keys];
+
+        for (i = 0; i <= node_rhs->nr_of_keys && ret == 0; i++) {
+            ret = basicbtfs_bptree_set_link(sb, node_rhs->children[i], &rhs, NULL, NULL);
+        }
+    }
+
+    node_lhs->nr_of_keys = lhs_keys;
+
+    for (i = node_par->nr_of_keys; i > index; i--) {
+        node_par->children[i + 1] = node_par->children[i];
+        node_par->entries[i] = node_par->entries[i - 1];
+    }
+
+    node_par->children[index + 1] = rhs;
+    node_par->entries[index] = separator;
+    node_par->nr_of_keys++;
+    basicbtfs_cache_pin_block(sb, par, rhs);
+
+    basicbtfs_mark_dirty(bh_par);
+    basicbtfs_mark_dirty(bh_lhs);
+    basicbtfs_mark_dirty(bh_rhs);
+    brelse(bh_par);
+    brelse(bh_lhs);
+    brelse(bh_rhs);
+    return ret;
+}
+
+static inline int basicbtfs_bptree_insert_non_full(struct super_block *sb, uint32_t bno, struct basicbtfs_entry *new_entry) {
+    struct buffer_head *bh = NULL, *bh_child = NULL;
+    struct basicbtfs_disk_block *disk_block = NULL;
+    struct basicbtfs_btree_node *node = NULL, *child = NULL;
+    uint32_t next = 0;
+    bool full = false;
+    int index = 0, ret = 0;
+
+    while (true) {
+        bh = basicbtfs_bread(sb, bno);
+
+        if (!bh) return -EIO;
+
+        disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+        node = &disk_block->block_type.btree_node;
+
+        if (node->leaf) {
+            index = node->nr_of_keys - 1;
+
+            while (index >= 0 && node->entries[index].hash > new_entry->hash) {
+                node->entries[index + 1] = node->entries[index];
+                index--;
+            }
+
+            node->entries[index + 1] = *new_entry;
+            node->nr_of_keys++;
+            basicbtfs_mark_dirty(bh);
+            brelse(bh);
+            return 0;
+        }
+
+        index = basicbtfs_bptree_find_child(node, new_entry->hash);
+        bh_child = basicbtfs_bread(sb, node->children[index]);
+
+        if (!bh_child) {
+            brelse(bh);
+            return -EIO;
+        }
+
+        disk_block = (struct basicbtfs_disk_block *) bh_child->b_data;
+        child = &disk_block->block_type.btree_node;
+        full = child->nr_of_keys == 2 * BASICBTFS_MIN_DEGREE - 1;
+        brelse(bh_child);
+
+        if (full) {
+            ret = basicbtfs_bptree_split_child(sb, bno, node->children[index], index);
+
+            if (ret != 0) {
+                brelse(bh);
+                return ret;
+            }
+
+            if (new_entry->hash >= node->entries[index].hash) {
+                index++;
+            }
+        }
+
+        next = node->children[index];
+        brelse(bh);
+        bno = next;
+    }
+}
+
+static inline int basicbtfs_bptree_insert(struct super_block *sb, struct inode *par_inode, uint32_t root_bno, struct basicbtfs_entry *entry) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct buffer_head *bh_old = NULL, *bh_new = NULL;
+    struct basicbtfs_disk_block *disk_block = NULL;
+    struct basicbtfs_btree_node *old_root = NULL, *new_root = NULL;
+    uint32_t new_root_bno = 0;
+    int ret = 0;
+
+    bh_old = basicbtfs_bread(sb, root_bno);
+
+    if (!bh_old) return -EIO;
+
+    disk_block = (struct basicbtfs_disk_block *) bh_old->b_data;
+    old_root = &disk_block->block_type.btree_node;
+
+    if (old_root->nr_of_keys == 2 * BASICBTFS_MIN_DEGREE - 1) {
+        new_root_bno = get_free_blocks(sbi, 1);
+
+        if (new_root_bno == -1) {
+            brelse(bh_old);
+            return -ENOSPC;
+        }
+
+        bh_new = basicbtfs_bread(sb, new_root_bno);
+
+        if (!bh_new) {
+            brelse(bh_old);
+            put_blocks(sbi, new_root_bno, 1);
+            return -EIO;
+        }
+
+        disk_block = (struct basicbtfs_disk_block *) bh_new->b_data;
+        memset(disk_block, 0, BASICBTFS_BLOCKSIZE);
+        disk_block->block_type_id = BASICBTFS_BLOCKTYPE_BTREE_NODE;
+        new_root = &disk_block->block_type.btree_node;
+        new_root->leaf = false;
+        new_root->root = true;
+        new_root->parent = par_inode->i_ino;
+        new_root->children[0] = root_bno;
+        new_root->tree_name_bno = old_root->tree_name_bno;
+        new_root->nr_of_files = old_root->nr_of_files;
+        new_root->nr_times_done = old_root->nr_times_done + 1;
+
+        old_root->root = false;
+        old_root->parent = new_root_bno;
+        basicbtfs_cache_pin_block(sb, root_bno, new_root_bno);
+        basicbtfs_mark_dirty(bh_old);
+        basicbtfs_mark_dirty(bh_new);
+        brelse(bh_new);
+        brelse(bh_old);
+
+        ret = basicbtfs_bptree_split_child(sb, new_root_bno, root_bno, 0);
+
+        if (ret != 0) return ret;
+
+        ret = basicbtfs_btree_update_root(par_inode, new_root_bno);
+
+        if (ret != 0) return ret;
+
+        root_bno = new_root_bno;
+    } else {
+        brelse(bh_old);
+    }
+
+    ret = basicbtfs_bptree_insert_non_full(sb, root_bno, entry);
+
+    if (ret != 0) return ret;
+
+    bh_new = basicbtfs_bread(sb, root_bno);
+
+    if (!bh_new) return -EIO;
+
+    disk_block = (struct basicbtfs_disk_block *) bh_new->b_data;
+    disk_block->block_type.btree_node.nr_of_files++;
+    basicbtfs_mark_dirty(bh_new);
+    brelse(bh_new);
+    return 0;
+}
+
+/* Removes the pointer to the freed child from bno, empty internal nodes are removed as well */
+static inline int basicbtfs_bptree_remove_child(struct super_block *sb, struct inode *inode, uint32_t bno, uint32_t child_bno) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct buffer_head *bh = NULL, *bh_child = NULL;
+    struct basicbtfs_disk_block *disk_block = NULL;
+    struct basicbtfs_btree_node *node = NULL, *child = NULL;
+    uint32_t parent = 0, new_root_bno = 0;
+    int index = 0, ret = 0;
+
+    /* the b+tree does not rebalance, an emptied node is dropped instead of merged */
+    basicbtfs_stat_inc(sbi, BASICBTFS_STAT_MERGES);
+    bh = basicbtfs_bread(sb, bno);
+
+    if (!bh) return -EIO;
+
+    disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+    node = &disk_block->block_type.btree_node;
+
+    while (index <= node->nr_of_keys && node->children[index] != child_bno) {
+        index++;
+    }
+
+    if (index > node->nr_of_keys) {
+        brelse(bh);
+        return -EIO;
+    }
+
+    if (node->nr_of_keys == 0) {
+        /* the last child is gone */
+        if (node->root) {
+            node->leaf = true;
+            node->children[0] = 0;
+            node->next_leaf = 0;
+            node->prev_leaf = 0;
+            basicbtfs_mark_dirty(bh);
+            brelse(bh);
+            return 0;
+        }
+
+        parent = node->parent;
+        brelse(bh);
+        basicbtfs_cache_unpin_block(sb, bno);
+        put_blocks(sbi, bno, 1);
+        return basicbtfs_bptree_remove_child(sb, inode, parent, bno);
+    }
+
+    /* children[index] covers [entries[index - 1], entries[index]), drop the lower bound */
+    memmove(&node->entries[index > 0 ? index - 1 : 0], &node->entries[index > 0 ? index : 1], (node->nr_of_keys - (index > 0 ? index : 1)) * sizeof(struct basicbtfs_entry));
+    memmove(&node->children[index], &node->children[index + 1], (node->nr_of_keys - index) * sizeof(uint32_t));
+    node->nr_of_keys--;
+    basicbtfs_mark_dirty(bh);
+
+    /* A root with a single child hands its role over to that child */
+    if (node->root && node->nr_of_keys == 0) {
+        new_root_bno = node->children[0];
+        bh_child = basicbtfs_bread(sb, new_root_bno);
+
+        if (!bh_child) {
+            brelse(bh);
+            return -EIO;
+        }
+
+        disk_block = (struct basicbtfs_disk_block *) bh_child->b_data;
+        child = &disk_block->block_type.btree_node;
+        child->root = true;
+        child->parent = inode->i_ino;
+        child->tree_name_bno = node->tree_name_bno;
+        child->nr_of_files = node->nr_of_files;
+        child->nr_times_done = node->nr_times_done;
+        basicbtfs_mark_dirty(bh_child);
+        brelse(bh_child);
+        brelse(bh);
+
+        ret = basicbtfs_btree_update_root(inode, new_root_bno);
+
+        if (ret != 0) return ret;
+
+        basicbtfs_cache_unpin_block(sb, bno);
+        put_blocks(sbi, bno, 1);
+        return 0;
+    }
+
+    brelse(bh);
+    return ret;
+}
+
+static inline int basicbtfs_bptree_delete(struct super_block *sb, struct inode *inode, uint32_t root_bno, uint32_t hash) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct buffer_head *bh = NULL;
+    struct basicbtfs_disk_block *disk_block = NULL;
+    struct basicbtfs_btree_node *node = NULL;
+    uint32_t bno = basicbtfs_bptree_find_leaf(sb, root_bno, hash);
+    uint32_t parent = 0, next_leaf = 0, prev_leaf = 0;
+    bool empty = false;
+    int index = 0, ret = 0;
+
+    if (bno == 0) return -EIO;
+
+    bh = basicbtfs_bread(sb, bno);
+
+    if (!bh) return -EIO;
+
+    disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+    node = &disk_block->block_type.btree_node;
+    index = basicbtfs_bptree_find_entry(node, hash);
+
+    if (index < 0) {
+        brelse(bh);
+        return -ENOENT;
+    }
+
+    memmove(&node->entries[index], &node->entries[index + 1], (node->nr_of_keys - index - 1) * sizeof(struct basicbtfs_entry));
+    node->nr_of_keys--;
+    empty = node->nr_of_keys == 0 && !node->root;
+    parent = node->parent;
+    next_leaf = node->next_leaf;
+    prev_leaf = node->prev_leaf;
+    basicbtfs_mark_dirty(bh);
+    brelse(bh);
+
+    if (empty) {
+        ret = basicbtfs_bptree_set_link(sb, prev_leaf, NULL, &next_leaf, NULL);
+
+        if (ret == 0) ret = basicbtfs_bptree_set_link(sb, next_leaf, NULL, NULL, &prev_leaf);
+        if (ret != 0) return ret;
+
+        basicbtfs_cache_unpin_block(sb, bno);
+        put_blocks(sbi, bno, 1);
+        ret = basicbtfs_bptree_remove_child(sb, inode, parent, bno);
+
+        if (ret != 0) return ret;
+    }
+
+    bh = basicbtfs_bread(sb, BASICBTFS_INODE(inode)->i_bno);
+
+    if (!bh) return -EIO;
+
+    disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+    disk_block->block_type.btree_node.nr_of_files--;
+    basicbtfs_mark_dirty(bh);
+    brelse(bh);
+    return 0;
+}
+
+/* readdir as a sequential scan over the leaves, starting at the position in ctx->pos */
+static inline int basicbtfs_bptree_iterate(struct super_block *sb, uint32_t root_bno, struct dir_context *ctx, struct basicbtfs_dir_cursor *cursor) {
+    struct buffer_head *bh = NULL, *bh_name = NULL;
+    struct basicbtfs_disk_block *disk_block = NULL;
+    struct basicbtfs_btree_node *node = NULL;
+    struct basicbtfs_name_entry *name_entry = NULL;
+    struct basicbtfs_entry *entry = NULL;
+    uint32_t hash = 0, bno = 0, next = 0;
+    int index = 0;
+
+    if (ctx->pos >= BASICBTFS_BPTREE_POS_EOF) return 0;
+
+    hash = basicbtfs_bptree_pos_hash(ctx, cursor);
+    bno = basicbtfs_bptree_find_leaf(sb, root_bno, hash);
+
+    while (bno != 0) {
+        bh = basicbtfs_bread(sb, bno);
+
+        if (!bh) return -EIO;
+
+        disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+        node = &disk_block->block_type.btree_node;
+
+        for (index = 0; index < node->nr_of_keys; index++) {
+            entry = &node->entries[index];
+
+            if (entry->hash < hash) continue;
+
+            bh_name = basicbtfs_bread(sb, entry->name_bno);
+
+            if (!bh_name) {
+                brelse(bh);
+                return -EIO;
+            }
+
+            name_entry = (struct basicbtfs_name_entry *) (bh_name->b_data + entry->block_index);
+            ctx->pos = BASICBTFS_BPTREE_POS(entry->hash);
+
+            if (!dir_emit(ctx, (char *) (name_entry + 1), name_entry->name_length - 1, entry->ino, name_entry->file_type)) {
+                cursor->pos = ctx->pos;
+                cursor->hash = entry->hash;
+                brelse(bh_name);
+                brelse(bh);
+                return 0;
+            }
+
+            ctx->pos++;
+            brelse(bh_name);
+        }
+
+        next = node->next_leaf;
+        brelse(bh);
+        bno = next;
+    }
+
+    ctx->pos = BASICBTFS_BPTREE_POS_EOF;
+    return 0;
+}
+
+#endif
@@ -4,11 +4,16 @@
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/slab.h>
 
 #include "basicbtfs.h"
 #include "bitmap.h"
 #include "cache.h"
+#include "journal.h"
+#include "stats.h"
+#include "trace.h"
 
 static inline int basicbtfs_btree_node_delete(struct super_block *sb, uint32_t bno, uint32_t hash);
 
@@ -32,11 +37,11 @@ static inline int basicbtfs_btree_update_root(struct inode *inode, uint32_t bno)
 
     if (ino >= sbi->s_ninodes) return -1;
 
-    bh = sb_bread(sb, inode_block);
+    bh = basicbtfs_bread(sb, inode_block);
 
     if (!bh) return -EIO;
 
-    basicbtfs_cache_update_root_bno(inode_info->i_bno, bno);
+    basicbtfs_cache_update_root_bno(sb, inode_info->i_bno, bno);
 
     disk_inode = (struct basicbtfs_inode *) bh->b_data;
     disk_inode += inode_offset;
@@ -44,7 +49,22 @@ static inline int basicbtfs_btree_update_root(struct inode *inode, uint32_t bno)
     inode_info->i_bno = bno;
     disk_inode->i_bno = bno;
 
-    mark_buffer_dirty(bh);
+    basicbtfs_mark_dirty(bh);
+    brelse(bh);
+    return 0;
+}
+
+static inline int basicbtfs_btree_node_set_parent(struct super_block *sb, uint32_t bno, uint32_t parent) {
+    struct buffer_head *bh = NULL;
+    struct basicbtfs_disk_block *disk_block = NULL;
+
+    bh = basicbtfs_bread(sb, bno);
+
+    if (!bh) return -EIO;
+
+    disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+    disk_block->block_type.btree_node.parent = parent;
+    basicbtfs_mark_dirty(bh);
     brelse(bh);
     return 0;
 }
@@ -56,7 +76,8 @@ static inline uint32_t basicbtfs_btree_node_lookup(struct super_block *sb, uint3
     uint32_t ret = 0, child = 0;
     int index = 0;
 
-    bh = sb_bread(sb, root_bno);
+    basicbtfs_stat_node(sb, root_bno);
+    bh = basicbtfs_bread(sb, root_bno);
 
     if (!bh) return 0;
     disk_block = (struct basicbtfs_disk_block *) bh->b_data;
@@ -67,7 +88,7 @@ static inline uint32_t basicbtfs_btree_node_lookup(struct super_block *sb, uint3
         counter++;
     }
 
-    if (btr_node->entries[index].hash == hash) {
+    if (index < btr_node->nr_of_keys && btr_node->entries[index].hash == hash) {
         ret = btr_node->entries[index].ino;
         brelse(bh);
         return ret;
@@ -96,7 +117,7 @@ static inline uint32_t basicbtfs_btree_node_update_namelist_info(struct super_bl
         return -1;
     }
 
-    bh = sb_bread(sb, root_bno);
+    bh = basicbtfs_bread(sb, root_bno);
 
     if (!bh) return 0;
     disk_block = (struct basicbtfs_disk_block *) bh->b_data;
@@ -107,18 +128,16 @@ static inline uint32_t basicbtfs_btree_node_update_namelist_info(struct super_bl
         counter++;
     }
 
-    if (btr_node->entries[index].hash == hash) {
-        printk("found :)\n");
+    if (index < btr_node->nr_of_keys && btr_node->entries[index].hash == hash) {
         btr_node->entries[index].name_bno = name_bno;
         btr_node->entries[index].block_index = block_index;
-        mark_buffer_dirty(bh);
+        basicbtfs_mark_dirty(bh);
         brelse(bh);
         return 0;
     }
 
     if (btr_node->leaf) {
         brelse(bh);
-        printk("couldn't find hash\n");
         return -1;
     }
     child = btr_node->children[index];
@@ -134,7 +153,7 @@ static inline uint32_t basicbtfs_btree_node_lookup_with_entry(struct super_block
     uint32_t ret = 0, child = 0;
     int index = 0;
 
-    bh = sb_bread(sb, root_bno);
+    bh = basicbtfs_bread(sb, root_bno);
 
     if (!bh) return 0;
 
@@ -146,7 +165,7 @@ static inline uint32_t basicbtfs_btree_node_lookup_with_entry(struct super_block
         counter++;
     }
 
-    if (btr_node->entries[index].hash == hash) {
+    if (index < btr_node->nr_of_keys && btr_node->entries[index].hash == hash) {
         ret = btr_node->entries[index].ino;
         memcpy(entry, &btr_node->entries[index], sizeof(struct basicbtfs_entry));
         brelse(bh);
@@ -169,20 +188,22 @@ static inline int basicbtfs_btree_split_child(struct super_block *sb, uint32_t p
     struct basicbtfs_disk_block *disk_block = NULL;
     struct basicbtfs_btree_node *node_par = NULL, *node_lhs = NULL, *node_rhs = NULL;
     uint32_t rhs = get_free_blocks(sbi, 1);
-    int i = 0;
+    int i = 0, ret = 0;
 
     if (rhs == -1) {
         return -ENOSPC;
     }
 
-    bh_par = sb_bread(sb, par);
+    basicbtfs_stat_inc(sbi, BASICBTFS_STAT_SPLITS);
+
+    bh_par = basicbtfs_bread(sb, par);
 
     if (!bh_par) return -EIO;
 
     disk_block = (struct basicbtfs_disk_block *) bh_par->b_data;
     node_par = &disk_block->block_type.btree_node;
 
-    bh_lhs = sb_bread(sb, lhs);
+    bh_lhs = basicbtfs_bread(sb, lhs);
 
     if (!bh_lhs) {
         brelse(bh_par);
@@ -192,7 +213,7 @@ static inline int basicbtfs_btree_split_child(struct super_block *sb, uint32_t p
     disk_block = (struct basicbtfs_disk_block *) bh_lhs->b_data;
     node_lhs = &disk_block->block_type.btree_node;
 
-    bh_rhs = sb_bread(sb, rhs);
+    bh_rhs = basicbtfs_bread(sb, rhs);
 
     if (!bh_rhs) {
         brelse(bh_par);
@@ -214,8 +235,9 @@ static inline int basicbtfs_btree_split_child(struct super_block *sb, uint32_t p
     }
 
     if (!node_lhs->leaf) {
-        for (i = 0; i < BASICBTFS_MIN_DEGREE; i++) {
+        for (i = 0; i < BASICBTFS_MIN_DEGREE && ret == 0; i++) {
             node_rhs->children[i] = node_lhs->children[i + BASICBTFS_MIN_DEGREE];
+            ret = basicbtfs_btree_node_set_parent(sb, node_rhs->children[i], rhs);
         }
     }
 
@@ -233,14 +255,15 @@ static inline int basicbtfs_btree_split_child(struct super_block *sb, uint32_t p
 
     memcpy(&node_par->entries[index], &node_lhs->entries[BASICBTFS_MIN_DEGREE - 1], sizeof(struct basicbtfs_entry));
     node_par->nr_of_keys++;
+    basicbtfs_cache_pin_block(sb, par, rhs);
 
-    mark_buffer_dirty(bh_par);
-    mark_buffer_dirty(bh_lhs);
-    mark_buffer_dirty(bh_rhs);
+    basicbtfs_mark_dirty(bh_par);
+    basicbtfs_mark_dirty(bh_lhs);
+    basicbtfs_mark_dirty(bh_rhs);
     brelse(bh_par);
     brelse(bh_lhs);
     brelse(bh_rhs);
-    return 0;
+    return ret;
 }
 
 static inline int basicbtfs_btree_insert_non_full(struct super_block *sb, uint32_t bno, struct basicbtfs_entry *new_entry, uint32_t dir_bno) {
@@ -249,7 +272,7 @@ static inline int basicbtfs_btree_insert_non_full(struct super_block *sb, uint32
     struct basicbtfs_btree_node *node = NULL, *child = NULL;
     int ret = 0;
 
-    bh = sb_bread(sb, bno);
+    bh = basicbtfs_bread(sb, bno);
 
     if (!bh) return -EIO;
 
@@ -266,7 +289,7 @@ static inline int basicbtfs_btree_insert_non_full(struct super_block *sb, uint32
 
         memcpy(&node->entries[index + 1], new_entry, sizeof(struct basicbtfs_entry));
         node->nr_of_keys++;
-        mark_buffer_dirty(bh);
+        basicbtfs_mark_dirty(bh);
     } else {
         int index = node->nr_of_keys - 1;
 
@@ -274,7 +297,7 @@ static inline int basicbtfs_btree_insert_non_full(struct super_block *sb, uint32
             index--;
         }
 
-        bh_child = sb_bread(sb, node->children[index + 1]);
+        bh_child = basicbtfs_bread(sb, node->children[index + 1]);
 
         if (!bh_child) {
             brelse(bh);
@@ -313,7 +336,7 @@ static inline int basicbtfs_btree_node_update(struct super_block *sb, uint32_t r
     uint32_t ret = 0;
     int index = 0;
 
-    bh = sb_bread(sb, root_bno);
+    bh = basicbtfs_bread(sb, root_bno);
 
     if (!bh) return 0;
 
@@ -325,9 +348,9 @@ static inline int basicbtfs_btree_node_update(struct super_block *sb, uint32_t r
         counter++;
     }
 
-    if (btr_node->entries[index].hash == hash) {
+    if (index < btr_node->nr_of_keys && btr_node->entries[index].hash == hash) {
         btr_node->entries[index].ino = inode;
-        mark_buffer_dirty(bh);
+        basicbtfs_mark_dirty(bh);
         brelse(bh);
         return ret;
     }
@@ -348,7 +371,7 @@ static inline int basicbtfs_btree_node_insert(struct super_block *sb, struct ino
     struct basicbtfs_btree_node * old_node = NULL, *new_node = NULL;
     int ret = 0;
 
-    bh_old = sb_bread(sb, bno);
+    bh_old = basicbtfs_bread(sb, bno);
 
     if (!bh_old) return -EIO;
 
@@ -363,7 +386,7 @@ static inline int basicbtfs_btree_node_insert(struct super_block *sb, struct ino
             return -ENOSPC;
         }
 
-        bh_new = sb_bread(sb, bno_new_root);
+        bh_new = basicbtfs_bread(sb, bno_new_root);
 
         if (!bh_new) {
             brelse(bh_old);
@@ -376,6 +399,7 @@ static inline int basicbtfs_btree_node_insert(struct super_block *sb, struct ino
         new_node = &disk_block->block_type.btree_node;
         basicbtfs_btree_node_init(sb, new_node, false, bno, bno_new_root, par_inode->i_ino);
         new_node->children[0] = bno;
+        basicbtfs_cache_pin_block(sb, bno, bno_new_root);
 
         ret = basicbtfs_btree_split_child(sb, bno_new_root, bno, 0, bno);
 
@@ -412,7 +436,7 @@ static inline int basicbtfs_btree_node_insert(struct super_block *sb, struct ino
         new_node->root = true;
         old_node->root = false;
         old_node->parent = bno_new_root;
-        mark_buffer_dirty(bh_new);
+        basicbtfs_mark_dirty(bh_new);
         brelse(bh_new);
     } else {
         ret = basicbtfs_btree_insert_non_full(sb, bno, entry, bno);
@@ -423,7 +447,7 @@ static inline int basicbtfs_btree_node_insert(struct super_block *sb, struct ino
         }
         old_node->nr_of_files++;
         old_node->nr_times_done++;
-        mark_buffer_dirty(bh_old);
+        basicbtfs_mark_dirty(bh_old);
     }
     brelse(bh_old);
     return 0;
@@ -435,7 +459,7 @@ static inline int basicbtfs_btree_node_find_key(struct super_block *sb, uint32_t
     struct basicbtfs_btree_node *node = NULL;
     int index = 0;
 
-    bh = sb_bread(sb, bno);
+    bh = basicbtfs_bread(sb, bno);
 
     if (!bh) return -1;
 
@@ -455,7 +479,7 @@ static inline int basicbtfs_btree_node_remove_from_leaf(struct super_block *sb,
     struct basicbtfs_btree_node *node = NULL;
     int i = 0;
 
-    bh = sb_bread(sb, bno);
+    bh = basicbtfs_bread(sb, bno);
 
     if (!bh) return -1;
 
@@ -467,7 +491,7 @@ static inline int basicbtfs_btree_node_remove_from_leaf(struct super_block *sb,
     }
 
     node->nr_of_keys--;
-    mark_buffer_dirty(bh);
+    basicbtfs_mark_dirty(bh);
     brelse(bh);
     return 0;
 }
@@ -478,7 +502,7 @@ static inline int basicbtfs_btree_node_get_predecessor(struct super_block *sb, u
     struct basicbtfs_disk_block *disk_block = NULL;
     uint32_t bno_child = 0;
 
-    bh = sb_bread(sb, bno);
+    bh = basicbtfs_bread(sb, bno);
 
     if (!bh) return -EIO;
 
@@ -489,7 +513,7 @@ static inline int basicbtfs_btree_node_get_predecessor(struct super_block *sb, u
     brelse(bh);
     bh = NULL;
     node = NULL;
-    bh = sb_bread(sb, bno_child);
+    bh = basicbtfs_bread(sb, bno_child);
 
     if (!bh) return -EIO;
 
@@ -503,7 +527,7 @@ static inline int basicbtfs_btree_node_get_predecessor(struct super_block *sb, u
         bh = NULL;
         node = NULL;
 
-        bh = sb_bread(sb, bno_child);
+        bh = basicbtfs_bread(sb, bno_child);
 
         if (!bh) return -EIO;
         disk_block = (struct basicbtfs_disk_block *) bh->b_data;
@@ -521,7 +545,7 @@ static inline int basicbtfs_btree_node_get_succesor(struct super_block *sb, uint
     struct basicbtfs_disk_block *disk_block = NULL;
     uint32_t bno_child = 0;
 
-    bh = sb_bread(sb, bno);
+    bh = basicbtfs_bread(sb, bno);
 
     if (!bh) return -EIO;
 
@@ -532,7 +556,7 @@ static inline int basicbtfs_btree_node_get_succesor(struct super_block *sb, uint
     brelse(bh);
     bh = NULL;
     node = NULL;
-    bh = sb_bread(sb, bno_child);
+    bh = basicbtfs_bread(sb, bno_child);
 
     if (!bh) return -EIO;
 
@@ -545,7 +569,7 @@ static inline int basicbtfs_btree_node_get_succesor(struct super_block *sb, uint
         bh = NULL;
         node = NULL;
 
-        bh = sb_bread(sb, bno_child);
+        bh = basicbtfs_bread(sb, bno_child);
 
         if (!bh) return -EIO;
 
@@ -554,25 +578,30 @@ static inline int basicbtfs_btree_node_get_succesor(struct super_block *sb, uint
     }
 
     memcpy(ret, &node->entries[0], sizeof (struct basicbtfs_entry));
-    mark_buffer_dirty(bh);
+    basicbtfs_mark_dirty(bh);
     brelse(bh);
     return 0;
 }
 
+/* Merges children[index + 1] and the separator at index into children[index] */
 static inline int basicbtfs_btree_node_merge(struct super_block *sb, uint32_t bno, int index) {
     struct buffer_head *bh_par = NULL, *bh_lhs = NULL, *bh_rhs = NULL;
     struct basicbtfs_btree_node *node = NULL, *lhs = NULL, *rhs = NULL;
     struct basicbtfs_disk_block *disk_block = NULL;
-    int i = 0;
+    uint32_t lhs_bno = 0, rhs_bno = 0;
+    int i = 0, ret = 0;
 
-    bh_par = sb_bread(sb, bno);
+    basicbtfs_stat_inc(BASICBTFS_SB(sb), BASICBTFS_STAT_MERGES);
+    bh_par = basicbtfs_bread(sb, bno);
 
     if (!bh_par) return -EIO;
 
     disk_block = (struct basicbtfs_disk_block *) bh_par->b_data;
     node = &disk_block->block_type.btree_node;
+    lhs_bno = node->children[index];
+    rhs_bno = node->children[index + 1];
 
-    bh_lhs = sb_bread(sb, node->children[index]);
+    bh_lhs = basicbtfs_bread(sb, lhs_bno);
 
     if (!bh_lhs) {
         brelse(bh_par);
@@ -582,7 +611,7 @@ static inline int basicbtfs_btree_node_merge(struct super_block *sb, uint32_t bn
     disk_block = (struct basicbtfs_disk_block *) bh_lhs->b_data;
     lhs = &disk_block->block_type.btree_node;
 
-    bh_rhs = sb_bread(sb, node->children[index + 1]);
+    bh_rhs = basicbtfs_bread(sb, rhs_bno);
 
     if (!bh_rhs) {
         brelse(bh_par);
@@ -593,15 +622,16 @@ static inline int basicbtfs_btree_node_merge(struct super_block *sb, uint32_t bn
     disk_block = (struct basicbtfs_disk_block *) bh_rhs->b_data;
     rhs = &disk_block->block_type.btree_node;
 
-    memcpy(&lhs->entries[BASICBTFS_MIN_DEGREE - 1], &node->entries[index], sizeof(struct basicbtfs_entry));
+    memcpy(&lhs->entries[lhs->nr_of_keys], &node->entries[index], sizeof(struct basicbtfs_entry));
 
     for (i  = 0; i < rhs->nr_of_keys; i++) {
-        memcpy(&lhs->entries[i + BASICBTFS_MIN_DEGREE], &rhs->entries[i], sizeof(struct basicbtfs_entry));
+        memcpy(&lhs->entries[i + lhs->nr_of_keys + 1], &rhs->entries[i], sizeof(struct basicbtfs_entry));
     }
 
     if (!lhs->leaf) {
-        for (i = 0; rhs->nr_of_keys; i++) {
-            lhs->children[i + BASICBTFS_MIN_DEGREE] = rhs->children[i];
+        for (i = 0; i <= rhs->nr_of_keys && ret == 0; i++) {
+            lhs->children[i + lhs->nr_of_keys + 1] = rhs->children[i];
+            ret = basicbtfs_btree_node_set_parent(sb, rhs->children[i], lhs_bno);
         }
     }
 
@@ -613,19 +643,20 @@ static inline int basicbtfs_btree_node_merge(struct super_block *sb, uint32_t bn
         node->children[i - 1] = node->children[i];
     }
 
+    node->children[node->nr_of_keys] = 0;
     lhs->nr_of_keys = lhs->nr_of_keys + rhs->nr_of_keys + 1;
     node->nr_of_keys--;
-    put_blocks(BASICBTFS_SB(sb), node->children[index + 1], 1);
-    node->children[index + 1] = 0;
+    basicbtfs_cache_unpin_block(sb, rhs_bno);
+    put_blocks(BASICBTFS_SB(sb), rhs_bno, 1);
 
-    mark_buffer_dirty(bh_par);
-    mark_buffer_dirty(bh_lhs);
-    mark_buffer_dirty(bh_rhs);
+    basicbtfs_mark_dirty(bh_par);
+    basicbtfs_mark_dirty(bh_lhs);
+    basicbtfs_mark_dirty(bh_rhs);
 
     brelse(bh_par);
     brelse(bh_lhs);
     brelse(bh_rhs);
-    return 0;
+    return ret;
 }
 
 static inline int basicbtfs_btree_node_remove_from_nonleaf(struct super_block *sb, uint32_t bno, int index) {
@@ -635,14 +666,14 @@ static inline int basicbtfs_btree_node_remove_from_nonleaf(struct super_block *s
     struct basicbtfs_entry tmp, pred, succ;
     int ret = 0;
 
-    bh_par = sb_bread(sb, bno);
+    bh_par = basicbtfs_bread(sb, bno);
 
     if (!bh_par) return -EIO;
 
     disk_block = (struct basicbtfs_disk_block *) bh_par->b_data;
     node = &disk_block->block_type.btree_node;
 
-    bh_lhs = sb_bread(sb, node->children[index]);
+    bh_lhs = basicbtfs_bread(sb, node->children[index]);
 
     if (!bh_lhs) {
         brelse(bh_par);
@@ -653,7 +684,7 @@ static inline int basicbtfs_btree_node_remove_from_nonleaf(struct super_block *s
     disk_block = (struct basicbtfs_disk_block *) bh_lhs->b_data;
     lhs = &disk_block->block_type.btree_node;
 
-    bh_rhs = sb_bread(sb, node->children[index + 1]);
+    bh_rhs = basicbtfs_bread(sb, node->children[index + 1]);
 
     if (!bh_rhs) {
         brelse(bh_par);
@@ -674,7 +705,7 @@ static inline int basicbtfs_btree_node_remove_from_nonleaf(struct super_block *s
             return ret;
         }
         memcpy(&node->entries[index], &pred, sizeof(struct basicbtfs_entry));
-        mark_buffer_dirty(bh_par);
+        basicbtfs_mark_dirty(bh_par);
         ret = basicbtfs_btree_node_delete(sb, node->children[index], pred.hash);
     } else if (rhs->nr_of_keys >= BASICBTFS_MIN_DEGREE) {
         ret = basicbtfs_btree_node_get_succesor(sb, bno, index, &succ);
@@ -687,7 +718,7 @@ static inline int basicbtfs_btree_node_remove_from_nonleaf(struct super_block *s
         }
 
         memcpy(&node->entries[index], &succ, sizeof(struct basicbtfs_entry));
-        mark_buffer_dirty(bh_par);
+        basicbtfs_mark_dirty(bh_par);
         ret = basicbtfs_btree_node_delete(sb, node->children[index + 1], succ.hash);
     } else {
         memcpy(&tmp, &node->entries[index], sizeof(struct basicbtfs_entry));
@@ -714,16 +745,16 @@ static inline int basicbtfs_btree_node_steal_from_previous(struct super_block *s
     struct buffer_head *bh_par = NULL, *bh_lhs = NULL, *bh_rhs = NULL;
     struct basicbtfs_btree_node *node = NULL, *lhs = NULL, *rhs = NULL;
     struct basicbtfs_disk_block *disk_block = NULL;
-    int i = 0;
+    int i = 0, ret = 0;
 
-    bh_par = sb_bread(sb, bno);
+    bh_par = basicbtfs_bread(sb, bno);
 
     if (!bh_par) return -EIO;
 
     disk_block = (struct basicbtfs_disk_block *) bh_par->b_data;
     node = &disk_block->block_type.btree_node;
 
-    bh_lhs = sb_bread(sb, node->children[index]);
+    bh_lhs = basicbtfs_bread(sb, node->children[index - 1]);
 
     if (!bh_lhs) {
         brelse(bh_par);
@@ -733,7 +764,7 @@ static inline int basicbtfs_btree_node_steal_from_previous(struct super_block *s
     disk_block = (struct basicbtfs_disk_block *) bh_lhs->b_data;
     lhs = &disk_block->block_type.btree_node;
 
-    bh_rhs = sb_bread(sb, node->children[index + 1]);
+    bh_rhs = basicbtfs_bread(sb, node->children[index]);
 
     if (!bh_rhs) {
         brelse(bh_par);
@@ -758,6 +789,7 @@ static inline int basicbtfs_btree_node_steal_from_previous(struct super_block *s
 
     if (!rhs->leaf) {
         rhs->children[0] = lhs->children[lhs->nr_of_keys];
+        ret = basicbtfs_btree_node_set_parent(sb, rhs->children[0], node->children[index]);
     }
 
     memcpy(&node->entries[index - 1], &lhs->entries[lhs->nr_of_keys - 1], sizeof(struct basicbtfs_entry));
@@ -765,30 +797,30 @@ static inline int basicbtfs_btree_node_steal_from_previous(struct super_block *s
     rhs->nr_of_keys++;
     lhs->nr_of_keys--;
 
-    mark_buffer_dirty(bh_par);
-    mark_buffer_dirty(bh_lhs);
-    mark_buffer_dirty(bh_rhs);
+    basicbtfs_mark_dirty(bh_par);
+    basicbtfs_mark_dirty(bh_lhs);
+    basicbtfs_mark_dirty(bh_rhs);
 
     brelse(bh_par);
     brelse(bh_lhs);
     brelse(bh_rhs);
-    return 0;
+    return ret;
 }
 
 static inline int basicbtfs_btree_node_steal_from_next(struct super_block *sb, uint32_t bno, int index) {
     struct buffer_head *bh_par = NULL, *bh_lhs = NULL, *bh_rhs = NULL;
     struct basicbtfs_btree_node *node = NULL, *lhs = NULL, *rhs = NULL;
     struct basicbtfs_disk_block *disk_block = NULL;
-    int i = 0;
+    int i = 0, ret = 0;
 
-    bh_par = sb_bread(sb, bno);
+    bh_par = basicbtfs_bread(sb, bno);
 
     if (!bh_par) return -EIO;
 
     disk_block = (struct basicbtfs_disk_block *) bh_par->b_data;
     node = &disk_block->block_type.btree_node;
 
-    bh_lhs = sb_bread(sb, node->children[index]);
+    bh_lhs = basicbtfs_bread(sb, node->children[index]);
 
     if (!bh_lhs) {
         brelse(bh_par);
@@ -798,7 +830,7 @@ static inline int basicbtfs_btree_node_steal_from_next(struct super_block *sb, u
     disk_block = (struct basicbtfs_disk_block *) bh_lhs->b_data;
     lhs = &disk_block->block_type.btree_node;
 
-    bh_rhs = sb_bread(sb, node->children[index + 1]);
+    bh_rhs = basicbtfs_bread(sb, node->children[index + 1]);
 
     if (!bh_rhs) {
         brelse(bh_par);
@@ -813,6 +845,7 @@ static inline int basicbtfs_btree_node_steal_from_next(struct super_block *sb, u
 
     if (!lhs->leaf) {
         lhs->children[lhs->nr_of_keys+1] = rhs->children[0];
+        ret = basicbtfs_btree_node_set_parent(sb, rhs->children[0], node->children[index]);
     }
 
     memcpy(&node->entries[index], &rhs->entries[0], sizeof(struct basicbtfs_entry));
@@ -830,53 +863,57 @@ static inline int basicbtfs_btree_node_steal_from_next(struct super_block *sb, u
     lhs->nr_of_keys++;
     rhs->nr_of_keys--;
 
-    mark_buffer_dirty(bh_par);
-    mark_buffer_dirty(bh_lhs);
-    mark_buffer_dirty(bh_rhs);
+    basicbtfs_mark_dirty(bh_par);
+    basicbtfs_mark_dirty(bh_lhs);
+    basicbtfs_mark_dirty(bh_rhs);
 
     brelse(bh_par);
     brelse(bh_lhs);
     brelse(bh_rhs);
-    return 0;
+    return ret;
+}
+
+static inline uint32_t basicbtfs_btree_node_nr_of_keys(struct super_block *sb, uint32_t bno) {
+    struct buffer_head *bh = NULL;
+    struct basicbtfs_disk_block *disk_block = NULL;
+    uint32_t nr_of_keys = 0;
+
+    bh = basicbtfs_bread(sb, bno);
+
+    if (!bh) return 0;
+
+    disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+    nr_of_keys = disk_block->block_type.btree_node.nr_of_keys;
+    brelse(bh);
+    return nr_of_keys;
 }
 
+/* Makes sure children[index] has at least BASICBTFS_MIN_DEGREE keys before it is entered */
 static inline int basicbtfs_btree_node_fill(struct super_block *sb, uint32_t bno, int index) {
-    struct buffer_head *bh_par = NULL, *bh_lhs = NULL, *bh_rhs = NULL;
-    struct basicbtfs_btree_node *node = NULL, *lhs = NULL, *rhs = NULL;
+    struct buffer_head *bh_par = NULL;
+    struct basicbtfs_btree_node *node = NULL;
     struct basicbtfs_disk_block *disk_block = NULL;
+    uint32_t prev = 0, next = 0;
     int ret = 0;
 
-    bh_par = sb_bread(sb, bno);
+    bh_par = basicbtfs_bread(sb, bno);
 
     if (!bh_par) return -EIO;
 
     disk_block = (struct basicbtfs_disk_block *) bh_par->b_data;
     node = &disk_block->block_type.btree_node;
 
-    bh_lhs = sb_bread(sb, node->children[index]);
-
-    if (!bh_lhs) {
-        brelse(bh_par);
-        return -EIO;
+    if (index != 0) {
+        prev = node->children[index - 1];
     }
 
-    disk_block = (struct basicbtfs_disk_block *) bh_lhs->b_data;
-    lhs = &disk_block->block_type.btree_node;
-
-    bh_rhs = sb_bread(sb, node->children[index + 1]);
-
-    if (!bh_rhs) {
-        brelse(bh_par);
-        brelse(bh_lhs);
-        return -EIO;
+    if (index != node->nr_of_keys) {
+        next = node->children[index + 1];
     }
 
-    disk_block = (struct basicbtfs_disk_block *) bh_rhs->b_data;
-    rhs = &disk_block->block_type.btree_node;
-
-    if (index != 0 && lhs->nr_of_keys >= BASICBTFS_MIN_DEGREE) {
+    if (prev && basicbtfs_btree_node_nr_of_keys(sb, prev) >= BASICBTFS_MIN_DEGREE) {
         ret = basicbtfs_btree_node_steal_from_previous(sb, bno, index);
-    } else if (index != node->nr_of_keys && rhs->nr_of_keys >= BASICBTFS_MIN_DEGREE) {
+    } else if (next && basicbtfs_btree_node_nr_of_keys(sb, next) >= BASICBTFS_MIN_DEGREE) {
         ret = basicbtfs_btree_node_steal_from_next(sb, bno, index);
     } else {
         if (index != node->nr_of_keys) {
@@ -887,9 +924,7 @@ static inline int basicbtfs_btree_node_fill(struct super_block *sb, uint32_t bno
     }
 
     brelse(bh_par);
-    brelse(bh_lhs);
-    brelse(bh_rhs);
-    return 0;
+    return ret;
 }
 
 static inline int basicbtfs_btree_node_delete(struct super_block *sb, uint32_t bno, uint32_t hash) {
@@ -900,7 +935,7 @@ static inline int basicbtfs_btree_node_delete(struct super_block *sb, uint32_t b
     int ret = 0;
     bool flag = false;
 
-    bh = sb_bread(sb, bno);
+    bh = basicbtfs_bread(sb, bno);
 
     if (!bh) return -EIO;
 
@@ -913,9 +948,12 @@ static inline int basicbtfs_btree_node_delete(struct super_block *sb, uint32_t b
         } else {
             ret = basicbtfs_btree_node_remove_from_nonleaf(sb, bno, index);
         }
+    } else if (node->leaf) {
+        brelse(bh);
+        return -ENOENT;
     } else {
 
-        bh2 = sb_bread(sb, node->children[index]);
+        bh2 = basicbtfs_bread(sb, node->children[index]);
 
         if (!bh2) {
             brelse(bh);
@@ -937,27 +975,136 @@ static inline int basicbtfs_btree_node_delete(struct super_block *sb, uint32_t b
             }
         }
 
-        basicbtfs_btree_node_delete(sb, node->children[index], hash);
+        /* the last child was merged into its left neighbour */
+        if (flag && index > node->nr_of_keys) {
+            index--;
+        }
+
+        ret = basicbtfs_btree_node_delete(sb, node->children[index], hash);
         brelse(bh2);
     }
     brelse(bh);
-    return 0;
+    return ret;
+}
+
+/*
+ * Restores children[index] of bno once it has dropped below low_water keys, either by
+ * merging it with a neighbour or by taking a single entry over from a full neighbour.
+ */
+static inline int basicbtfs_btree_node_rebalance(struct super_block *sb, uint32_t bno, int index, uint32_t low_water) {
+    struct buffer_head *bh = NULL;
+    struct basicbtfs_btree_node *node = NULL;
+    struct basicbtfs_disk_block *disk_block = NULL;
+    uint32_t nr_of_keys = 0, sibling_keys = 0;
+    int ret = 0;
+
+    bh = basicbtfs_bread(sb, bno);
+
+    if (!bh) return -EIO;
+
+    disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+    node = &disk_block->block_type.btree_node;
+    nr_of_keys = basicbtfs_btree_node_nr_of_keys(sb, node->children[index]);
+
+    if (nr_of_keys >= low_water || node->nr_of_keys == 0) {
+        brelse(bh);
+        return 0;
+    }
+
+    if (index != 0) {
+        sibling_keys = basicbtfs_btree_node_nr_of_keys(sb, node->children[index - 1]);
+
+        if (sibling_keys + nr_of_keys + 1 <= 2 * BASICBTFS_MIN_DEGREE - 1) {
+            ret = basicbtfs_btree_node_merge(sb, bno, index - 1);
+        } else {
+            ret = basicbtfs_btree_node_steal_from_previous(sb, bno, index);
+        }
+    } else {
+        sibling_keys = basicbtfs_btree_node_nr_of_keys(sb, node->children[index + 1]);
+
+        if (sibling_keys + nr_of_keys + 1 <= 2 * BASICBTFS_MIN_DEGREE - 1) {
+            ret = basicbtfs_btree_node_merge(sb, bno, index);
+        } else {
+            ret = basicbtfs_btree_node_steal_from_next(sb, bno, index);
+        }
+    }
+
+    brelse(bh);
+    return ret;
+}
+
+/*
+ * Relaxed deletion: the entry is removed without preparing the path, a node is only
+ * rebalanced on the way back up once it holds less than low_water keys. Every node
+ * keeps at least one key, so an internal entry can always be replaced by its predecessor.
+ */
+static inline int basicbtfs_btree_node_delete_relaxed(struct super_block *sb, uint32_t bno, uint32_t hash, uint32_t low_water) {
+    struct buffer_head *bh = NULL;
+    struct basicbtfs_btree_node *node = NULL;
+    struct basicbtfs_disk_block *disk_block = NULL;
+    struct basicbtfs_entry pred;
+    int index = 0, ret = 0;
+
+    bh = basicbtfs_bread(sb, bno);
+
+    if (!bh) return -EIO;
+
+    disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+    node = &disk_block->block_type.btree_node;
+
+    while (index < node->nr_of_keys && node->entries[index].hash < hash) {
+        index++;
+    }
+
+    if (index < node->nr_of_keys && node->entries[index].hash == hash) {
+        if (node->leaf) {
+            memmove(&node->entries[index], &node->entries[index + 1], (node->nr_of_keys - index - 1) * sizeof(struct basicbtfs_entry));
+            node->nr_of_keys--;
+            basicbtfs_mark_dirty(bh);
+            brelse(bh);
+            return 0;
+        }
+
+        ret = basicbtfs_btree_node_get_predecessor(sb, bno, index, &pred);
+
+        if (ret == 0) {
+            memcpy(&node->entries[index], &pred, sizeof(struct basicbtfs_entry));
+            basicbtfs_mark_dirty(bh);
+            ret = basicbtfs_btree_node_delete_relaxed(sb, node->children[index], pred.hash, low_water);
+        }
+    } else if (node->leaf) {
+        ret = -ENOENT;
+    } else {
+        ret = basicbtfs_btree_node_delete_relaxed(sb, node->children[index], hash, low_water);
+    }
+
+    if (ret == 0 && !node->leaf) {
+        ret = basicbtfs_btree_node_rebalance(sb, bno, index, low_water);
+    }
+
+    brelse(bh);
+    return ret;
 }
 
 static inline int basicbtfs_btree_delete_entry(struct super_block *sb, struct inode *inode, uint32_t root_bno, uint32_t hash) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
     struct buffer_head *bh = NULL, *bh2 = NULL;
     struct basicbtfs_btree_node *node, *new_root_node = NULL;
     struct basicbtfs_disk_block *disk_block = NULL;
     int ret = 0;
 
-    bh = sb_bread(sb, root_bno);
+    bh = basicbtfs_bread(sb, root_bno);
 
     if (!bh) return -EIO;
 
     disk_block = (struct basicbtfs_disk_block *) bh->b_data;
     node = &disk_block->block_type.btree_node;
 
-    ret = basicbtfs_btree_node_delete(sb, root_bno, hash);
+    if (sbi->s_relaxed_delete) {
+        ret = basicbtfs_btree_node_delete_relaxed(sb, root_bno, hash, sbi->s_low_water);
+    } else {
+        ret = basicbtfs_btree_node_delete(sb, root_bno, hash);
+    }
 
     if (ret == 1) {
         brelse(bh);
@@ -970,7 +1117,7 @@ static inline int basicbtfs_btree_delete_entry(struct super_block *sb, struct in
     if (node->nr_of_keys == 0) {
         if (node->leaf) {
             node->nr_of_files--;
-            mark_buffer_dirty(bh);
+            basicbtfs_mark_dirty(bh);
         } else {
             ret = basicbtfs_btree_update_root(inode, node->children[0]);
 
@@ -979,7 +1126,7 @@ static inline int basicbtfs_btree_delete_entry(struct super_block *sb, struct in
                 return ret;
             }
 
-            bh2 = sb_bread(sb, node->children[0]);
+            bh2 = basicbtfs_bread(sb, node->children[0]);
 
             if (!bh2) {
                 brelse(bh);
@@ -994,12 +1141,14 @@ static inline int basicbtfs_btree_delete_entry(struct super_block *sb, struct in
             new_root_node->parent = inode->i_ino;
             new_root_node->root = true;
             node->root = false;
-            mark_buffer_dirty(bh2);
+            basicbtfs_mark_dirty(bh2);
             brelse(bh2);
+            basicbtfs_cache_unpin_block(sb, root_bno);
+            put_blocks(sbi, root_bno, 1);
         }
     } else {
         node->nr_of_files--;
-        mark_buffer_dirty(bh);
+        basicbtfs_mark_dirty(bh);
     }
 
     brelse(bh);
@@ -1010,13 +1159,298 @@ static inline int basicbtfs_btree_clear(struct super_block *sb, uint32_t bno) {
     return 0;
 }
 
-static inline int basicbtfs_btree_traverse_debug(struct super_block *sb, uint32_t bno) {
+/*
+ * Builds a packed btree bottom up from nr_of_entries entries sorted on hash. Every level
+ * is cut into nodes filled up to fill_factor percent, the entry between two neighbouring
+ * nodes is promoted to the level above. The entries array is used as scratch space for
+ * the promoted entries. All nodes are allocated in one go, root first, so the new tree
+ * ends up in one contiguous area when possible. With linked_leaves a B+-tree is built:
+ * every entry stays in a leaf, the leaves are chained and only copies move up.
+ */
+static inline int basicbtfs_btree_bulk_load(struct super_block *sb, struct inode *inode, struct basicbtfs_entry *entries, uint32_t nr_of_entries, uint32_t fill_factor, bool linked_leaves, struct basicbtfs_btree_bulk_plan *plan, uint32_t *root_bno) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct buffer_head *bh = NULL;
+    struct basicbtfs_disk_block *disk_block = NULL;
+    struct basicbtfs_btree_node *node = NULL;
+    uint32_t *bnos = NULL;
+    uint32_t start_bno = 0, level = 0, index = 0, i = 0, nr_of_keys = 0;
+    uint32_t key_index = 0, child_index = 0, parent_index = 0, parent_children = 0;
+    int ret = 0;
+
+    if (basicbtfs_btree_bulk_plan(plan, nr_of_entries, fill_factor, linked_leaves) < 0) return -EFBIG;
+
+    bnos = kmalloc_array(plan->total_nodes, sizeof(uint32_t), GFP_KERNEL);
+
+    if (!bnos) return -ENOMEM;
+
+    start_bno = get_free_blocks(sbi, plan->total_nodes);
+
+    for (i = 0; i < plan->total_nodes; i++) {
+        bnos[i] = start_bno != -1 ? start_bno + i : get_free_blocks(sbi, 1);
+
+        if (bnos[i] == -1) {
+            while (i-- > 0) {
+                put_blocks(sbi, bnos[i], 1);
+            }
+            kfree(bnos);
+            return -ENOSPC;
+        }
+    }
+
+    for (level = 0; level < plan->height; level++) {
+        key_index = 0;
+        child_index = 0;
+        parent_index = 0;
+        parent_children = level + 1 < plan->height ? basicbtfs_btree_bulk_nr_of_keys(plan, level + 1, 0) + 1 : 0;
+
+        for (index = 0; index < plan->nr_of_nodes[level]; index++) {
+            bh = basicbtfs_bread(sb, bnos[plan->first_node[level] + index]);
+
+            if (!bh) {
+                ret = -EIO;
+                goto out;
+            }
+
+            disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+            memset(disk_block, 0, BASICBTFS_BLOCKSIZE);
+            disk_block->block_type_id = BASICBTFS_BLOCKTYPE_BTREE_NODE;
+            node = &disk_block->block_type.btree_node;
+
+            nr_of_keys = basicbtfs_btree_bulk_nr_of_keys(plan, level, index);
+            memcpy(node->entries, &entries[key_index], nr_of_keys * sizeof(struct basicbtfs_entry));
+            key_index += nr_of_keys;
+            node->nr_of_keys = nr_of_keys;
+            node->leaf = level == 0;
+
+            if (!node->leaf) {
+                for (i = 0; i <= nr_of_keys; i++) {
+                    node->children[i] = bnos[plan->first_node[level - 1] + child_index + i];
+                }
+                child_index += nr_of_keys + 1;
+            } else if (linked_leaves) {
+                node->prev_leaf = index > 0 ? bnos[plan->first_node[0] + index - 1] : 0;
+                node->next_leaf = index + 1 < plan->nr_of_nodes[0] ? bnos[plan->first_node[0] + index + 1] : 0;
+            }
+
+            if (level + 1 == plan->height) {
+                node->parent = inode->i_ino;
+                node->root = true;
+            } else {
+                node->parent = bnos[plan->first_node[level + 1] + parent_index];
+
+                if (--parent_children == 0 && parent_index + 1 < plan->nr_of_nodes[level + 1]) {
+                    parent_index++;
+                    parent_children = basicbtfs_btree_bulk_nr_of_keys(plan, level + 1, parent_index) + 1;
+                }
+
+                /* the separator is never written before it is read, as index < key_index */
+                if (index + 1 < plan->nr_of_nodes[level]) {
+                    entries[index] = entries[key_index];
+
+                    if (!node->leaf || !linked_leaves) {
+                        key_index++;
+                    }
+                }
+            }
+
+            basicbtfs_mark_dirty(bh);
+            brelse(bh);
+        }
+    }
+
+    *root_bno = bnos[0];
+
+out:
+    if (ret < 0) {
+        for (i = 0; i < plan->total_nodes; i++) {
+            put_blocks(sbi, bnos[i], 1);
+        }
+    }
+
+    kfree(bnos);
+    return ret;
+}
+
+/* Counts the entries below bno, with leaves_only the separators of a B+-tree are skipped */
+static inline int basicbtfs_btree_count_entries(struct super_block *sb, uint32_t bno, uint32_t *nr_of_entries, bool leaves_only) {
     struct buffer_head *bh = NULL;
     struct basicbtfs_btree_node *node = NULL;
     struct basicbtfs_disk_block *disk_block = NULL;
     int index = 0, ret = 0;
+
+    bh = basicbtfs_bread(sb, bno);
+
+    if (!bh) return -EIO;
+
+    disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+    node = &disk_block->block_type.btree_node;
+    if (node->leaf || !leaves_only) {
+        *nr_of_entries += node->nr_of_keys;
+    }
+
+    if (!node->leaf) {
+        for (index = 0; index <= node->nr_of_keys; index++) {
+            ret = basicbtfs_btree_count_entries(sb, node->children[index], nr_of_entries, leaves_only);
+
+            if (ret < 0) break;
+        }
+    }
+
+    brelse(bh);
+    return ret;
+}
+
+/* Counts the nodes of the subtree in bno */
+static inline int basicbtfs_btree_count_nodes(struct super_block *sb, uint32_t bno, uint32_t *nr_of_nodes) {
+    struct buffer_head *bh = NULL;
+    struct basicbtfs_btree_node *node = NULL;
+    int index = 0, ret = 0;
+
     bh = sb_bread(sb, bno);
 
+    if (!bh) return -EIO;
+
+    node = &((struct basicbtfs_disk_block *) bh->b_data)->block_type.btree_node;
+    (*nr_of_nodes)++;
+
+    if (!node->leaf) {
+        for (index = 0; index <= node->nr_of_keys; index++) {
+            ret = basicbtfs_btree_count_nodes(sb, node->children[index], nr_of_nodes);
+
+            if (ret < 0) break;
+        }
+    }
+
+    brelse(bh);
+    return ret;
+}
+
+/* Collects the entries of the subtree in bno in sorted order */
+static inline int basicbtfs_btree_collect_entries(struct super_block *sb, uint32_t bno, struct basicbtfs_entry *entries, uint32_t *nr_of_entries, uint32_t max_entries, bool leaves_only) {
+    struct buffer_head *bh = NULL;
+    struct basicbtfs_btree_node *node = NULL;
+    struct basicbtfs_disk_block *disk_block = NULL;
+    int index = 0, ret = 0;
+
+    bh = basicbtfs_bread(sb, bno);
+
+    if (!bh) return -EIO;
+
+    disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+    node = &disk_block->block_type.btree_node;
+
+    for (index = 0; index <= node->nr_of_keys; index++) {
+        if (!node->leaf) {
+            ret = basicbtfs_btree_collect_entries(sb, node->children[index], entries, nr_of_entries, max_entries, leaves_only);
+
+            if (ret < 0) break;
+        }
+
+        if (index == node->nr_of_keys) break;
+
+        if (!node->leaf && leaves_only) continue;
+
+        if (*nr_of_entries >= max_entries) {
+            ret = -EIO;
+            break;
+        }
+
+        entries[(*nr_of_entries)++] = node->entries[index];
+    }
+
+    brelse(bh);
+    return ret;
+}
+
+/*
+ * Replaces the btree of a directory by a bulk loaded copy. The old tree is only freed
+ * once the new one has been written, so a failure leaves the directory untouched.
+ */
+static inline int basicbtfs_btree_rebuild(struct super_block *sb, struct inode *inode, uint32_t fill_factor) {
+    struct basicbtfs_inode_info *inode_info = BASICBTFS_INODE(inode);
+    struct basicbtfs_btree_bulk_plan plan;
+    struct basicbtfs_entry *entries = NULL;
+    struct buffer_head *bh = NULL;
+    struct basicbtfs_btree_node *node = NULL;
+    struct basicbtfs_disk_block *disk_block = NULL;
+    uint32_t old_root_bno = inode_info->i_bno, root_bno = 0;
+    uint32_t tree_name_bno = 0, nr_times_done = 0, nr_of_entries = 0, nr_collected = 0, nr_of_nodes = 0;
+    bool linked_leaves = BASICBTFS_HAS_BPTREE(sb);
+    int ret = 0;
+
+    bh = basicbtfs_bread(sb, old_root_bno);
+
+    if (!bh) return -EIO;
+
+    disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+    node = &disk_block->block_type.btree_node;
+
+    /* a single leaf can not be packed any further */
+    if (node->leaf) {
+        brelse(bh);
+        return 0;
+    }
+
+    tree_name_bno = node->tree_name_bno;
+    nr_times_done = node->nr_times_done;
+    brelse(bh);
+
+    ret = basicbtfs_btree_count_entries(sb, old_root_bno, &nr_of_entries, linked_leaves);
+
+    if (ret == 0) ret = basicbtfs_btree_count_nodes(sb, old_root_bno, &nr_of_nodes);
+
+    if (ret < 0) return ret;
+
+    /* a tree that already has no more nodes than its packed copy would only be moved */
+    if (basicbtfs_btree_bulk_plan(&plan, nr_of_entries, fill_factor, linked_leaves) == 0 && plan.total_nodes >= nr_of_nodes) return 0;
+
+    entries = kvmalloc_array(nr_of_entries, sizeof(struct basicbtfs_entry), GFP_KERNEL);
+
+    if (!entries) return -ENOMEM;
+
+    ret = basicbtfs_btree_collect_entries(sb, old_root_bno, entries, &nr_collected, nr_of_entries, linked_leaves);
+
+    if (ret < 0) goto out;
+
+    ret = basicbtfs_btree_bulk_load(sb, inode, entries, nr_collected, fill_factor, linked_leaves, &plan, &root_bno);
+
+    if (ret < 0) goto out;
+
+    bh = basicbtfs_bread(sb, root_bno);
+
+    if (!bh) {
+        ret = -EIO;
+        goto out;
+    }
+
+    disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+    node = &disk_block->block_type.btree_node;
+    node->tree_name_bno = tree_name_bno;
+    node->nr_times_done = nr_times_done;
+    node->nr_of_files = nr_collected;
+    basicbtfs_mark_dirty(bh);
+    brelse(bh);
+
+    ret = basicbtfs_btree_update_root(inode, root_bno);
+
+    if (ret < 0) goto out;
+
+    ret = basicbtfs_btree_free_dir(sb, inode, old_root_bno);
+
+    if (ret == 0) trace_basicbtfs_btree_rebuild(inode, nr_collected, plan.total_nodes, plan.height);
+
+out:
+    kvfree(entries);
+    return ret;
+}
+
+static inline int basicbtfs_btree_traverse_debug(struct super_block *sb, uint32_t bno) {
+    struct buffer_head *bh = NULL;
+    struct basicbtfs_btree_node *node = NULL;
+    struct basicbtfs_disk_block *disk_block = NULL;
+    int index = 0, ret = 0;
+    bh = basicbtfs_bread(sb, bno);
+
 
     if (!bh) return -EIO;
 
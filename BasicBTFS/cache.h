@@ -10,331 +10,353 @@
 #include "basicbtfs.h"
 #include "bitmap.h"
 
-static inline void basicbtfs_cache_add_dir(struct super_block *sb, uint32_t bno, struct basicbtfs_btree_node_cache *node, struct basicbtfs_block *name_block, uint32_t name_bno) {
-    struct basicbtfs_btree_dir_cache_list *new_cache_dir_entry = basicbtfs_alloc_btree_dir(sb);
-    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
-    struct basicbtfs_name_tree_cache *name_tree_cache;
+/*
+ * The directory cache keeps the btree nodes and name list blocks of a directory in memory by
+ * holding a reference to their buffer_heads. The btree and nametree code keeps going through
+ * sb_bread, which finds the pinned buffers, so every block exists once and is changed in place.
+ * Dirty blocks are written back by the buffer cache on sync, or when they are unpinned and
+ * evicted. A block that is missed by the hooks below is just not pinned, it is never stale.
+ *
+ * Operations in different directories run side by side, and a split or free in any of them
+ * looks through every cached directory, so s_dir_cache and the block lists of its entries are
+ * only walked or changed under s_dir_cache_lock. The helpers up to basicbtfs_cache_pin_dir
+ * expect the caller to hold it, the ones after it take it themselves.
+ */
+static inline int basicbtfs_cache_pin(struct super_block *sb, struct basicbtfs_btree_dir_cache_list *dir_cache, uint32_t bno) {
+    struct basicbtfs_cached_block *cached_block = NULL;
+
+    if (dir_cache->nr_of_blocks >= BASICBTFS_MAX_CACHE_BLOCKS_PER_DIR) {
+        dir_cache->complete = false;
+        return 0;
+    }
 
-    new_cache_dir_entry->root_node_cache = (struct basicbtfs_btree_node_cache *)basicbtfs_alloc_file(sb);
-    new_cache_dir_entry->bno = bno;
-    new_cache_dir_entry->nr_of_blocks = 5;
-    INIT_LIST_HEAD(&new_cache_dir_entry->list);
-    list_add(&new_cache_dir_entry->list, &dir_cache_list);
+    cached_block = basicbtfs_alloc_cached_block(sb);
 
-    new_cache_dir_entry->name_tree_cache = basicbtfs_alloc_nametree_hdr(sb);
-    name_tree_cache = basicbtfs_alloc_nametree_hdr(sb);
+    if (!cached_block) {
+        dir_cache->complete = false;
+        return -ENOMEM;
+    }
 
-    new_cache_dir_entry->name_tree_cache->name_tree_block = basicbtfs_alloc_file(sb);
-    name_tree_cache->name_tree_block = basicbtfs_alloc_file(sb);
+    cached_block->bh = sb_bread(sb, bno);
 
-    name_tree_cache->name_bno = name_bno;
-    memcpy(name_tree_cache->name_tree_block, name_block, sizeof(struct basicbtfs_block));
+    if (!cached_block->bh) {
+        basicbtfs_destroy_cached_block(cached_block);
+        dir_cache->complete = false;
+        return -EIO;
+    }
 
-    INIT_LIST_HEAD(&new_cache_dir_entry->name_tree_cache->list);
-    INIT_LIST_HEAD(&name_tree_cache->list);
-    list_add(&name_tree_cache->list, &new_cache_dir_entry->name_tree_cache->list);
+    cached_block->bno = bno;
+    list_add_tail(&cached_block->list, &dir_cache->blocks);
+    dir_cache->nr_of_blocks++;
+    return 0;
+}
 
-    INIT_LIST_HEAD(&new_cache_dir_entry->root_node_cache->list);
-    INIT_LIST_HEAD(&node->list);
-    list_add(&node->list, &new_cache_dir_entry->root_node_cache->list);
+static inline void basicbtfs_cache_unpin_all(struct basicbtfs_btree_dir_cache_list *dir_cache) {
+    struct basicbtfs_cached_block *cached_block, *tmp;
 
-    sbi->s_cache_dir_entries++;
+    list_for_each_entry_safe(cached_block, tmp, &dir_cache->blocks, list) {
+        list_del(&cached_block->list);
+        brelse(cached_block->bh);
+        basicbtfs_destroy_cached_block(cached_block);
+    }
+
+    dir_cache->nr_of_blocks = 0;
 }
 
-static inline void basicbtfs_cache_add_node(struct super_block *sb, uint32_t dir_bno, struct basicbtfs_btree_node_cache *node) {
-    struct basicbtfs_btree_dir_cache_list *dir_cache, *tmp;
+static inline int basicbtfs_cache_pin_tree(struct super_block *sb, struct basicbtfs_btree_dir_cache_list *dir_cache, uint32_t bno, int depth) {
+    struct buffer_head *bh = NULL;
+    struct basicbtfs_btree_node *node = NULL;
+    int index = 0, ret = 0;
 
-    list_for_each_entry_safe(dir_cache, tmp, &dir_cache_list, list) {
-        if (dir_cache->bno == dir_bno) {
-            INIT_LIST_HEAD(&node->list);
-            list_add_tail(&node->list, &dir_cache->root_node_cache->list);
+    if (depth > BASICBTFS_BTREE_MAX_HEIGHT) return -EIO;
 
-            list_del(&dir_cache->list);
-            dir_cache->nr_of_blocks++;
-            list_add(&dir_cache->list, &dir_cache_list);
-            break;
-        }
-    }
-}
+    ret = basicbtfs_cache_pin(sb, dir_cache, bno);
 
-static inline void basicbtfs_cache_add_name_block(struct super_block *sb, uint32_t dir_bno, struct basicbtfs_block *name_block, uint32_t name_bno) {
-    struct basicbtfs_btree_dir_cache_list *dir_cache, *tmp;
-    struct basicbtfs_name_tree_cache *nametree_hdr = basicbtfs_alloc_nametree_hdr(sb);
+    if (ret < 0 || !dir_cache->complete) return ret;
 
-    nametree_hdr->name_tree_block = basicbtfs_alloc_file(sb);
-    nametree_hdr->name_bno = name_bno;
+    bh = sb_bread(sb, bno);
 
-    memcpy(nametree_hdr->name_tree_block, name_block, sizeof(struct basicbtfs_block));
+    if (!bh) return -EIO;
 
-    list_for_each_entry_safe(dir_cache, tmp, &dir_cache_list, list) {
-        if (dir_cache->bno == dir_bno) {
-            INIT_LIST_HEAD(&nametree_hdr->list);
-            list_add(&nametree_hdr->list, &dir_cache->name_tree_cache->list);
+    node = &((struct basicbtfs_disk_block *) bh->b_data)->block_type.btree_node;
 
-            list_del(&dir_cache->list);
-            dir_cache->nr_of_blocks++;
-            list_add(&dir_cache->list, &dir_cache_list);
-            break;
+    if (!node->leaf) {
+        for (index = 0; index <= node->nr_of_keys && ret == 0 && dir_cache->complete; index++) {
+            ret = basicbtfs_cache_pin_tree(sb, dir_cache, node->children[index], depth + 1);
         }
     }
+
+    brelse(bh);
+    return ret;
 }
 
-static inline void basicbtfs_cache_update_block(struct super_block *sb, uint32_t dir_bno, struct basicbtfs_block *name_block, uint32_t name_bno) {
-    struct basicbtfs_btree_dir_cache_list *dir_cache;
-    struct basicbtfs_name_tree_cache *nametree_hdr_cache, *tmp;
+/*
+ * Pins the tree below the root at dir_cache->bno, then its name list. An inline directory is
+ * its root block. The directory is complete when nothing was left out.
+ */
+static inline int basicbtfs_cache_pin_dir(struct super_block *sb, struct basicbtfs_btree_dir_cache_list *dir_cache) {
+    struct buffer_head *bh = NULL;
+    struct basicbtfs_disk_block *disk_block = NULL;
+    uint32_t name_bno = 0;
+    int ret = 0;
 
-    list_for_each_entry(dir_cache, &dir_cache_list, list) {
-        if (dir_cache->bno == dir_bno) {
-            list_for_each_entry_safe(nametree_hdr_cache, tmp, &dir_cache->name_tree_cache->list, list) {
-                if (nametree_hdr_cache->name_bno == name_bno) {
-                    memcpy(nametree_hdr_cache->name_tree_block, name_block, sizeof(struct basicbtfs_block));
-                    break;
-                }
-            }
-        }
+    dir_cache->complete = true;
+    bh = sb_bread(sb, dir_cache->bno);
+
+    if (!bh) {
+        dir_cache->complete = false;
+        return -EIO;
     }
-}
 
-static inline void basicbtfs_cache_update_root_node(uint32_t dir_bno, struct basicbtfs_btree_node_cache *new_node) {
-    struct basicbtfs_btree_dir_cache_list *tmp, *dir_cache;
-    struct basicbtfs_btree_node_cache *node_cache;
+    disk_block = (struct basicbtfs_disk_block *) bh->b_data;
 
-    list_for_each_entry_safe(dir_cache, tmp, &dir_cache_list, list) {
-        if (dir_cache->bno == dir_bno) {
-            list_del(&new_node->list);
-            list_add(&new_node->list, &dir_cache->root_node_cache->list);
-            break;
-        }
+    if (disk_block->block_type_id == BASICBTFS_BLOCKTYPE_INLINE_DIR) {
+        brelse(bh);
+        return basicbtfs_cache_pin(sb, dir_cache, dir_cache->bno);
     }
 
-    node_cache =  list_first_entry(&dir_cache->root_node_cache->list, struct basicbtfs_btree_node_cache, list);
-}
+    if (disk_block->block_type_id != BASICBTFS_BLOCKTYPE_BTREE_NODE) {
+        brelse(bh);
+        dir_cache->complete = false;
+        return 0;
+    }
 
-static inline void basicbtfs_cache_update_root_bno(uint32_t dir_bno, uint32_t new_bno) {
-    struct basicbtfs_btree_dir_cache_list *tmp, *dir_cache;
+    name_bno = disk_block->block_type.btree_node.tree_name_bno;
+    brelse(bh);
 
-    list_for_each_entry_safe(dir_cache, tmp, &dir_cache_list, list) {
-        if (dir_cache->bno == dir_bno) {
-            list_del(&dir_cache->list);
-            dir_cache->bno = new_bno;
-            list_add(&dir_cache->list, &dir_cache_list);
-            return;
-        }
-    }
-}
+    ret = basicbtfs_cache_pin_tree(sb, dir_cache, dir_cache->bno, 0);
 
-static inline struct basicbtfs_btree_node_cache * basicbtfs_cache_get_root_node(uint32_t dir_bno) {
-    struct basicbtfs_btree_dir_cache_list *dir_cache;
-    struct basicbtfs_btree_node_cache *node_cache;
+    while (ret == 0 && name_bno != 0 && dir_cache->complete) {
+        ret = basicbtfs_cache_pin(sb, dir_cache, name_bno);
 
-    list_for_each_entry(dir_cache, &dir_cache_list, list) {
-        if (dir_cache->bno == dir_bno) {
-            node_cache =  list_first_entry(&dir_cache->root_node_cache->list, struct basicbtfs_btree_node_cache, list);
-            return node_cache;
-        }
+        if (ret < 0 || !dir_cache->complete) break;
+
+        disk_block = (struct basicbtfs_disk_block *) list_last_entry(&dir_cache->blocks, struct basicbtfs_cached_block, list)->bh->b_data;
+        name_bno = disk_block->block_type.name_list_hdr.next_block;
     }
 
-    return NULL;
+    if (ret < 0) dir_cache->complete = false;
+
+    return ret;
 }
 
-static inline uint32_t basicbtfs_cache_get_nr_of_blocks(uint32_t dir_bno) {
-    struct basicbtfs_btree_dir_cache_list *dir_cache;
+/* Starts caching the directory with root bno, as far as BASICBTFS_MAX_CACHE_BLOCKS_PER_DIR goes */
+static inline int basicbtfs_cache_add_dir(struct super_block *sb, uint32_t bno) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct basicbtfs_btree_dir_cache_list *dir_cache = NULL;
+    int ret = 0;
 
-    list_for_each_entry(dir_cache, &dir_cache_list, list) {
-        if (dir_cache->bno == dir_bno) {
-            return dir_cache->nr_of_blocks;
-        }
+    mutex_lock(&sbi->s_dir_cache_lock);
+
+    if (sbi->s_cache_dir_entries >= BASICBTFS_MAX_CACHE_DIR_ENTRIES) {
+        mutex_unlock(&sbi->s_dir_cache_lock);
+        return 0;
     }
 
-    return 0;
-}
+    dir_cache = basicbtfs_alloc_btree_dir(sb);
 
+    if (!dir_cache) {
+        mutex_unlock(&sbi->s_dir_cache_lock);
+        return -ENOMEM;
+    }
+
+    dir_cache->bno = bno;
+    dir_cache->nr_of_blocks = 0;
+    INIT_LIST_HEAD(&dir_cache->blocks);
+    list_add(&dir_cache->list, &sbi->s_dir_cache);
+    sbi->s_cache_dir_entries++;
 
+    ret = basicbtfs_cache_pin_dir(sb, dir_cache);
+    mutex_unlock(&sbi->s_dir_cache_lock);
 
-static inline void basicbtfs_cache_delete_dir(struct super_block *sb, uint32_t hash) {
+    if (ret < 0) {
+        printk(KERN_ERR "Could not cache directory %u: %d\n", bno, ret);
+    }
+
+    return ret;
+}
+
+/* Pins a block that was just added to the directory which has near_bno pinned */
+static inline void basicbtfs_cache_pin_block(struct super_block *sb, uint32_t near_bno, uint32_t bno) {
     struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
-    struct basicbtfs_btree_dir_cache_list *dir_cache, *tmp_dir_cache;
-    struct basicbtfs_btree_node_cache *node_cache, *tmp_node;
-    struct basicbtfs_name_tree_cache *nametree_hdr_cache, *tmp_natr_hdr_cache;
-
-    list_for_each_entry_safe(dir_cache, tmp_dir_cache, &dir_cache_list, list) {
-        if (dir_cache->bno == hash) {
-            list_for_each_entry_safe(node_cache, tmp_node, &dir_cache->root_node_cache->list, list) {
-                list_del(&node_cache->list);
-                basicbtfs_destroy_file_block((struct basicbtfs_block *) node_cache);
-            }
+    struct basicbtfs_btree_dir_cache_list *dir_cache;
+    struct basicbtfs_cached_block *cached_block;
 
-            list_for_each_entry_safe(nametree_hdr_cache, tmp_natr_hdr_cache, &dir_cache->name_tree_cache->list, list) {
-                list_del(&nametree_hdr_cache->list);
-                basicbtfs_destroy_file_block(nametree_hdr_cache->name_tree_block);
-                basicbtfs_destroy_nametree_hdr(nametree_hdr_cache);
+    mutex_lock(&sbi->s_dir_cache_lock);
+
+    list_for_each_entry(dir_cache, &sbi->s_dir_cache, list) {
+        list_for_each_entry(cached_block, &dir_cache->blocks, list) {
+            if (cached_block->bno == near_bno) {
+                basicbtfs_cache_pin(sb, dir_cache, bno);
+                goto out;
             }
-            list_del(&dir_cache->list);
-            basicbtfs_destroy_btree_dir(dir_cache);
-            sbi->s_cache_dir_entries--;
-            break;
         }
     }
+
+out:
+    mutex_unlock(&sbi->s_dir_cache_lock);
 }
 
-static inline int basicbtfs_cache_emit_block(struct basicbtfs_block *btfs_block, int *total_nr_entries, int *current_index, struct dir_context *ctx, loff_t start_pos) {
-    struct basicbtfs_name_list_hdr *name_list_hdr = NULL;
-    struct basicbtfs_disk_block *disk_block = NULL;
-    struct basicbtfs_name_entry *cur_entry = NULL;
-    char *block = NULL;
-    char *filename = NULL;
-    int i = 0;
-    
-    disk_block = (struct basicbtfs_disk_block *) btfs_block;
-    name_list_hdr = &disk_block->block_type.name_list_hdr;
-    block = (char *) btfs_block;
-    block += BASICBTFS_NAME_ENTRY_S_OFFSET;
-    cur_entry = (struct basicbtfs_name_entry *) block;
-    *total_nr_entries += name_list_hdr->nr_of_entries;
-
-    if (start_pos < *total_nr_entries) {
-        for (i = 0; i < name_list_hdr->nr_of_entries; i++) {
-            block += sizeof(struct basicbtfs_name_entry);
-            if (cur_entry->ino != 0) {
-                filename = kzalloc(sizeof(char) * cur_entry->name_length, GFP_KERNEL);
-                strncpy(filename, block, cur_entry->name_length);
-                if (!dir_emit(ctx, filename, cur_entry->name_length - 1, cur_entry->ino, DT_UNKNOWN)) {
-                    kfree(filename);
-                    return 1;
-                }
-                ctx->pos++;
-                kfree(filename);
-            } else {
-                i--;
+/* Lets go of a block that is about to be freed */
+static inline void basicbtfs_cache_unpin_block(struct super_block *sb, uint32_t bno) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct basicbtfs_btree_dir_cache_list *dir_cache;
+    struct basicbtfs_cached_block *cached_block;
+
+    mutex_lock(&sbi->s_dir_cache_lock);
+
+    list_for_each_entry(dir_cache, &sbi->s_dir_cache, list) {
+        list_for_each_entry(cached_block, &dir_cache->blocks, list) {
+            if (cached_block->bno == bno) {
+                list_del(&cached_block->list);
+                brelse(cached_block->bh);
+                basicbtfs_destroy_cached_block(cached_block);
+                dir_cache->nr_of_blocks--;
+                goto out;
             }
-
-            block += cur_entry->name_length;
-            cur_entry = (struct basicbtfs_name_entry *) block;
         }
     }
 
-    return 0;
+out:
+    mutex_unlock(&sbi->s_dir_cache_lock);
 }
 
-static inline bool basicbtfs_cache_iterate_dir(struct super_block *sb, uint32_t hash, struct dir_context *ctx, loff_t start_pos) {
+/*
+ * Whether the directory with root dir_bno is cached with all its blocks. A lookup in it only
+ * goes through pinned buffers, so a miss is answered from memory and needs no Bloom filter.
+ */
+static inline bool basicbtfs_cache_dir_complete(struct super_block *sb, uint32_t dir_bno) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
     struct basicbtfs_btree_dir_cache_list *dir_cache;
-    struct basicbtfs_name_tree_cache *nametree_hdr_cache;
-    uint32_t current_index = 0;
-    uint32_t total_nr_entries = 0;
-
-    list_for_each_entry(dir_cache, &dir_cache_list, list) {
-        if (dir_cache->bno == hash) {
-            list_for_each_entry(nametree_hdr_cache, &dir_cache->name_tree_cache->list, list) {
-                basicbtfs_cache_emit_block(nametree_hdr_cache->name_tree_block, &total_nr_entries, &current_index, ctx, start_pos);
-            }
+    bool complete = false;
+
+    mutex_lock(&sbi->s_dir_cache_lock);
 
-            return true;
+    list_for_each_entry(dir_cache, &sbi->s_dir_cache, list) {
+        if (dir_cache->bno == dir_bno) {
+            complete = dir_cache->complete;
+            break;
         }
     }
-    return false;
+
+    mutex_unlock(&sbi->s_dir_cache_lock);
+    return complete;
 }
 
-static inline int basicbtfs_cache_emit_block_debug(struct basicbtfs_block *btfs_block, int *total_nr_entries, int *current_index) {
-    struct basicbtfs_name_list_hdr *name_list_hdr = NULL;
-    struct basicbtfs_name_entry *cur_entry = NULL;
-    struct basicbtfs_disk_block *disk_block = NULL;
-    char *block = NULL;
-    char *filename = NULL;
-    int i = 0;
-    
-    disk_block = (struct basicbtfs_disk_block *) btfs_block;
-    name_list_hdr = &disk_block->block_type.name_list_hdr;
-    block = (char *)btfs_block;
-    block += BASICBTFS_NAME_ENTRY_S_OFFSET;
-    cur_entry = (struct basicbtfs_name_entry *) block;
-    *total_nr_entries += name_list_hdr->nr_of_entries;
-
-
-    for (i = 0; i < name_list_hdr->nr_of_entries; i++) {
-        block += sizeof(struct basicbtfs_name_entry);
-        if (cur_entry->ino != 0) {
-            filename = kzalloc(sizeof(char) * cur_entry->name_length, GFP_KERNEL);
-            strncpy(filename, block, cur_entry->name_length);
-            kfree(filename);
-        } else {
-            i--;
-        }
+static inline void basicbtfs_cache_update_root_bno(struct super_block *sb, uint32_t dir_bno, uint32_t new_bno) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct basicbtfs_btree_dir_cache_list *dir_cache;
 
-        block += cur_entry->name_length;
-        cur_entry = (struct basicbtfs_name_entry *) block;
-        *current_index += 1;
+    mutex_lock(&sbi->s_dir_cache_lock);
+
+    list_for_each_entry(dir_cache, &sbi->s_dir_cache, list) {
+        if (dir_cache->bno == dir_bno) {
+            dir_cache->bno = new_bno;
+            break;
+        }
     }
 
-    return 0;
+    mutex_unlock(&sbi->s_dir_cache_lock);
 }
 
-static inline bool basicbtfs_cache_iterate_dir_debug(struct super_block *sb, uint32_t hash) {
-    struct basicbtfs_btree_dir_cache_list *dir_cache;
-    struct basicbtfs_name_tree_cache *nametree_hdr_cache;
-    uint32_t current_index = 0;
-    uint32_t total_nr_entries = 0;
-
-    list_for_each_entry(dir_cache, &dir_cache_list, list) {
-        if (dir_cache->bno == hash) {
-            list_for_each_entry(nametree_hdr_cache, &dir_cache->name_tree_cache->list, list) {
-                basicbtfs_cache_emit_block_debug(nametree_hdr_cache->name_tree_block, &total_nr_entries, &current_index);
-            }
+static inline void basicbtfs_cache_delete_dir(struct super_block *sb, uint32_t dir_bno) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct basicbtfs_btree_dir_cache_list *dir_cache, *tmp;
 
-            return true;
+    mutex_lock(&sbi->s_dir_cache_lock);
+
+    list_for_each_entry_safe(dir_cache, tmp, &sbi->s_dir_cache, list) {
+        if (dir_cache->bno == dir_bno) {
+            basicbtfs_cache_unpin_all(dir_cache);
+            list_del(&dir_cache->list);
+            basicbtfs_destroy_btree_dir(dir_cache);
+            sbi->s_cache_dir_entries--;
+            break;
         }
     }
-    return false;
+
+    mutex_unlock(&sbi->s_dir_cache_lock);
 }
 
-static inline uint32_t basicbtfs_btree_node_cache_lookup(struct basicbtfs_btree_node_cache *btr_node, uint32_t hash, int counter) {
-    uint32_t ret = 0;
-    int index = 0;
+/* Pins the blocks of every cached directory again, after defrag moved them */
+static inline void basicbtfs_cache_refresh(struct super_block *sb) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct basicbtfs_btree_dir_cache_list *dir_cache;
 
-    while (index < btr_node->nr_of_keys && hash > btr_node->entries[index].hash) {
-        index++;
-        counter++;
-    }
+    mutex_lock(&sbi->s_dir_cache_lock);
 
-    if (btr_node->entries[index].hash == hash) {
-        ret = btr_node->entries[index].ino;
-        return ret;
+    list_for_each_entry(dir_cache, &sbi->s_dir_cache, list) {
+        basicbtfs_cache_unpin_all(dir_cache);
+        basicbtfs_cache_pin_dir(sb, dir_cache);
     }
 
-    if (btr_node->leaf) {
-        return 0;
+    mutex_unlock(&sbi->s_dir_cache_lock);
+}
+
+/* Drops the whole cache on unmount, after the pinned blocks have been synced */
+static inline void basicbtfs_cache_destroy(struct super_block *sb) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct basicbtfs_btree_dir_cache_list *dir_cache, *tmp;
+
+    mutex_lock(&sbi->s_dir_cache_lock);
+
+    list_for_each_entry_safe(dir_cache, tmp, &sbi->s_dir_cache, list) {
+        basicbtfs_cache_unpin_all(dir_cache);
+        list_del(&dir_cache->list);
+        basicbtfs_destroy_btree_dir(dir_cache);
     }
 
-    ret = basicbtfs_btree_node_cache_lookup(btr_node->children[index], hash, counter);
-    return ret;
+    sbi->s_cache_dir_entries = 0;
+    mutex_unlock(&sbi->s_dir_cache_lock);
 }
 
-static inline uint32_t basicbtfs_cache_lookup_entry(struct super_block *sb, uint32_t dir_bno, uint32_t hash) {
-    struct basicbtfs_btree_dir_cache_list *dir_cache;
-    struct basicbtfs_btree_node_cache *node_cache;
+/*
+ * Emits the names of a name list block from offset on. The names are
+ * handed to dir_emit straight out of the block. Returns 1 when ctx is full, with the cursor
+ * at the first name that was not emitted.
+ */
+static inline int basicbtfs_cache_emit_block(char *block, uint32_t name_bno, uint32_t offset, struct dir_context *ctx, struct basicbtfs_dir_cursor *cursor) {
+    struct basicbtfs_disk_block *disk_block = (struct basicbtfs_disk_block *) block;
+    struct basicbtfs_name_list_hdr *name_list_hdr = &disk_block->block_type.name_list_hdr;
+    struct basicbtfs_name_entry *cur_entry = NULL;
 
-    list_for_each_entry(dir_cache, &dir_cache_list, list) {
-        if (dir_cache->bno == dir_bno) {
-            node_cache =  list_first_entry(&dir_cache->root_node_cache->list, struct basicbtfs_btree_node_cache, list);
-            return basicbtfs_btree_node_cache_lookup(node_cache, hash, 0);
+    while (offset < name_list_hdr->start_unused_area) {
+        cur_entry = (struct basicbtfs_name_entry *) (block + offset);
+
+        if (cur_entry->ino != 0) {
+            if (!dir_emit(ctx, (char *) (cur_entry + 1), cur_entry->name_length - 1, cur_entry->ino, cur_entry->file_type)) {
+                cursor->name_bno = name_bno;
+                cursor->offset = offset;
+                return 1;
+            }
+
+            ctx->pos++;
         }
+
+        offset += sizeof(struct basicbtfs_name_entry) + cur_entry->name_length;
     }
 
     return 0;
 }
 
-static inline void basicbtfs_cache_delete_node(struct super_block *sb, uint32_t dir_bno, struct basicbtfs_btree_node_cache *node_cache) {
-    struct basicbtfs_btree_dir_cache_list *dir_cache, *tmp;
-    list_for_each_entry_safe(dir_cache, tmp, &dir_cache_list, list) {
-        if (dir_cache->bno == dir_bno) {
-            list_del(&dir_cache->list);
-            dir_cache->nr_of_blocks--;
-            list_add(&dir_cache->list, &dir_cache_list);
+/* Returns the offset of name number skip in a name list block, skip being below its nr_of_entries */
+static inline uint32_t basicbtfs_cache_block_offset(char *block, uint32_t skip) {
+    struct basicbtfs_name_entry *cur_entry = NULL;
+    uint32_t offset = BASICBTFS_NAME_ENTRY_S_OFFSET;
 
-            list_del(&node_cache->list);
-            basicbtfs_destroy_file_block((struct basicbtfs_block *) node_cache);
-            break;
+    while (true) {
+        cur_entry = (struct basicbtfs_name_entry *) (block + offset);
+
+        if (cur_entry->ino != 0) {
+            if (skip == 0) break;
+
+            skip--;
         }
+
+        offset += sizeof(struct basicbtfs_name_entry) + cur_entry->name_length;
     }
+
+    return offset;
 }
 
 #endif
@@ -54,12 +54,12 @@ void init_default_commands() {
 
     init_command("defragment", BASICBTFS_IOC_DEFRAG);
     init_command("defrag", BASICBTFS_IOC_DEFRAG);
+    init_command("stat", BASICBTFS_IOC_FRAG_STAT);
 }
 
 unsigned long search_command(char *command) {
     for (int index = 0; index <= cmd_list->pointer; index++) {
         struct command_t *cur_command = cmd_list->data[index];
-        printf("cur: %s, %s\n", cur_command->name, command);
 
         if (strcmp(command, cur_command->name) == 0) {
             return cur_command->code;
@@ -75,10 +75,69 @@ char *to_lowercase(char *command) {
     return command;
 }
 
+/* Prints the non-empty buckets of a histogram, each with the smallest value it counts */
+void print_histogram(const char *name, uint32_t *buckets, bool last) {
+    bool first = true;
+
+    printf("    \"%s\": [", name);
+
+    for (int index = 0; index < BASICBTFS_STAT_BUCKETS; index++) {
+        if (buckets[index] == 0) continue;
+
+        printf("%s{\"from\": %llu, \"count\": %u}", first ? "" : ", ", 1ULL << index, buckets[index]);
+        first = false;
+    }
+
+    printf("]%s\n", last ? "" : ",");
+}
+
+double average(uint64_t sum, uint64_t count) {
+    return count ? (double) sum / count : 0;
+}
+
+/* The fragmentation report as JSON, histograms are lists of log2 buckets */
+void print_stat(struct basicbtfs_ioctl_frag_stat *stat) {
+    uint32_t btree_dirs = stat->nr_of_dirs - stat->nr_of_inline_dirs;
+
+    printf("{\n");
+    printf("  \"files\": %u,\n", stat->nr_of_files);
+    printf("  \"directories\": %u,\n", stat->nr_of_dirs);
+    printf("  \"inline_directories\": %u,\n", stat->nr_of_inline_dirs);
+    printf("  \"file_extents\": {\n");
+    printf("    \"total\": %llu,\n", (unsigned long long) stat->nr_of_file_extents);
+    printf("    \"average\": %.3f,\n", average(stat->nr_of_file_extents, stat->nr_of_files));
+    print_histogram("histogram", stat->file_extents, true);
+    printf("  },\n");
+    printf("  \"free_extents\": {\n");
+    printf("    \"total\": %llu,\n", (unsigned long long) stat->nr_of_free_extents);
+    printf("    \"free_blocks\": %llu,\n", (unsigned long long) stat->nr_of_free_blocks);
+    printf("    \"largest\": %u,\n", stat->largest_free_extent);
+    print_histogram("histogram", stat->free_extents, true);
+    printf("  },\n");
+    printf("  \"btree\": {\n");
+    printf("    \"nodes\": %llu,\n", (unsigned long long) stat->nr_of_btree_nodes);
+    printf("    \"keys\": %llu,\n", (unsigned long long) stat->nr_of_btree_keys);
+    printf("    \"fill_factor\": %.3f\n", average(stat->nr_of_btree_keys, stat->nr_of_btree_nodes * (2 * BASICBTFS_MIN_DEGREE - 1)));
+    printf("  },\n");
+    printf("  \"name_lists\": {\n");
+    printf("    \"blocks\": %llu,\n", (unsigned long long) stat->nr_of_name_list_blocks);
+    printf("    \"average_chain\": %.3f,\n", average(stat->nr_of_name_list_blocks, btree_dirs));
+    print_histogram("histogram", stat->name_list_chains, true);
+    printf("  },\n");
+    printf("  \"directory_distance\": {\n");
+    printf("    \"pairs\": %llu,\n", (unsigned long long) stat->nr_of_dir_distances);
+    printf("    \"average\": %.3f,\n", average(stat->dir_distance_sum, stat->nr_of_dir_distances));
+    print_histogram("histogram", stat->dir_distances, true);
+    printf("  }\n");
+    printf("}\n");
+}
+
 int main(int argc, char **argv) {
     unsigned long cur_cmd_code = 0;
     int fd, ret;
     struct basicbtfs_ioctl_vol_args args;
+    struct basicbtfs_ioctl_frag_stat frag_stat;
+    struct stat st;
     init_default_commands();
 
     if (argv[1] != NULL) {
@@ -99,27 +158,65 @@ int main(int argc, char **argv) {
                     perror("could not open disk\n");
                     return EXIT_FAILURE;
                 }
-                
-                ret = ioctl(fd, cur_cmd_code, (int32_t *) &args);
 
-                if (ret != -1) {
-                    printf("oh no, something went wrong\n");
+                if (fstat(fd, &st) == -1) {
+                    perror("could not stat file\n");
+                    close(fd);
+                    return EXIT_FAILURE;
+                }
+
+                /* a regular file is defragmented on its own, the root directory means the whole disk */
+                if (S_ISREG(st.st_mode)) {
+                    ret = ioctl(fd, BASICBTFS_IOC_DEFRAG_FILE);
+                } else {
+                    ret = ioctl(fd, cur_cmd_code, (int32_t *) &args);
+                }
+
+                if (ret == -1) {
+                    perror("oh no, something went wrong");
+                    close(fd);
+                    return EXIT_FAILURE;
+                }
+
+                /* a planned pass of the whole disk reports its moves as well, a swap pass does not */
+                if (S_ISREG(st.st_mode) || ret > 0) {
+                    printf("%d blocks moved\n", ret);
                 } else {
                     printf("sent\n");
                 }
+
+                close(fd);
             } else {
                 printf("no valid entry\n");
             }
             break;
+        case BASICBTFS_IOC_FRAG_STAT:
+            if (argv[2] == NULL) {
+                printf("no valid entry\n");
+                break;
+            }
+
+            fd = open(argv[2], O_RDONLY);
+
+            if (fd == -1) {
+                perror("could not open disk\n");
+                return EXIT_FAILURE;
+            }
+
+            memset(&frag_stat, 0, sizeof(frag_stat));
+
+            if (ioctl(fd, BASICBTFS_IOC_FRAG_STAT, &frag_stat) == -1) {
+                perror("oh no, something went wrong");
+                close(fd);
+                return EXIT_FAILURE;
+            }
+
+            print_stat(&frag_stat);
+            close(fd);
+            break;
         default:
             printf("invalid command, try again\n");
     }
 
-    if (argv[2] != NULL && argv[2][0] == '/') {
-        memcpy(args.name, argv[2], strlen(argv[2]) + 1);
-        ioctl(fd, cur_cmd_code, (int32_t *) &args);
-    }
-
-    close(fd);
-
-}
\ No newline at end of file
+    return 0;
+}
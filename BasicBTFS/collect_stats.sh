@@ -0,0 +1,31 @@
+#!/usr/bin/env bash
+#!/bin/bash
+
+# Snapshot of the counters and latency histograms of a mounted basicbtfs, see sysfs.c, as
+# json. The benchmarks take one before and one after every fio run, the difference between
+# the two is what the run did.
+# Usage: ./collect_stats.sh <mountpoint> <output.json>
+
+if [ $# -ne 2 ]; then
+    echo "usage: $0 <mountpoint> <output.json>" >&2
+    exit 1
+fi
+
+SYSFS=/sys/fs/basicbtfs/$(basename $(findmnt -no SOURCE --target $1))
+
+if [ ! -d $SYSFS ]; then
+    echo "$1 is not on a mounted basicbtfs" >&2
+    exit 1
+fi
+
+python3 - $SYSFS $2 << 'END'
+import json, sys, time
+sysfs, output = sys.argv[1], sys.argv[2]
+stats = dict((name, int(value)) for name, value in (line.split() for line in open(sysfs + "/stats")))
+latency = {}
+for line in open(sysfs + "/latency"):
+    fields = line.split()
+    latency[fields[0]] = dict((bucket, int(calls)) for bucket, calls in (field.split(":") for field in fields[1:]))
+snapshot = {"time": time.time(), "frag_score": int(open(sysfs + "/frag_score").read()), "stats": stats, "latency": latency}
+json.dump(snapshot, open(output, "w"), indent=4)
+END
@@ -0,0 +1,103 @@
+#!/usr/bin/env bash
+#!/bin/bash
+
+# Crash replay for the metadata journal. The image sits below a dm-flakey
+# target. Files are created and fsynced, then the target starts dropping every
+# write, as a disk that lost power would, while more files are created and
+# deleted and directories split. After the unmount the target is switched
+# back, the image is mounted again, which replays the journal, and every
+# fsynced file has to be there and the whole tree has to be readable.
+# Results end up in ../Results/tmpfs/journal/crash.csv
+
+OUT_DIR=Results/tmpfs/journal
+CSV=../$OUT_DIR/crash.csv
+ROOT_DIR="test/mnt"
+FLAKEY=basicbtfs_flakey
+NR_OF_FILES=5000
+RUNS=10
+
+init() {
+    make
+    sudo insmod basicbtfs.ko
+    sudo modprobe dm-flakey
+    mkdir -p test
+    sudo mount -t tmpfs -o size=20G tmpfs test
+    sudo chown $USER test
+    mkdir $ROOT_DIR
+    dd if=/dev/zero of=test/test.img bs=1 count=0 seek=2G
+}
+
+flakey_table() {
+    local sectors=$(sudo blockdev --getsz $LOOP)
+
+    if [ "$1" == "drop" ]; then
+        echo "0 $sectors flakey $LOOP 0 0 180 1 drop_writes"
+    else
+        echo "0 $sectors linear $LOOP 0"
+    fi
+}
+
+# Creates files $1 .. $2 - 1 in dir $3 and fsyncs each of them
+create_fsync() {
+    python3 - "$ROOT_DIR/$3" $1 $2 << 'PYEOF'
+import os, sys
+path, first, last = sys.argv[1], int(sys.argv[2]), int(sys.argv[3])
+os.makedirs(path, exist_ok=True)
+for i in range(first, last):
+    fd = os.open("%s/file_%d" % (path, i), os.O_CREAT | os.O_WRONLY, 0o644)
+    os.fsync(fd)
+    os.close(fd)
+dfd = os.open(path, os.O_RDONLY)
+os.fsync(dfd)
+os.close(dfd)
+PYEOF
+}
+
+sudo rm -f $CSV
+mkdir -p ../$OUT_DIR
+echo "run,synced_files,missing_files,readable" > $CSV
+
+init
+
+for (( run=0 ; run<$RUNS ; run++ ));
+do
+    ./mkfs.basicbtfs -j test/test.img > /dev/null
+    LOOP=$(sudo losetup -f --show test/test.img)
+    flakey_table linear | sudo dmsetup create $FLAKEY
+    sudo mount -t basicbtfs /dev/mapper/$FLAKEY $ROOT_DIR
+    sudo chown $USER $ROOT_DIR
+
+    create_fsync 0 $NR_OF_FILES dir
+
+    # from here on nothing reaches the disk anymore
+    flakey_table drop | sudo dmsetup load $FLAKEY
+    sudo dmsetup suspend $FLAKEY
+    sudo dmsetup resume $FLAKEY
+    create_fsync $NR_OF_FILES $(( NR_OF_FILES * 2 )) dir
+    create_fsync 0 $NR_OF_FILES lost
+    (cd $ROOT_DIR/dir && seq -f "file_%.0f" 0 2 $(( NR_OF_FILES - 1 )) | xargs rm -f)
+    sudo umount $ROOT_DIR
+
+    flakey_table linear | sudo dmsetup load $FLAKEY
+    sudo dmsetup suspend $FLAKEY
+    sudo dmsetup resume $FLAKEY
+    sudo mount -t basicbtfs /dev/mapper/$FLAKEY $ROOT_DIR
+
+    missing=0
+    for (( i=0 ; i<$NR_OF_FILES ; i++ ));
+    do
+        [ -e $ROOT_DIR/dir/file_$i ] || missing=$(( missing + 1 ))
+    done
+
+    readable=1
+    ls -lR $ROOT_DIR > /dev/null 2>&1 || readable=0
+
+    echo "$run,$NR_OF_FILES,$missing,$readable" >> $CSV
+    echo "run $run: $missing of $NR_OF_FILES synced files missing, tree readable: $readable"
+
+    sudo umount $ROOT_DIR
+    sudo dmsetup remove $FLAKEY
+    sudo losetup -d $LOOP
+done
+
+./clean.sh
@@ -0,0 +1,1288 @@
+#include <linux/bsearch.h>
+#include <linux/buffer_head.h>
+#include <linux/delay.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/module.h>
+#include <linux/pagemap.h>
+#include <linux/sched.h>
+#include <linux/sched/mm.h>
+#include <linux/sort.h>
+
+#include "basicbtfs.h"
+#include "defrag.h"
+#include "journal.h"
+
+/*
+ * Background defragmenter, one kernel thread per mounted filesystem. It sleeps until the
+ * fragmentation score, the share of free blocks in the allocated part of the disk, reaches
+ * s_defrag_threshold, then walks the inodes in inode number order and moves each directory
+ * or file that is in pieces into one free run, see basicbtfs_defrag_relocate_dir. Every
+ * inode is a slice of its own: the inode lock keeps its users out, s_defrag_lock taken
+ * exclusively keeps out every operation that allocates, frees or follows block numbers, and
+ * the journal is flushed and locked as for basicbtfs_defrag_disk. Between two slices the
+ * thread sleeps at least s_defrag_delay_ms, and longer when the last slice moved more than
+ * s_defrag_rate blocks per second allows. Foreground operations only wait for one slice.
+ *
+ * The pass is controlled through /sys/fs/basicbtfs/<dev>/defrag, see sysfs.c. Pausing keeps
+ * the position in s_defrag_ino, cancelling drops it.
+ *
+ * While no pass runs the thread works through s_defrag_queue instead, the directories and
+ * files the workload statistics in init.h point at. A queued inode is only moved when the
+ * blocks it copies per run it gets rid of stay below s_defrag_max_cost, so a large file that
+ * is in two pieces stays where it is and a directory whose name lists are all over the disk
+ * moves.
+ */
+
+/*
+ * Moves the blocks of a regular file into one free run, for the background pass and for
+ * BASICBTFS_IOC_DEFRAG_FILE. The caller holds the inode lock. Any write needs it, so
+ * get_block cannot allocate for the file while it is moved, only look up blocks, which
+ * i_defrag_sem holds off. A file that is mapped writable can be changed without the lock
+ * and gets -EBUSY. Returns the number of blocks moved.
+ *
+ * i_defrag_sem is taken before s_defrag_lock, as get_block does when it allocates.
+ */
+int basicbtfs_defrag_file(struct inode *inode) {
+    struct super_block *sb = inode->i_sb;
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct basicbtfs_inode_info *inode_info = BASICBTFS_INODE(inode);
+    unsigned int nofs_flags = 0;
+    int ret = 0;
+
+    if (mapping_writably_mapped(inode->i_mapping)) return -EBUSY;
+
+    ret = filemap_write_and_wait(inode->i_mapping);
+
+    if (ret < 0) return ret;
+
+    /* pages keep the block numbers of their buffers, they have to be read again after the move */
+    invalidate_inode_pages2(inode->i_mapping);
+
+    /* reclaim could evict an inode, which needs a journal handle while the journal is locked */
+    nofs_flags = memalloc_nofs_save();
+    down_write(&inode_info->i_defrag_sem);
+    down_write(&sbi->s_defrag_lock);
+    ret = basicbtfs_journal_lock(sb);
+
+    if (ret == 0) {
+        ret = basicbtfs_defrag_relocate_file(sb, inode);
+        basicbtfs_journal_unlock(sb);
+    }
+
+    if (ret > 0) sbi->s_defrag_moved_blocks += ret;
+
+    up_write(&sbi->s_defrag_lock);
+    up_write(&inode_info->i_defrag_sem);
+    memalloc_nofs_restore(nofs_flags);
+
+    /* a page that was read while the locks were being taken still points at the old blocks */
+    if (ret > 0) invalidate_inode_pages2(inode->i_mapping);
+
+    return ret;
+}
+
+static int basicbtfs_bgdefrag_dir(struct super_block *sb, struct inode *dir) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    unsigned int nofs_flags = 0;
+    int ret = 0;
+
+    nofs_flags = memalloc_nofs_save();
+    down_write(&sbi->s_defrag_lock);
+    ret = basicbtfs_journal_lock(sb);
+
+    if (ret == 0) {
+        ret = basicbtfs_defrag_relocate_dir(sb, dir);
+
+        /* readdir positions and pinned blocks refer to the old blocks */
+        if (ret != 0) {
+            sbi->s_defrag_runs++;
+            basicbtfs_cache_refresh(sb);
+        }
+
+        basicbtfs_journal_unlock(sb);
+    }
+
+    if (ret > 0) sbi->s_defrag_moved_blocks += ret;
+
+    up_write(&sbi->s_defrag_lock);
+    memalloc_nofs_restore(nofs_flags);
+    return ret;
+}
+
+/* Takes the next inode of the pass, NULL once the pass is done */
+static struct inode *basicbtfs_bgdefrag_next(struct super_block *sb) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct inode *inode = NULL;
+    unsigned long ino = 0;
+
+    while (!inode) {
+        ino = find_next_bit(sbi->s_ifree_bitmap, sbi->s_ninodes, sbi->s_defrag_ino);
+
+        if (ino >= sbi->s_ninodes) return NULL;
+
+        sbi->s_defrag_ino = ino + 1;
+        inode = basicbtfs_iget(sb, ino);
+
+        if (IS_ERR(inode)) inode = NULL;
+    }
+
+    return inode;
+}
+
+/* Whether moving a queued inode gets rid of enough runs for the blocks it copies */
+static bool basicbtfs_bgdefrag_pays_off(struct super_block *sb, struct inode *inode) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct buffer_head *bh = NULL;
+    uint32_t *bnos = NULL, nr_of_bnos = 0, runs = 0;
+    bool inline_dir = false;
+
+    if (S_ISDIR(inode->i_mode)) {
+        bh = sb_bread(sb, BASICBTFS_INODE(inode)->i_bno);
+
+        if (!bh) return false;
+
+        inline_dir = ((struct basicbtfs_disk_block *) bh->b_data)->block_type_id == BASICBTFS_BLOCKTYPE_INLINE_DIR;
+        brelse(bh);
+
+        if (inline_dir) return false;
+    }
+
+    if (basicbtfs_defrag_list(sb, BASICBTFS_INODE(inode)->i_bno, S_ISDIR(inode->i_mode), &bnos, &nr_of_bnos) < 0) return false;
+
+    runs = basicbtfs_defrag_runs(bnos, nr_of_bnos);
+    kvfree(bnos);
+
+    if (runs < 2) return false;
+
+    return sbi->s_defrag_max_cost == 0 || nr_of_bnos <= (uint64_t) (runs - 1) * sbi->s_defrag_max_cost;
+}
+
+/* Defragments a directory or regular file, returns the number of blocks that were moved */
+static int basicbtfs_bgdefrag_inode(struct super_block *sb, struct inode *inode, bool queued) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    bool pays_off = true;
+    int ret = 0;
+
+    if (inode->i_nlink == 0 || !(S_ISDIR(inode->i_mode) || S_ISREG(inode->i_mode))) return 0;
+
+    inode_lock(inode);
+
+    if (queued) {
+        down_read(&sbi->s_defrag_lock);
+        pays_off = basicbtfs_bgdefrag_pays_off(sb, inode);
+        up_read(&sbi->s_defrag_lock);
+
+        if (pays_off) {
+            sbi->s_defrag_targeted++;
+        } else {
+            sbi->s_defrag_skipped++;
+        }
+    }
+
+    if (!pays_off) {
+        ret = 0;
+    } else if (S_ISDIR(inode->i_mode)) {
+        ret = basicbtfs_bgdefrag_dir(sb, inode);
+    } else {
+        ret = basicbtfs_defrag_file(inode);
+    }
+
+    /* the statistics start over, a failed inode is queued again by its next operation */
+    if (ret >= 0) {
+        BASICBTFS_INODE(inode)->i_churn = 0;
+        clear_bit(inode->i_ino, sbi->s_defrag_queue);
+    }
+
+    inode_unlock(inode);
+
+    /* a mapped file or one without room for it is tried again on the next pass */
+    if (ret < 0 && ret != -EBUSY && ret != -ENOSPC) {
+        printk(KERN_ERR "Background defrag of inode %lu failed: %d\n", inode->i_ino, ret);
+    }
+
+    return max(ret, 0);
+}
+
+/* Defragments one inode of the pass, returns the number of blocks that were moved */
+static int basicbtfs_bgdefrag_slice(struct super_block *sb) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct inode *inode = basicbtfs_bgdefrag_next(sb);
+    int ret = 0;
+
+    if (!inode) {
+        sbi->s_defrag_state = BASICBTFS_BGDEFRAG_IDLE;
+        sbi->s_defrag_ino = 0;
+        sbi->s_defrag_passes++;
+        return 0;
+    }
+
+    ret = basicbtfs_bgdefrag_inode(sb, inode, false);
+    iput(inode);
+    return ret;
+}
+
+/* Defragments the next queued inode, -ENOENT once the queue is empty */
+static int basicbtfs_bgdefrag_target(struct super_block *sb) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct inode *inode = NULL;
+    unsigned long ino = find_first_bit(sbi->s_defrag_queue, sbi->s_ninodes);
+    int ret = 0;
+
+    if (ino >= sbi->s_ninodes) return -ENOENT;
+
+    clear_bit(ino, sbi->s_defrag_queue);
+    inode = basicbtfs_iget(sb, ino);
+
+    if (IS_ERR(inode)) return 0;
+
+    ret = basicbtfs_bgdefrag_inode(sb, inode, true);
+    iput(inode);
+    return ret;
+}
+
+static int basicbtfs_bgdefrag_thread(void *data) {
+    struct super_block *sb = data;
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    unsigned long timeout = 0;
+    int moved = 0;
+
+    while (!kthread_should_stop()) {
+        if (sbi->s_defrag_state == BASICBTFS_BGDEFRAG_IDLE && sbi->s_defrag_threshold > 0 && basicbtfs_defrag_score(sbi) >= sbi->s_defrag_threshold) {
+            sbi->s_defrag_state = BASICBTFS_BGDEFRAG_RUNNING;
+        }
+
+        if (sbi->s_defrag_state == BASICBTFS_BGDEFRAG_RUNNING) {
+            moved = basicbtfs_bgdefrag_slice(sb);
+        } else if (sbi->s_defrag_state == BASICBTFS_BGDEFRAG_IDLE) {
+            moved = basicbtfs_bgdefrag_target(sb);
+        } else {
+            moved = -ENOENT;
+        }
+
+        if (moved < 0) {
+            timeout = msecs_to_jiffies(BASICBTFS_DEFRAG_POLL_MS);
+        } else {
+            timeout = msecs_to_jiffies(max_t(uint32_t, sbi->s_defrag_delay_ms, sbi->s_defrag_rate ? moved * 1000 / sbi->s_defrag_rate : 0));
+        }
+
+        set_current_state(TASK_INTERRUPTIBLE);
+
+        if (!kthread_should_stop()) schedule_timeout(timeout);
+
+        __set_current_state(TASK_RUNNING);
+    }
+
+    return 0;
+}
+
+int basicbtfs_bgdefrag_start(struct super_block *sb) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct task_struct *task = NULL;
+
+    if (sb_rdonly(sb)) return 0;
+
+    sbi->s_defrag_queue = kcalloc(BITS_TO_LONGS(sbi->s_ninodes), sizeof(unsigned long), GFP_KERNEL);
+
+    if (!sbi->s_defrag_queue) return -ENOMEM;
+
+    task = kthread_run(basicbtfs_bgdefrag_thread, sb, "basicbtfs-defrag/%s", sb->s_id);
+
+    if (IS_ERR(task)) {
+        printk(KERN_ERR "Could not start the background defragmenter: %ld\n", PTR_ERR(task));
+        kfree(sbi->s_defrag_queue);
+        sbi->s_defrag_queue = NULL;
+        return PTR_ERR(task);
+    }
+
+    sbi->s_defrag_task = task;
+    return 0;
+}
+
+void basicbtfs_bgdefrag_stop(struct super_block *sb) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+
+    if (!sbi->s_defrag_task) return;
+
+    kthread_stop(sbi->s_defrag_task);
+    sbi->s_defrag_task = NULL;
+    kfree(sbi->s_defrag_queue);
+    sbi->s_defrag_queue = NULL;
+}
+
+/* Lets the thread check the score now rather than at the end of its poll interval */
+void basicbtfs_bgdefrag_wake(struct super_block *sb) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+
+    if (sbi->s_defrag_task && sbi->s_defrag_state == BASICBTFS_BGDEFRAG_IDLE) {
+        wake_up_process(sbi->s_defrag_task);
+    }
+}
+
+/*
+ * Whole-disk defragmentation in two phases, what BASICBTFS_IOC_DEFRAG does unless defrag_mode
+ * is set to swap, which keeps basicbtfs_defrag_directory for comparison.
+ *
+ * The plan walks the namespace from the root in the order basicbtfs_defrag_directory does and
+ * lists the blocks of every directory and file. Each object gets the next run of blocks that
+ * holds all of it, a run only skips blocks that are in use but not on the plan, such as the
+ * journal. Seen as a map from source to destination the moves form chains, which end in a
+ * free block, and cycles. A chain is moved starting at its free end and a cycle once its first
+ * block was copied aside in memory, so every block that is out of place is copied exactly once
+ * and nothing is parked in the unused area. All chains and cycles are lined up in one list
+ * whose sources are read BASICBTFS_DEFRAG_BATCH blocks at a time, neighbouring blocks end up
+ * in one request. The references in btree nodes, name lists, cluster tables, inodes and the
+ * file map are rewritten from the map once every block is in place.
+ */
+struct basicbtfs_defrag_move {
+    uint32_t src;
+    uint32_t dst;
+};
+
+struct basicbtfs_defrag_plan {
+    uint32_t *src; /* blocks in plan order */
+    uint32_t *dst; /* while planning, the number of blocks of the object that starts there */
+    uint32_t nr_of_bnos;
+    uint32_t max_bnos;
+    uint32_t end; /* first block after the packed objects */
+    struct basicbtfs_defrag_move *moves; /* src and dst, sorted by src */
+    uint32_t *inos; /* directories and files in plan order */
+    uint32_t nr_of_inos;
+    uint32_t max_inos;
+    unsigned long *planned; /* blocks on the plan, later the ones that still have to move */
+    unsigned long *visited; /* inodes on the plan, a file with several links is planned once */
+};
+
+static int basicbtfs_plan_cmp(const void *a, const void *b) {
+    uint32_t src_a = ((const struct basicbtfs_defrag_move *) a)->src;
+    uint32_t src_b = ((const struct basicbtfs_defrag_move *) b)->src;
+
+    return src_a < src_b ? -1 : src_a > src_b;
+}
+
+static struct basicbtfs_defrag_move *basicbtfs_plan_find(struct basicbtfs_defrag_plan *plan, uint32_t bno) {
+    struct basicbtfs_defrag_move key = { .src = bno };
+
+    return bsearch(&key, plan->moves, plan->nr_of_bnos, sizeof(key), basicbtfs_plan_cmp);
+}
+
+/* Where block bno is after the pass, blocks that are not on the plan stay */
+static uint32_t basicbtfs_plan_lookup(struct basicbtfs_defrag_plan *plan, uint32_t bno) {
+    struct basicbtfs_defrag_move *move = basicbtfs_plan_find(plan, bno);
+
+    return move ? move->dst : bno;
+}
+
+static void basicbtfs_plan_remap(struct basicbtfs_defrag_plan *plan, uint32_t *bno, bool *changed) {
+    uint32_t new_bno = basicbtfs_plan_lookup(plan, *bno);
+
+    if (new_bno == *bno) return;
+
+    *bno = new_bno;
+    *changed = true;
+}
+
+/* Adds the directory or file whose first block is bno as one object */
+static int basicbtfs_plan_object(struct super_block *sb, struct basicbtfs_defrag_plan *plan, uint32_t bno, uint8_t block_type_id) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    uint32_t first = plan->nr_of_bnos, nr_of_bnos = 1, i = 0;
+    int ret = 0;
+
+    if (block_type_id == BASICBTFS_BLOCKTYPE_BTREE_NODE) {
+        nr_of_bnos = 0;
+        ret = basicbtfs_defrag_collect_dir(sb, bno, NULL, &nr_of_bnos);
+    } else if (block_type_id == BASICBTFS_BLOCKTYPE_CLUSTER_TABLE) {
+        nr_of_bnos = 0;
+        ret = basicbtfs_defrag_collect_file(sb, bno, NULL, &nr_of_bnos);
+    }
+
+    if (ret < 0) return ret;
+
+    /* there are never more blocks on the plan than in use, unless two objects share one */
+    if (nr_of_bnos > plan->max_bnos - plan->nr_of_bnos) return -EIO;
+
+    if (block_type_id == BASICBTFS_BLOCKTYPE_BTREE_NODE) {
+        ret = basicbtfs_defrag_collect_dir(sb, bno, plan->src, &plan->nr_of_bnos);
+    } else if (block_type_id == BASICBTFS_BLOCKTYPE_CLUSTER_TABLE) {
+        ret = basicbtfs_defrag_collect_file(sb, bno, plan->src, &plan->nr_of_bnos);
+    } else {
+        plan->src[plan->nr_of_bnos++] = bno;
+    }
+
+    if (ret < 0) return ret;
+
+    for (i = first; i < plan->nr_of_bnos; i++) {
+        if (plan->src[i] < basicbtfs_defrag_data_start(sbi) || plan->src[i] >= sbi->s_nblocks || __test_and_set_bit(plan->src[i], plan->planned)) {
+            printk(KERN_ERR "Defrag plan: block %u is outside the disk or used twice\n", plan->src[i]);
+            return -EIO;
+        }
+
+        plan->dst[i] = 0;
+    }
+
+    plan->dst[first] = plan->nr_of_bnos - first;
+    return 0;
+}
+
+static int basicbtfs_plan_inode(struct super_block *sb, struct basicbtfs_defrag_plan *plan, uint32_t ino);
+
+/* Plans the children of the btree directory below node bno, in key order */
+static int basicbtfs_plan_children(struct super_block *sb, struct basicbtfs_defrag_plan *plan, uint32_t bno, int depth) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct buffer_head *bh = NULL;
+    struct basicbtfs_btree_node *node = NULL;
+    int index = 0, ret = 0;
+
+    if (depth > BASICBTFS_BTREE_MAX_HEIGHT || bno == 0 || bno >= sbi->s_nblocks) return -EIO;
+
+    bh = sb_bread(sb, bno);
+
+    if (!bh) return -EIO;
+
+    node = &((struct basicbtfs_disk_block *) bh->b_data)->block_type.btree_node;
+
+    for (index = 0; index < node->nr_of_keys && ret == 0; index++) {
+        if (!node->leaf) {
+            ret = basicbtfs_plan_children(sb, plan, node->children[index], depth + 1);
+
+            if (ret < 0) break;
+        }
+
+        /* B+-tree separators are copies of leaf entries */
+        if (!node->leaf && BASICBTFS_HAS_BPTREE(sb)) continue;
+
+        ret = basicbtfs_plan_inode(sb, plan, node->entries[index].ino);
+    }
+
+    if (ret == 0 && !node->leaf) {
+        ret = basicbtfs_plan_children(sb, plan, node->children[index], depth + 1);
+    }
+
+    brelse(bh);
+    return ret;
+}
+
+/* Plans the children of an inline directory, their inodes are copied out of the block first */
+static int basicbtfs_plan_inline_children(struct super_block *sb, struct basicbtfs_defrag_plan *plan, uint32_t bno) {
+    struct basicbtfs_disk_block *disk_block = NULL;
+    struct basicbtfs_inline_dir_entry *entry = NULL;
+    struct buffer_head *bh = NULL;
+    uint32_t *inos = NULL, nr_of_files = 0, pos = 0, index = 0;
+    int ret = 0;
+
+    bh = sb_bread(sb, bno);
+
+    if (!bh) return -EIO;
+
+    disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+    nr_of_files = min_t(uint32_t, disk_block->block_type.inline_dir.nr_of_files, BASICBTFS_INLINE_DIR_MAX_FILES);
+
+    if (nr_of_files == 0) {
+        brelse(bh);
+        return 0;
+    }
+
+    inos = kmalloc_array(nr_of_files, sizeof(uint32_t), GFP_KERNEL);
+
+    if (!inos) {
+        brelse(bh);
+        return -ENOMEM;
+    }
+
+    for (index = 0; index < nr_of_files; index++) {
+        entry = (struct basicbtfs_inline_dir_entry *) (disk_block->block_type.inline_dir.data + pos);
+        pos += BASICBTFS_INLINE_DIR_REC_LEN(entry->name_length);
+        inos[index] = entry->ino;
+    }
+
+    brelse(bh);
+
+    for (index = 0; index < nr_of_files && ret == 0; index++) {
+        ret = basicbtfs_plan_inode(sb, plan, inos[index]);
+    }
+
+    kfree(inos);
+    return ret;
+}
+
+/* Plans a directory or file and, for a directory, everything below it */
+static int basicbtfs_plan_inode(struct super_block *sb, struct basicbtfs_defrag_plan *plan, uint32_t ino) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct buffer_head *bh = NULL;
+    struct inode *inode = NULL;
+    uint8_t block_type_id = 0;
+    int ret = 0;
+
+    if (ino >= sbi->s_ninodes || __test_and_set_bit(ino, plan->visited)) return 0;
+
+    inode = basicbtfs_iget(sb, ino);
+
+    if (IS_ERR(inode)) return PTR_ERR(inode);
+
+    if (!S_ISDIR(inode->i_mode) && !S_ISREG(inode->i_mode)) goto out;
+
+    if (plan->nr_of_inos >= plan->max_inos) {
+        ret = -EIO;
+        goto out;
+    }
+
+    plan->inos[plan->nr_of_inos++] = ino;
+
+    if (S_ISREG(inode->i_mode)) {
+        ret = basicbtfs_plan_object(sb, plan, BASICBTFS_INODE(inode)->i_bno, BASICBTFS_BLOCKTYPE_CLUSTER_TABLE);
+        goto out;
+    }
+
+    bh = sb_bread(sb, BASICBTFS_INODE(inode)->i_bno);
+
+    if (!bh) {
+        ret = -EIO;
+        goto out;
+    }
+
+    block_type_id = ((struct basicbtfs_disk_block *) bh->b_data)->block_type_id;
+    brelse(bh);
+
+    if (block_type_id == BASICBTFS_BLOCKTYPE_INLINE_DIR) {
+        ret = basicbtfs_plan_object(sb, plan, BASICBTFS_INODE(inode)->i_bno, block_type_id);
+
+        if (ret == 0) ret = basicbtfs_plan_inline_children(sb, plan, BASICBTFS_INODE(inode)->i_bno);
+
+        goto out;
+    }
+
+    /* pack the btree first, the plan only has to place the packed nodes */
+    ret = basicbtfs_btree_rebuild(sb, inode, BASICBTFS_BTREE_FILL_FACTOR);
+
+    if (ret == 0) ret = basicbtfs_plan_object(sb, plan, BASICBTFS_INODE(inode)->i_bno, BASICBTFS_BLOCKTYPE_BTREE_NODE);
+
+    if (ret == 0) ret = basicbtfs_plan_children(sb, plan, BASICBTFS_INODE(inode)->i_bno, 0);
+out:
+    iput(inode);
+    return ret;
+}
+
+/*
+ * Gives every object the next run that holds it and turns the plan into moves sorted by
+ * source. Afterwards planned only holds the blocks that are out of place.
+ */
+static int basicbtfs_plan_assign(struct basicbtfs_sb_info *sbi, struct basicbtfs_defrag_plan *plan) {
+    uint32_t cursor = basicbtfs_defrag_data_start(sbi), start = 0, len = 0, i = 0, k = 0;
+
+    /* blocks in use that are not on the plan stay where they are */
+    bitmap_andnot(plan->planned, sbi->s_bfree_bitmap, plan->planned, sbi->s_nblocks);
+
+    while (i < plan->nr_of_bnos) {
+        len = plan->dst[i];
+        start = bitmap_find_next_zero_area(plan->planned, sbi->s_nblocks, cursor, len, 0);
+
+        if (start + len > sbi->s_nblocks) return -ENOSPC;
+
+        for (k = 0; k < len; k++) {
+            plan->dst[i + k] = start + k;
+        }
+
+        i += len;
+        cursor = start + len;
+    }
+
+    plan->end = cursor;
+    plan->moves = kvmalloc_array(plan->nr_of_bnos, sizeof(struct basicbtfs_defrag_move), GFP_KERNEL);
+
+    if (!plan->moves) return -ENOMEM;
+
+    bitmap_zero(plan->planned, sbi->s_nblocks);
+
+    for (i = 0; i < plan->nr_of_bnos; i++) {
+        plan->moves[i].src = plan->src[i];
+        plan->moves[i].dst = plan->dst[i];
+
+        if (plan->src[i] != plan->dst[i]) __set_bit(plan->src[i], plan->planned);
+    }
+
+    sort(plan->moves, plan->nr_of_bnos, sizeof(struct basicbtfs_defrag_move), basicbtfs_plan_cmp, NULL);
+
+    kvfree(plan->src);
+    kvfree(plan->dst);
+    plan->src = NULL;
+    plan->dst = NULL;
+    return 0;
+}
+
+static int basicbtfs_plan_build(struct super_block *sb, struct basicbtfs_defrag_plan *plan, struct inode *root) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    int ret = 0;
+
+    plan->max_bnos = bitmap_weight(sbi->s_bfree_bitmap, sbi->s_nblocks);
+    plan->max_inos = bitmap_weight(sbi->s_ifree_bitmap, sbi->s_ninodes);
+    plan->src = kvmalloc_array(plan->max_bnos, sizeof(uint32_t), GFP_KERNEL);
+    plan->dst = kvmalloc_array(plan->max_bnos, sizeof(uint32_t), GFP_KERNEL);
+    plan->inos = kvmalloc_array(plan->max_inos, sizeof(uint32_t), GFP_KERNEL);
+    plan->planned = kvcalloc(BITS_TO_LONGS(sbi->s_nblocks), sizeof(unsigned long), GFP_KERNEL);
+    plan->visited = kvcalloc(BITS_TO_LONGS(sbi->s_ninodes), sizeof(unsigned long), GFP_KERNEL);
+
+    if (!plan->src || !plan->dst || !plan->inos || !plan->planned || !plan->visited) return -ENOMEM;
+
+    ret = basicbtfs_plan_inode(sb, plan, root->i_ino);
+
+    if (ret < 0) return ret;
+
+    return basicbtfs_plan_assign(sbi, plan);
+}
+
+static void basicbtfs_plan_free(struct basicbtfs_defrag_plan *plan) {
+    kvfree(plan->src);
+    kvfree(plan->dst);
+    kvfree(plan->moves);
+    kvfree(plan->inos);
+    kvfree(plan->planned);
+    kvfree(plan->visited);
+}
+
+static int basicbtfs_plan_write_block(struct super_block *sb, uint32_t bno, void *data) {
+    struct buffer_head *bh = sb_getblk(sb, bno);
+
+    if (!bh) return -EIO;
+
+    lock_buffer(bh);
+    memcpy(bh->b_data, data, BASICBTFS_BLOCKSIZE);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    mark_buffer_dirty(bh);
+    brelse(bh);
+    return 0;
+}
+
+/* Marks the first block of a cycle in the run list, once to copy it aside, once to put it back */
+#define BASICBTFS_PLAN_CYCLE (1U << 31)
+
+/*
+ * Lists every move that is out of place in the order it can be done in. A chain is listed from
+ * its free end, so every destination has been moved away from by the time it is written. A
+ * chain can also end in the source of a move listed before, which is done by then as well. A
+ * cycle is listed between two entries for its first block, the first copies the block aside
+ * and the second writes it to its destination once the rest of the cycle moved. Listed moves
+ * are cleared in planned, returns the length of the list.
+ */
+static uint32_t basicbtfs_plan_order(struct basicbtfs_defrag_plan *plan, uint32_t *run, uint32_t *path) {
+    struct basicbtfs_defrag_move *next = NULL;
+    uint32_t nr_of_runs = 0, len = 0, i = 0;
+
+    for (i = 0; i < plan->nr_of_bnos; i++) {
+        if (!test_bit(plan->moves[i].src, plan->planned)) continue;
+
+        path[0] = i;
+        len = 1;
+        __clear_bit(plan->moves[i].src, plan->planned);
+
+        while ((next = basicbtfs_plan_find(plan, plan->moves[path[len - 1]].dst)) && test_bit(next->src, plan->planned)) {
+            __clear_bit(next->src, plan->planned);
+            path[len++] = next - plan->moves;
+        }
+
+        if (next == &plan->moves[i]) {
+            run[nr_of_runs++] = i | BASICBTFS_PLAN_CYCLE;
+
+            while (len > 1) run[nr_of_runs++] = path[--len];
+
+            run[nr_of_runs++] = i | BASICBTFS_PLAN_CYCLE;
+            continue;
+        }
+
+        while (len > 0) run[nr_of_runs++] = path[--len];
+    }
+
+    return nr_of_runs;
+}
+
+/*
+ * Reads the sources of a window of the run list with one submission. File data was written
+ * back before the pass, a cached copy of a block is only trusted while it is dirty. The block
+ * layer merges the requests for neighbouring blocks. The
+ * second entry of a cycle reads nothing, so there can be fewer buffers than entries. A block
+ * that can not be read is left NULL.
+ */
+static int basicbtfs_plan_read_batch(struct super_block *sb, struct basicbtfs_defrag_plan *plan, uint32_t *run, uint32_t nr_of_runs, bool saving, struct buffer_head **bhs, uint32_t *nr_of_bhs) {
+    uint32_t i = 0, j = 0, k = 0;
+    int ret = 0;
+
+    for (i = 0; i < nr_of_runs; i++) {
+        if (run[i] & BASICBTFS_PLAN_CYCLE) {
+            saving = !saving;
+
+            if (!saving) continue;
+        }
+
+        bhs[k] = sb_getblk(sb, plan->moves[run[i] & ~BASICBTFS_PLAN_CYCLE].src);
+
+        if (bhs[k]) {
+            lock_buffer(bhs[k]);
+
+            if (!buffer_dirty(bhs[k])) clear_buffer_uptodate(bhs[k]);
+
+            unlock_buffer(bhs[k]);
+        }
+
+        k++;
+    }
+
+    for (i = 0; i < k; i = j + 1) {
+        for (j = i; j < k && bhs[j]; j++);
+
+        ll_rw_block(REQ_OP_READ, 0, j - i, bhs + i);
+    }
+
+    for (i = 0; i < k; i++) {
+        if (!bhs[i]) {
+            ret = -EIO;
+            continue;
+        }
+
+        wait_on_buffer(bhs[i]);
+
+        if (buffer_uptodate(bhs[i]) || bh_submit_read(bhs[i]) == 0) continue;
+
+        printk(KERN_ERR "Defrag plan: could not read block %llu\n", (unsigned long long) bhs[i]->b_blocknr);
+        brelse(bhs[i]);
+        bhs[i] = NULL;
+        ret = -EIO;
+    }
+
+    *nr_of_bhs = k;
+    return ret;
+}
+
+/*
+ * Moves every block that is out of place, BASICBTFS_DEFRAG_BATCH entries of the run list at a
+ * time, and returns how many were moved. Stopping halfway could leave a cluster split over old
+ * and new blocks, so a block that can not be read is moved all the same and its destination
+ * is zeroed, the pass carries on and returns -EIO in the end.
+ */
+static int basicbtfs_plan_execute(struct super_block *sb, struct basicbtfs_defrag_plan *plan) {
+    struct basicbtfs_defrag_move *move = NULL;
+    struct buffer_head **bhs = NULL;
+    uint32_t *run = NULL, *path = NULL, nr_of_runs = 0, nr_of_bhs = 0, start = 0, end = 0, i = 0, k = 0;
+    char *saved = NULL, *blank = NULL, *data = NULL;
+    bool saving = false;
+    u64 move_start = 0;
+    int ret = 0, err = 0, moved = 0;
+
+    run = kvmalloc_array(plan->nr_of_bnos + plan->nr_of_bnos / 2 + 1, sizeof(uint32_t), GFP_KERNEL);
+    path = kvmalloc_array(plan->nr_of_bnos, sizeof(uint32_t), GFP_KERNEL);
+    bhs = kmalloc_array(BASICBTFS_DEFRAG_BATCH, sizeof(struct buffer_head *), GFP_KERNEL);
+    saved = kmalloc(BASICBTFS_BLOCKSIZE, GFP_KERNEL);
+    blank = kzalloc(BASICBTFS_BLOCKSIZE, GFP_KERNEL);
+
+    if (!run || !path || !bhs || !saved || !blank) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    nr_of_runs = basicbtfs_plan_order(plan, run, path);
+
+    for (start = 0; start < nr_of_runs; start = end) {
+        end = min_t(uint32_t, start + BASICBTFS_DEFRAG_BATCH, nr_of_runs);
+        err = basicbtfs_plan_read_batch(sb, plan, run + start, end - start, saving, bhs, &nr_of_bhs);
+
+        if (err < 0) ret = err;
+
+        for (i = start, k = 0; i < end; i++) {
+            move = &plan->moves[run[i] & ~BASICBTFS_PLAN_CYCLE];
+
+            if (run[i] & BASICBTFS_PLAN_CYCLE) {
+                saving = !saving;
+
+                if (saving) {
+                    memcpy(saved, bhs[k] ? bhs[k]->b_data : blank, BASICBTFS_BLOCKSIZE);
+                    k++;
+                    continue;
+                }
+
+                data = saved;
+            } else {
+                data = bhs[k] ? bhs[k]->b_data : blank;
+                k++;
+            }
+
+            move_start = BASICBTFS_TRACE_START(basicbtfs_defrag_move);
+            err = basicbtfs_plan_write_block(sb, move->dst, data);
+            trace_basicbtfs_defrag_move(sb, move->src, move->dst, 1, err, move_start);
+
+            if (err < 0) ret = err;
+
+            basicbtfs_stat_inc(BASICBTFS_SB(sb), BASICBTFS_STAT_DEFRAG_MOVES);
+            basicbtfs_stat_inc(BASICBTFS_SB(sb), BASICBTFS_STAT_DEFRAG_MOVED_BLOCKS);
+            moved++;
+        }
+
+        for (k = 0; k < nr_of_bhs; k++) {
+            if (bhs[k]) brelse(bhs[k]);
+        }
+    }
+out:
+    kvfree(run);
+    kvfree(path);
+    kfree(bhs);
+    kfree(saved);
+    kfree(blank);
+    return ret < 0 ? ret : moved;
+}
+
+/*
+ * Hands the sources of the moves back to the bitmap and takes the destinations, moves that
+ * did not happen are dropped from the map first. The file map entries of the sources are
+ * cleared, the ones of the destinations are set while fixing up the files.
+ */
+static void basicbtfs_plan_settle(struct super_block *sb, struct basicbtfs_defrag_plan *plan) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct basicbtfs_defrag_move *move = NULL;
+    uint32_t first = sbi->s_nblocks, last = 0, i = 0;
+
+    for (i = 0; i < plan->nr_of_bnos; i++) {
+        move = &plan->moves[i];
+
+        if (test_bit(move->src, plan->planned)) move->dst = move->src;
+
+        if (move->src == move->dst) continue;
+
+        basicbtfs_update_file_info(sb, move->src, 0, 0);
+        __clear_bit(move->src, sbi->s_bfree_bitmap);
+        first = min3(first, move->src, move->dst);
+        last = max3(last, move->src, move->dst);
+    }
+
+    for (i = 0; i < plan->nr_of_bnos; i++) {
+        if (plan->moves[i].src != plan->moves[i].dst) __set_bit(plan->moves[i].dst, sbi->s_bfree_bitmap);
+    }
+
+    /* a dirty buffer of a block that is free now would be written over whatever reuses it */
+    for (i = 0; i < plan->nr_of_bnos; i++) {
+        if (!test_bit(plan->moves[i].src, sbi->s_bfree_bitmap)) basicbtfs_defrag_forget_block(sb, plan->moves[i].src);
+    }
+
+    if (first < last) basicbtfs_journal_bitmap(sbi, sbi->s_bfree_bitmap, sbi->s_imap_blocks + 1, first, last - first + 1);
+}
+
+static int basicbtfs_plan_fix_tree(struct super_block *sb, struct basicbtfs_defrag_plan *plan, uint32_t bno, int depth) {
+    struct buffer_head *bh = NULL;
+    struct basicbtfs_btree_node *node = NULL;
+    bool changed = false;
+    int index = 0, ret = 0;
+
+    if (depth > BASICBTFS_BTREE_MAX_HEIGHT) return -EIO;
+
+    bh = sb_bread(sb, bno);
+
+    if (!bh) return -EIO;
+
+    node = &((struct basicbtfs_disk_block *) bh->b_data)->block_type.btree_node;
+
+    for (index = 0; index < node->nr_of_keys; index++) {
+        basicbtfs_plan_remap(plan, &node->entries[index].name_bno, &changed);
+    }
+
+    if (!node->leaf) {
+        for (index = 0; index <= node->nr_of_keys; index++) {
+            basicbtfs_plan_remap(plan, &node->children[index], &changed);
+        }
+    }
+
+    /* the parent of a root is the inode of the directory */
+    if (node->root) {
+        basicbtfs_plan_remap(plan, &node->tree_name_bno, &changed);
+    } else {
+        basicbtfs_plan_remap(plan, &node->parent, &changed);
+    }
+
+    if (node->leaf && BASICBTFS_HAS_BPTREE(sb)) {
+        basicbtfs_plan_remap(plan, &node->next_leaf, &changed);
+        basicbtfs_plan_remap(plan, &node->prev_leaf, &changed);
+    }
+
+    if (changed) mark_buffer_dirty(bh);
+
+    if (!node->leaf) {
+        for (index = 0; index <= node->nr_of_keys && ret == 0; index++) {
+            ret = basicbtfs_plan_fix_tree(sb, plan, node->children[index], depth + 1);
+        }
+    }
+
+    brelse(bh);
+    return ret;
+}
+
+static int basicbtfs_plan_fix_names(struct super_block *sb, struct basicbtfs_defrag_plan *plan, uint32_t name_bno) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct basicbtfs_name_list_hdr *name_list_hdr = NULL;
+    struct buffer_head *bh = NULL;
+    bool changed = false;
+
+    while (name_bno != 0) {
+        if (name_bno >= sbi->s_nblocks) return -EIO;
+
+        bh = sb_bread(sb, name_bno);
+
+        if (!bh) return -EIO;
+
+        name_list_hdr = &((struct basicbtfs_disk_block *) bh->b_data)->block_type.name_list_hdr;
+        changed = false;
+        basicbtfs_plan_remap(plan, &name_list_hdr->next_block, &changed);
+
+        /* the first block points back at the inode of the directory */
+        if (name_list_hdr->first_list) {
+            basicbtfs_plan_remap(plan, &name_list_hdr->free_hint, &changed);
+        } else {
+            basicbtfs_plan_remap(plan, &name_list_hdr->prev_block, &changed);
+        }
+
+        if (changed) mark_buffer_dirty(bh);
+
+        name_bno = name_list_hdr->next_block;
+        brelse(bh);
+    }
+
+    return 0;
+}
+
+/* Points the cluster table at the moved clusters and moves their file map entries along */
+static int basicbtfs_plan_fix_file(struct super_block *sb, struct basicbtfs_defrag_plan *plan, struct inode *inode) {
+    struct basicbtfs_cluster_table *cluster_list = NULL;
+    struct buffer_head *bh = NULL;
+    uint32_t cluster_index = 0, block_index = 0, start_bno = 0;
+    bool changed = false;
+    int ret = 0;
+
+    bh = sb_bread(sb, BASICBTFS_INODE(inode)->i_bno);
+
+    if (!bh) return -EIO;
+
+    cluster_list = &((struct basicbtfs_disk_block *) bh->b_data)->block_type.cluster_table;
+
+    for (cluster_index = 0; cluster_index < BASICBTFS_ATABLE_MAX_CLUSTERS; cluster_index++) {
+        if (cluster_list->table[cluster_index].start_bno == 0) break;
+
+        start_bno = basicbtfs_plan_lookup(plan, cluster_list->table[cluster_index].start_bno);
+
+        if (start_bno == cluster_list->table[cluster_index].start_bno) continue;
+
+        for (block_index = 0; block_index < cluster_list->table[cluster_index].cluster_length; block_index++) {
+            if (basicbtfs_plan_lookup(plan, cluster_list->table[cluster_index].start_bno + block_index) != start_bno + block_index) {
+                printk(KERN_ERR "Defrag plan: cluster %u of inode %lu was split\n", cluster_index, inode->i_ino);
+                ret = -EIO;
+                break;
+            }
+        }
+
+        if (ret < 0) break;
+
+        basicbtfs_update_file_info_range(sb, start_bno, cluster_list->table[cluster_index].cluster_length, inode->i_ino, cluster_index);
+        cluster_list->table[cluster_index].start_bno = start_bno;
+        changed = true;
+    }
+
+    if (changed) mark_buffer_dirty(bh);
+
+    brelse(bh);
+
+    /* pages keep the block numbers of their buffers */
+    if (changed) invalidate_inode_pages2(inode->i_mapping);
+
+    return ret;
+}
+
+/* Rewrites the references of one directory or file and of the inode to its first block */
+static int basicbtfs_plan_fix_inode(struct super_block *sb, struct basicbtfs_defrag_plan *plan, uint32_t ino) {
+    struct basicbtfs_inode_info *inode_info = NULL;
+    struct buffer_head *bh = NULL;
+    struct basicbtfs_disk_block *disk_block = NULL;
+    struct inode *inode = NULL;
+    uint32_t bno = 0, name_bno = 0;
+    int ret = 0;
+
+    inode = basicbtfs_iget(sb, ino);
+
+    if (IS_ERR(inode)) return PTR_ERR(inode);
+
+    inode_info = BASICBTFS_INODE(inode);
+    bno = basicbtfs_plan_lookup(plan, inode_info->i_bno);
+
+    if (bno != inode_info->i_bno) ret = basicbtfs_file_update_root(inode, bno);
+
+    if (ret < 0) goto out;
+
+    if (S_ISREG(inode->i_mode)) {
+        ret = basicbtfs_plan_fix_file(sb, plan, inode);
+        goto out;
+    }
+
+    bh = sb_bread(sb, bno);
+
+    if (!bh) {
+        ret = -EIO;
+        goto out;
+    }
+
+    disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+
+    if (disk_block->block_type_id != BASICBTFS_BLOCKTYPE_BTREE_NODE) {
+        brelse(bh);
+        goto out;
+    }
+
+    brelse(bh);
+    ret = basicbtfs_plan_fix_tree(sb, plan, bno, 0);
+
+    if (ret < 0) goto out;
+
+    bh = sb_bread(sb, bno);
+
+    if (!bh) {
+        ret = -EIO;
+        goto out;
+    }
+
+    name_bno = ((struct basicbtfs_disk_block *) bh->b_data)->block_type.btree_node.tree_name_bno;
+    brelse(bh);
+    ret = basicbtfs_plan_fix_names(sb, plan, name_bno);
+out:
+    iput(inode);
+    return ret;
+}
+
+/*
+ * Moves the blocks and rewrites the references. The references follow whatever was moved,
+ * also when the moves did not get under way because memory ran out.
+ */
+static int basicbtfs_plan_move(struct super_block *sb, struct basicbtfs_defrag_plan *plan) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct basicbtfs_btree_dir_cache_list *dir_cache = NULL;
+    uint32_t i = 0;
+    int ret = 0, err = 0, moved = 0;
+
+    /* pinned buffers would hold on to the old copies */
+    mutex_lock(&sbi->s_dir_cache_lock);
+
+    list_for_each_entry(dir_cache, &sbi->s_dir_cache, list) {
+        basicbtfs_cache_unpin_all(dir_cache);
+    }
+
+    mutex_unlock(&sbi->s_dir_cache_lock);
+
+    moved = basicbtfs_plan_execute(sb, plan);
+
+    if (moved < 0) {
+        printk(KERN_ERR "Defrag plan: moving blocks failed: %d\n", moved);
+        ret = moved;
+    }
+
+    basicbtfs_plan_settle(sb, plan);
+
+    for (i = 0; i < plan->nr_of_inos; i++) {
+        err = basicbtfs_plan_fix_inode(sb, plan, plan->inos[i]);
+
+        if (err < 0 && ret == 0) ret = err;
+    }
+
+    mutex_lock(&sbi->s_dir_cache_lock);
+
+    list_for_each_entry(dir_cache, &sbi->s_dir_cache, list) {
+        dir_cache->bno = basicbtfs_plan_lookup(plan, dir_cache->bno);
+        basicbtfs_cache_pin_dir(sb, dir_cache);
+    }
+
+    mutex_unlock(&sbi->s_dir_cache_lock);
+
+    /* readdir positions refer to the old blocks */
+    sbi->s_defrag_runs++;
+
+    if (ret < 0) return ret;
+
+    sbi->s_unused_area = plan->end;
+    return moved;
+}
+
+/*
+ * Packs the whole disk with a plan, see above. Returns the number of blocks that were moved.
+ * Blocks of every file are copied underneath the page cache, so the filesystem is frozen for
+ * the pass: freezing writes back all file data and keeps writes and writable faults out until
+ * it is thawed, s_defrag_lock keeps out the rest. The caller must not hold write access to
+ * the filesystem, the freeze would wait for it.
+ */
+int basicbtfs_defrag_plan_disk(struct super_block *sb, struct inode *root) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct basicbtfs_defrag_plan plan = { 0 };
+    uint32_t unused_area_before = sbi->s_unused_area;
+    unsigned int nofs_flags = 0;
+    int ret = 0, err = 0;
+
+    ret = freeze_super(sb);
+
+    if (ret < 0) return ret;
+
+    /* a frozen filesystem can not be remounted, a read-only one stays read-only */
+    if (sb_rdonly(sb)) {
+        thaw_super(sb);
+        return -EROFS;
+    }
+
+    nofs_flags = memalloc_nofs_save();
+    down_write(&sbi->s_defrag_lock);
+    ret = basicbtfs_journal_lock(sb);
+
+    if (ret == 0) {
+        ret = basicbtfs_plan_build(sb, &plan, root);
+
+        if (ret == 0) ret = basicbtfs_plan_move(sb, &plan);
+
+        basicbtfs_journal_unlock(sb);
+    }
+
+    if (ret > 0) sbi->s_defrag_moved_blocks += ret;
+
+    up_write(&sbi->s_defrag_lock);
+    memalloc_nofs_restore(nofs_flags);
+    basicbtfs_plan_free(&plan);
+
+    err = thaw_super(sb);
+
+    if (err < 0 && ret >= 0) ret = err;
+
+    trace_basicbtfs_defrag_disk(sb, plan.nr_of_bnos, ret, unused_area_before, sbi->s_unused_area);
+    return ret;
+}
+
+/*
+ * Fragmentation report for BASICBTFS_IOC_FRAG_STAT. Every inode is looked at under its own lock
+ * and s_defrag_lock, so a directory or file is never seen halfway through an operation or a
+ * move, the disk as a whole can change between two inodes. The free runs are counted from
+ * the bitmap as it is at the end.
+ */
+static uint32_t basicbtfs_stat_bucket(uint64_t value) {
+    uint32_t bucket = 0;
+
+    while (value > 1 && bucket < BASICBTFS_STAT_BUCKETS - 1) {
+        value >>= 1;
+        bucket++;
+    }
+
+    return bucket;
+}
+
+static int basicbtfs_stat_file(struct super_block *sb, struct inode *inode, struct basicbtfs_ioctl_frag_stat *stat) {
+    uint32_t *bnos = NULL, nr_of_bnos = 0, runs = 0;
+    int ret = basicbtfs_defrag_list(sb, BASICBTFS_INODE(inode)->i_bno, false, &bnos, &nr_of_bnos);
+
+    if (ret < 0) return ret;
+
+    runs = basicbtfs_defrag_runs(bnos, nr_of_bnos);
+    stat->nr_of_files++;
+    stat->file_extents[basicbtfs_stat_bucket(runs)]++;
+    stat->nr_of_file_extents += runs;
+    kvfree(bnos);
+    return 0;
+}
+
+static int basicbtfs_stat_dir(struct super_block *sb, struct inode *dir, struct basicbtfs_ioctl_frag_stat *stat) {
+    struct basicbtfs_disk_block *disk_block = NULL;
+    struct buffer_head *bh = NULL;
+    uint32_t *bnos = NULL, nr_of_bnos = 0, nr_of_names = 0, distance = 0, i = 0;
+    int ret = 0;
+
+    stat->nr_of_dirs++;
+    bh = sb_bread(sb, BASICBTFS_INODE(dir)->i_bno);
+
+    if (!bh) return -EIO;
+
+    disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+
+    if (disk_block->block_type_id == BASICBTFS_BLOCKTYPE_INLINE_DIR) {
+        stat->nr_of_inline_dirs++;
+        brelse(bh);
+        return 0;
+    }
+
+    brelse(bh);
+    ret = basicbtfs_defrag_list(sb, BASICBTFS_INODE(dir)->i_bno, true, &bnos, &nr_of_bnos);
+
+    if (ret < 0) return ret;
+
+    for (i = 0; i < nr_of_bnos; i++) {
+        bh = sb_bread(sb, bnos[i]);
+
+        if (!bh) {
+            ret = -EIO;
+            break;
+        }
+
+        disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+
+        if (disk_block->block_type_id == BASICBTFS_BLOCKTYPE_BTREE_NODE) {
+            stat->nr_of_btree_nodes++;
+            stat->nr_of_btree_keys += disk_block->block_type.btree_node.nr_of_keys;
+        } else {
+            nr_of_names++;
+        }
+
+        brelse(bh);
+
+        if (i == 0) continue;
+
+        distance = bnos[i] > bnos[i - 1] ? bnos[i] - bnos[i - 1] : bnos[i - 1] - bnos[i];
+        stat->dir_distances[basicbtfs_stat_bucket(distance)]++;
+        stat->dir_distance_sum += distance;
+        stat->nr_of_dir_distances++;
+    }
+
+    stat->name_list_chains[basicbtfs_stat_bucket(nr_of_names)]++;
+    stat->nr_of_name_list_blocks += nr_of_names;
+    kvfree(bnos);
+    return ret;
+}
+
+static void basicbtfs_stat_free(struct basicbtfs_sb_info *sbi, struct basicbtfs_ioctl_frag_stat *stat) {
+    unsigned long start = basicbtfs_defrag_data_start(sbi), end = 0;
+
+    while (true) {
+        start = find_next_zero_bit(sbi->s_bfree_bitmap, sbi->s_nblocks, start);
+
+        if (start >= sbi->s_nblocks) break;
+
+        end = find_next_bit(sbi->s_bfree_bitmap, sbi->s_nblocks, start);
+        stat->free_extents[basicbtfs_stat_bucket(end - start)]++;
+        stat->nr_of_free_extents++;
+        stat->nr_of_free_blocks += end - start;
+        stat->largest_free_extent = max_t(uint32_t, stat->largest_free_extent, end - start);
+        start = end;
+    }
+}
+
+int basicbtfs_defrag_stat(struct super_block *sb, struct basicbtfs_ioctl_frag_stat *stat) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct inode *inode = NULL;
+    unsigned long ino = 0;
+    int ret = 0;
+
+    for (ino = find_next_bit(sbi->s_ifree_bitmap, sbi->s_ninodes, 0); ino < sbi->s_ninodes && ret == 0; ino = find_next_bit(sbi->s_ifree_bitmap, sbi->s_ninodes, ino + 1)) {
+        inode = basicbtfs_iget(sb, ino);
+
+        if (IS_ERR(inode)) continue;
+
+        inode_lock_shared(inode);
+        down_read(&sbi->s_defrag_lock);
+
+        if (S_ISREG(inode->i_mode)) {
+            ret = basicbtfs_stat_file(sb, inode, stat);
+        } else if (S_ISDIR(inode->i_mode)) {
+            ret = basicbtfs_stat_dir(sb, inode, stat);
+        }
+
+        up_read(&sbi->s_defrag_lock);
+        inode_unlock_shared(inode);
+        iput(inode);
+        cond_resched();
+    }
+
+    basicbtfs_stat_free(sbi, stat);
+    return ret;
+}
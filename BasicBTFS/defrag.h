@@ -1,25 +1,33 @@
 #ifndef BASICBTFS_DEFRAG_H
 #define BASICBTFS_DEFRAG_H
 
+#include <linux/bio.h>
+#include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/list.h>
+#include <linux/pagemap.h>
 #include <linux/slab.h>
 
 #include "basicbtfs.h"
 #include "btree.h"
+#include "bptree.h"
 #include "nametree.h"
+#include "inline.h"
 #include "bitmap.h"
 #include "cache.h"
 #include "init.h"
+#include "stats.h"
+#include "trace.h"
 
 static inline int basicbtfs_defrag_directory(struct super_block *sb, struct inode *inode, uint32_t *offset);
 static inline int basicbtfs_defrag_move_file_block(struct super_block *sb, struct buffer_head *bh_old, uint32_t old_bno, uint32_t new_bno);
 static inline int basicbtfs_defrag_move_cluster_table(struct super_block *sb, struct buffer_head *bh, uint32_t new_bno);
 static inline int basicbtfs_defrag_move_namelist(struct super_block *sb, struct buffer_head *bh,  uint32_t new_bno);
 static inline int basicbtfs_defrag_move_btree_node(struct super_block *sb, struct buffer_head *bh, uint32_t cur_bno, uint32_t new_bno);
+static inline int basicbtfs_defrag_move_inline_dir(struct super_block *sb, struct buffer_head *bh, uint32_t new_bno);
 
 
 static inline int basicbtfs_defrag_btree_node(struct super_block *sb, uint32_t old_bno, uint32_t *offset) {
@@ -33,12 +41,9 @@ static inline int basicbtfs_defrag_btree_node(struct super_block *sb, uint32_t o
     uint32_t tmp_bno, new_bno;
     int ret = 0, i = 0;
 
-    printk("defrag btree nodee and offset: %d | %d\n", old_bno, *offset);
-
     if (old_bno == *offset) {
-        printk("It is already placed on the correct place. No further action\n");
+        /* already in place */
     } else if (is_bit_range_empty(sbi->s_bfree_bitmap, sbi->s_nblocks, *offset, 1)) {
-        printk("The new block is empty. This will be taken and the old block will be removed\n");
         new_bno = get_offset(sbi, sbi->s_bfree_bitmap, sbi->s_nblocks, *offset, 1);
         if (old_bno == 0 || old_bno > sbi->s_nblocks) {
             printk("basicbtfs_defrag_btree_node: old_bno: %d\n", old_bno);
@@ -74,7 +79,6 @@ static inline int basicbtfs_defrag_btree_node(struct super_block *sb, uint32_t o
         brelse(bh_new);
         brelse(bh_old);
     } else {
-        printk("The new block is not empty. The current block on the wanted block, will be moved somewhere else and the old block will be removed\n");
         tmp_bno = get_offset(sbi, sbi->s_bfree_bitmap, sbi->s_nblocks, sbi->s_unused_area, 1);
 
         if (old_bno == 0 || old_bno > sbi->s_nblocks) {
@@ -117,8 +121,6 @@ static inline int basicbtfs_defrag_btree_node(struct super_block *sb, uint32_t o
         memcpy(disk_block_swap, disk_block_new, BASICBTFS_BLOCKSIZE);
         memcpy(disk_block_new, disk_block_old, BASICBTFS_BLOCKSIZE);
 
-        printk("handle references swapped one\n");
-
         switch (disk_block_swap->block_type_id) {
             case BASICBTFS_BLOCKTYPE_BTREE_NODE:
 
@@ -129,22 +131,33 @@ static inline int basicbtfs_defrag_btree_node(struct super_block *sb, uint32_t o
                     }
                 }
 
+                /* neighbouring leaves point at each other, link them through tmp_bno */
+                if (BASICBTFS_HAS_BPTREE(sb) && disk_block_new->block_type.btree_node.leaf) {
+                    if (disk_block_new->block_type.btree_node.next_leaf == *offset) {
+                        disk_block_new->block_type.btree_node.next_leaf = tmp_bno;
+                        disk_block_swap->block_type.btree_node.prev_leaf = *offset;
+                    } else if (disk_block_new->block_type.btree_node.prev_leaf == *offset) {
+                        disk_block_new->block_type.btree_node.prev_leaf = tmp_bno;
+                        disk_block_swap->block_type.btree_node.next_leaf = *offset;
+                    }
+                }
+
                 ret = basicbtfs_defrag_move_btree_node(sb, bh_new, old_bno, *offset);
                 ret = basicbtfs_defrag_move_btree_node(sb, bh_swap, *offset, tmp_bno);
-                printk("need to move btree\n");
                 break;
             case BASICBTFS_BLOCKTYPE_CLUSTER_TABLE:
-                printk("need to move cluster table\n");
                 ret = basicbtfs_defrag_move_btree_node(sb, bh_new, old_bno, *offset);
                 ret = basicbtfs_defrag_move_cluster_table(sb, bh_swap, tmp_bno);
                 break;
             case BASICBTFS_BLOCKTYPE_NAMETREE:
-                printk("need to move namelist\n");
                 ret = basicbtfs_defrag_move_btree_node(sb, bh_new, old_bno, *offset);
                 ret = basicbtfs_defrag_move_namelist(sb, bh_swap, tmp_bno);
                 break;
+            case BASICBTFS_BLOCKTYPE_INLINE_DIR:
+                ret = basicbtfs_defrag_move_btree_node(sb, bh_new, old_bno, *offset);
+                ret = basicbtfs_defrag_move_inline_dir(sb, bh_swap, tmp_bno);
+                break;
             default:
-                printk("need to move file block\n");
                 ret = basicbtfs_defrag_move_btree_node(sb, bh_new, old_bno, *offset);
                 ret = basicbtfs_defrag_move_file_block(sb, bh_swap, *offset, tmp_bno);
                 break;
@@ -161,7 +174,6 @@ static inline int basicbtfs_defrag_btree_node(struct super_block *sb, uint32_t o
     }
     // basicbtfs_btree_traverse_debug(sb, *offset);
     *offset += 1;
-    printk("New offset after updating a btree node %d\n", *offset);
     return 0;
 }
 
@@ -186,7 +198,6 @@ static inline int basicbtfs_defrag_btree(struct super_block *sb, struct inode *i
         return -1;
     }
 
-    printk("new bno for btree: %d\n", new_bno);
     bh = sb_bread(sb, new_bno);
 
     if (!bh) return -EIO;
@@ -196,7 +207,6 @@ static inline int basicbtfs_defrag_btree(struct super_block *sb, struct inode *i
 
     for (index = 0; index < node->nr_of_keys; index++) {
         if (!node->leaf) {
-            printk("current: node->children[index]: %d\n", node->children[index]);
             ret = basicbtfs_defrag_btree(sb, inode, node->children[index], offset);
 
             if (ret != 0 || ret == -1) {
@@ -229,14 +239,17 @@ static inline int basicbtfs_defrag_move_btree_node(struct super_block *sb, struc
     if (btr_node->root) {
         parent_inode = basicbtfs_iget(sb, btr_node->parent);
 
+        if (IS_ERR(parent_inode)) return PTR_ERR(parent_inode);
+
         if (( BASICBTFS_INODE(parent_inode)->i_bno == 0) || BASICBTFS_INODE(parent_inode)->i_bno >  sbi->s_nblocks) {
             printk("basicbtfs_defrag_move_btree_node: new_bno: %d\n", new_bno);
+            iput(parent_inode);
             return -1;
         }
         basicbtfs_btree_update_root(parent_inode, new_bno);
+        iput(parent_inode);
 
     } else {
-        printk("no root\n");
         if (btr_node->parent == 0 || btr_node->parent > sbi->s_nblocks) {
             printk("basicbtfs_defrag_move_btree_node: btr_node->parent: %d\n", btr_node->parent);
             return -1;
@@ -249,7 +262,6 @@ static inline int basicbtfs_defrag_move_btree_node(struct super_block *sb, struc
 
         for (index = 0; index <= btr_node_parent->nr_of_keys; index++) {
             if (btr_node_parent->children[index] == cur_bno) {
-                printk("found old and new child: %d | %d | %d\n", btr_node->parent, btr_node_parent->children[index], new_bno);
                 btr_node_parent->children[index] = new_bno;
                 break;
             }
@@ -274,8 +286,51 @@ static inline int basicbtfs_defrag_move_btree_node(struct super_block *sb, struc
             mark_buffer_dirty(bh_child);
             brelse(bh_child);
         }
+    } else if (BASICBTFS_HAS_BPTREE(sb)) {
+        if (basicbtfs_bptree_set_link(sb, btr_node->prev_leaf, NULL, &new_bno, NULL) != 0) return -EIO;
+        if (basicbtfs_bptree_set_link(sb, btr_node->next_leaf, NULL, NULL, &new_bno) != 0) return -EIO;
+    }
+
+    return 0;
+}
+
+/* Walks back from cur_bno to the first block of the list and moves its free_hint along with a moved block */
+static inline int basicbtfs_defrag_move_namelist_hint(struct super_block *sb, uint32_t cur_bno, uint32_t old_bno, uint32_t new_bno) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct basicbtfs_name_list_hdr *name_list_hdr = NULL;
+    struct basicbtfs_disk_block *disk_block = NULL;
+    struct buffer_head *bh = NULL;
+
+    while (true) {
+        if (cur_bno == 0 || cur_bno > sbi->s_nblocks) {
+            printk("basicbtfs_defrag_move_namelist_hint: cur_bno: %d\n", cur_bno);
+            return -1;
+        }
+
+        bh = sb_bread(sb, cur_bno);
+
+        if (!bh) return -EIO;
+
+        disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+        name_list_hdr = &disk_block->block_type.name_list_hdr;
+
+        if (disk_block->block_type_id != BASICBTFS_BLOCKTYPE_NAMETREE) {
+            brelse(bh);
+            return -1;
+        }
+
+        if (name_list_hdr->first_list) break;
+
+        cur_bno = name_list_hdr->prev_block;
+        brelse(bh);
     }
 
+    if (name_list_hdr->free_hint == old_bno) {
+        name_list_hdr->free_hint = new_bno;
+        mark_buffer_dirty(bh);
+    }
+
+    brelse(bh);
     return 0;
 }
 
@@ -286,6 +341,8 @@ static inline int basicbtfs_defrag_move_namelist(struct super_block *sb, struct
     struct basicbtfs_btree_node *btr_node = NULL;
     struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
     struct inode *inode = NULL;
+    uint32_t old_bno = 0;
+    int ret = 0;
 
     disk_block = (struct basicbtfs_disk_block *) bh->b_data;
     name_list_hdr = &disk_block->block_type.name_list_hdr;
@@ -293,18 +350,26 @@ static inline int basicbtfs_defrag_move_namelist(struct super_block *sb, struct
     if (name_list_hdr->first_list) {
         inode = basicbtfs_iget(sb, name_list_hdr->prev_block);
 
+        if (IS_ERR(inode)) return PTR_ERR(inode);
+
         if (BASICBTFS_INODE(inode)->i_bno == 0 || BASICBTFS_INODE(inode)->i_bno > sbi->s_nblocks) {
             printk("basicbtfs_defrag_move_namelist: BASICBTFS_INODE(inode)->i_bno first: %d\n", BASICBTFS_INODE(inode)->i_bno);
+            iput(inode);
             return -1;
         }
 
         bh_prev = sb_bread(sb, BASICBTFS_INODE(inode)->i_bno);
+        iput(inode);
 
         if (!bh_prev) return -EIO;
 
         disk_block_prev = (struct basicbtfs_disk_block *) bh_prev->b_data;
         btr_node = &disk_block_prev->block_type.btree_node;
 
+        if (name_list_hdr->free_hint == btr_node->tree_name_bno) {
+            name_list_hdr->free_hint = new_bno;
+        }
+
         btr_node->tree_name_bno = new_bno;
 
         mark_buffer_dirty(bh_prev);
@@ -321,9 +386,14 @@ static inline int basicbtfs_defrag_move_namelist(struct super_block *sb, struct
         disk_block_prev = (struct basicbtfs_disk_block *) bh_prev->b_data;
         name_list_prev = &disk_block_prev->block_type.name_list_hdr;
 
+        old_bno = name_list_prev->next_block;
         name_list_prev->next_block = new_bno;
         mark_buffer_dirty(bh_prev);
         brelse(bh_prev);
+
+        ret = basicbtfs_defrag_move_namelist_hint(sb, name_list_hdr->prev_block, old_bno, new_bno);
+
+        if (ret < 0) return ret;
     }
 
     if (name_list_hdr->next_block != 0) {
@@ -358,25 +428,127 @@ static inline int basicbtfs_defrag_move_cluster_table(struct super_block *sb, st
     cluster_list = &disk_block->block_type.cluster_table;
     inode = basicbtfs_iget(sb, cluster_list->ino);
 
+    if (IS_ERR(inode)) return PTR_ERR(inode);
+
     if (new_bno == 0 || new_bno > sbi->s_nblocks) {
         printk("basicbtfs_defrag_move_cluster_table: new_bno: %d\n", new_bno);
+        iput(inode);
         return -1;
     }
     ret = basicbtfs_file_update_root(inode, new_bno);
+    iput(inode);
 
     return ret;
 }
 
+static inline int basicbtfs_defrag_move_inline_dir(struct super_block *sb, struct buffer_head *bh, uint32_t new_bno) {
+    struct basicbtfs_disk_block *disk_block;
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct inode *inode = NULL;
+    int ret = 0;
+
+    disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+    inode = basicbtfs_iget(sb, disk_block->block_type.inline_dir.ino);
+
+    if (IS_ERR(inode)) return PTR_ERR(inode);
+
+    if (new_bno == 0 || new_bno > sbi->s_nblocks) {
+        printk("basicbtfs_defrag_move_inline_dir: new_bno: %d\n", new_bno);
+        iput(inode);
+        return -1;
+    }
+
+    ret = basicbtfs_file_update_root(inode, new_bno);
+    iput(inode);
+    return ret;
+}
+
+/* Reads or writes nr_of_pages blocks from bno with a single bio and waits for it */
+static inline int basicbtfs_defrag_submit_extent(struct super_block *sb, unsigned int op, uint32_t bno, struct page **pages, uint32_t nr_of_pages) {
+    struct bio *bio = bio_alloc(GFP_NOFS, nr_of_pages);
+    uint32_t i = 0;
+    int ret = 0;
+
+    bio_set_dev(bio, sb->s_bdev);
+    bio->bi_iter.bi_sector = (sector_t) bno * (BASICBTFS_BLOCKSIZE >> 9);
+    bio->bi_opf = op;
+
+    for (i = 0; i < nr_of_pages; i++) {
+        if (bio_add_page(bio, pages[i], BASICBTFS_BLOCKSIZE, 0) != BASICBTFS_BLOCKSIZE) {
+            bio_put(bio);
+            return -EIO;
+        }
+    }
+
+    ret = submit_bio_wait(bio);
+    bio_put(bio);
+    return ret;
+}
+
+/*
+ * Copies the data blocks src .. src + len - 1 to dst with bios of up to BIO_MAX_PAGES blocks,
+ * past the block device cache so file data does not push metadata out of it. Dirty copies of
+ * the sources in that cache are written first. Cached copies of both ranges are dropped, the
+ * destinations would otherwise be read back as they were before.
+ */
+static inline int basicbtfs_defrag_copy_extent(struct super_block *sb, uint32_t src, uint32_t dst, uint32_t len) {
+    struct address_space *mapping = sb->s_bdev->bd_inode->i_mapping;
+    struct page **pages = NULL;
+    uint32_t nr_of_pages = min_t(uint32_t, len, BIO_MAX_PAGES), done = 0, chunk = 0, i = 0;
+    u64 start = BASICBTFS_TRACE_START(basicbtfs_defrag_move);
+    int ret = 0;
+
+    if (len == 0) return 0;
+
+    ret = filemap_write_and_wait_range(mapping, (loff_t) src * BASICBTFS_BLOCKSIZE, ((loff_t) src + len) * BASICBTFS_BLOCKSIZE - 1);
+
+    if (ret < 0) return ret;
+
+    pages = kcalloc(nr_of_pages, sizeof(struct page *), GFP_KERNEL);
+
+    if (!pages) return -ENOMEM;
+
+    for (i = 0; i < nr_of_pages; i++) {
+        pages[i] = alloc_page(GFP_KERNEL);
+
+        if (!pages[i]) {
+            ret = -ENOMEM;
+            goto out;
+        }
+    }
+
+    /* a dirty buffer left at a destination would be written over the copy */
+    clean_bdev_aliases(sb->s_bdev, dst, len);
+
+    for (done = 0; done < len && ret == 0; done += chunk) {
+        chunk = min_t(uint32_t, len - done, nr_of_pages);
+        ret = basicbtfs_defrag_submit_extent(sb, REQ_OP_READ, src + done, pages, chunk);
+
+        if (ret == 0) ret = basicbtfs_defrag_submit_extent(sb, REQ_OP_WRITE, dst + done, pages, chunk);
+    }
+
+    invalidate_mapping_pages(mapping, ((loff_t) src * BASICBTFS_BLOCKSIZE) >> PAGE_SHIFT, (((loff_t) src + len) * BASICBTFS_BLOCKSIZE - 1) >> PAGE_SHIFT);
+    invalidate_mapping_pages(mapping, ((loff_t) dst * BASICBTFS_BLOCKSIZE) >> PAGE_SHIFT, (((loff_t) dst + len) * BASICBTFS_BLOCKSIZE - 1) >> PAGE_SHIFT);
+out:
+    for (i = 0; i < nr_of_pages && pages[i]; i++) __free_page(pages[i]);
+
+    kfree(pages);
+    basicbtfs_stat_inc(BASICBTFS_SB(sb), BASICBTFS_STAT_DEFRAG_MOVES);
+    basicbtfs_stat_add(BASICBTFS_SB(sb), BASICBTFS_STAT_DEFRAG_MOVED_BLOCKS, len);
+    trace_basicbtfs_defrag_move(sb, src, dst, len, ret, start);
+    return ret;
+}
+
 static inline int basicbtfs_defrag_move_file_block(struct super_block *sb, struct buffer_head *bh_old, uint32_t old_bno, uint32_t new_bno) {
     struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
     struct inode *inode;
     struct basicbtfs_inode_info *inode_info = NULL;
     uint32_t ino = 0, cluster_index, tmp_bno, fblock_info_bno, fblock_info_index;
-    struct buffer_head *bh = NULL, *bh_new, *bh_old2, *bh_file_info;
+    struct buffer_head *bh = NULL, *bh_new, *bh_file_info;
     struct basicbtfs_cluster_table *cluster_list;
     struct basicbtfs_fileblock_info *file_info;
     struct basicbtfs_disk_block *disk_block, *disk_block_new, *disk_block_old;
-    int i = 0;
+    int ret = 0;
 
     fblock_info_bno = BASICBTFS_GET_FILEBLOCK(old_bno, sbi->s_imap_blocks, sbi->s_bmap_blocks, sbi->s_inode_blocks);
     fblock_info_index = BASICBTFS_GET_FILEBLOCK_IDX(old_bno);
@@ -397,18 +569,22 @@ static inline int basicbtfs_defrag_move_file_block(struct super_block *sb, struc
     // ino = sbi->s_fileblock_map[old_bno].ino;
     // cluster_index = sbi->s_fileblock_map[old_bno].cluster_index;
     if (ino == 0) {
-        printk("something went wrong\n");
         return 0;
     }
 
     inode = basicbtfs_iget(sb, ino);
+
+    if (IS_ERR(inode)) return PTR_ERR(inode);
+
     inode_info = BASICBTFS_INODE(inode);
 
     if (inode_info->i_bno == 0 || inode_info->i_bno > sbi->s_nblocks) {
         printk("basicbtfs_defrag_move_file_block: inode_info->i_bno: %d\n", inode_info->i_bno);
+        iput(inode);
         return -1;
     }
     bh = sb_bread(sb, inode_info->i_bno);
+    iput(inode);
 
     if (!bh) return -EIO;
 
@@ -433,37 +609,23 @@ static inline int basicbtfs_defrag_move_file_block(struct super_block *sb, struc
     brelse(bh_new);
 
 
-    for (i = 1; i < cluster_list->table[cluster_index].cluster_length; i++) {
-        bh_old2 = sb_bread(sb, cluster_list->table[cluster_index].start_bno + i);
-
-        if (!bh_old2) return -EIO;
+    /* the first block is only in bh_old by now, the rest of the cluster goes over in one piece */
+    ret = basicbtfs_defrag_copy_extent(sb, cluster_list->table[cluster_index].start_bno + 1, tmp_bno + 1, cluster_list->table[cluster_index].cluster_length - 1);
 
-        if (tmp_bno + i == 0 || tmp_bno + i > sbi->s_nblocks) {
-            printk("basicbtfs_defrag_move_file_block: tmp_bno + i: %d\n", tmp_bno + i);
-            return -1;
-        }
-        bh_new = sb_bread(sb, tmp_bno + i);
-        
-        disk_block_new = (struct basicbtfs_disk_block *) bh_new->b_data;
-        disk_block_old = (struct basicbtfs_disk_block *) bh_old2->b_data;
-        memcpy(disk_block_new, disk_block_old, BASICBTFS_BLOCKSIZE);
-
-        mark_buffer_dirty(bh_new);
-        brelse(bh_old2);
-        brelse(bh_new);
+    if (ret < 0) {
+        brelse(bh);
+        return ret;
     }
 
-    put_blocks(sbi, cluster_list->table[cluster_index].start_bno + 1, cluster_list->table[cluster_index].cluster_length - 1);
+    put_data_blocks(sbi, cluster_list->table[cluster_index].start_bno + 1, cluster_list->table[cluster_index].cluster_length - 1);
     put_blocks(sbi, new_bno, 1);
     cluster_list->table[cluster_index].start_bno = tmp_bno;
 
-    for (i = 0; i < BASICBTFS_MAX_BLOCKS_PER_CLUSTER; i++) {
-
-        basicbtfs_update_file_info(sb, old_bno + i, 0, 0);
-        basicbtfs_update_file_info(sb, tmp_bno + i, ino, cluster_index);
-    }
+    basicbtfs_update_file_info_range(sb, old_bno, cluster_list->table[cluster_index].cluster_length, 0, 0);
+    basicbtfs_update_file_info_range(sb, tmp_bno, cluster_list->table[cluster_index].cluster_length, ino, cluster_index);
+    mark_buffer_dirty(bh);
+    brelse(bh);
 
-    printk("new tmp bno: %d\n", tmp_bno);
     return 0;
 }
 
@@ -487,8 +649,6 @@ static inline int basicbtfs_defrag_nametree_block(struct super_block *sb, struct
     char *filename = NULL;
     int i = 0, ret = 0;
 
-    printk("defragment namelist block and offset: %d | %d\n", name_bno, *offset);
-
 
     disk_block = (struct basicbtfs_disk_block *) bh->b_data;
     name_list_hdr = &disk_block->block_type.name_list_hdr;
@@ -497,22 +657,17 @@ static inline int basicbtfs_defrag_nametree_block(struct super_block *sb, struct
     pos += BASICBTFS_NAME_ENTRY_S_OFFSET;
     cur_entry = (struct basicbtfs_name_entry *) block;
 
-    printk("start iterating name list: %d\n", name_list_hdr->nr_of_entries);
-
     for (i = 0; i < name_list_hdr->nr_of_entries; i++) {
         block += sizeof(struct basicbtfs_name_entry);
         pos += sizeof(struct basicbtfs_name_entry);
-        printk("current pos: %d\n", pos);
         if (cur_entry->ino != 0) {
-            printk("entry exist: %d | %d\n", cur_entry->ino, cur_entry->name_length);
             filename = (char *)kzalloc(sizeof(char) * cur_entry->name_length, GFP_KERNEL);
             strncpy(filename, block, cur_entry->name_length);
     
-            ret = basicbtfs_btree_node_update_namelist_info(sb, BASICBTFS_INODE(inode)->i_bno, get_hash_from_block(filename, cur_entry->name_length - 1), 0, name_bno, pos - sizeof(struct basicbtfs_name_entry));
+            ret = basicbtfs_nametree_update_namelist_info(sb, BASICBTFS_INODE(inode)->i_bno, get_hash_from_block(filename, cur_entry->name_length - 1), name_bno, pos - sizeof(struct basicbtfs_name_entry));
             if (ret == -1) return ret;
             kfree(filename);
         } else {
-            printk("entry doesnt' exist\n");
             rest_of_block = BASICBTFS_BLOCKSIZE - (pos + cur_entry->name_length);
             name_list_hdr->start_unused_area -= (sizeof(struct basicbtfs_name_entry) + cur_entry->name_length);
             memcpy(block - sizeof(struct basicbtfs_name_entry) , block + cur_entry->name_length, rest_of_block);
@@ -564,7 +719,7 @@ static inline int basicbtfs_defrag_nametree_block(struct super_block *sb, struct
 
                     filename = (char *)kzalloc(sizeof(char) * cur_entry_next->name_length, GFP_KERNEL);
                     strncpy(filename, block_next, cur_entry_next->name_length);
-                    basicbtfs_btree_node_update_namelist_info(sb, BASICBTFS_INODE(inode)->i_bno, get_hash_from_block(filename, cur_entry_next->name_length - 1), 0, name_bno, pos_next - sizeof(struct basicbtfs_name_entry));
+                    basicbtfs_nametree_update_namelist_info(sb, BASICBTFS_INODE(inode)->i_bno, get_hash_from_block(filename, cur_entry_next->name_length - 1), name_bno, pos_next - sizeof(struct basicbtfs_name_entry));
                     kfree(filename);
                 } else {
                     i--;
@@ -586,9 +741,8 @@ static inline int basicbtfs_defrag_nametree_block(struct super_block *sb, struct
 
     // check if offset is empty, then take spot and copy item, otherwise 
     if (*offset == name_bno) {
-        printk("offset and current block are the same. Nothing  needs to be changed\n");
+        /* already in place */
     } else if (is_bit_range_empty(sbi->s_bfree_bitmap, sbi->s_nblocks, *offset, 1)) {
-        printk("offset is free. Take the offset block and delete old block\n");
         new_bno = get_offset(sbi, sbi->s_bfree_bitmap, sbi->s_nblocks, *offset, 1);
 
         if (new_bno == 0 || new_bno > sbi->s_nblocks) {
@@ -608,7 +762,6 @@ static inline int basicbtfs_defrag_nametree_block(struct super_block *sb, struct
         brelse(bh_new);
         put_blocks(sbi, name_bno, 1);
     } else {
-        printk("offset is not free. Find new place for the wanted block and delete old block\n");
         // swap
         tmp_bno = get_offset(sbi, sbi->s_bfree_bitmap, sbi->s_nblocks, sbi->s_unused_area, 1);
 
@@ -641,19 +794,18 @@ static inline int basicbtfs_defrag_nametree_block(struct super_block *sb, struct
 
         switch (disk_block_swap->block_type_id) {
             case BASICBTFS_BLOCKTYPE_BTREE_NODE:
-                printk("need to move btree\n");
                 ret = basicbtfs_defrag_move_btree_node(sb, bh_swap, *offset, tmp_bno);
                 break;
             case BASICBTFS_BLOCKTYPE_CLUSTER_TABLE:
-                printk("need to move cluster table\n");
                 ret = basicbtfs_defrag_move_cluster_table(sb, bh_swap, tmp_bno);
                 break;
             case BASICBTFS_BLOCKTYPE_NAMETREE:
-                printk("need to move nametree\n");
                 ret = basicbtfs_defrag_move_namelist(sb, bh_swap, tmp_bno);
                 break;
+            case BASICBTFS_BLOCKTYPE_INLINE_DIR:
+                ret = basicbtfs_defrag_move_inline_dir(sb, bh_swap, tmp_bno);
+                break;
             default:
-                printk("need to move file block\n");
                 ret = basicbtfs_defrag_move_file_block(sb, bh_swap, *offset, tmp_bno);
                 break;
         }
@@ -677,7 +829,7 @@ static inline int basicbtfs_defrag_nametree_block(struct super_block *sb, struct
         if (cur_entry->ino != 0) {
             filename = (char *)kzalloc(sizeof(char) * cur_entry->name_length, GFP_KERNEL);
             strncpy(filename, block, cur_entry->name_length);
-            basicbtfs_btree_node_update_namelist_info(sb, BASICBTFS_INODE(inode)->i_bno, get_hash_from_block(filename, cur_entry->name_length - 1), 0, name_bno, pos - sizeof(struct basicbtfs_name_entry));
+            basicbtfs_nametree_update_namelist_info(sb, BASICBTFS_INODE(inode)->i_bno, get_hash_from_block(filename, cur_entry->name_length - 1), name_bno, pos - sizeof(struct basicbtfs_name_entry));
             kfree(filename);
         } else {
             i--;
@@ -688,7 +840,6 @@ static inline int basicbtfs_defrag_nametree_block(struct super_block *sb, struct
         cur_entry = (struct basicbtfs_name_entry *) block;
     }
     *offset += 1;
-    printk("offset after defragmenting a namelist block: %d\n", *offset);
     return 0;
 }
 
@@ -705,7 +856,6 @@ static inline int basicbtfs_defrag_nametree(struct super_block *sb, struct inode
     struct buffer_head *bh = NULL;
     uint32_t cur_namelist_bno = 0;
     int ret = 0;
-    printk("defragment namelist\n");
     if (inode_info->i_bno == 0 || inode_info->i_bno > sbi->s_nblocks) {
         printk("basicbtfs_defrag_nametree: inode_info->i_bno: %d\n", inode_info->i_bno);
         return -1;
@@ -752,6 +902,24 @@ static inline int basicbtfs_defrag_nametree(struct super_block *sb, struct inode
         if (ret < 0) return ret;
     }
 
+    brelse(bh);
+
+    /* the blocks have been packed, so inserts start at the front of the list again */
+    bh = sb_bread(sb, inode_info->i_bno);
+
+    if (!bh) return -EIO;
+
+    disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+    cur_namelist_bno = disk_block->block_type.btree_node.tree_name_bno;
+    brelse(bh);
+
+    bh = sb_bread(sb, cur_namelist_bno);
+
+    if (!bh) return -EIO;
+
+    disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+    disk_block->block_type.name_list_hdr.free_hint = 0;
+    mark_buffer_dirty(bh);
     brelse(bh);
     return 0;
 }
@@ -769,13 +937,10 @@ static inline int basicbtfs_defrag_file_table_block(struct super_block *sb, stru
     struct buffer_head *bh_old = NULL, *bh_new = NULL, *bh_swap, *bh_old_block, *bh_new_block, *bh_swap_block;
     uint32_t cluster_index = 0, block_index = 0, disk_block_offset = 0, tmp_bno, new_bno, new_start_bno;
     int ret = 0;
-    printk("start defragging of file : %d | %d\n", *offset, BASICBTFS_INODE(inode)->i_bno);
     if (*offset == BASICBTFS_INODE(inode)->i_bno) {
-        printk("offset is same as current block");
+        /* already in place */
     } else if (is_bit_range_empty(sbi->s_bfree_bitmap, sbi->s_nblocks, *offset, 1)) {
-        printk("offset is free. Take it and remove old block\n");
         new_bno = get_offset(sbi, sbi->s_bfree_bitmap, sbi->s_nblocks, *offset, 1);
-        printk("new_bno: %d\n", new_bno);
         if (BASICBTFS_INODE(inode)->i_bno == 0 || BASICBTFS_INODE(inode)->i_bno > sbi->s_nblocks) {
             printk("basicbtfs_defrag_file_table_block: BASICBTFS_INODE(inode)->i_bno: %d\n", BASICBTFS_INODE(inode)->i_bno);
             return -1;
@@ -809,9 +974,7 @@ static inline int basicbtfs_defrag_file_table_block(struct super_block *sb, stru
         brelse(bh_old);
         brelse(bh_new);
     } else {
-        printk("offset is not free. swap it and remove old block: %d\n", sbi->s_unused_area);
         tmp_bno = get_offset(sbi, sbi->s_bfree_bitmap, sbi->s_nblocks, sbi->s_unused_area, 1);
-        printk("new tmp_bno: %d\n", tmp_bno);
         if (tmp_bno == 0 || tmp_bno > sbi->s_nblocks) {
             printk("basicbtfs_defrag_file_table_block: tmp_bno: %d\n", tmp_bno);
             return -1;
@@ -847,19 +1010,18 @@ static inline int basicbtfs_defrag_file_table_block(struct super_block *sb, stru
         switch (disk_block_swap->block_type_id) {
             case BASICBTFS_BLOCKTYPE_BTREE_NODE:
                 ret = basicbtfs_defrag_move_btree_node(sb, bh_swap, *offset, tmp_bno);
-                printk("updated btree on wanted place\n");
                 break;
             case BASICBTFS_BLOCKTYPE_CLUSTER_TABLE:
                 ret = basicbtfs_defrag_move_cluster_table(sb, bh_swap, tmp_bno);
-                printk("updated cluster table on wanted place\n");
                 break;
             case BASICBTFS_BLOCKTYPE_NAMETREE:
                 ret = basicbtfs_defrag_move_namelist(sb, bh_swap, tmp_bno);
-                printk("updated nametree on wanted place\n");
+                break;
+            case BASICBTFS_BLOCKTYPE_INLINE_DIR:
+                ret = basicbtfs_defrag_move_inline_dir(sb, bh_swap, tmp_bno);
                 break;
             default:
                 ret = basicbtfs_defrag_move_file_block(sb, bh_swap, *offset, tmp_bno);
-                printk("updated file block on wanted place\n");
                 break;
         }
 
@@ -880,7 +1042,6 @@ static inline int basicbtfs_defrag_file_table_block(struct super_block *sb, stru
         if (ret < 0) return ret;
     }
 
-    printk("cluster table is updated\n");
     if (BASICBTFS_INODE(inode)->i_bno == 0 || BASICBTFS_INODE(inode)->i_bno > sbi->s_nblocks) {
         printk("basicbtfs_defrag_file_table_block: BASICBTFS_INODE(inode)->i_bno: %d\n", BASICBTFS_INODE(inode)->i_bno);
         return -1;
@@ -895,19 +1056,15 @@ static inline int basicbtfs_defrag_file_table_block(struct super_block *sb, stru
         new_start_bno = *offset;
 
         if (cluster_list->table[cluster_index].start_bno == 0) {
-            printk("end of cluster table with index: %d\n", cluster_index);
             break;
         }
         for (block_index = 0; block_index < cluster_list->table[cluster_index].cluster_length; block_index++) {
             disk_block_offset = cluster_list->table[cluster_index].start_bno;
 
-            printk("offset and current block: %d | %d\n", *offset, disk_block_offset + block_index);
             if (*offset == disk_block_offset + block_index) {
-                printk("same offset\n");
                 *offset += 1;
                 continue;
             } else if (sbi && is_bit_empty(sbi->s_bfree_bitmap, sbi->s_nblocks, *offset, block_index)) {
-                printk("wanted offset is free\n");
                 // if (block_index > 0) continue;
                 new_bno = get_offset(sbi, sbi->s_bfree_bitmap, sbi->s_nblocks, *offset, 1);
 
@@ -934,7 +1091,7 @@ static inline int basicbtfs_defrag_file_table_block(struct super_block *sb, stru
 
                 memcpy(disk_block_new, disk_block, BASICBTFS_BLOCKSIZE);
 
-                put_blocks(sbi, disk_block_offset + block_index, 1);
+                put_data_blocks(sbi, disk_block_offset + block_index, 1);
                 mark_buffer_dirty(bh_new_block);
 
 
@@ -944,7 +1101,6 @@ static inline int basicbtfs_defrag_file_table_block(struct super_block *sb, stru
                 brelse(bh_new_block);
                 brelse(bh_old_block);
             } else {
-                printk("wanted offset should be swept\n");
                 // swap
                 tmp_bno = get_offset(sbi, sbi->s_bfree_bitmap, sbi->s_nblocks, sbi->s_unused_area, 1);
                 if (tmp_bno == 0 || tmp_bno > sbi->s_nblocks) {
@@ -983,19 +1139,18 @@ static inline int basicbtfs_defrag_file_table_block(struct super_block *sb, stru
 
                 switch (disk_block_swap->block_type_id) {
                     case BASICBTFS_BLOCKTYPE_BTREE_NODE:
-                        printk("need to move btree\n");
                         ret = basicbtfs_defrag_move_btree_node(sb, bh_swap_block, *offset, tmp_bno);
                         break;
                     case BASICBTFS_BLOCKTYPE_CLUSTER_TABLE:
-                        printk("need to move cluster table\n");
                         ret = basicbtfs_defrag_move_cluster_table(sb, bh_swap_block, tmp_bno);
                         break;
                     case BASICBTFS_BLOCKTYPE_NAMETREE:
-                        printk("need to move nametree\n");
                         ret = basicbtfs_defrag_move_namelist(sb, bh_swap_block, tmp_bno);
                         break;
+                    case BASICBTFS_BLOCKTYPE_INLINE_DIR:
+                        ret = basicbtfs_defrag_move_inline_dir(sb, bh_swap_block, tmp_bno);
+                        break;
                     default:
-                        printk("need to move file block\n");
                         ret = basicbtfs_defrag_move_file_block(sb, bh_swap_block, *offset,tmp_bno);
                         break;
                 }
@@ -1014,7 +1169,6 @@ static inline int basicbtfs_defrag_file_table_block(struct super_block *sb, stru
             *offset += 1;
         }
         cluster_list->table[cluster_index].start_bno = new_start_bno;
-        printk("it has been updated: %d\n", cluster_list->table[cluster_index].start_bno);
 
     }
 
@@ -1053,20 +1207,19 @@ static inline int basicbtfs_defrag_traverse_directory(struct super_block *sb, ui
             }
         }
 
+        /* B+-tree separators are copies of leaf entries */
+        if (!node->leaf && BASICBTFS_HAS_BPTREE(sb)) continue;
+
         inode = basicbtfs_iget(sb, node->entries[index].ino);
         if (S_ISDIR(inode->i_mode)) {
-            printk("directory to be defragmented\n");
             ret = basicbtfs_defrag_directory(sb, inode, offset);
             if (ret < 0) return ret;
         } else if (S_ISREG(inode->i_mode)) {
-            printk("will defrag file\n");
             ret = basicbtfs_defrag_file_table_block(sb, inode, offset);
             if (ret < 0) return ret;
-            printk("offset after defrag file: %d\n", *offset);
         }
 
 
-        printk(KERN_INFO "file: %d | ino: %d\n", node->entries[index].hash, node->entries[index].ino);
     }
 
     if (!node->leaf) {
@@ -1078,6 +1231,173 @@ static inline int basicbtfs_defrag_traverse_directory(struct super_block *sb, ui
     return 0;
 }
 
+static inline int basicbtfs_defrag_inline_dir(struct super_block *sb, struct inode *inode, uint32_t *offset) {
+    /**
+     * 1. Place the inline block on offset, swapping out the current block if necessary
+     * 2. Defrag every file and directory stored in it
+     */
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct basicbtfs_inode_info *inode_info = BASICBTFS_INODE(inode);
+    struct basicbtfs_disk_block *disk_block, *disk_block_new, *disk_block_swap;
+    struct basicbtfs_inline_dir_entry *entry = NULL;
+    struct buffer_head *bh_old = NULL, *bh_new = NULL, *bh_swap = NULL;
+    struct inode *child = NULL;
+    uint32_t *inos = NULL;
+    uint32_t tmp_bno, new_bno, nr_of_files = 0, pos = 0;
+    int ret = 0, index = 0;
+
+    if (*offset == 0 || *offset > sbi->s_nblocks) {
+        printk("basicbtfs_defrag_inline_dir: *offset: %d\n", *offset);
+        return -1;
+    }
+
+    if (*offset != inode_info->i_bno && is_bit_range_empty(sbi->s_bfree_bitmap, sbi->s_nblocks, *offset, 1)) {
+        new_bno = get_offset(sbi, sbi->s_bfree_bitmap, sbi->s_nblocks, *offset, 1);
+
+        bh_old = sb_bread(sb, inode_info->i_bno);
+
+        if (!bh_old) return -EIO;
+
+        bh_new = sb_bread(sb, new_bno);
+
+        if (!bh_new) {
+            brelse(bh_old);
+            return -EIO;
+        }
+
+        memcpy(bh_new->b_data, bh_old->b_data, BASICBTFS_BLOCKSIZE);
+        put_blocks(sbi, inode_info->i_bno, 1);
+        mark_buffer_dirty(bh_new);
+        brelse(bh_old);
+        brelse(bh_new);
+
+        ret = basicbtfs_file_update_root(inode, new_bno);
+
+        if (ret < 0) return ret;
+    } else if (*offset != inode_info->i_bno) {
+        tmp_bno = get_offset(sbi, sbi->s_bfree_bitmap, sbi->s_nblocks, sbi->s_unused_area, 1);
+
+        if (tmp_bno == 0 || tmp_bno > sbi->s_nblocks) {
+            printk("basicbtfs_defrag_inline_dir: tmp_bno: %d\n", tmp_bno);
+            return -1;
+        }
+
+        bh_swap = sb_bread(sb, tmp_bno);
+
+        if (!bh_swap) return -EIO;
+
+        bh_old = sb_bread(sb, inode_info->i_bno);
+
+        if (!bh_old) {
+            brelse(bh_swap);
+            return -EIO;
+        }
+
+        bh_new = sb_bread(sb, *offset);
+
+        if (!bh_new) {
+            brelse(bh_swap);
+            brelse(bh_old);
+            return -EIO;
+        }
+
+        disk_block = (struct basicbtfs_disk_block *) bh_old->b_data;
+        disk_block_new = (struct basicbtfs_disk_block *) bh_new->b_data;
+        disk_block_swap = (struct basicbtfs_disk_block *) bh_swap->b_data;
+
+        memcpy(disk_block_swap, disk_block_new, BASICBTFS_BLOCKSIZE);
+        memcpy(disk_block_new, disk_block, BASICBTFS_BLOCKSIZE);
+
+        switch (disk_block_swap->block_type_id) {
+            case BASICBTFS_BLOCKTYPE_BTREE_NODE:
+                ret = basicbtfs_defrag_move_btree_node(sb, bh_swap, *offset, tmp_bno);
+                break;
+            case BASICBTFS_BLOCKTYPE_CLUSTER_TABLE:
+                ret = basicbtfs_defrag_move_cluster_table(sb, bh_swap, tmp_bno);
+                break;
+            case BASICBTFS_BLOCKTYPE_NAMETREE:
+                ret = basicbtfs_defrag_move_namelist(sb, bh_swap, tmp_bno);
+                break;
+            case BASICBTFS_BLOCKTYPE_INLINE_DIR:
+                ret = basicbtfs_defrag_move_inline_dir(sb, bh_swap, tmp_bno);
+                break;
+            default:
+                ret = basicbtfs_defrag_move_file_block(sb, bh_swap, *offset, tmp_bno);
+                break;
+        }
+
+        if (ret < 0) {
+            brelse(bh_swap);
+            brelse(bh_old);
+            brelse(bh_new);
+            return ret;
+        }
+
+        put_blocks(sbi, inode_info->i_bno, 1);
+        mark_buffer_dirty(bh_swap);
+        mark_buffer_dirty(bh_new);
+        brelse(bh_swap);
+        brelse(bh_old);
+        brelse(bh_new);
+
+        ret = basicbtfs_file_update_root(inode, *offset);
+
+        if (ret < 0) return ret;
+    }
+
+    *offset += 1;
+
+    /* copy the inodes out, the children are moved around while defragging them */
+    bh_new = sb_bread(sb, inode_info->i_bno);
+
+    if (!bh_new) return -EIO;
+
+    disk_block = (struct basicbtfs_disk_block *) bh_new->b_data;
+    nr_of_files = disk_block->block_type.inline_dir.nr_of_files;
+
+    if (nr_of_files == 0) {
+        brelse(bh_new);
+        return 0;
+    }
+
+    inos = kmalloc_array(nr_of_files, sizeof(uint32_t), GFP_KERNEL);
+
+    if (!inos) {
+        brelse(bh_new);
+        return -ENOMEM;
+    }
+
+    for (index = 0; index < nr_of_files; index++) {
+        entry = (struct basicbtfs_inline_dir_entry *) (disk_block->block_type.inline_dir.data + pos);
+        pos += BASICBTFS_INLINE_DIR_REC_LEN(entry->name_length);
+        inos[index] = entry->ino;
+    }
+
+    brelse(bh_new);
+
+    for (index = 0; index < nr_of_files; index++) {
+        child = basicbtfs_iget(sb, inos[index]);
+
+        if (IS_ERR(child)) {
+            ret = PTR_ERR(child);
+            break;
+        }
+
+        if (S_ISDIR(child->i_mode)) {
+            ret = basicbtfs_defrag_directory(sb, child, offset);
+        } else if (S_ISREG(child->i_mode)) {
+            ret = basicbtfs_defrag_file_table_block(sb, child, offset);
+        }
+
+        iput(child);
+
+        if (ret < 0) break;
+    }
+
+    kfree(inos);
+    return ret;
+}
+
 static inline int basicbtfs_defrag_directory(struct super_block *sb, struct inode *inode, uint32_t *offset) {
     /**
      * 1. Defrag nametree
@@ -1091,24 +1411,39 @@ static inline int basicbtfs_defrag_directory(struct super_block *sb, struct inod
 
     int ret = 0;
     struct basicbtfs_inode_info *inode_info = BASICBTFS_INODE(inode);
-    printk("defrag directory before: %d | %d\n", *offset, BASICBTFS_INODE(inode)->i_bno);
+    struct buffer_head *bh = NULL;
+    bool inline_dir = false;
+
+    bh = sb_bread(sb, inode_info->i_bno);
+
+    if (!bh) return -EIO;
+
+    inline_dir = ((struct basicbtfs_disk_block *) bh->b_data)->block_type_id == BASICBTFS_BLOCKTYPE_INLINE_DIR;
+    brelse(bh);
+
+    if (inline_dir) {
+        return basicbtfs_defrag_inline_dir(sb, inode, offset);
+    }
+
+    /* Pack the btree first, so only the packed nodes have to be moved into place */
+    ret = basicbtfs_btree_rebuild(sb, inode, BASICBTFS_BTREE_FILL_FACTOR);
+    if (ret < 0) {
+        return ret;
+    }
+
     basicbtfs_btree_traverse_debug(sb, BASICBTFS_INODE(inode)->i_bno);
     ret = basicbtfs_defrag_btree(sb, inode, inode_info->i_bno, offset);
     if (ret < 0) {
         return ret;
     }
 
-    printk("defrag directory intermediate: %d | %d\n", *offset, BASICBTFS_INODE(inode)->i_bno);
-    printk("defragmented btree with offset: %d\n", *offset);
     basicbtfs_btree_traverse_debug(sb, inode_info->i_bno);
     ret = basicbtfs_defrag_nametree(sb, inode, offset);
 
     if (ret < 0) return ret;
-    // printk("defragmented nametree with offset: %d\n", *offset);
     ret = basicbtfs_defrag_traverse_directory(sb, inode_info->i_bno, offset);
 
     if (ret < 0) return ret;
-    printk("defrag directory after: %d\n", *offset);
     return 0;
 
 }
@@ -1122,12 +1457,412 @@ static inline int basicbtfs_defrag_disk(struct super_block *sb, struct inode *in
     uint32_t offset = 1 + sbi->s_imap_blocks + sbi->s_bmap_blocks + sbi->s_inode_blocks + sbi->s_filemap_blocks;
     uint32_t unused_area_before = sbi->s_unused_area;
     int ret = 0;
-    printk("unused area: %d | %d\n", sbi->s_unused_area, offset);
+
+    /* blocks are moved without handles, nothing else may run in a transaction meanwhile */
+    down_write(&sbi->s_defrag_lock);
+    ret = basicbtfs_journal_lock(sb);
+    if (ret < 0) {
+        up_write(&sbi->s_defrag_lock);
+        return ret;
+    }
+
+    sbi->s_defrag_runs++;
     ret = basicbtfs_defrag_directory(sb, inode, &offset);
+    if (ret == 0) sbi->s_unused_area = offset;
+    basicbtfs_cache_refresh(sb);
+    basicbtfs_journal_unlock(sb);
+    up_write(&sbi->s_defrag_lock);
+    trace_basicbtfs_defrag_disk(sb, 0, ret, unused_area_before, sbi->s_unused_area);
     if (ret < 0) return ret;
-    sbi->s_unused_area = offset;
-    printk("unused area before and after: %d | %d\n", unused_area_before, sbi->s_unused_area);
     return 0;
 }
 
+/*
+ * Background defragmentation, see defrag.c. basicbtfs_defrag_disk packs everything towards
+ * the front of the disk and swaps out whatever is in the way. The helpers below move a single
+ * directory or file instead, into the first free run that holds all of its blocks, so every
+ * other object stays where it is and a slice only touches the blocks of one inode.
+ */
+static inline uint32_t basicbtfs_defrag_data_start(struct basicbtfs_sb_info *sbi) {
+    return 1 + sbi->s_imap_blocks + sbi->s_bmap_blocks + sbi->s_inode_blocks + sbi->s_filemap_blocks;
+}
+
+/* Free blocks in the allocated part of the disk, as a percentage of it. A packed disk scores 0 */
+static inline uint32_t basicbtfs_defrag_score(struct basicbtfs_sb_info *sbi) {
+    uint32_t start = basicbtfs_defrag_data_start(sbi);
+    uint64_t area = 0, used = 0;
+
+    if (sbi->s_unused_area <= start) return 0;
+
+    area = sbi->s_unused_area - start;
+    used = bitmap_weight(sbi->s_bfree_bitmap, sbi->s_unused_area) - bitmap_weight(sbi->s_bfree_bitmap, start);
+    return (uint32_t) div64_u64((area - used) * 100, area);
+}
+
+/* Adds the btree nodes below bno in preorder, parents have to move before their children */
+static inline int basicbtfs_defrag_collect_btree(struct super_block *sb, uint32_t bno, int depth, uint32_t *bnos, uint32_t *nr_of_bnos) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct buffer_head *bh = NULL;
+    struct basicbtfs_btree_node *node = NULL;
+    int index = 0, ret = 0;
+
+    if (depth > BASICBTFS_BTREE_MAX_HEIGHT || bno == 0 || bno >= sbi->s_nblocks) return -EIO;
+
+    bh = sb_bread(sb, bno);
+
+    if (!bh) return -EIO;
+
+    if (bnos) bnos[*nr_of_bnos] = bno;
+
+    (*nr_of_bnos)++;
+    node = &((struct basicbtfs_disk_block *) bh->b_data)->block_type.btree_node;
+
+    if (!node->leaf) {
+        for (index = 0; index <= node->nr_of_keys && ret == 0; index++) {
+            ret = basicbtfs_defrag_collect_btree(sb, node->children[index], depth + 1, bnos, nr_of_bnos);
+        }
+    }
+
+    brelse(bh);
+    return ret;
+}
+
+/* Counts the blocks of the btree directory with root root_bno, or lists them when bnos is set */
+static inline int basicbtfs_defrag_collect_dir(struct super_block *sb, uint32_t root_bno, uint32_t *bnos, uint32_t *nr_of_bnos) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct buffer_head *bh = NULL;
+    uint32_t name_bno = 0;
+    int ret = 0;
+
+    bh = sb_bread(sb, root_bno);
+
+    if (!bh) return -EIO;
+
+    name_bno = ((struct basicbtfs_disk_block *) bh->b_data)->block_type.btree_node.tree_name_bno;
+    brelse(bh);
+
+    ret = basicbtfs_defrag_collect_btree(sb, root_bno, 0, bnos, nr_of_bnos);
+
+    while (ret == 0 && name_bno != 0) {
+        if (name_bno >= sbi->s_nblocks) return -EIO;
+
+        bh = sb_bread(sb, name_bno);
+
+        if (!bh) return -EIO;
+
+        if (bnos) bnos[*nr_of_bnos] = name_bno;
+
+        (*nr_of_bnos)++;
+        name_bno = ((struct basicbtfs_disk_block *) bh->b_data)->block_type.name_list_hdr.next_block;
+        brelse(bh);
+    }
+
+    return ret;
+}
+
+/* Counts the cluster table and data blocks of a file, or lists them when bnos is set */
+static inline int basicbtfs_defrag_collect_file(struct super_block *sb, uint32_t table_bno, uint32_t *bnos, uint32_t *nr_of_bnos) {
+    struct basicbtfs_cluster_table *cluster_list = NULL;
+    struct buffer_head *bh = NULL;
+    uint32_t cluster_index = 0, block_index = 0;
+
+    bh = sb_bread(sb, table_bno);
+
+    if (!bh) return -EIO;
+
+    cluster_list = &((struct basicbtfs_disk_block *) bh->b_data)->block_type.cluster_table;
+
+    if (bnos) bnos[*nr_of_bnos] = table_bno;
+
+    (*nr_of_bnos)++;
+
+    for (cluster_index = 0; cluster_index < BASICBTFS_ATABLE_MAX_CLUSTERS; cluster_index++) {
+        if (cluster_list->table[cluster_index].start_bno == 0) break;
+
+        for (block_index = 0; block_index < cluster_list->table[cluster_index].cluster_length; block_index++) {
+            if (bnos) bnos[*nr_of_bnos] = cluster_list->table[cluster_index].start_bno + block_index;
+
+            (*nr_of_bnos)++;
+        }
+    }
+
+    brelse(bh);
+    return 0;
+}
+
+/* Counts the runs of neighbouring blocks in bnos, in the order they are read */
+static inline uint32_t basicbtfs_defrag_runs(uint32_t *bnos, uint32_t nr_of_bnos) {
+    uint32_t runs = nr_of_bnos > 0, i = 0;
+
+    for (i = 1; i < nr_of_bnos; i++) {
+        if (bnos[i] != bnos[i - 1] + 1) runs++;
+    }
+
+    return runs;
+}
+
+/* Lists the blocks of a directory or file into a new array, freed with kvfree */
+static inline int basicbtfs_defrag_list(struct super_block *sb, uint32_t bno, bool dir, uint32_t **bnos, uint32_t *nr_of_bnos) {
+    int ret = 0;
+
+    *nr_of_bnos = 0;
+    ret = dir ? basicbtfs_defrag_collect_dir(sb, bno, NULL, nr_of_bnos) : basicbtfs_defrag_collect_file(sb, bno, NULL, nr_of_bnos);
+
+    if (ret < 0) return ret;
+
+    *bnos = kvmalloc_array(*nr_of_bnos, sizeof(uint32_t), GFP_KERNEL);
+
+    if (!*bnos) return -ENOMEM;
+
+    *nr_of_bnos = 0;
+    ret = dir ? basicbtfs_defrag_collect_dir(sb, bno, *bnos, nr_of_bnos) : basicbtfs_defrag_collect_file(sb, bno, *bnos, nr_of_bnos);
+
+    if (ret < 0) {
+        kvfree(*bnos);
+        *bnos = NULL;
+    }
+
+    return ret;
+}
+
+/*
+ * Finds where the nr_of_bnos blocks of an object should go, target stays 0 if they should
+ * stay. An object that is already in one piece only moves to a free run in front of it, one
+ * that is not and has no free run large enough gets -ENOSPC.
+ */
+static inline int basicbtfs_defrag_find_target(struct basicbtfs_sb_info *sbi, uint32_t *bnos, uint32_t nr_of_bnos, uint32_t *target) {
+    uint32_t start = 0, i = 0;
+    bool contiguous = true;
+
+    for (i = 1; i < nr_of_bnos && contiguous; i++) {
+        contiguous = bnos[i] == bnos[0] + i;
+    }
+
+    *target = 0;
+    start = bitmap_find_next_zero_area(sbi->s_bfree_bitmap, sbi->s_nblocks, basicbtfs_defrag_data_start(sbi), nr_of_bnos, 0);
+
+    if (start + nr_of_bnos > sbi->s_nblocks) return contiguous ? 0 : -ENOSPC;
+
+    if (contiguous && start > bnos[0]) return 0;
+
+    *target = start;
+    return 0;
+}
+
+/* Copies block old_bno to new_bno through the buffer cache, the copy is dirty and up to date */
+static inline struct buffer_head *basicbtfs_defrag_copy_block(struct super_block *sb, uint32_t old_bno, uint32_t new_bno) {
+    struct buffer_head *bh_old = NULL, *bh_new = NULL;
+    u64 start = BASICBTFS_TRACE_START(basicbtfs_defrag_move);
+
+    bh_old = sb_bread(sb, old_bno);
+
+    if (!bh_old) return NULL;
+
+    bh_new = sb_getblk(sb, new_bno);
+
+    if (!bh_new) {
+        brelse(bh_old);
+        return NULL;
+    }
+
+    lock_buffer(bh_new);
+    memcpy(bh_new->b_data, bh_old->b_data, BASICBTFS_BLOCKSIZE);
+    set_buffer_uptodate(bh_new);
+    unlock_buffer(bh_new);
+    mark_buffer_dirty(bh_new);
+    brelse(bh_old);
+    basicbtfs_stat_inc(BASICBTFS_SB(sb), BASICBTFS_STAT_DEFRAG_MOVES);
+    basicbtfs_stat_inc(BASICBTFS_SB(sb), BASICBTFS_STAT_DEFRAG_MOVED_BLOCKS);
+    trace_basicbtfs_defrag_move(sb, old_bno, new_bno, 1, 0, start);
+    return bh_new;
+}
+
+/* Drops the old copy of a moved block, a dirty buffer would otherwise be written over whatever reuses it */
+static inline void basicbtfs_defrag_forget_block(struct super_block *sb, uint32_t bno) {
+    struct buffer_head *bh = sb_find_get_block(sb, bno);
+
+    if (bh) bforget(bh);
+}
+
+/* Repoints the btree entries of the names in the name list block at name_bno */
+static inline int basicbtfs_defrag_repoint_names(struct super_block *sb, struct inode *dir, struct buffer_head *bh, uint32_t name_bno) {
+    struct basicbtfs_name_list_hdr *name_list_hdr = &((struct basicbtfs_disk_block *) bh->b_data)->block_type.name_list_hdr;
+    struct basicbtfs_name_entry *cur_entry = NULL;
+    char *block = (char *) bh->b_data;
+    uint32_t pos = BASICBTFS_NAME_ENTRY_S_OFFSET;
+    int ret = 0;
+
+    while (pos < name_list_hdr->start_unused_area) {
+        cur_entry = (struct basicbtfs_name_entry *) (block + pos);
+
+        if (cur_entry->ino != 0) {
+            ret = basicbtfs_nametree_update_namelist_info(sb, BASICBTFS_INODE(dir)->i_bno, get_hash_from_block((char *) (cur_entry + 1), cur_entry->name_length - 1), name_bno, pos);
+
+            if (ret < 0) return ret;
+        }
+
+        pos += sizeof(struct basicbtfs_name_entry) + cur_entry->name_length;
+    }
+
+    return 0;
+}
+
+/*
+ * Moves the btree nodes and name list blocks of a btree directory to target, in the order
+ * basicbtfs_defrag_collect_dir listed them. Inline directories are a single block and are
+ * left alone. Returns the number of blocks moved.
+ */
+static inline int basicbtfs_defrag_relocate_dir(struct super_block *sb, struct inode *dir) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct buffer_head *bh = NULL;
+    uint32_t *bnos = NULL, nr_of_bnos = 0, target = 0, i = 0;
+    uint8_t block_type_id = 0;
+    int ret = 0;
+
+    bh = sb_bread(sb, BASICBTFS_INODE(dir)->i_bno);
+
+    if (!bh) return -EIO;
+
+    block_type_id = ((struct basicbtfs_disk_block *) bh->b_data)->block_type_id;
+    brelse(bh);
+
+    if (block_type_id != BASICBTFS_BLOCKTYPE_BTREE_NODE) return 0;
+
+    ret = basicbtfs_defrag_collect_dir(sb, BASICBTFS_INODE(dir)->i_bno, NULL, &nr_of_bnos);
+
+    if (ret < 0) return ret;
+
+    bnos = kvmalloc_array(nr_of_bnos, sizeof(uint32_t), GFP_KERNEL);
+
+    if (!bnos) return -ENOMEM;
+
+    nr_of_bnos = 0;
+    ret = basicbtfs_defrag_collect_dir(sb, BASICBTFS_INODE(dir)->i_bno, bnos, &nr_of_bnos);
+
+    if (ret == 0) ret = basicbtfs_defrag_find_target(sbi, bnos, nr_of_bnos, &target);
+
+    if (ret < 0 || target == 0) goto out;
+
+    get_offset(sbi, sbi->s_bfree_bitmap, sbi->s_nblocks, target, nr_of_bnos);
+    sbi->s_nfree_blocks -= nr_of_bnos;
+
+    for (i = 0; i < nr_of_bnos; i++) {
+        if (bnos[i] == target + i) continue;
+
+        bh = basicbtfs_defrag_copy_block(sb, bnos[i], target + i);
+
+        if (!bh) {
+            ret = -EIO;
+            break;
+        }
+
+        if (((struct basicbtfs_disk_block *) bh->b_data)->block_type_id == BASICBTFS_BLOCKTYPE_BTREE_NODE) {
+            ret = basicbtfs_defrag_move_btree_node(sb, bh, bnos[i], target + i);
+        } else {
+            ret = basicbtfs_defrag_move_namelist(sb, bh, target + i);
+
+            if (ret == 0) ret = basicbtfs_defrag_repoint_names(sb, dir, bh, target + i);
+        }
+
+        brelse(bh);
+
+        if (ret < 0) break;
+
+        basicbtfs_cache_unpin_block(sb, bnos[i]);
+        basicbtfs_defrag_forget_block(sb, bnos[i]);
+        put_blocks(sbi, bnos[i], 1);
+    }
+
+    /* blocks that were not reached are still free, the ones that were are in use either way */
+    if (i < nr_of_bnos) {
+        put_blocks(sbi, target + i, nr_of_bnos - i);
+    }
+
+    if (ret == 0) ret = nr_of_bnos;
+out:
+    kvfree(bnos);
+    return ret;
+}
+
+/*
+ * Moves the cluster table and clusters of a regular file to target, data first. The file
+ * only points at the copies once all of them were made, a failed copy frees the target
+ * again and leaves the file as it was. Returns the number of blocks moved.
+ */
+static inline int basicbtfs_defrag_relocate_file(struct super_block *sb, struct inode *inode) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct basicbtfs_cluster_table *cluster_list = NULL;
+    struct buffer_head *bh = NULL;
+    uint32_t *bnos = NULL, nr_of_bnos = 0, target = 0, i = 0, len = 0, bno = 0;
+    uint32_t cluster_index = 0;
+    int ret = 0;
+
+    ret = basicbtfs_defrag_collect_file(sb, BASICBTFS_INODE(inode)->i_bno, NULL, &nr_of_bnos);
+
+    if (ret < 0) return ret;
+
+    bnos = kvmalloc_array(nr_of_bnos, sizeof(uint32_t), GFP_KERNEL);
+
+    if (!bnos) return -ENOMEM;
+
+    nr_of_bnos = 0;
+    ret = basicbtfs_defrag_collect_file(sb, BASICBTFS_INODE(inode)->i_bno, bnos, &nr_of_bnos);
+
+    if (ret == 0) ret = basicbtfs_defrag_find_target(sbi, bnos, nr_of_bnos, &target);
+
+    if (ret < 0 || target == 0) goto out;
+
+    get_offset(sbi, sbi->s_bfree_bitmap, sbi->s_nblocks, target, nr_of_bnos);
+    sbi->s_nfree_blocks -= nr_of_bnos;
+
+    /* the data blocks go over in runs of neighbouring blocks, mostly whole clusters */
+    for (i = 1; i < nr_of_bnos && ret == 0; i += len) {
+        for (len = 1; i + len < nr_of_bnos && bnos[i + len] == bnos[i] + len; len++);
+
+        ret = basicbtfs_defrag_copy_extent(sb, bnos[i], target + i, len);
+    }
+
+    if (ret < 0) {
+        put_blocks(sbi, target, nr_of_bnos);
+        goto out;
+    }
+
+    bh = basicbtfs_defrag_copy_block(sb, bnos[0], target);
+
+    if (!bh) {
+        put_blocks(sbi, target, nr_of_bnos);
+        ret = -EIO;
+        goto out;
+    }
+
+    cluster_list = &((struct basicbtfs_disk_block *) bh->b_data)->block_type.cluster_table;
+    bno = target + 1;
+
+    for (cluster_index = 0; cluster_index < BASICBTFS_ATABLE_MAX_CLUSTERS; cluster_index++) {
+        if (cluster_list->table[cluster_index].start_bno == 0) break;
+
+        basicbtfs_update_file_info_range(sb, cluster_list->table[cluster_index].start_bno, cluster_list->table[cluster_index].cluster_length, 0, 0);
+        basicbtfs_update_file_info_range(sb, bno, cluster_list->table[cluster_index].cluster_length, inode->i_ino, cluster_index);
+        cluster_list->table[cluster_index].start_bno = bno;
+        bno += cluster_list->table[cluster_index].cluster_length;
+    }
+
+    mark_buffer_dirty(bh);
+    brelse(bh);
+
+    ret = basicbtfs_file_update_root(inode, target);
+
+    if (ret < 0) goto out;
+
+    for (i = 0; i < nr_of_bnos; i++) {
+        basicbtfs_defrag_forget_block(sb, bnos[i]);
+        put_blocks(sbi, bnos[i], 1);
+    }
+
+    ret = nr_of_bnos;
+out:
+    kvfree(bnos);
+    return ret;
+}
+
 #endif 
\ No newline at end of file
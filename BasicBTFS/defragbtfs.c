@@ -0,0 +1,872 @@
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <glob.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "basicbtfs.h"
+
+/*
+ * Offline defragmenter for an unmounted image, the counterpart of the planned pass in
+ * defrag.c. The image is mapped as a whole. The namespace is walked from the root: every
+ * directory gets its btree nodes and name list blocks in one run, every file its cluster
+ * table and clusters in the run after it, in the order the walk meets them. Blocks that are
+ * in use but not reached by the walk, such as the journal, stay where they are and the runs
+ * go around them.
+ *
+ * Seen as a map from source to destination the moves form chains, which end in a free block,
+ * and cycles. Every chain and cycle is independent of the others, they are handed out to the
+ * copy threads, which move each chain starting at its free end and each cycle once its first
+ * block was copied aside. The references in btree nodes, name lists, cluster tables, inodes,
+ * the file map and the block bitmap are rewritten afterwards.
+ */
+struct superblock {
+    struct basicbtfs_sb_info info;
+    char padding[BASICBTFS_BLOCKSIZE - sizeof(struct basicbtfs_sb_info)]; /* Padding to match block size */
+};
+
+/* The first fields of a jbd2 journal superblock, which are big endian */
+struct jbd2_superblock {
+    uint32_t h_magic;
+    uint32_t h_blocktype;
+    uint32_t h_sequence;
+    uint32_t s_blocksize;
+    uint32_t s_maxlen;
+    uint32_t s_first;
+    uint32_t s_sequence;
+    uint32_t s_start;
+};
+
+#define JBD2_MAGIC_NUMBER 0xc03b3998
+
+/* as in inline.h */
+#define INLINE_DIR_REC_LEN(name_length) ((sizeof(struct basicbtfs_inline_dir_entry) + (name_length) + 3) & ~3UL)
+
+struct image {
+    int fd;
+    uint8_t *map;
+    size_t size;
+    struct superblock *sb;
+    uint32_t nr_blocks;
+    uint32_t nr_inodes;
+    uint8_t *imap;
+    uint8_t *bmap;
+    uint32_t inode_start;
+    struct basicbtfs_fileblock_info *filemap;
+    uint32_t data_start;
+    bool linked_leaves;
+};
+
+struct plan {
+    uint32_t *src; /* blocks in plan order */
+    uint32_t *len; /* blocks of the object that starts at an index, 0 inside an object */
+    uint32_t nr_of_bnos;
+    uint32_t max_bnos;
+    uint32_t *inos; /* directories and files in plan order */
+    uint32_t nr_of_inos;
+    uint32_t max_inos;
+    uint32_t *remap; /* destination of every block, a block that stays maps to itself */
+    uint32_t *from; /* block that moves into a destination, 0 if none does */
+    uint8_t *planned; /* blocks on the plan */
+    uint8_t *visited; /* inodes on the plan, a file with several links is planned once */
+    uint32_t end; /* first block after the packed objects */
+};
+
+/* A chain starts at its free end, a cycle anywhere on it */
+struct work_item {
+    uint32_t bno;
+    bool cycle;
+};
+
+struct copy_ctx {
+    struct image *img;
+    struct plan *plan;
+    struct work_item *items;
+    uint32_t nr_of_items;
+    uint32_t next_item;
+    pthread_mutex_t lock;
+    uint64_t nr_of_copies;
+};
+
+static inline bool test_bit8(uint8_t *map, uint32_t bit) {
+    return map[bit / 8] & (1 << (bit % 8));
+}
+
+static inline void set_bit8(uint8_t *map, uint32_t bit) {
+    map[bit / 8] |= 1 << (bit % 8);
+}
+
+static inline void clear_bit8(uint8_t *map, uint32_t bit) {
+    map[bit / 8] &= ~(1 << (bit % 8));
+}
+
+static inline void *get_block(struct image *img, uint32_t bno) {
+    return img->map + (size_t) bno * BASICBTFS_BLOCKSIZE;
+}
+
+/* Inodes do not cross block boundaries, the tail of every inode block is unused */
+static inline struct basicbtfs_inode *get_inode(struct image *img, uint32_t ino) {
+    return (struct basicbtfs_inode *) get_block(img, img->inode_start + ino / BASICBTFS_INODES_PER_BLOCK) + ino % BASICBTFS_INODES_PER_BLOCK;
+}
+
+static inline bool valid_bno(struct image *img, uint32_t bno) {
+    return bno >= img->data_start && bno < img->nr_blocks;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* A loop device backed by the image means it may be mounted */
+static bool image_in_use(const char *path) {
+    char real_path[PATH_MAX], backing_file[PATH_MAX];
+    glob_t loops;
+    size_t i = 0, len = 0;
+    bool in_use = false;
+    FILE *file = NULL;
+
+    if (!realpath(path, real_path)) return false;
+
+    if (glob("/sys/block/loop*/loop/backing_file", 0, NULL, &loops) != 0) return false;
+
+    for (i = 0; i < loops.gl_pathc && !in_use; i++) {
+        file = fopen(loops.gl_pathv[i], "r");
+
+        if (!file) continue;
+
+        if (fgets(backing_file, PATH_MAX, file)) {
+            len = strlen(backing_file);
+
+            if (len > 0 && backing_file[len - 1] == '\n') backing_file[len - 1] = '\0';
+
+            in_use = strcmp(backing_file, real_path) == 0;
+        }
+
+        fclose(file);
+    }
+
+    globfree(&loops);
+    return in_use;
+}
+
+static int open_image(struct image *img, const char *path) {
+    struct stat stat_buf;
+    struct jbd2_superblock *jsb = NULL;
+    uint64_t blk_size = 0;
+
+    img->fd = open(path, O_RDWR | O_EXCL);
+    if (img->fd == -1) {
+        perror("could not open disk");
+        return -1;
+    }
+
+    if (fstat(img->fd, &stat_buf)) {
+        perror("fstat()");
+        return -1;
+    }
+
+    img->size = stat_buf.st_size;
+
+    if ((stat_buf.st_mode & S_IFMT) == S_IFBLK) {
+        if (ioctl(img->fd, BLKGETSIZE64, &blk_size) != 0) {
+            perror("get block size failed");
+            return -1;
+        }
+        img->size = blk_size;
+    } else if (image_in_use(path)) {
+        fprintf(stderr, "%s is attached to a loop device, unmount and detach it first\n", path);
+        return -1;
+    }
+
+    img->map = mmap(NULL, img->size, PROT_READ | PROT_WRITE, MAP_SHARED, img->fd, 0);
+    if (img->map == MAP_FAILED) {
+        perror("mmap()");
+        return -1;
+    }
+
+    img->sb = (struct superblock *) img->map;
+
+    if (le32toh(img->sb->info.s_magic) != BASICBTFS_MAGIC_NUMBER) {
+        fprintf(stderr, "wrong magic number: %x\n", le32toh(img->sb->info.s_magic));
+        return -1;
+    }
+
+    img->nr_blocks = le32toh(img->sb->info.s_nblocks);
+    img->nr_inodes = le32toh(img->sb->info.s_ninodes);
+
+    if ((size_t) img->nr_blocks * BASICBTFS_BLOCKSIZE > img->size) {
+        fprintf(stderr, "the superblock describes %u blocks, the image is smaller\n", img->nr_blocks);
+        return -1;
+    }
+
+    img->imap = get_block(img, 1);
+    img->bmap = get_block(img, 1 + le32toh(img->sb->info.s_imap_blocks));
+    img->inode_start = 1 + le32toh(img->sb->info.s_imap_blocks) + le32toh(img->sb->info.s_bmap_blocks);
+    img->filemap = get_block(img, 1 + le32toh(img->sb->info.s_imap_blocks) + le32toh(img->sb->info.s_bmap_blocks) + le32toh(img->sb->info.s_inode_blocks));
+    img->data_start = 1 + le32toh(img->sb->info.s_imap_blocks) + le32toh(img->sb->info.s_bmap_blocks) + le32toh(img->sb->info.s_inode_blocks) + le32toh(img->sb->info.s_filemap_blocks);
+    img->linked_leaves = le32toh(img->sb->info.s_features) & BASICBTFS_FEATURE_BPTREE;
+
+    /* the moves bypass the journal, whatever it still holds would be replayed over them */
+    if (le32toh(img->sb->info.s_features) & BASICBTFS_FEATURE_JOURNAL) {
+        jsb = get_block(img, le32toh(img->sb->info.s_journal_bno));
+
+        if (be32toh(jsb->h_magic) != JBD2_MAGIC_NUMBER) {
+            fprintf(stderr, "no journal at block %u\n", le32toh(img->sb->info.s_journal_bno));
+            return -1;
+        }
+
+        if (jsb->s_start != 0) {
+            fprintf(stderr, "the journal has to be recovered, mount and unmount the image first\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void close_image(struct image *img) {
+    if (img->map && img->map != MAP_FAILED) munmap(img->map, img->size);
+
+    if (img->fd != -1) close(img->fd);
+}
+
+/* Adds the btree nodes below bno in preorder, as basicbtfs_defrag_collect_btree does */
+static int collect_btree(struct image *img, struct plan *plan, uint32_t bno, int depth) {
+    struct basicbtfs_btree_node *node = NULL;
+    uint32_t index = 0;
+    int ret = 0;
+
+    if (depth > BASICBTFS_BTREE_MAX_HEIGHT || !valid_bno(img, bno) || plan->nr_of_bnos >= plan->max_bnos) return -1;
+
+    plan->src[plan->nr_of_bnos++] = bno;
+    node = &((struct basicbtfs_disk_block *) get_block(img, bno))->block_type.btree_node;
+
+    if (!node->leaf) {
+        for (index = 0; index <= le32toh(node->nr_of_keys) && ret == 0; index++) {
+            ret = collect_btree(img, plan, le32toh(node->children[index]), depth + 1);
+        }
+    }
+
+    return ret;
+}
+
+/* Adds the btree nodes and then the name list of a directory */
+static int collect_dir(struct image *img, struct plan *plan, uint32_t root_bno) {
+    struct basicbtfs_disk_block *disk_block = get_block(img, root_bno);
+    uint32_t name_bno = le32toh(disk_block->block_type.btree_node.tree_name_bno);
+    int ret = collect_btree(img, plan, root_bno, 0);
+
+    while (ret == 0 && name_bno != 0) {
+        if (!valid_bno(img, name_bno) || plan->nr_of_bnos >= plan->max_bnos) return -1;
+
+        plan->src[plan->nr_of_bnos++] = name_bno;
+        disk_block = get_block(img, name_bno);
+        name_bno = le32toh(disk_block->block_type.name_list_hdr.next_block);
+    }
+
+    return ret;
+}
+
+/* Adds the cluster table and then the clusters of a file */
+static int collect_file(struct image *img, struct plan *plan, uint32_t table_bno) {
+    struct basicbtfs_cluster_table *cluster_table = &((struct basicbtfs_disk_block *) get_block(img, table_bno))->block_type.cluster_table;
+    uint32_t cluster_index = 0, block_index = 0, start_bno = 0, len = 0;
+
+    plan->src[plan->nr_of_bnos++] = table_bno;
+
+    for (cluster_index = 0; cluster_index < BASICBTFS_ATABLE_MAX_CLUSTERS; cluster_index++) {
+        start_bno = le32toh(cluster_table->table[cluster_index].start_bno);
+        len = le32toh(cluster_table->table[cluster_index].cluster_length);
+
+        if (start_bno == 0) break;
+
+        if (len > plan->max_bnos - plan->nr_of_bnos) return -1;
+
+        for (block_index = 0; block_index < len; block_index++) {
+            plan->src[plan->nr_of_bnos++] = start_bno + block_index;
+        }
+    }
+
+    return 0;
+}
+
+/* Adds the directory or file whose first block is bno as one object */
+static int plan_object(struct image *img, struct plan *plan, uint32_t bno, uint32_t block_type_id) {
+    uint32_t first = plan->nr_of_bnos, i = 0;
+    int ret = 0;
+
+    if (!valid_bno(img, bno) || plan->nr_of_bnos >= plan->max_bnos) return -1;
+
+    if (block_type_id == BASICBTFS_BLOCKTYPE_BTREE_NODE) {
+        ret = collect_dir(img, plan, bno);
+    } else if (block_type_id == BASICBTFS_BLOCKTYPE_CLUSTER_TABLE) {
+        ret = collect_file(img, plan, bno);
+    } else {
+        plan->src[plan->nr_of_bnos++] = bno;
+    }
+
+    if (ret < 0) {
+        fprintf(stderr, "the blocks of the object at %u are damaged\n", bno);
+        return -1;
+    }
+
+    for (i = first; i < plan->nr_of_bnos; i++) {
+        if (!valid_bno(img, plan->src[i]) || !test_bit8(img->bmap, plan->src[i]) || test_bit8(plan->planned, plan->src[i])) {
+            fprintf(stderr, "block %u is outside the disk, free or used twice\n", plan->src[i]);
+            return -1;
+        }
+
+        set_bit8(plan->planned, plan->src[i]);
+        plan->len[i] = 0;
+    }
+
+    plan->len[first] = plan->nr_of_bnos - first;
+    return 0;
+}
+
+static int plan_inode(struct image *img, struct plan *plan, uint32_t ino);
+
+/* Plans the children of the btree directory below node bno, in key order */
+static int plan_children(struct image *img, struct plan *plan, uint32_t bno, int depth) {
+    struct basicbtfs_btree_node *node = NULL;
+    uint32_t index = 0;
+    int ret = 0;
+
+    if (depth > BASICBTFS_BTREE_MAX_HEIGHT || !valid_bno(img, bno)) return -1;
+
+    node = &((struct basicbtfs_disk_block *) get_block(img, bno))->block_type.btree_node;
+
+    for (index = 0; index < le32toh(node->nr_of_keys) && ret == 0; index++) {
+        if (!node->leaf) {
+            ret = plan_children(img, plan, le32toh(node->children[index]), depth + 1);
+
+            if (ret < 0) break;
+        }
+
+        /* B+-tree separators are copies of leaf entries */
+        if (!node->leaf && img->linked_leaves) continue;
+
+        ret = plan_inode(img, plan, le32toh(node->entries[index].ino));
+    }
+
+    if (ret == 0 && !node->leaf) {
+        ret = plan_children(img, plan, le32toh(node->children[index]), depth + 1);
+    }
+
+    return ret;
+}
+
+static int plan_inline_children(struct image *img, struct plan *plan, uint32_t bno) {
+    struct basicbtfs_inline_dir *inline_dir = &((struct basicbtfs_disk_block *) get_block(img, bno))->block_type.inline_dir;
+    struct basicbtfs_inline_dir_entry *entry = NULL;
+    uint32_t nr_of_files = le32toh(inline_dir->nr_of_files), pos = 0, index = 0;
+    int ret = 0;
+
+    if (nr_of_files > BASICBTFS_INLINE_DIR_MAX_FILES) nr_of_files = BASICBTFS_INLINE_DIR_MAX_FILES;
+
+    for (index = 0; index < nr_of_files && ret == 0; index++) {
+        if (pos + sizeof(struct basicbtfs_inline_dir_entry) > BASICBTFS_INLINE_DIR_DATA_SIZE) return -1;
+
+        entry = (struct basicbtfs_inline_dir_entry *) (inline_dir->data + pos);
+        pos += INLINE_DIR_REC_LEN(le16toh(entry->name_length));
+        ret = plan_inode(img, plan, le32toh(entry->ino));
+    }
+
+    return ret;
+}
+
+/* Plans a directory or file and, for a directory, everything below it */
+static int plan_inode(struct image *img, struct plan *plan, uint32_t ino) {
+    struct basicbtfs_inode *inode = NULL;
+    uint32_t mode = 0, bno = 0, block_type_id = 0;
+    int ret = 0;
+
+    if (ino >= img->nr_inodes || test_bit8(plan->visited, ino)) return 0;
+
+    set_bit8(plan->visited, ino);
+    inode = get_inode(img, ino);
+    mode = le32toh(inode->i_mode);
+    bno = le32toh(inode->i_bno);
+
+    if (!S_ISDIR(mode) && !S_ISREG(mode)) return 0;
+
+    if (plan->nr_of_inos >= plan->max_inos || !valid_bno(img, bno)) {
+        fprintf(stderr, "inode %u is damaged\n", ino);
+        return -1;
+    }
+
+    plan->inos[plan->nr_of_inos++] = ino;
+
+    if (S_ISREG(mode)) return plan_object(img, plan, bno, BASICBTFS_BLOCKTYPE_CLUSTER_TABLE);
+
+    block_type_id = le32toh(((struct basicbtfs_disk_block *) get_block(img, bno))->block_type_id);
+
+    if (block_type_id == BASICBTFS_BLOCKTYPE_INLINE_DIR) {
+        ret = plan_object(img, plan, bno, block_type_id);
+
+        if (ret == 0) ret = plan_inline_children(img, plan, bno);
+
+        return ret;
+    }
+
+    ret = plan_object(img, plan, bno, BASICBTFS_BLOCKTYPE_BTREE_NODE);
+
+    if (ret == 0) ret = plan_children(img, plan, bno, 0);
+
+    return ret;
+}
+
+/* Gives every object the next run that holds it, going around blocks that are not on the plan */
+static int plan_assign(struct image *img, struct plan *plan) {
+    uint32_t cursor = img->data_start, start = 0, len = 0, i = 0, k = 0, free_len = 0;
+
+    while (i < plan->nr_of_bnos) {
+        len = plan->len[i];
+        start = cursor;
+        free_len = 0;
+
+        while (free_len < len) {
+            if (start + free_len >= img->nr_blocks) {
+                fprintf(stderr, "no room for %u blocks\n", len);
+                return -1;
+            }
+
+            /* in use and not on the plan, the run starts over behind it */
+            if (test_bit8(img->bmap, start + free_len) && !test_bit8(plan->planned, start + free_len)) {
+                start += free_len + 1;
+                free_len = 0;
+            } else {
+                free_len++;
+            }
+        }
+
+        for (k = 0; k < len; k++) {
+            plan->remap[plan->src[i + k]] = start + k;
+        }
+
+        i += len;
+        cursor = start + len;
+    }
+
+    plan->end = cursor;
+
+    for (i = 0; i < plan->nr_of_bnos; i++) {
+        if (plan->remap[plan->src[i]] != plan->src[i]) plan->from[plan->remap[plan->src[i]]] = plan->src[i];
+    }
+
+    return 0;
+}
+
+/* Lines up the chains and cycles of the moves as independent pieces of work */
+static struct work_item *plan_work(struct image *img, struct plan *plan, uint32_t *nr_of_items, uint32_t *nr_of_cycles) {
+    struct work_item *items = calloc(plan->nr_of_bnos + 1, sizeof(struct work_item));
+    uint8_t *seen = calloc(img->nr_blocks / 8 + 1, 1);
+    uint32_t i = 0, src = 0, dst = 0, bno = 0;
+
+    *nr_of_items = 0;
+    *nr_of_cycles = 0;
+
+    if (!items || !seen) {
+        free(items);
+        free(seen);
+        return NULL;
+    }
+
+    /* a destination that is not moved away itself was free, a chain ends there */
+    for (i = 0; i < plan->nr_of_bnos; i++) {
+        src = plan->src[i];
+        dst = plan->remap[src];
+
+        if (src == dst || plan->remap[dst] != dst) continue;
+
+        items[(*nr_of_items)++] = (struct work_item) { .bno = dst, .cycle = false };
+
+        for (bno = dst; plan->from[bno] != 0; bno = plan->from[bno]) {
+            set_bit8(seen, plan->from[bno]);
+        }
+    }
+
+    /* every move that is not on a chain is on a cycle */
+    for (i = 0; i < plan->nr_of_bnos; i++) {
+        src = plan->src[i];
+
+        if (src == plan->remap[src] || test_bit8(seen, src)) continue;
+
+        items[(*nr_of_items)++] = (struct work_item) { .bno = src, .cycle = true };
+        (*nr_of_cycles)++;
+
+        for (bno = src; !test_bit8(seen, bno); bno = plan->from[bno]) {
+            set_bit8(seen, bno);
+        }
+    }
+
+    free(seen);
+    return items;
+}
+
+static void *copy_thread(void *data) {
+    struct copy_ctx *ctx = data;
+    struct plan *plan = ctx->plan;
+    char saved[BASICBTFS_BLOCKSIZE];
+    struct work_item *item = NULL;
+    uint64_t nr_of_copies = 0;
+    uint32_t bno = 0;
+
+    while (true) {
+        pthread_mutex_lock(&ctx->lock);
+        item = ctx->next_item < ctx->nr_of_items ? &ctx->items[ctx->next_item++] : NULL;
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (!item) break;
+
+        bno = item->bno;
+
+        if (item->cycle) memcpy(saved, get_block(ctx->img, bno), BASICBTFS_BLOCKSIZE);
+
+        /* every block is filled from the one that moves into it, then that one is next */
+        while (plan->from[bno] != 0 && !(item->cycle && plan->from[bno] == item->bno)) {
+            memcpy(get_block(ctx->img, bno), get_block(ctx->img, plan->from[bno]), BASICBTFS_BLOCKSIZE);
+            bno = plan->from[bno];
+            nr_of_copies++;
+        }
+
+        if (item->cycle) {
+            memcpy(get_block(ctx->img, bno), saved, BASICBTFS_BLOCKSIZE);
+            nr_of_copies++;
+        }
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->nr_of_copies += nr_of_copies;
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+static int plan_execute(struct image *img, struct plan *plan, uint32_t nr_of_threads, uint64_t *nr_of_copies) {
+    struct copy_ctx ctx = { .img = img, .plan = plan };
+    pthread_t *threads = calloc(nr_of_threads, sizeof(pthread_t));
+    uint32_t nr_of_cycles = 0, nr_of_started = 0, i = 0;
+
+    ctx.items = plan_work(img, plan, &ctx.nr_of_items, &nr_of_cycles);
+
+    if (!threads || !ctx.items) {
+        free(threads);
+        free(ctx.items);
+        return -1;
+    }
+
+    pthread_mutex_init(&ctx.lock, NULL);
+
+    for (i = 0; i < nr_of_threads; i++) {
+        if (pthread_create(&threads[i], NULL, copy_thread, &ctx) != 0) break;
+
+        nr_of_started++;
+    }
+
+    /* without any thread the work is done here */
+    if (nr_of_started == 0) copy_thread(&ctx);
+
+    for (i = 0; i < nr_of_started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("%u chains and %u cycles on %u threads\n", ctx.nr_of_items - nr_of_cycles, nr_of_cycles, nr_of_started);
+    *nr_of_copies = ctx.nr_of_copies;
+    pthread_mutex_destroy(&ctx.lock);
+    free(ctx.items);
+    free(threads);
+    return 0;
+}
+
+static inline void remap(struct image *img, struct plan *plan, uint32_t *bno) {
+    uint32_t old_bno = le32toh(*bno);
+
+    if (old_bno != 0 && old_bno < img->nr_blocks) *bno = htole32(plan->remap[old_bno]);
+}
+
+static int fix_tree(struct image *img, struct plan *plan, uint32_t bno, int depth) {
+    struct basicbtfs_btree_node *node = NULL;
+    uint32_t index = 0;
+    int ret = 0;
+
+    if (depth > BASICBTFS_BTREE_MAX_HEIGHT || !valid_bno(img, bno)) return -1;
+
+    node = &((struct basicbtfs_disk_block *) get_block(img, bno))->block_type.btree_node;
+
+    for (index = 0; index < le32toh(node->nr_of_keys); index++) {
+        remap(img, plan, &node->entries[index].name_bno);
+    }
+
+    if (!node->leaf) {
+        for (index = 0; index <= le32toh(node->nr_of_keys); index++) {
+            remap(img, plan, &node->children[index]);
+        }
+    }
+
+    /* the parent of a root is the inode of the directory */
+    if (node->root) {
+        remap(img, plan, &node->tree_name_bno);
+    } else {
+        remap(img, plan, &node->parent);
+    }
+
+    if (node->leaf && img->linked_leaves) {
+        remap(img, plan, &node->next_leaf);
+        remap(img, plan, &node->prev_leaf);
+    }
+
+    if (!node->leaf) {
+        for (index = 0; index <= le32toh(node->nr_of_keys) && ret == 0; index++) {
+            ret = fix_tree(img, plan, le32toh(node->children[index]), depth + 1);
+        }
+    }
+
+    return ret;
+}
+
+static int fix_names(struct image *img, struct plan *plan, uint32_t name_bno) {
+    struct basicbtfs_name_list_hdr *name_list_hdr = NULL;
+
+    while (name_bno != 0) {
+        if (!valid_bno(img, name_bno)) return -1;
+
+        name_list_hdr = &((struct basicbtfs_disk_block *) get_block(img, name_bno))->block_type.name_list_hdr;
+        remap(img, plan, &name_list_hdr->next_block);
+
+        /* the first block points back at the inode of the directory */
+        if (name_list_hdr->first_list) {
+            remap(img, plan, &name_list_hdr->free_hint);
+        } else {
+            remap(img, plan, &name_list_hdr->prev_block);
+        }
+
+        name_bno = le32toh(name_list_hdr->next_block);
+    }
+
+    return 0;
+}
+
+/* Points the cluster table at the moved clusters and fills in their file map entries */
+static int fix_file(struct image *img, struct plan *plan, uint32_t ino, uint32_t table_bno) {
+    struct basicbtfs_cluster_table *cluster_table = &((struct basicbtfs_disk_block *) get_block(img, table_bno))->block_type.cluster_table;
+    uint32_t cluster_index = 0, block_index = 0, start_bno = 0, len = 0;
+
+    for (cluster_index = 0; cluster_index < BASICBTFS_ATABLE_MAX_CLUSTERS; cluster_index++) {
+        start_bno = le32toh(cluster_table->table[cluster_index].start_bno);
+        len = le32toh(cluster_table->table[cluster_index].cluster_length);
+
+        if (start_bno == 0) break;
+
+        if (plan->remap[start_bno] == start_bno) continue;
+
+        for (block_index = 0; block_index < len; block_index++) {
+            if (plan->remap[start_bno + block_index] != plan->remap[start_bno] + block_index) {
+                fprintf(stderr, "cluster %u of inode %u was split\n", cluster_index, ino);
+                return -1;
+            }
+
+            img->filemap[plan->remap[start_bno] + block_index].ino = htole32(ino);
+            img->filemap[plan->remap[start_bno] + block_index].cluster_index = htole32(cluster_index);
+        }
+
+        cluster_table->table[cluster_index].start_bno = htole32(plan->remap[start_bno]);
+    }
+
+    return 0;
+}
+
+/* Rewrites the references of one directory or file and of the inode to its first block */
+static int fix_inode(struct image *img, struct plan *plan, uint32_t ino) {
+    struct basicbtfs_inode *inode = get_inode(img, ino);
+    struct basicbtfs_disk_block *disk_block = NULL;
+    uint32_t bno = plan->remap[le32toh(inode->i_bno)];
+    int ret = 0;
+
+    inode->i_bno = htole32(bno);
+
+    if (S_ISREG(le32toh(inode->i_mode))) return fix_file(img, plan, ino, bno);
+
+    disk_block = get_block(img, bno);
+
+    if (le32toh(disk_block->block_type_id) != BASICBTFS_BLOCKTYPE_BTREE_NODE) return 0;
+
+    ret = fix_tree(img, plan, bno, 0);
+
+    if (ret == 0) ret = fix_names(img, plan, le32toh(disk_block->block_type.btree_node.tree_name_bno));
+
+    return ret;
+}
+
+/* Moves the blocks off their old places in the bitmap and the file map, then fixes the references */
+static int plan_settle(struct image *img, struct plan *plan) {
+    uint32_t i = 0, src = 0;
+    int ret = 0;
+
+    for (i = 0; i < plan->nr_of_bnos; i++) {
+        src = plan->src[i];
+
+        if (src == plan->remap[src]) continue;
+
+        img->filemap[src].ino = 0;
+        img->filemap[src].cluster_index = 0;
+        clear_bit8(img->bmap, src);
+    }
+
+    for (i = 0; i < plan->nr_of_bnos; i++) {
+        set_bit8(img->bmap, plan->remap[plan->src[i]]);
+    }
+
+    for (i = 0; i < plan->nr_of_inos && ret == 0; i++) {
+        ret = fix_inode(img, plan, plan->inos[i]);
+    }
+
+    img->sb->info.s_unused_area = htole32(plan->end);
+    return ret;
+}
+
+static int plan_build(struct image *img, struct plan *plan) {
+    uint32_t i = 0;
+
+    for (i = img->data_start; i < img->nr_blocks; i++) {
+        if (test_bit8(img->bmap, i)) plan->max_bnos++;
+    }
+
+    for (i = 0; i < img->nr_inodes; i++) {
+        if (test_bit8(img->imap, i)) plan->max_inos++;
+    }
+
+    plan->src = calloc(plan->max_bnos + 1, sizeof(uint32_t));
+    plan->len = calloc(plan->max_bnos + 1, sizeof(uint32_t));
+    plan->inos = calloc(plan->max_inos + 1, sizeof(uint32_t));
+    plan->remap = calloc(img->nr_blocks, sizeof(uint32_t));
+    plan->from = calloc(img->nr_blocks, sizeof(uint32_t));
+    plan->planned = calloc(img->nr_blocks / 8 + 1, 1);
+    plan->visited = calloc(img->nr_inodes / 8 + 1, 1);
+
+    if (!plan->src || !plan->len || !plan->inos || !plan->remap || !plan->from || !plan->planned || !plan->visited) {
+        fprintf(stderr, "not enough memory for the plan\n");
+        return -1;
+    }
+
+    for (i = 0; i < img->nr_blocks; i++) {
+        plan->remap[i] = i;
+    }
+
+    if (plan_inode(img, plan, 0) < 0) return -1;
+
+    return plan_assign(img, plan);
+}
+
+static void plan_free(struct plan *plan) {
+    free(plan->src);
+    free(plan->len);
+    free(plan->inos);
+    free(plan->remap);
+    free(plan->from);
+    free(plan->planned);
+    free(plan->visited);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-t threads] [-n] image\n", prog);
+    fprintf(stderr, "  -t threads  threads that copy blocks (default: one per cpu)\n");
+    fprintf(stderr, "  -n          only plan, print what would move\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct image img = { .fd = -1 };
+    struct plan plan = { 0 };
+    uint32_t nr_of_threads = sysconf(_SC_NPROCESSORS_ONLN), old_unused_area = 0, nr_of_moves = 0, i = 0;
+    uint64_t nr_of_copies = 0, plan_ns = 0, copy_ns = 0, fix_ns = 0, start_ns = 0;
+    bool dry_run = false;
+    int opt, ret = 0;
+
+    while ((opt = getopt(argc, argv, "t:n")) != -1) {
+        switch (opt) {
+        case 't':
+            nr_of_threads = atoi(optarg);
+            break;
+        case 'n':
+            dry_run = true;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind != 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    ret = open_image(&img, argv[optind]);
+    if (ret < 0) {
+        close_image(&img);
+        return EXIT_FAILURE;
+    }
+
+    old_unused_area = le32toh(img.sb->info.s_unused_area);
+    start_ns = now_ns();
+    ret = plan_build(&img, &plan);
+    plan_ns = now_ns() - start_ns;
+
+    if (ret < 0) {
+        fprintf(stderr, "the image could not be planned, nothing was moved\n");
+        goto out;
+    }
+
+    for (i = 0; i < plan.nr_of_bnos; i++) {
+        if (plan.remap[plan.src[i]] != plan.src[i]) nr_of_moves++;
+    }
+
+    printf("%u blocks of %u inodes planned, %u out of place, packed up to block %u\n", plan.nr_of_bnos, plan.nr_of_inos, nr_of_moves, plan.end);
+
+    if (dry_run) goto out;
+
+    start_ns = now_ns();
+    ret = plan_execute(&img, &plan, nr_of_threads, &nr_of_copies);
+    copy_ns = now_ns() - start_ns;
+
+    if (ret < 0) {
+        fprintf(stderr, "not enough memory to move the blocks, nothing was moved\n");
+        goto out;
+    }
+
+    start_ns = now_ns();
+    ret = plan_settle(&img, &plan);
+
+    if (ret == 0) ret = msync(img.map, img.size, MS_SYNC);
+
+    if (ret == 0) ret = fsync(img.fd);
+
+    fix_ns = now_ns() - start_ns;
+
+    if (ret < 0) {
+        fprintf(stderr, "rewriting the references failed, the image is damaged\n");
+        goto out;
+    }
+
+    printf("%llu blocks moved, unused area %u -> %u\n", (unsigned long long) nr_of_copies, old_unused_area, plan.end);
+    printf("plan %.3f s, copy %.3f s, references and sync %.3f s\n", plan_ns / 1e9, copy_ns / 1e9, fix_ns / 1e9);
+out:
+    plan_free(&plan);
+    close_image(&img);
+    return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
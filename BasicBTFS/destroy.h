@@ -8,10 +8,11 @@
 
 #include "basicbtfs.h"
 #include "bitmap.h"
+#include "journal.h"
 
 static inline void reset_block(char *block, struct buffer_head *bh) {
     memset(block, 0, BASICBTFS_BLOCKSIZE);
-    mark_buffer_dirty(bh);
+    basicbtfs_mark_dirty(bh);
     brelse(bh);
 }
 
@@ -20,7 +21,7 @@ static inline int clean_block(struct super_block *sb, struct inode *inode) {
     char *block = NULL;
     int ret = 0;
 
-    bh = sb_bread(sb, BASICBTFS_INODE(inode)->i_bno);
+    bh = basicbtfs_bread(sb, BASICBTFS_INODE(inode)->i_bno);
 
     if (!bh) return -EIO;
 
@@ -31,7 +32,7 @@ static inline int clean_block(struct super_block *sb, struct inode *inode) {
 
 static inline void clean_allocated_block(struct basicbtfs_alloc_table *alloc_table_block, struct super_block *sb, int bi, int is_allocated) {
     if (is_allocated && alloc_table_block->table[bi] != 0) {
-        put_blocks(BASICBTFS_SB(sb), alloc_table_block->table[bi], alloc_table_block->table[bi]);
+        put_data_blocks(BASICBTFS_SB(sb), alloc_table_block->table[bi], alloc_table_block->table[bi]);
         alloc_table_block->table[bi] = 0;
     }
 }
@@ -3,34 +3,157 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/kmod.h>
+#include <linux/iversion.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
 
 #include "basicbtfs.h"
 #include "destroy.h"
 #include "io.h"
 #include "init.h"
 #include "btree.h"
-#include "btreecache.h"
+#include "bptree.h"
 #include "nametree.h"
+#include "inline.h"
+#include "bloom.h"
 #include "cache.h"
 #include "defrag.h"
+#include "stats.h"
 
-static int basicbtfs_iterate(struct file *dir, struct dir_context *ctx) {
+static struct basicbtfs_dir_cursor *basicbtfs_get_dir_cursor(struct file *dir) {
+    if (!dir->private_data) {
+        dir->private_data = kzalloc(sizeof(struct basicbtfs_dir_cursor), GFP_KERNEL);
+    }
+
+    return dir->private_data;
+}
+
+/*
+ * A readdir is usually followed by a stat of every entry, and each basicbtfs_iget reads the
+ * inode table block of its inode on its own. The actor below sits between the emitters and
+ * the caller's dir_context and notes the emitted inode numbers, so the blocks holding them
+ * can be read ahead in one sorted batch.
+ */
+struct basicbtfs_readahead_ctx {
+    struct dir_context ctx;
+    struct dir_context *caller;
+    struct super_block *sb;
+    struct basicbtfs_dir_cursor *cursor;
+};
+
+static int basicbtfs_cmp_ino(const void *a, const void *b) {
+    uint32_t ino_a = *(const uint32_t *) a, ino_b = *(const uint32_t *) b;
+
+    if (ino_a < ino_b) return -1;
+
+    return ino_a > ino_b;
+}
+
+static void basicbtfs_readahead_inodes(struct super_block *sb, struct basicbtfs_dir_cursor *cursor) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    uint32_t i = 0, bno = 0, prev_bno = 0;
+
+    sort(cursor->inos, cursor->nr_of_inos, sizeof(uint32_t), basicbtfs_cmp_ino, NULL);
+
+    for (i = 0; i < cursor->nr_of_inos; i++) {
+        bno = BASICBTFS_GET_INODE_BLOCK(cursor->inos[i], sbi->s_imap_blocks, sbi->s_bmap_blocks);
+
+        if (bno != prev_bno) {
+            sb_breadahead(sb, bno);
+            prev_bno = bno;
+        }
+    }
+
+    cursor->nr_of_inos = 0;
+}
+
+static int basicbtfs_readahead_actor(struct dir_context *ctx, const char *name, int namelen, loff_t offset, u64 ino, unsigned int d_type) {
+    struct basicbtfs_readahead_ctx *ra_ctx = container_of(ctx, struct basicbtfs_readahead_ctx, ctx);
+    struct basicbtfs_dir_cursor *cursor = ra_ctx->cursor;
+    int ret = 0;
+
+    ret = ra_ctx->caller->actor(ra_ctx->caller, name, namelen, offset, ino, d_type);
+
+    if (ret == 0) {
+        cursor->inos[cursor->nr_of_inos++] = ino;
+
+        if (cursor->nr_of_inos == BASICBTFS_READAHEAD_INODES) {
+            basicbtfs_readahead_inodes(ra_ctx->sb, cursor);
+        }
+    }
+
+    return ret;
+}
+
+static int basicbtfs_iterate_entries(struct file *dir, struct dir_context *ctx, struct basicbtfs_dir_cursor *cursor) {
     struct inode *inode = file_inode(dir);
     struct basicbtfs_inode_info *inode_info = BASICBTFS_INODE(inode);
     struct super_block *sb = inode->i_sb;
-    uint32_t name_bno = 0, nr_of_files = 0;
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    uint32_t name_bno = 0;
     struct buffer_head *bh = NULL;
     struct basicbtfs_disk_block *disk_block = NULL;
     struct basicbtfs_btree_node *node = NULL;
+    u64 version = 0;
+    bool resume = false;
+    int ret = 0;
+
+    bh = basicbtfs_bread(sb, inode_info->i_bno);
+
+    if (!bh) return -EIO;
 
-    nr_of_inode_operations = increase_counter(nr_of_inode_operations, BASICBTFS_DEFRAG_PERIOD);
+    disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+
+    if (disk_block->block_type_id == BASICBTFS_BLOCKTYPE_INLINE_DIR) {
+        ret = basicbtfs_inline_dir_iterate(sb, &disk_block->block_type.inline_dir, ctx, cursor);
+        brelse(bh);
+        return ret;
+    }
+
+    if (BASICBTFS_HAS_BPTREE(sb)) {
+        brelse(bh);
+        return basicbtfs_bptree_iterate(sb, inode_info->i_bno, ctx, cursor);
+    }
+
+    node = &disk_block->block_type.btree_node;
+    name_bno = node->tree_name_bno;
+    brelse(bh);
+
+    /* the cursor is only good as long as no name block has been changed or moved since */
+    version = inode_peek_iversion(inode);
+    resume = cursor->pos == ctx->pos && cursor->version == version && cursor->defrag_runs == sbi->s_defrag_runs;
+
+    if (resume && cursor->name_bno == 0) {
+        return 0;
+    }
+
+    ret = basicbtfs_nametree_iterate_name(sb, name_bno, ctx, cursor, resume);
+
+    cursor->pos = ctx->pos;
+    cursor->version = version;
+    cursor->defrag_runs = sbi->s_defrag_runs;
+    return ret;
+}
+
+static int basicbtfs_iterate(struct file *dir, struct dir_context *ctx) {
+    struct inode *inode = file_inode(dir);
+    struct super_block *sb = inode->i_sb;
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct basicbtfs_dir_cursor *cursor = NULL;
+    struct basicbtfs_readahead_ctx ra_ctx = {
+        .ctx.actor = basicbtfs_readahead_actor,
+        .caller = ctx,
+        .sb = sb,
+    };
+    u64 start = ktime_get_ns();
+    int ret = 0;
 
     if (!S_ISDIR(inode->i_mode)) {
         printk(KERN_ERR "This file is not a directory\n");
         return -ENOTDIR;
     }
 
-    if (ctx->pos > BASICBTFS_ENTRIES_PER_DIR + 2) {
+    if (!BASICBTFS_HAS_BPTREE(sb) && ctx->pos > BASICBTFS_ENTRIES_PER_DIR + 2) {
         printk(KERN_ERR "ctx position is bigger than the amount of subfiles we can handle in a directory\n");
         return 0;
     }
@@ -39,44 +162,101 @@ static int basicbtfs_iterate(struct file *dir, struct dir_context *ctx) {
         return 0;
     }
 
-    bh = sb_bread(sb, inode_info->i_bno);
+    cursor = basicbtfs_get_dir_cursor(dir);
 
-    if (!bh) return -EIO;
+    if (!cursor) return -ENOMEM;
 
-    disk_block = (struct basicbtfs_disk_block *) bh->b_data;
-    node = &disk_block->block_type.btree_node;
-    name_bno = node->tree_name_bno;
-    nr_of_files = node->nr_of_files;
-    brelse(bh);
+    ra_ctx.ctx.pos = ctx->pos;
+    ra_ctx.cursor = cursor;
+    down_read(&sbi->s_defrag_lock);
+    ret = basicbtfs_iterate_entries(dir, &ra_ctx.ctx, cursor);
+    up_read(&sbi->s_defrag_lock);
+    ctx->pos = ra_ctx.ctx.pos;
 
-    if (basicbtfs_cache_iterate_dir(sb, inode_info->i_bno, ctx, ctx->pos - 2)) {
-        if (ctx->pos - 2 >= nr_of_files) {
-            return 0;
-        }
+    basicbtfs_readahead_inodes(sb, cursor);
+    basicbtfs_stat_latency(sbi, BASICBTFS_LAT_ITERATE, start);
+    return ret;
+}
+
+static int basicbtfs_dir_release(struct inode *inode, struct file *file) {
+    kfree(file->private_data);
+    return 0;
+}
+
+static loff_t basicbtfs_dir_llseek(struct file *file, loff_t offset, int whence) {
+    struct inode *inode = file_inode(file);
+    struct basicbtfs_dir_cursor *cursor = file->private_data;
+    loff_t old_pos = file->f_pos, ret = 0;
+
+    if (!BASICBTFS_HAS_BPTREE(inode->i_sb)) {
+        return generic_file_llseek(file, offset, whence);
+    }
+
+    ret = generic_file_llseek_size(file, offset, whence, BASICBTFS_BPTREE_POS_EOF, BASICBTFS_BPTREE_POS_EOF);
+
+    /* the hash kept for a position only holds for the getdents call right after it stopped there */
+    if (cursor && ret >= 0 && ret != old_pos) {
+        cursor->hash = 0;
     }
 
-    return basicbtfs_nametree_iterate_name(sb, name_bno, ctx, ctx->pos - 2);
+    return ret;
 }
 
 struct dentry *basicbtfs_search_entry(struct inode *dir, struct dentry *dentry) {
     struct super_block *sb = dir->i_sb;
     struct basicbtfs_inode_info *inode_info = BASICBTFS_INODE(dir);
     struct inode *inode = NULL;
-    uint32_t ino = 0, hash = 0;
+    struct buffer_head *bh = NULL;
+    struct basicbtfs_disk_block *disk_block = NULL;
+    struct basicbtfs_bloom *bloom = NULL;
+    uint32_t ino = 0, hash = 0, nr_of_files = 0;
+    bool complete = false;
 
     hash = get_hash_from_block((char *)dentry->d_name.name, dentry->d_name.len);
+    basicbtfs_stat_inc(BASICBTFS_SB(sb), BASICBTFS_STAT_LOOKUPS);
 
-    ino = basicbtfs_cache_lookup_entry(sb, inode_info->i_bno, hash);
+    bh = basicbtfs_bread(sb, inode_info->i_bno);
+
+    if (!bh) return ERR_PTR(-EIO);
+
+    disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+
+    if (disk_block->block_type_id == BASICBTFS_BLOCKTYPE_INLINE_DIR) {
+        ino = basicbtfs_inline_dir_lookup(&disk_block->block_type.inline_dir, hash);
+        brelse(bh);
+
+        if (ino != 0) {
+            inode = basicbtfs_iget(sb, ino);
+        }
 
-    if (ino != 0 && ino != -1) {
-        inode = basicbtfs_iget(sb, ino);
         goto end;
     }
 
-    ino = basicbtfs_btree_node_lookup(sb, inode_info->i_bno, hash, 0);
+    nr_of_files = disk_block->block_type.btree_node.nr_of_files;
+    brelse(bh);
+
+    /* a fully cached directory answers from its pinned blocks, the filter would only cost memory */
+    complete = basicbtfs_cache_dir_complete(sb, inode_info->i_bno);
+
+    if (!complete) {
+        bloom = basicbtfs_bloom_get(dir, inode_info->i_bno, nr_of_files);
+
+        if (bloom && !basicbtfs_bloom_may_contain(bloom, hash)) {
+            basicbtfs_stat_inc(BASICBTFS_SB(sb), BASICBTFS_STAT_BLOOM_NEGATIVES);
+            goto end;
+        }
+    }
+
+    if (BASICBTFS_HAS_BPTREE(sb)) {
+        ino = basicbtfs_bptree_lookup(sb, inode_info->i_bno, hash, NULL);
+    } else {
+        ino = basicbtfs_btree_node_lookup(sb, inode_info->i_bno, hash, 0);
+    }
 
     if (ino != 0 && ino != -1) {
         inode = basicbtfs_iget(sb, ino);
+    } else if (complete) {
+        basicbtfs_stat_inc(BASICBTFS_SB(sb), BASICBTFS_STAT_CACHE_NEGATIVES);
     }
 
     end:
@@ -85,27 +265,56 @@ struct dentry *basicbtfs_search_entry(struct inode *dir, struct dentry *dentry)
     return NULL;
 }
 
-int basicbtfs_add_entry(struct inode *dir, struct inode *inode, struct dentry *dentry) {
+static int basicbtfs_do_add_entry(struct inode *dir, struct inode *inode, struct dentry *dentry) {
     struct basicbtfs_inode_info *inode_info = BASICBTFS_INODE(dir);
     int ret = 0;
     struct basicbtfs_entry new_entry;
-    uint32_t name_bno = 0, hash = 0, nr_of_blocks = 0;
+    uint32_t name_bno = 0, hash = 0;
     struct buffer_head *bh = NULL;
     struct basicbtfs_btree_node *node = NULL;
     struct basicbtfs_disk_block *disk_block = NULL;
-    struct basicbtfs_btree_node_cache *node_cache = NULL;
+    struct basicbtfs_bloom *bloom = NULL;
+
+    hash = get_hash_from_block((char *)dentry->d_name.name, dentry->d_name.len);
+    inode_inc_iversion(dir);
 
-    bh = sb_bread(dir->i_sb, inode_info->i_bno);
+    bh = basicbtfs_bread(dir->i_sb, inode_info->i_bno);
     if (!bh) return -EIO;
 
     disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+
+    if (disk_block->block_type_id == BASICBTFS_BLOCKTYPE_INLINE_DIR) {
+        ret = basicbtfs_inline_dir_add(&disk_block->block_type.inline_dir, inode->i_ino, hash, &dentry->d_name, BASICBTFS_DT_TYPE(inode->i_mode));
+
+        if (ret == 0) {
+            basicbtfs_mark_dirty(bh);
+        } else if (ret == -ENOSPC) {
+            ret = basicbtfs_inline_dir_convert(dir->i_sb, dir, bh);
+        } else if (ret == -EEXIST) {
+            printk(KERN_INFO "Filename %s already exists\n", dentry->d_name.name);
+            ret = -EIO;
+        }
+
+        /* anything but a conversion is done with the inline block */
+        if (ret != 0 || disk_block->block_type_id == BASICBTFS_BLOCKTYPE_INLINE_DIR) {
+            brelse(bh);
+            return ret;
+        }
+    }
+
     node = &disk_block->block_type.btree_node;
     name_bno = node->tree_name_bno;
     brelse(bh);
 
-    hash = get_hash_from_block((char *)dentry->d_name.name, dentry->d_name.len);
+    bloom = BASICBTFS_INODE(dir)->i_bloom;
 
-    ret = basicbtfs_btree_node_lookup(dir->i_sb, inode_info->i_bno, hash, 0);
+    if (bloom && !basicbtfs_bloom_may_contain(bloom, hash)) {
+        ret = 0;
+    } else if (BASICBTFS_HAS_BPTREE(dir->i_sb)) {
+        ret = basicbtfs_bptree_lookup(dir->i_sb, inode_info->i_bno, hash, NULL);
+    } else {
+        ret = basicbtfs_btree_node_lookup(dir->i_sb, inode_info->i_bno, hash, 0);
+    }
 
     if (ret != -1 && ret > 0) {
         printk(KERN_INFO "Filename %s already exists\n", dentry->d_name.name);
@@ -115,19 +324,21 @@ int basicbtfs_add_entry(struct inode *dir, struct inode *inode, struct dentry *d
     new_entry.ino = inode->i_ino;
     new_entry.hash = hash;
 
-    nr_of_blocks = basicbtfs_cache_get_nr_of_blocks(inode_info->i_bno);
-
+    ret = basicbtfs_nametree_insert_name(dir->i_sb, name_bno, &new_entry, &dentry->d_name, BASICBTFS_DT_TYPE(inode->i_mode), inode_info->i_bno);
+    basicbtfs_bloom_add_entry(dir, hash);
 
-    ret = basicbtfs_nametree_insert_name(dir->i_sb, name_bno, &new_entry, dentry, inode_info->i_bno, nr_of_blocks);
+    if (BASICBTFS_HAS_BPTREE(dir->i_sb)) {
+        return basicbtfs_bptree_insert(dir->i_sb, dir, inode_info->i_bno, &new_entry);
+    }
 
-    ret = basicbtfs_btree_node_insert(dir->i_sb, dir, inode_info->i_bno, &new_entry);
+    return basicbtfs_btree_node_insert(dir->i_sb, dir, inode_info->i_bno, &new_entry);
+}
 
-    if (nr_of_blocks < BASICBTFS_MAX_CACHE_BLOCKS_PER_DIR) {
-        node_cache = basicbtfs_cache_get_root_node(inode_info->i_bno);
-        if (!node_cache) return ret;
-        ret = basicbtfs_btree_node_cache_insert(dir->i_sb, dir, node_cache, &new_entry, inode_info->i_bno);
-    }
+int basicbtfs_add_entry(struct inode *dir, struct inode *inode, struct dentry *dentry) {
+    uint64_t start = ktime_get_ns();
+    int ret = basicbtfs_do_add_entry(dir, inode, dentry);
 
+    basicbtfs_stat_latency(BASICBTFS_SB(dir->i_sb), BASICBTFS_LAT_INSERT, start);
     return ret;
 }
 
@@ -138,45 +349,102 @@ int basicbtfs_delete_entry(struct inode *dir, struct dentry *dentry) {
     uint32_t hash = 0;
     struct buffer_head *bh = NULL;
     struct basicbtfs_btree_node *node = NULL;
-    struct basicbtfs_btree_node_cache *node_cache = NULL;
     struct basicbtfs_disk_block *disk_block = NULL;
     struct basicbtfs_entry new_entry;
 
-    bh = sb_bread(dir->i_sb, inode_info->i_bno);
+    hash = get_hash_from_block((char *)dentry->d_name.name, dentry->d_name.len);
+    inode_inc_iversion(dir);
+
+    bh = basicbtfs_bread(dir->i_sb, inode_info->i_bno);
     if (!bh) return -EIO;
 
     disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+
+    if (disk_block->block_type_id == BASICBTFS_BLOCKTYPE_INLINE_DIR) {
+        ret = basicbtfs_inline_dir_delete(&disk_block->block_type.inline_dir, hash);
+
+        if (ret == 0) {
+            basicbtfs_mark_dirty(bh);
+        }
+
+        brelse(bh);
+        return ret;
+    }
+
     node = &disk_block->block_type.btree_node;
     name_bno = node->tree_name_bno;
     brelse(bh);
 
-    hash = get_hash_from_block((char *)dentry->d_name.name, dentry->d_name.len);
+    if (BASICBTFS_HAS_BPTREE(dir->i_sb)) {
+        if (basicbtfs_bptree_lookup(dir->i_sb, inode_info->i_bno, hash, &new_entry) == 0) {
+            return -ENOENT;
+        }
 
-    ino = basicbtfs_btree_node_lookup_with_entry(dir->i_sb, inode_info->i_bno, hash, 0, &new_entry);
+        ret = basicbtfs_bptree_delete(dir->i_sb, dir, inode_info->i_bno, hash);
 
-    node_cache = basicbtfs_cache_get_root_node(inode_info->i_bno);
-    if (node_cache) {
-        ino = basicbtfs_btree_node_cache_lookup(node_cache, hash, 0);
-    }
+        if (ret != 0) return ret;
 
-    ret = basicbtfs_btree_delete_entry(dir->i_sb, dir, inode_info->i_bno, hash);
-    
-    if (node_cache) {
-        ret = basicbtfs_btree_cache_delete_entry(dir->i_sb, dir, node_cache, hash, inode_info->i_bno);
+        return basicbtfs_nametree_delete_name(dir->i_sb, new_entry.name_bno, new_entry.block_index, inode_info->i_bno);
     }
 
+    ino = basicbtfs_btree_node_lookup_with_entry(dir->i_sb, inode_info->i_bno, hash, 0, &new_entry);
+    ret = basicbtfs_btree_delete_entry(dir->i_sb, dir, inode_info->i_bno, hash);
     ret = basicbtfs_nametree_delete_name(dir->i_sb, new_entry.name_bno, new_entry.block_index, inode_info->i_bno);
 
     return ret;
 }
 
+/*
+ * Journal credits of adding or removing one name in dir. Every level of the tree, and a new
+ * root, may split or merge, which rewrites the parent, both halves and the parent of every
+ * moved child. The name list insert rewrites the blocks it walks and the next block's link,
+ * a compaction the node of every moved name. Each new or freed block may sit in its own
+ * bitmap block and dir's inode is written back.
+ */
+int basicbtfs_dir_credits(struct inode *dir) {
+    struct super_block *sb = dir->i_sb;
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct buffer_head *bh = NULL;
+    struct basicbtfs_disk_block *disk_block = NULL;
+    struct basicbtfs_btree_node *node = NULL;
+    uint32_t bno = BASICBTFS_INODE(dir)->i_bno, height = 0;
+    int tree = 0, names = 0, bitmaps = 0;
+
+    while (height < BASICBTFS_BTREE_MAX_HEIGHT) {
+        bh = sb_bread(sb, bno);
+
+        if (!bh) {
+            height = BASICBTFS_BTREE_MAX_HEIGHT;
+            break;
+        }
+
+        disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+        node = &disk_block->block_type.btree_node;
+
+        if (disk_block->block_type_id != BASICBTFS_BLOCKTYPE_BTREE_NODE || node->leaf) {
+            brelse(bh);
+            break;
+        }
+
+        bno = node->children[0];
+        brelse(bh);
+        height++;
+    }
+
+    tree = (height + 1) * (3 + BASICBTFS_MIN_DEGREE) + 1;
+    names = BASICBTFS_NAMELIST_MAX_WALK + 3;
+    names += BASICBTFS_EMPTY_NAME_TREE * BASICBTFS_NAMELIST_COMPACT_PERCENT / 100 / (sizeof(struct basicbtfs_name_entry) + 2);
+    bitmaps = min_t(uint32_t, height + 3, sbi->s_bmap_blocks);
+
+    return tree + names + bitmaps + 1;
+}
+
 int basicbtfs_update_entry(struct inode *old_dir, struct inode *new_dir, struct dentry *old_dentry, struct dentry *new_dentry, unsigned int flags) {
     struct super_block *sb = old_dir->i_sb;
     struct inode *old_inode = d_inode(old_dentry);
     struct inode *new_inode = d_inode(new_dentry);
     struct basicbtfs_inode_info *new_dir_info = BASICBTFS_INODE(new_dir);
     struct buffer_head *bh = NULL;
-    struct basicbtfs_btree_node * node = NULL;
     struct basicbtfs_disk_block *disk_block = NULL;
     uint32_t hash = 0;
     int ret = 0;
@@ -193,20 +461,26 @@ int basicbtfs_update_entry(struct inode *old_dir, struct inode *new_dir, struct
 
     hash = get_hash_from_block((char *)new_dentry->d_name.name, new_dentry->d_name.len);
 
-    ret = basicbtfs_btree_node_lookup(sb, new_dir_info->i_bno, hash, 0);
-
-    if (ret != -1 && ret > 0) {
-        return -EEXIST;
-    }
-
-    bh = sb_bread(sb, new_dir_info->i_bno);
+    bh = basicbtfs_bread(sb, new_dir_info->i_bno);
 
     if (!bh) return -EIO;
 
     disk_block = (struct basicbtfs_disk_block *) bh->b_data;
-    node = &disk_block->block_type.btree_node;
 
-    if (node->nr_of_files >= BASICBTFS_ENTRIES_PER_DIR) {
+    if (disk_block->block_type_id == BASICBTFS_BLOCKTYPE_INLINE_DIR) {
+        ret = basicbtfs_inline_dir_lookup(&disk_block->block_type.inline_dir, hash);
+    } else if (BASICBTFS_HAS_BPTREE(sb)) {
+        ret = basicbtfs_bptree_lookup(sb, new_dir_info->i_bno, hash, NULL);
+    } else {
+        ret = basicbtfs_btree_node_lookup(sb, new_dir_info->i_bno, hash, 0);
+    }
+
+    if (ret != -1 && ret > 0) {
+        brelse(bh);
+        return -EEXIST;
+    }
+
+    if (basicbtfs_dir_nr_of_files(disk_block) >= BASICBTFS_ENTRIES_PER_DIR) {
         brelse(bh);
         return -EMLINK;
     }
@@ -238,13 +512,19 @@ int basicbtfs_btree_free_dir(struct super_block *sb, struct inode *inode, uint32
         return -1;
     }
 
-    bh = sb_bread(sb, bno);
+    bh = basicbtfs_bread(sb, bno);
 
     if (!bh) return -EIO;
 
     disk_block = (struct basicbtfs_disk_block *) bh->b_data;
     node = &disk_block->block_type.btree_node;
 
+    if (disk_block->block_type_id == BASICBTFS_BLOCKTYPE_INLINE_DIR) {
+        put_blocks(sbi, bno, 1);
+        brelse(bh);
+        return 0;
+    }
+
     for (index = 0; index < node->nr_of_keys; index++) {
         if (!node->leaf) {
             ret = basicbtfs_btree_free_dir(sb, inode, node->children[index]);
@@ -273,7 +553,7 @@ int basicbtfs_nametree_free_namelist_blocks(struct super_block *sb, uint32_t nam
     struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
     uint32_t next_bno, cur_bno = name_bno;
     
-    bh = sb_bread(sb, name_bno);
+    bh = basicbtfs_bread(sb, name_bno);
 
     if (!bh) return -EIO;
 
@@ -282,12 +562,13 @@ int basicbtfs_nametree_free_namelist_blocks(struct super_block *sb, uint32_t nam
 
     while (name_list_hdr->next_block != 0) {
         next_bno = name_list_hdr->next_block;
+        basicbtfs_cache_unpin_block(sb, cur_bno);
         put_blocks(sbi, cur_bno, 1);
         brelse(bh);
 
         cur_bno = next_bno;
 
-        bh = sb_bread(sb, next_bno);
+        bh = basicbtfs_bread(sb, next_bno);
 
         if (!bh) return -EIO;
 
@@ -295,6 +576,7 @@ int basicbtfs_nametree_free_namelist_blocks(struct super_block *sb, uint32_t nam
         name_list_hdr = &disk_block->block_type.name_list_hdr;
     }
 
+    basicbtfs_cache_unpin_block(sb, cur_bno);
     put_blocks(sbi, cur_bno, 1);
     brelse(bh);
     return 0;
@@ -309,7 +591,7 @@ int clean_file_block(struct inode *inode) {
 
     struct basicbtfs_alloc_table *file_block = NULL;
 
-    bh = sb_bread(sb, BASICBTFS_INODE(inode)->i_bno);
+    bh = basicbtfs_bread(sb, BASICBTFS_INODE(inode)->i_bno);
     if (!bh) {
         return -EMLINK;
     }
@@ -319,7 +601,7 @@ int clean_file_block(struct inode *inode) {
     while (bi < BASICBTFS_ATABLE_MAX_CLUSTERS && file_block->table[bi] != 0) {
         char *block;
 
-        put_blocks(sbi, file_block->table[bi], 1);
+        put_data_blocks(sbi, file_block->table[bi], 1);
 
         bno = file_block->table[bi];
         bh2 = sb_bread(sb, bno);
@@ -338,8 +620,9 @@ int clean_file_block(struct inode *inode) {
 
 const struct file_operations basicbtfs_dir_ops = {
     .owner = THIS_MODULE,
-    .llseek		= generic_file_llseek,
+    .llseek		= basicbtfs_dir_llseek,
 	.read		= generic_read_dir,
     .iterate_shared = basicbtfs_iterate,
+    .release    = basicbtfs_dir_release,
     .unlocked_ioctl = basicbtfs_ioctl,
 };
\ No newline at end of file
@@ -1,4 +1,5 @@
 
+#include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
@@ -7,7 +8,11 @@
 
 #include "bitmap.h"
 #include "io.h"
+#include "init.h"
 #include "basicbtfs.h"
+#include "journal.h"
+#include "stats.h"
+#include "trace.h"
 
 uint32_t basicbtfs_search_cluster(struct basicbtfs_cluster_table *cluster_table, uint32_t iblock) {
     uint32_t i = 0, len = 0, phy_block = 0, old_total_nr_of_blocks = 0, total_nr_of_blocks = 0;
@@ -38,7 +43,7 @@ int basicbtfs_file_update_root(struct inode *inode, uint32_t bno) {
 
     if (ino >= sbi->s_ninodes) return -1;
 
-    bh = sb_bread(sb, inode_block);
+    bh = basicbtfs_bread(sb, inode_block);
 
     if (!bh) return -EIO;
 
@@ -48,7 +53,7 @@ int basicbtfs_file_update_root(struct inode *inode, uint32_t bno) {
     inode_info->i_bno = bno;
     disk_inode->i_bno = bno;
 
-    mark_buffer_dirty(bh);
+    basicbtfs_mark_dirty(bh);
     brelse(bh);
     return 0;
 }
@@ -91,7 +96,7 @@ int basicbtfs_file_free_blocks(struct inode *inode) {
             basicbtfs_update_file_info(sb, disk_block_offset, 0, 0);
 
             brelse(bh_block);
-            put_blocks(sbi, disk_block_offset, 1);       
+            put_data_blocks(sbi, disk_block_offset, 1);
         }
     }
     brelse(bh);
@@ -99,15 +104,138 @@ int basicbtfs_file_free_blocks(struct inode *inode) {
     return 0;
 }
 
-static int basicbtfs_file_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create) {
+/*
+ * Without a journal the block bitmap is only written by sync_fs and the file map blocks hold
+ * the entries of many files. The blocks that hold the bits and entries of a new cluster are
+ * dirtied for the file, so its fsync writes them.
+ */
+static void basicbtfs_file_dirty_shared(struct inode *inode, uint32_t bno, uint32_t len) {
+    struct super_block *sb = inode->i_sb;
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct buffer_head *bh = NULL;
+    uint32_t bi = 0, last = bno + len - 1;
+
+    for (bi = bno / (BASICBTFS_BLOCKSIZE * 8); bi <= last / (BASICBTFS_BLOCKSIZE * 8); bi++) {
+        bh = sb_bread(sb, sbi->s_imap_blocks + 1 + bi);
+
+        if (!bh) return;
+
+        memcpy(bh->b_data, (void *) sbi->s_bfree_bitmap + bi * BASICBTFS_BLOCKSIZE, BASICBTFS_BLOCKSIZE);
+        basicbtfs_mark_dirty_inode(bh, inode, true);
+        brelse(bh);
+    }
+
+    for (bi = BASICBTFS_GET_FILEBLOCK(bno, sbi->s_imap_blocks, sbi->s_bmap_blocks, sbi->s_inode_blocks); bi <= BASICBTFS_GET_FILEBLOCK(last, sbi->s_imap_blocks, sbi->s_bmap_blocks, sbi->s_inode_blocks); bi++) {
+        bh = sb_bread(sb, bi);
+
+        if (!bh) return;
+
+        basicbtfs_mark_dirty_inode(bh, inode, true);
+        brelse(bh);
+    }
+}
+
+static int basicbtfs_file_alloc_cluster(struct inode *inode, struct buffer_head *bh_index, uint32_t cluster_index) {
+    struct super_block *sb = inode->i_sb;
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct basicbtfs_disk_block *disk_block = (struct basicbtfs_disk_block *) bh_index->b_data;
+    struct basicbtfs_cluster *prev_cluster = NULL;
+    struct basicbtfs_block *disk_file_block;
+    struct buffer_head *bh_block;
+    int bno, i;
+
+    bno = get_free_blocks(sbi, BASICBTFS_MAX_BLOCKS_PER_CLUSTER);
+    if (bno == -1) {
+        return -ENOSPC;
+    }
+
+    if (cluster_index > 0) {
+        prev_cluster = &disk_block->block_type.cluster_table.table[cluster_index - 1];
+
+        if (bno != prev_cluster->start_bno + prev_cluster->cluster_length) basicbtfs_defrag_count_extent(inode);
+    }
+
+    disk_block->block_type.cluster_table.table[cluster_index].start_bno = bno;
+    disk_block->block_type.cluster_table.table[cluster_index].cluster_length = BASICBTFS_MAX_BLOCKS_PER_CLUSTER;
+    basicbtfs_mark_dirty_inode(bh_index, inode, false);
+    basicbtfs_update_file_info_range(sb, bno, BASICBTFS_MAX_BLOCKS_PER_CLUSTER, inode->i_ino, cluster_index);
+
+    for (i = 0; i < BASICBTFS_MAX_BLOCKS_PER_CLUSTER; i++) {
+        /*
+         * file data, written back without the journal. A block that is written before its
+         * zeroes went out is mapped as new by get_block, which drops the zeroes.
+         */
+        bh_block = sb_bread(sb, bno + i);
+
+        if (!bh_block) return -EIO;
+
+        disk_file_block = (struct basicbtfs_block *) bh_block->b_data;
+        memset(disk_file_block, 0, sizeof(struct basicbtfs_block));
+        mark_buffer_dirty_inode(bh_block, inode);
+        brelse(bh_block);
+    }
+
+    if (!sbi->s_journal) basicbtfs_file_dirty_shared(inode, bno, BASICBTFS_MAX_BLOCKS_PER_CLUSTER);
+
+    return bno;
+}
+
+/* Writes the shared blocks the file dirtied since its last fsync and waits for them */
+static int basicbtfs_file_sync_shared(struct inode *inode) {
+    struct super_block *sb = inode->i_sb;
+    struct basicbtfs_inode_info *inode_info = BASICBTFS_INODE(inode);
+    struct buffer_head *bhs[BASICBTFS_FSYNC_SHARED_BLOCKS];
+    uint32_t i = 0, nr_of_bhs = 0;
+    int ret = 0;
+
+    if (inode_info->i_nr_shared_bnos > BASICBTFS_FSYNC_SHARED_BLOCKS) {
+        inode_info->i_nr_shared_bnos = 0;
+        return sync_blockdev(sb->s_bdev);
+    }
+
+    for (i = 0; i < inode_info->i_nr_shared_bnos; i++) {
+        bhs[nr_of_bhs] = sb_find_get_block(sb, inode_info->i_shared_bnos[i]);
+
+        if (!bhs[nr_of_bhs]) continue;
+
+        write_dirty_buffer(bhs[nr_of_bhs], REQ_SYNC);
+        nr_of_bhs++;
+    }
+
+    inode_info->i_nr_shared_bnos = 0;
+
+    for (i = 0; i < nr_of_bhs; i++) {
+        wait_on_buffer(bhs[i]);
+
+        if (!buffer_uptodate(bhs[i])) ret = -EIO;
+
+        brelse(bhs[i]);
+    }
+
+    return ret;
+}
+
+static bool basicbtfs_file_zeroes_pending(struct super_block *sb, uint32_t bno) {
+    struct buffer_head *bh = sb_find_get_block(sb, bno);
+    bool pending = false;
+
+    if (!bh) return false;
+
+    pending = buffer_dirty(bh) || buffer_locked(bh);
+    brelse(bh);
+    return pending;
+}
+
+static int basicbtfs_file_do_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create) {
     struct super_block *sb = inode->i_sb;
     struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
     struct basicbtfs_inode_info *ci = BASICBTFS_INODE(inode);
     struct basicbtfs_disk_block *disk_block;
-    struct basicbtfs_block *disk_file_block;
-    struct buffer_head *bh_index, *bh_block;
-    int ret = 0, bno, i;
+    struct buffer_head *bh_index;
+    handle_t *handle = NULL;
+    int ret = 0, bno;
     uint32_t cluster_index = 0;
+    u64 start = 0;
     if (iblock >= BASICBTFS_MAX_BLOCKS_PER_DIR) {
         return -EFBIG;
     }
@@ -124,35 +252,112 @@ static int basicbtfs_file_get_block(struct inode *inode, sector_t iblock, struct
 
     if (disk_block->block_type.cluster_table.table[cluster_index].start_bno == 0) {
         if (!create) {
-            return ret;
-        }
-        
-        bno = get_free_blocks(sbi, BASICBTFS_MAX_BLOCKS_PER_CLUSTER);
-        if (bno == -1) {
             brelse(bh_index);
-            return -ENOSPC;
+            return ret;
         }
+        brelse(bh_index);
 
-        disk_block->block_type.cluster_table.table[cluster_index].start_bno = bno;
-        disk_block->block_type.cluster_table.table[cluster_index].cluster_length = BASICBTFS_MAX_BLOCKS_PER_CLUSTER;
+        /* the cluster table, file map and bitmap change together, and not while defrag moves blocks */
+        down_read(&sbi->s_defrag_lock);
+        handle = basicbtfs_journal_start(sb, BASICBTFS_JOURNAL_ALLOC_CREDITS);
 
-        for (i = 0; i < BASICBTFS_MAX_BLOCKS_PER_CLUSTER; i++) {
-            basicbtfs_update_file_info(sb, bno + i, inode->i_ino, cluster_index);
+        if (IS_ERR(handle)) {
+            up_read(&sbi->s_defrag_lock);
+            return PTR_ERR(handle);
+        }
 
-            bh_block = sb_bread(sb, bno + i);
-            disk_file_block = (struct basicbtfs_block *) bh_block->b_data;
-            memset(disk_file_block, 0, sizeof(struct basicbtfs_block));
-            mark_buffer_dirty(bh_block);
-            brelse(bh_block);
+        bh_index = basicbtfs_bread(sb, ci->i_bno);
+
+        if (!bh_index) {
+            basicbtfs_journal_stop(handle);
+            up_read(&sbi->s_defrag_lock);
+            return -EIO;
         }
+
+        start = ktime_get_ns();
+        bno = basicbtfs_file_alloc_cluster(inode, bh_index, cluster_index);
+        basicbtfs_stat_latency(sbi, BASICBTFS_LAT_ALLOC, start);
+        trace_basicbtfs_alloc(inode, cluster_index, bno, BASICBTFS_MAX_BLOCKS_PER_CLUSTER, start);
+        brelse(bh_index);
+        ret = basicbtfs_journal_end(handle, bno);
+        up_read(&sbi->s_defrag_lock);
+
+        if (ret < 0) return ret;
     } else {
         bno = disk_block->block_type.cluster_table.table[cluster_index].start_bno + (iblock % disk_block->block_type.cluster_table.table[cluster_index].cluster_length);
+        brelse(bh_index);
     }
 
     map_bh(bh_result, sb, bno);
+
+    /*
+     * The zeroes of a new cluster may still be dirty in the block device cache. Mapping the
+     * block as new makes the page cache drop them, they would otherwise overwrite the data.
+     */
+    if (create && basicbtfs_file_zeroes_pending(sb, bno)) set_buffer_new(bh_result);
+
+    return 0;
+}
+
+/* The background defragmenter moves the cluster table and clusters of a file with i_defrag_sem held, it nests s_defrag_lock inside */
+static int basicbtfs_file_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create) {
+    struct basicbtfs_inode_info *ci = BASICBTFS_INODE(inode);
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(inode->i_sb);
+    u64 start = ktime_get_ns();
+    int ret = 0;
+
+    down_read(&ci->i_defrag_sem);
+    ret = basicbtfs_file_do_get_block(inode, iblock, bh_result, create);
+    up_read(&ci->i_defrag_sem);
+    basicbtfs_stat_inc(sbi, BASICBTFS_STAT_GET_BLOCKS);
+    basicbtfs_stat_latency(sbi, BASICBTFS_LAT_GET_BLOCK, start);
+    trace_basicbtfs_get_block(inode, iblock, bh_result, create, ret, start);
     return ret;
 }
 
+/*
+ * Writes the data of the file first, then the metadata that points at it. Without a journal
+ * that is the cluster tables and zeroed blocks on the buffer list of the inode, the shared
+ * blocks it remembered and its inode table block. With a journal all of it is in the
+ * transaction that last changed the file, which is committed once the data is on disk.
+ */
+static int basicbtfs_fsync(struct file *file, loff_t start, loff_t end, int datasync) {
+    struct inode *inode = file->f_mapping->host;
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(inode->i_sb);
+    int ret = 0, err = 0;
+
+    ret = file_write_and_wait_range(file, start, end);
+
+    if (ret) return ret;
+
+    inode_lock(inode);
+    ret = sync_mapping_buffers(inode->i_mapping);
+
+    if (!sbi->s_journal) {
+        err = basicbtfs_file_sync_shared(inode);
+
+        if (!ret) ret = err;
+    }
+
+    if (!datasync || (inode->i_state & I_DIRTY_DATASYNC)) {
+        err = sync_inode_metadata(inode, 1);
+
+        if (!ret) ret = err;
+    }
+
+    if (sbi->s_journal) {
+        err = jbd2_complete_transaction(sbi->s_journal, BASICBTFS_INODE(inode)->i_sync_tid);
+
+        if (!ret) ret = err;
+    }
+
+    inode_unlock(inode);
+
+    if (ret || sbi->s_journal) return ret;
+
+    return blkdev_issue_flush(inode->i_sb->s_bdev, GFP_KERNEL, NULL);
+}
+
 static int basicbtfs_readpage(struct file *file, struct page *page) {
     return mpage_readpage(page, basicbtfs_file_get_block);
 }
@@ -186,18 +391,17 @@ static int basicbtfs_write_end(struct file *file,
                               unsigned int copied,
                               struct page *page,
                               void *fsdata) {
-    struct inode *inode = file->f_inode;
-
     int ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
 
+    /*
+     * generic_write_end dirtied the inode if the size changed, the write path updated mtime
+     * and ctime through file_update_time, which defers them on a lazytime mount.
+     */
     if (ret < len) {
         pr_err("wrote less than requested.");
         return ret;
     }
 
-    inode->i_mtime = inode->i_ctime = current_time(inode);
-    mark_inode_dirty(inode);
-
     return ret;
 }
 
@@ -213,6 +417,6 @@ const struct file_operations basicbtfs_file_ops = {
     .owner = THIS_MODULE,
     .read_iter = generic_file_read_iter,
     .write_iter = generic_file_write_iter,
-    .fsync = generic_file_fsync,
+    .fsync = basicbtfs_fsync,
     .unlocked_ioctl = basicbtfs_ioctl,
 };
\ No newline at end of file
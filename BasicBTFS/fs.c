@@ -8,6 +8,9 @@
 #include "basicbtfs.h"
 #include "cache.h"
 
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("quardell");
 
@@ -27,6 +30,16 @@ struct dentry *basicbtfs_mount(struct file_system_type *fs_type, int flags, cons
 /* Unmount a basicftfs partition */
 void basicbtfs_kill_sb(struct super_block *sb) {
     printk(KERN_INFO "disk will be destroyed\n");
+
+    /*
+     * The defragmenter holds inode references, which have to be gone before the inodes are
+     * evicted. A failed fill_super frees sbi and clears s_fs_info, there is nothing to stop.
+     */
+    if (sb->s_fs_info) {
+        basicbtfs_bgdefrag_stop(sb);
+        basicbtfs_sysfs_unregister(sb);
+    }
+
     kill_block_super(sb);
 }
 
@@ -53,30 +66,24 @@ static int __init basicbtfs_init(void) {
         return ret;
     }
 
-    ret = basicbtfs_init_btree_node_data_cache();
-
-    if (ret) {
-        printk(KERN_ERR "btree node data cache creation failed\n");
-        return ret;
-    }
-
-    ret = basicbtfs_init_nametree_hdr_cache();
+    ret = basicbtfs_init_cached_block_cache();
 
     if (ret) {
-        printk(KERN_ERR "btree nametree header cache creation failed\n");
+        printk(KERN_ERR "cached block cache creation failed\n");
         return ret;
     }
 
-    ret = basicbtfs_init_file_cache();
+    ret = basicbtfs_sysfs_init();
 
     if (ret) {
-        printk(KERN_ERR "btree file block cache creation failed\n");
+        printk(KERN_ERR "sysfs directory creation failed\n");
         return ret;
     }
 
     ret = register_filesystem(&basicftfs_file_system_type);
     if (ret) {
         printk(KERN_ERR "Failed registration of filesystem\n");
+        basicbtfs_sysfs_exit();
         return ret;
     }
 
@@ -90,11 +97,10 @@ static void __exit basicbtfs_exit(void) {
         printk(KERN_ERR "Failed unregistration of filesystem\n");
     }
 
+    basicbtfs_sysfs_exit();
     basicbtfs_destroy_inode_cache();
-    basicbtfs_destroy_btree_node_data_cache();
     basicbtfs_destroy_btree_dir_cache();
-    basicbtfs_destroy_nametree_hdr_cache();
-    basicbtfs_destroy_file_cache();
+    basicbtfs_destroy_cached_block_cache();
     printk(KERN_INFO "Module unregistered succesfully\n");
 }
 
@@ -78,13 +78,32 @@ static inline unsigned long get_hash_from_block(char *filename, int length) {
     return crc;
 }
 
-static inline uint32_t increase_counter(uint32_t counter, uint32_t limit) {
-    if (counter == limit) {
-        defrag_now = true;
-        return 0;
-    } else {
-        return counter + 1;
-    }
+/*
+ * Workload statistics for the background defragmenter. A directory counts the operations that
+ * change it, a file the clusters it got that do not follow the one before. Once the count
+ * reaches its threshold the inode is queued, the defragmenter moves it if that pays off.
+ * The counts are hints, a lost increment does not matter.
+ */
+static inline void basicbtfs_defrag_queue(struct inode *inode) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(inode->i_sb);
+
+    if (!sbi->s_defrag_queue || test_and_set_bit(inode->i_ino, sbi->s_defrag_queue)) return;
+
+    basicbtfs_bgdefrag_wake(inode->i_sb);
+}
+
+static inline void increase_counter(struct inode *dir) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(dir->i_sb);
+    struct basicbtfs_inode_info *inode_info = BASICBTFS_INODE(dir);
+
+    if (sbi->s_defrag_dir_churn > 0 && ++inode_info->i_churn >= sbi->s_defrag_dir_churn) basicbtfs_defrag_queue(dir);
+}
+
+static inline void basicbtfs_defrag_count_extent(struct inode *inode) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(inode->i_sb);
+    struct basicbtfs_inode_info *inode_info = BASICBTFS_INODE(inode);
+
+    if (sbi->s_defrag_file_extents > 0 && ++inode_info->i_churn >= sbi->s_defrag_file_extents) basicbtfs_defrag_queue(inode);
 }
 
 #endif
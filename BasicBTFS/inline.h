@@ -0,0 +1,257 @@
+#ifndef BASICBTFS_INLINE_H
+#define BASICBTFS_INLINE_H
+
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+
+#include "basicbtfs.h"
+#include "bitmap.h"
+#include "bptree.h"
+#include "nametree.h"
+
+/* Size of a record holding a name of name_length bytes, the terminating zero included */
+#define BASICBTFS_INLINE_DIR_REC_LEN(name_length) ALIGN(sizeof(struct basicbtfs_inline_dir_entry) + (name_length), sizeof(uint32_t))
+
+static inline void basicbtfs_inline_dir_init(struct basicbtfs_disk_block *disk_block, uint32_t ino) {
+    memset(disk_block, 0, sizeof(struct basicbtfs_disk_block));
+    disk_block->block_type_id = BASICBTFS_BLOCKTYPE_INLINE_DIR;
+    disk_block->block_type.inline_dir.ino = ino;
+}
+
+/* Returns the amount of files in the directory stored in the root block disk_block */
+static inline uint32_t basicbtfs_dir_nr_of_files(struct basicbtfs_disk_block *disk_block) {
+    if (disk_block->block_type_id == BASICBTFS_BLOCKTYPE_INLINE_DIR) {
+        return disk_block->block_type.inline_dir.nr_of_files;
+    }
+
+    return disk_block->block_type.btree_node.nr_of_files;
+}
+
+/*
+ * Walks the records until one with a hash of at least hash is found. offset is set to the
+ * start of that record, or to the end of the used area if there is none.
+ */
+static inline struct basicbtfs_inline_dir_entry *basicbtfs_inline_dir_find(struct basicbtfs_inline_dir *dir, uint32_t hash, uint32_t *offset) {
+    struct basicbtfs_inline_dir_entry *entry = NULL;
+    uint32_t cur = 0;
+    int index = 0;
+
+    for (index = 0; index < dir->nr_of_files; index++) {
+        entry = (struct basicbtfs_inline_dir_entry *) (dir->data + cur);
+
+        if (entry->hash >= hash) {
+            *offset = cur;
+            return entry;
+        }
+
+        cur += BASICBTFS_INLINE_DIR_REC_LEN(entry->name_length);
+    }
+
+    *offset = cur;
+    return NULL;
+}
+
+static inline uint32_t basicbtfs_inline_dir_lookup(struct basicbtfs_inline_dir *dir, uint32_t hash) {
+    struct basicbtfs_inline_dir_entry *entry = NULL;
+    uint32_t offset = 0;
+
+    entry = basicbtfs_inline_dir_find(dir, hash, &offset);
+
+    if (entry && entry->hash == hash) {
+        return entry->ino;
+    }
+
+    return 0;
+}
+
+/* Returns -ENOSPC when the record does not fit anymore and the directory has to be converted */
+static inline int basicbtfs_inline_dir_add(struct basicbtfs_inline_dir *dir, uint32_t ino, uint32_t hash, const struct qstr *name, uint8_t file_type) {
+    struct basicbtfs_inline_dir_entry *entry = NULL;
+    uint32_t offset = 0, rec_len = BASICBTFS_INLINE_DIR_REC_LEN(name->len + 1);
+    char *filename = NULL;
+
+    if (dir->nr_of_files >= BASICBTFS_INLINE_DIR_MAX_FILES || dir->used_bytes + rec_len > BASICBTFS_INLINE_DIR_DATA_SIZE) {
+        return -ENOSPC;
+    }
+
+    entry = basicbtfs_inline_dir_find(dir, hash, &offset);
+
+    if (entry && entry->hash == hash) {
+        return -EEXIST;
+    }
+
+    memmove(dir->data + offset + rec_len, dir->data + offset, dir->used_bytes - offset);
+
+    entry = (struct basicbtfs_inline_dir_entry *) (dir->data + offset);
+    memset(entry, 0, rec_len);
+    entry->ino = ino;
+    entry->hash = hash;
+    entry->name_length = name->len + 1;
+    entry->file_type = file_type;
+    filename = (char *) (entry + 1);
+    memcpy(filename, name->name, name->len);
+
+    dir->used_bytes += rec_len;
+    dir->nr_of_files++;
+    return 0;
+}
+
+static inline int basicbtfs_inline_dir_delete(struct basicbtfs_inline_dir *dir, uint32_t hash) {
+    struct basicbtfs_inline_dir_entry *entry = NULL;
+    uint32_t offset = 0, rec_len = 0;
+
+    entry = basicbtfs_inline_dir_find(dir, hash, &offset);
+
+    if (!entry || entry->hash != hash) {
+        return -ENOENT;
+    }
+
+    rec_len = BASICBTFS_INLINE_DIR_REC_LEN(entry->name_length);
+    memmove(dir->data + offset, dir->data + offset + rec_len, dir->used_bytes - offset - rec_len);
+    memset(dir->data + dir->used_bytes - rec_len, 0, rec_len);
+
+    dir->used_bytes -= rec_len;
+    dir->nr_of_files--;
+    return 0;
+}
+
+/*
+ * Emits the records starting at ctx->pos. The positions follow the directory format, so a
+ * readdir keeps its place when the directory is converted: record index + 2 for btrees and
+ * the hash based positions of the B+-tree.
+ */
+static inline int basicbtfs_inline_dir_iterate(struct super_block *sb, struct basicbtfs_inline_dir *dir, struct dir_context *ctx, struct basicbtfs_dir_cursor *cursor) {
+    struct basicbtfs_inline_dir_entry *entry = NULL;
+    bool hash_pos = BASICBTFS_HAS_BPTREE(sb);
+    uint32_t offset = 0, hash = 0;
+    int index = 0;
+
+    if (hash_pos) {
+        if (ctx->pos >= BASICBTFS_BPTREE_POS_EOF) return 0;
+
+        hash = basicbtfs_bptree_pos_hash(ctx, cursor);
+    }
+
+    for (index = 0; index < dir->nr_of_files; index++) {
+        entry = (struct basicbtfs_inline_dir_entry *) (dir->data + offset);
+        offset += BASICBTFS_INLINE_DIR_REC_LEN(entry->name_length);
+
+        if (hash_pos) {
+            if (entry->hash < hash) continue;
+
+            ctx->pos = BASICBTFS_BPTREE_POS(entry->hash);
+        } else if (index < ctx->pos - 2) {
+            continue;
+        }
+
+        if (!dir_emit(ctx, (char *) (entry + 1), entry->name_length - 1, entry->ino, entry->file_type)) {
+            cursor->pos = ctx->pos;
+            cursor->hash = entry->hash;
+            return 0;
+        }
+
+        ctx->pos++;
+    }
+
+    if (hash_pos) {
+        ctx->pos = BASICBTFS_BPTREE_POS_EOF;
+    }
+
+    return 0;
+}
+
+/*
+ * Turns the inline directory in the root block bh into a btree leaf with a name list.
+ * The records are sorted on hash and never exceed the keys of one node, so they are copied
+ * into the root as they are and the root block keeps its place. The leaf is built aside and
+ * only copied over the block once every name is in the name list, a failed insert frees the
+ * name list again and leaves the inline directory as it was.
+ */
+static inline int basicbtfs_inline_dir_convert(struct super_block *sb, struct inode *inode, struct buffer_head *bh) {
+    struct basicbtfs_inode_info *inode_info = BASICBTFS_INODE(inode);
+    struct basicbtfs_disk_block *disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+    struct basicbtfs_inline_dir *dir = &disk_block->block_type.inline_dir;
+    struct basicbtfs_inline_dir_entry *entry = NULL;
+    struct basicbtfs_btree_node *node = NULL;
+    struct basicbtfs_name_list_hdr *name_list_hdr = NULL;
+    struct buffer_head *bh_name_table = NULL;
+    struct basicbtfs_entry *new_entry = NULL;
+    uint32_t name_bno = 0, offset = 0;
+    int index = 0, ret = 0;
+
+    node = kzalloc(sizeof(struct basicbtfs_btree_node), GFP_KERNEL);
+
+    if (!node) return -ENOMEM;
+
+    name_bno = get_free_blocks(BASICBTFS_SB(sb), 1);
+
+    if (name_bno == -1) {
+        kfree(node);
+        return -ENOSPC;
+    }
+
+    bh_name_table = basicbtfs_bread(sb, name_bno);
+
+    if (!bh_name_table) {
+        put_blocks(BASICBTFS_SB(sb), name_bno, 1);
+        kfree(node);
+        return -EIO;
+    }
+
+    disk_block = (struct basicbtfs_disk_block *) bh_name_table->b_data;
+    memset(disk_block, 0, sizeof(struct basicbtfs_disk_block));
+    disk_block->block_type_id = BASICBTFS_BLOCKTYPE_NAMETREE;
+    name_list_hdr = &disk_block->block_type.name_list_hdr;
+    name_list_hdr->free_bytes = BASICBTFS_EMPTY_NAME_TREE;
+    name_list_hdr->start_unused_area = BASICBTFS_BLOCKSIZE - BASICBTFS_EMPTY_NAME_TREE;
+    name_list_hdr->prev_block = inode->i_ino;
+    name_list_hdr->first_list = true;
+    basicbtfs_mark_dirty(bh_name_table);
+    brelse(bh_name_table);
+
+    /* a cached directory keeps its root block, the name list joins it */
+    basicbtfs_cache_pin_block(sb, inode_info->i_bno, name_bno);
+
+    node->leaf = true;
+    node->root = true;
+    node->parent = inode->i_ino;
+    node->tree_name_bno = name_bno;
+
+    for (index = 0; index < dir->nr_of_files; index++) {
+        struct qstr name;
+
+        entry = (struct basicbtfs_inline_dir_entry *) (dir->data + offset);
+        offset += BASICBTFS_INLINE_DIR_REC_LEN(entry->name_length);
+
+        name = (struct qstr) QSTR_INIT((char *) (entry + 1), entry->name_length - 1);
+        new_entry = &node->entries[index];
+        new_entry->ino = entry->ino;
+        new_entry->hash = entry->hash;
+
+        ret = basicbtfs_nametree_insert_name(sb, name_bno, new_entry, &name, entry->file_type, inode_info->i_bno);
+
+        if (ret < 0) break;
+
+        node->nr_of_keys++;
+        node->nr_of_files++;
+    }
+
+    if (ret < 0) {
+        basicbtfs_nametree_free_namelist_blocks(sb, name_bno);
+        kfree(node);
+        return ret;
+    }
+
+    disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+    memset(disk_block, 0, sizeof(struct basicbtfs_disk_block));
+    disk_block->block_type_id = BASICBTFS_BLOCKTYPE_BTREE_NODE;
+    memcpy(&disk_block->block_type.btree_node, node, sizeof(struct basicbtfs_btree_node));
+    basicbtfs_mark_dirty(bh);
+    kfree(node);
+    return 0;
+}
+
+#endif
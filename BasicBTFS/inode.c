@@ -8,8 +8,12 @@
 #include "destroy.h"
 #include "io.h"
 #include "init.h"
-#include "btreecache.h"
+#include "cache.h"
+#include "inline.h"
 #include "defrag.h"
+#include "journal.h"
+#include "stats.h"
+#include "trace.h"
 
 static int init_vfs_inode(struct super_block *sb, struct inode *inode, unsigned long ino) {
     struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
@@ -63,16 +67,21 @@ struct inode *basicbtfs_iget(struct super_block *sb, unsigned long ino)
 }
 
 static struct dentry *basicbtfs_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(dir->i_sb);
     struct dentry *ret = 0;
+    u64 start = ktime_get_ns();
+
     if (dentry->d_name.len > BASICBTFS_NAME_LENGTH) {
         printk(KERN_ERR "filename is longer than %d\n", BASICBTFS_NAME_LENGTH);
         return ERR_PTR(-ENAMETOOLONG);
     }
 
+    down_read(&sbi->s_defrag_lock);
     ret =  basicbtfs_search_entry(dir, dentry);
+    up_read(&sbi->s_defrag_lock);
 
-    nr_of_inode_operations = increase_counter(nr_of_inode_operations, BASICBTFS_DEFRAG_PERIOD);
-
+    basicbtfs_stat_latency(sbi, BASICBTFS_LAT_LOOKUP, start);
+    trace_basicbtfs_lookup(dir, dentry, PTR_ERR_OR_ZERO(ret), start);
     return ret;
 }
 
@@ -131,19 +140,15 @@ static struct inode *basicbtfs_new_inode(struct inode *dir, mode_t mode) {
     return inode;
 }
 
-static int basicbtfs_create(struct inode *dir, struct dentry *dentry, umode_t mode, bool excl) {
+static int basicbtfs_do_create(struct inode *dir, struct dentry *dentry, umode_t mode) {
     struct super_block *sb = dir->i_sb;
-    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
     struct inode *inode = NULL;
     struct basicbtfs_inode_info *bfs_inode_info_dir = NULL;
-    struct basicbtfs_btree_node *node = NULL;
-    struct basicbtfs_btree_node_cache *node_cache = NULL;
-    struct basicbtfs_name_list_hdr *name_list_hdr = NULL;
-    struct buffer_head *bh_dir = NULL, *bh = NULL, *bh_name_table = NULL;
+    struct buffer_head *bh_dir = NULL, *bh = NULL;
     struct basicbtfs_disk_block *disk_block = NULL;
     int ret = 0;
 
-    nr_of_inode_operations = increase_counter(nr_of_inode_operations, BASICBTFS_DEFRAG_PERIOD);
+    increase_counter(dir);
 
     if (strlen(dentry->d_name.name) > BASICBTFS_NAME_LENGTH) return -ENAMETOOLONG;
 
@@ -153,9 +158,8 @@ static int basicbtfs_create(struct inode *dir, struct dentry *dentry, umode_t mo
     if (!bh_dir) return -EIO;
 
     disk_block = (struct basicbtfs_disk_block *) bh_dir->b_data;
-    node = &disk_block->block_type.btree_node;
 
-    if (node->nr_of_files >= BASICBTFS_ENTRIES_PER_DIR) {
+    if (basicbtfs_dir_nr_of_files(disk_block) >= BASICBTFS_ENTRIES_PER_DIR) {
         printk(KERN_ERR "Parent directory is full\n");
         ret = -EMLINK;
         brelse(bh_dir);
@@ -182,81 +186,31 @@ static int basicbtfs_create(struct inode *dir, struct dentry *dentry, umode_t mo
     }
 
     brelse(bh_dir);
-    node = NULL;
 
+    /* new directories start out inline and only get a btree once they overflow */
     if (S_ISDIR(inode->i_mode)) {
-        bh = sb_bread(sb, BASICBTFS_INODE(inode)->i_bno);
+        bh = basicbtfs_bread(sb, BASICBTFS_INODE(inode)->i_bno);
 
         if (!bh) return -EIO;
 
         disk_block = (struct basicbtfs_disk_block *) bh->b_data;
-        disk_block->block_type_id = BASICBTFS_BLOCKTYPE_BTREE_NODE;
-        node = &disk_block->block_type.btree_node;
-        node->leaf = true;
-        node->root = true;
-        node->nr_of_files = 0;
-        node->nr_of_keys = 0;
-        // node->block_type = BASICBTFS_BLOCKTYPE_BTREE_NODE;
-        node->parent = inode->i_ino;
-
-        if (node->tree_name_bno == 0) {
-            node->tree_name_bno = get_free_blocks(BASICBTFS_SB(sb), 1);
-
-            if (node->tree_name_bno == -1) {
-                return -ENOSPC;
-            }
-            bh_name_table = sb_bread(sb, node->tree_name_bno);
-
-            if (!bh_name_table) {
-                brelse(bh);
-                put_blocks(BASICBTFS_SB(sb), node->tree_name_bno, 1);
-                return -EIO;
-            }
-
-            // name_list_hdr = (struct basicbtfs_name_list_hdr *)bh_name_table->b_data;
-            disk_block = (struct basicbtfs_disk_block *) bh_name_table->b_data;
-            memset(disk_block, 0, sizeof(struct basicbtfs_disk_block));
-            disk_block->block_type_id = BASICBTFS_BLOCKTYPE_NAMETREE;
-            name_list_hdr = &disk_block->block_type.name_list_hdr;
-
-            name_list_hdr->free_bytes = BASICBTFS_EMPTY_NAME_TREE;
-            name_list_hdr->start_unused_area = BASICBTFS_BLOCKSIZE - BASICBTFS_EMPTY_NAME_TREE;
-            // name_list_hdr->block_type = BASICBTFS_BLOCKTYPE_NAMETREE;
-            name_list_hdr->prev_block = inode->i_ino;
-            name_list_hdr->first_list =  true;
-            name_list_hdr->next_block = 0;
-            name_list_hdr->nr_of_entries = 0;
-            mark_buffer_dirty(bh_name_table);
-            brelse(bh_name_table);
-        }
-
-        bh_name_table = sb_bread(sb, node->tree_name_bno);
-
-        if (!bh_name_table) {
-            brelse(bh);
-            return -EIO;
-        }
-        
-        node_cache = (struct basicbtfs_btree_node_cache *)basicbtfs_alloc_file(sb);
-        // // basicbtfs_destroy_btree_node_data(node_cache);
-        basicbtfs_btree_node_cache_init(sb, node_cache, true);
-
-        if (sbi->s_cache_dir_entries < BASICBTFS_MAX_CACHE_DIR_ENTRIES ) {
-            basicbtfs_cache_add_dir(sb, BASICBTFS_INODE(inode)->i_bno, node_cache, (struct basicbtfs_block *)bh_name_table->b_data, node->tree_name_bno);
-        }
+        basicbtfs_inline_dir_init(disk_block, inode->i_ino);
 
-        mark_buffer_dirty(bh);
+        basicbtfs_mark_dirty(bh);
         brelse(bh);
 
+        /* up to BASICBTFS_MAX_CACHE_DIR_ENTRIES directories stay cached, see cache.h */
+        basicbtfs_cache_add_dir(sb, BASICBTFS_INODE(inode)->i_bno);
+
     } else if (S_ISREG(inode->i_mode)) {
-        bh = sb_bread(sb, BASICBTFS_INODE(inode)->i_bno);
+        bh = basicbtfs_bread(sb, BASICBTFS_INODE(inode)->i_bno);
 
         if (!bh) return -EIO;
         disk_block = (struct basicbtfs_disk_block *) bh->b_data;
         disk_block->block_type.cluster_table.ino = inode->i_ino;
         disk_block->block_type_id =BASICBTFS_BLOCKTYPE_CLUSTER_TABLE;
 
-        mark_buffer_dirty(bh);
+        basicbtfs_mark_dirty(bh);
         brelse(bh);
     }
 
@@ -282,6 +236,28 @@ static int basicbtfs_create(struct inode *dir, struct dentry *dentry, umode_t mo
     return 0;
 }
 
+/* Every operation that changes the namespace is one handle, see journal.h, and keeps defrag out */
+static int basicbtfs_create(struct inode *dir, struct dentry *dentry, umode_t mode, bool excl) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(dir->i_sb);
+    handle_t *handle = NULL;
+    u64 start = ktime_get_ns();
+    int ret = 0;
+
+    down_read(&sbi->s_defrag_lock);
+    handle = basicbtfs_journal_start(dir->i_sb, basicbtfs_dir_credits(dir) + BASICBTFS_JOURNAL_INODE_CREDITS);
+
+    if (IS_ERR(handle)) {
+        up_read(&sbi->s_defrag_lock);
+        return PTR_ERR(handle);
+    }
+
+    ret = basicbtfs_journal_end(handle, basicbtfs_do_create(dir, dentry, mode));
+    up_read(&sbi->s_defrag_lock);
+    basicbtfs_stat_latency(sbi, BASICBTFS_LAT_CREATE, start);
+    trace_basicbtfs_create(dir, dentry, ret, start);
+    return ret;
+}
+
 int basicbtfs_makedir(struct inode *dir, struct dentry *dentry, umode_t mode) {
     return basicbtfs_create(dir, dentry, mode | S_IFDIR, 0);
 }
@@ -295,19 +271,31 @@ static int basicbtfs_link(struct dentry *old_dentry,
                          struct inode *dir,
                          struct dentry *dentry)
 {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(dir->i_sb);
     struct inode *inode = d_inode(old_dentry);
+    handle_t *handle = NULL;
     int ret = 0;
 
-    nr_of_inode_operations = increase_counter(nr_of_inode_operations, BASICBTFS_DEFRAG_PERIOD);
+    increase_counter(dir);
+
+    down_read(&sbi->s_defrag_lock);
+    handle = basicbtfs_journal_start(dir->i_sb, basicbtfs_dir_credits(dir) + 1);
+
+    if (IS_ERR(handle)) {
+        up_read(&sbi->s_defrag_lock);
+        return PTR_ERR(handle);
+    }
 
     inode_inc_link_count(inode);
     ret = basicbtfs_add_entry(dir, inode, dentry);
     d_instantiate(dentry, inode);
 
+    ret = basicbtfs_journal_end(handle, ret);
+    up_read(&sbi->s_defrag_lock);
     return ret;
 }
 
-static int basicbtfs_unlink(struct inode *dir ,struct dentry *dentry) {
+static int basicbtfs_do_unlink(struct inode *dir ,struct dentry *dentry) {
     int ret = 0;
     uint32_t bno = 0, ino = 0;
     struct super_block *sb  = dir->i_sb;
@@ -317,7 +305,7 @@ static int basicbtfs_unlink(struct inode *dir ,struct dentry *dentry) {
     struct inode *inode = d_inode(dentry);
     ino = inode->i_ino;
 
-    nr_of_inode_operations = increase_counter(nr_of_inode_operations, BASICBTFS_DEFRAG_PERIOD);
+    increase_counter(dir);
 
     ret = basicbtfs_delete_entry(dir, dentry);
 
@@ -329,7 +317,6 @@ static int basicbtfs_unlink(struct inode *dir ,struct dentry *dentry) {
 
     /* Currently, it just resets the inode*/
     bno = BASICBTFS_INODE(inode)->i_bno;
-    printk("bno: %d\n", bno);
     bh = sb_bread(sb, bno);
     if (!bh) {
         clean_inode(inode);
@@ -341,7 +328,10 @@ static int basicbtfs_unlink(struct inode *dir ,struct dentry *dentry) {
     basicbtfs_disk_block = (struct basicbtfs_disk_block *) bh->b_data;
 
     if (S_ISDIR(inode->i_mode)) {
-        basicbtfs_nametree_free_namelist_blocks(sb, basicbtfs_disk_block->block_type.btree_node.tree_name_bno );
+        if (basicbtfs_disk_block->block_type_id != BASICBTFS_BLOCKTYPE_INLINE_DIR) {
+            basicbtfs_nametree_free_namelist_blocks(sb, basicbtfs_disk_block->block_type.btree_node.tree_name_bno );
+        }
+
         basicbtfs_btree_free_dir(sb, inode, bno);
         put_inode(sbi, ino);
 
@@ -356,14 +346,34 @@ static int basicbtfs_unlink(struct inode *dir ,struct dentry *dentry) {
     return ret;
 }
 
-static int basicbtfs_rmdir(struct inode *dir, struct dentry *dentry) {
+static int basicbtfs_unlink(struct inode *dir, struct dentry *dentry) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(dir->i_sb);
+    handle_t *handle = NULL;
+    u64 start = ktime_get_ns();
+    int ret = 0;
+
+    down_read(&sbi->s_defrag_lock);
+    handle = basicbtfs_journal_start(dir->i_sb, basicbtfs_dir_credits(dir) + BASICBTFS_JOURNAL_FREE_CREDITS(sbi));
+
+    if (IS_ERR(handle)) {
+        up_read(&sbi->s_defrag_lock);
+        return PTR_ERR(handle);
+    }
+
+    ret = basicbtfs_journal_end(handle, basicbtfs_do_unlink(dir, dentry));
+    up_read(&sbi->s_defrag_lock);
+    basicbtfs_stat_latency(sbi, BASICBTFS_LAT_UNLINK, start);
+    trace_basicbtfs_unlink(dir, dentry, ret, start);
+    return ret;
+}
+
+static int basicbtfs_do_rmdir(struct inode *dir, struct dentry *dentry) {
     struct inode *inode = d_inode(dentry);
     struct super_block *sb = dir->i_sb;
     uint32_t ino = BASICBTFS_INODE(inode)->i_bno;
     struct buffer_head *bh = NULL;
-    struct basicbtfs_btree_node *node = NULL;
     struct basicbtfs_disk_block *disk_block = NULL;
-    int ret = basicbtfs_unlink(dir, dentry);
+    int ret = basicbtfs_do_unlink(dir, dentry);
 
     if (inode->i_nlink > 2) return -ENOTEMPTY;
 
@@ -372,9 +382,8 @@ static int basicbtfs_rmdir(struct inode *dir, struct dentry *dentry) {
     if (!bh) return -EIO;
 
     disk_block = (struct basicbtfs_disk_block *) bh->b_data;
-    node = &disk_block->block_type.btree_node;
 
-    if (node->nr_of_files > 0) {
+    if (basicbtfs_dir_nr_of_files(disk_block) > 0) {
         brelse(bh);
         return -ENOTEMPTY;
     }
@@ -383,10 +392,30 @@ static int basicbtfs_rmdir(struct inode *dir, struct dentry *dentry) {
     return ret;
 }
 
-static int basicbtfs_rename(struct inode *old_dir, struct dentry *old_dentry, struct inode *new_dir, struct dentry *new_dentry, unsigned int flags) {
+static int basicbtfs_rmdir(struct inode *dir, struct dentry *dentry) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(dir->i_sb);
+    handle_t *handle = NULL;
     int ret = 0;
 
-    nr_of_inode_operations = increase_counter(nr_of_inode_operations, BASICBTFS_DEFRAG_PERIOD);
+    down_read(&sbi->s_defrag_lock);
+    handle = basicbtfs_journal_start(dir->i_sb, basicbtfs_dir_credits(dir) + BASICBTFS_JOURNAL_FREE_CREDITS(sbi));
+
+    if (IS_ERR(handle)) {
+        up_read(&sbi->s_defrag_lock);
+        return PTR_ERR(handle);
+    }
+
+    ret = basicbtfs_journal_end(handle, basicbtfs_do_rmdir(dir, dentry));
+    up_read(&sbi->s_defrag_lock);
+    return ret;
+}
+
+static int basicbtfs_do_rename(struct inode *old_dir, struct dentry *old_dentry, struct inode *new_dir, struct dentry *new_dentry, unsigned int flags) {
+    int ret = 0;
+
+    increase_counter(old_dir);
+
+    if (new_dir != old_dir) increase_counter(new_dir);
 
     if (flags & (RENAME_EXCHANGE)) {
         return -EINVAL;
@@ -416,6 +445,26 @@ static int basicbtfs_rename(struct inode *old_dir, struct dentry *old_dentry, st
     return 0;
 }
 
+static int basicbtfs_rename(struct inode *old_dir, struct dentry *old_dentry, struct inode *new_dir, struct dentry *new_dentry, unsigned int flags) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(old_dir->i_sb);
+    handle_t *handle = NULL;
+    u64 start = ktime_get_ns();
+    int ret = 0;
+
+    down_read(&sbi->s_defrag_lock);
+    handle = basicbtfs_journal_start(old_dir->i_sb, basicbtfs_dir_credits(old_dir) + basicbtfs_dir_credits(new_dir));
+
+    if (IS_ERR(handle)) {
+        up_read(&sbi->s_defrag_lock);
+        return PTR_ERR(handle);
+    }
+
+    ret = basicbtfs_journal_end(handle, basicbtfs_do_rename(old_dir, old_dentry, new_dir, new_dentry, flags));
+    up_read(&sbi->s_defrag_lock);
+    basicbtfs_stat_latency(sbi, BASICBTFS_LAT_RENAME, start);
+    return ret;
+}
+
 const struct inode_operations basicbtfs_inode_ops = {
     .lookup = basicbtfs_lookup,
     .create = basicbtfs_create,
@@ -7,6 +7,7 @@
 #include <linux/module.h>
 
 #include "basicbtfs.h"
+#include "journal.h"
 
 static inline void write_from_disk_to_vfs_inode(struct super_block *sb, struct inode *vfs_inode, struct basicbtfs_inode *disk_inode, unsigned long ino) {
     vfs_inode->i_ino = ino;
@@ -61,6 +62,7 @@ static inline int flush_superblock(struct super_block *sb, int wait) {
     disk_sbi->s_nfree_blocks = sbi->s_nfree_blocks;
     disk_sbi->s_filemap_blocks = sbi->s_filemap_blocks;
     disk_sbi->s_unused_area = sbi->s_unused_area;
+    disk_sbi->s_features = sbi->s_features;
 
     mark_buffer_dirty(bh);
     if (wait) sync_dirty_buffer(bh);
@@ -95,7 +97,7 @@ static inline int basicbtfs_update_file_info(struct super_block *sb, uint32_t bn
     struct basicbtfs_fileblock_info *file_info;
     struct buffer_head *bh = NULL;
 
-    bh = sb_bread(sb, fblock_info_bno);
+    bh = basicbtfs_bread(sb, fblock_info_bno);
 
     if (!bh) return -EIO;
 
@@ -105,11 +107,38 @@ static inline int basicbtfs_update_file_info(struct super_block *sb, uint32_t bn
     file_info->cluster_index = new_cluster_index;
     file_info->ino = new_ino;
 
-    mark_buffer_dirty(bh);
+    basicbtfs_mark_dirty(bh);
     brelse(bh);
     return 0;
 }
 
+/* basicbtfs_update_file_info for len blocks from bno, reads each block of the file map once */
+static inline int basicbtfs_update_file_info_range(struct super_block *sb, uint32_t bno, uint32_t len, uint32_t new_ino, uint32_t new_cluster_index) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    struct basicbtfs_fileblock_info *file_info = NULL;
+    struct buffer_head *bh = NULL;
+    uint32_t end = bno + len, next = 0;
+
+    while (bno < end) {
+        next = min_t(uint32_t, end, (bno / BASICBTFS_FBLOCK_INFO_PER_BLOCK + 1) * BASICBTFS_FBLOCK_INFO_PER_BLOCK);
+        bh = basicbtfs_bread(sb, BASICBTFS_GET_FILEBLOCK(bno, sbi->s_imap_blocks, sbi->s_bmap_blocks, sbi->s_inode_blocks));
+
+        if (!bh) return -EIO;
+
+        file_info = (struct basicbtfs_fileblock_info *) bh->b_data;
+
+        for (; bno < next; bno++) {
+            file_info[BASICBTFS_GET_FILEBLOCK_IDX(bno)].cluster_index = new_cluster_index;
+            file_info[BASICBTFS_GET_FILEBLOCK_IDX(bno)].ino = new_ino;
+        }
+
+        basicbtfs_mark_dirty(bh);
+        brelse(bh);
+    }
+
+    return 0;
+}
+
 static inline int flush_filemap(struct super_block *sb, struct basicbtfs_fileblock_info *filemap, uint32_t nr_blocks, uint32_t block_offset, int wait) {
     struct buffer_head *bh = NULL;
     int i = 0;
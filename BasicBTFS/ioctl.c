@@ -1,36 +1,103 @@
 
 #include <linux/buffer_head.h>
+#include <linux/capability.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/mount.h>
 #include <linux/mpage.h>
 #include <linux/list.h>
 #include <linux/slab.h>
+#include <linux/uaccess.h>
 
 #include "bitmap.h"
 #include "basicbtfs.h"
 #include "defrag.h"
 
+/* Moves the clusters of a regular file and its cluster table into one run of free blocks */
+static long basicbtfs_ioctl_defrag_file(struct file *file) {
+    struct inode *inode = file_inode(file);
+    int ret = 0;
+
+    if (!S_ISREG(inode->i_mode)) return -EINVAL;
+
+    if (!inode_owner_or_capable(inode)) return -EACCES;
+
+    ret = mnt_want_write_file(file);
+
+    if (ret) return ret;
+
+    inode_lock(inode);
+    ret = basicbtfs_defrag_file(inode);
+    inode_unlock(inode);
+
+    mnt_drop_write_file(file);
+    return ret;
+}
+
+/* Defragments the whole filesystem, only on its root directory */
+static long basicbtfs_ioctl_defrag_disk(struct file *file) {
+    struct inode *inode = file_inode(file);
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(inode->i_sb);
+    int ret = 0;
+
+    if (!capable(CAP_SYS_ADMIN)) return -EPERM;
+
+    ret = mnt_want_write_file(file);
+
+    if (ret) return ret;
+
+    /* the planned pass freezes the filesystem, which would wait for this write access */
+    if (sbi->s_defrag_mode == BASICBTFS_DEFRAG_MODE_PLAN) {
+        mnt_drop_write_file(file);
+        return basicbtfs_defrag_plan_disk(inode->i_sb, inode);
+    }
+
+    ret = basicbtfs_defrag_disk(inode->i_sb, inode);
+
+    if (ret < 0) {
+        printk("something went wrong\n");
+    }
+
+    mnt_drop_write_file(file);
+    return ret;
+}
+
+/* Fills in the fragmentation report of the filesystem the file is on, it walks every inode */
+static long basicbtfs_ioctl_frag_stat(struct file *file, unsigned long arg) {
+    struct basicbtfs_ioctl_frag_stat *stat = NULL;
+    int ret = 0;
+
+    if (!capable(CAP_SYS_ADMIN)) return -EPERM;
+
+    stat = kzalloc(sizeof(struct basicbtfs_ioctl_frag_stat), GFP_KERNEL);
+
+    if (!stat) return -ENOMEM;
+
+    ret = basicbtfs_defrag_stat(file_inode(file)->i_sb, stat);
+
+    if (ret == 0 && copy_to_user((void __user *) arg, stat, sizeof(struct basicbtfs_ioctl_frag_stat))) ret = -EFAULT;
+
+    kfree(stat);
+    return ret;
+}
+
 long basicbtfs_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
     struct inode *inode = file_inode(file);
-    struct basicbtfs_inode_info *inode_info = BASICBTFS_INODE(inode);
     struct super_block *sb = inode->i_sb;
     struct dentry *dentry = sb->s_root;
-    int ret = 0;
 
     bool is_root = (inode->i_ino == 0) && (dentry->d_name.name && dentry->d_name.name[0] == '/');
 
-    printk("something has been sent: %d and filename %s\n", inode_info->i_bno, dentry->d_name.name);
-
     switch (cmd) {
         case BASICBTFS_IOC_DEFRAG:
-            if (is_root) {
-                ret = basicbtfs_defrag_disk(sb, inode);
-                if (ret < 0) {
-                    printk("something went wrong\n");
-                }
-            }
-            return -ENOTTY;
+            if (!is_root) return -EINVAL;
+
+            return basicbtfs_ioctl_defrag_disk(file);
+        case BASICBTFS_IOC_DEFRAG_FILE:
+            return basicbtfs_ioctl_defrag_file(file);
+        case BASICBTFS_IOC_FRAG_STAT:
+            return basicbtfs_ioctl_frag_stat(file, arg);
         default:
             return -ENOTTY;
     }
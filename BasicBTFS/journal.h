@@ -0,0 +1,269 @@
+#ifndef BASICBTFS_JOURNAL_H
+#define BASICBTFS_JOURNAL_H
+
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/jbd2.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+
+#include "basicbtfs.h"
+
+/*
+ * Metadata journal. An image made with mkfs -j has BASICBTFS_FEATURE_JOURNAL set and keeps a
+ * jbd2 journal in the s_journal_blocks blocks at s_journal_bno. Every namespace operation
+ * and every cluster allocation runs in a handle, and the btree, name list, cluster table,
+ * file map, bitmap and inode blocks it changes are read with basicbtfs_bread and dirtied
+ * with basicbtfs_mark_dirty, which add them to the running transaction. jbd2 only lets a
+ * block go to its home location once the transaction that changed it is in the journal,
+ * so after a crash a btree split shows up entirely or not at all. Transactions are
+ * committed every few seconds or on fsync, every handle that joined a transaction shares
+ * its commit. File data is not journaled nor ordered against the metadata.
+ *
+ * Without the feature there is no journal, no handle is ever started and the helpers
+ * behave like sb_bread and mark_buffer_dirty.
+ */
+static inline handle_t *basicbtfs_journal_handle(struct super_block *sb) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+
+    if (!sbi->s_journal) return NULL;
+
+    return journal_current_handle();
+}
+
+/* Returns NULL without a journal, nests in a handle the caller already runs in */
+static inline handle_t *basicbtfs_journal_start(struct super_block *sb, int credits) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+
+    if (!sbi->s_journal) return NULL;
+
+    return jbd2_journal_start(sbi->s_journal, credits);
+}
+
+static inline int basicbtfs_journal_stop(handle_t *handle) {
+    if (!handle) return 0;
+
+    return jbd2_journal_stop(handle);
+}
+
+/* Stops handle after an operation that returned ret, the error of the operation wins */
+static inline int basicbtfs_journal_end(handle_t *handle, int ret) {
+    int err = basicbtfs_journal_stop(handle);
+
+    return ret < 0 ? ret : err;
+}
+
+/* sb_bread for a metadata block that may be changed, in a handle the block joins the transaction */
+static inline struct buffer_head *basicbtfs_bread(struct super_block *sb, sector_t bno) {
+    struct buffer_head *bh = sb_bread(sb, bno);
+    handle_t *handle = basicbtfs_journal_handle(sb);
+    int ret = 0;
+
+    if (!bh || !handle) return bh;
+
+    ret = jbd2_journal_get_write_access(handle, bh);
+
+    if (ret < 0) {
+        printk(KERN_ERR "Could not journal block %llu: %d\n", (unsigned long long) bno, ret);
+        brelse(bh);
+        return NULL;
+    }
+
+    return bh;
+}
+
+/*
+ * mark_buffer_dirty for a block read with basicbtfs_bread. A block that never got write access,
+ * because it was read outside a handle or is file data, is written back as before.
+ *
+ * Handles start with the credits basicbtfs_dir_credits works out, so running out means the
+ * operation dirtied more than its bound. If the running transaction can not give one more
+ * credit the block is neither journaled nor written: the journal is aborted, so the half done
+ * operation never reaches the disk, and the handle fails with -EIO when it is stopped.
+ */
+static inline int basicbtfs_mark_dirty(struct buffer_head *bh) {
+    handle_t *handle = journal_current_handle();
+    int ret = 0;
+
+    if (!handle || !buffer_jbd(bh)) {
+        mark_buffer_dirty(bh);
+        return 0;
+    }
+
+    if (handle->h_buffer_credits < 1 && jbd2_journal_extend(handle, 1) != 0) {
+        printk(KERN_ERR "Journal handle out of credits for block %llu, aborting the journal\n", (unsigned long long) bh->b_blocknr);
+        jbd2_journal_abort(handle->h_transaction->t_journal, -ENOSPC);
+        return -ENOSPC;
+    }
+
+    ret = jbd2_journal_dirty_metadata(handle, bh);
+
+    if (ret < 0) {
+        printk(KERN_ERR "Could not journal block %llu: %d\n", (unsigned long long) bh->b_blocknr, ret);
+    }
+
+    return ret;
+}
+
+/*
+ * basicbtfs_mark_dirty for a block changed on behalf of a regular file, which the fsync of the
+ * file has to write. With a journal the file remembers the transaction. Without one a block
+ * of the file itself goes on the buffer list of the inode, a block it shares with other files
+ * is remembered by number, a buffer can only be on the list of one inode.
+ */
+static inline void basicbtfs_mark_dirty_inode(struct buffer_head *bh, struct inode *inode, bool shared) {
+    struct basicbtfs_inode_info *inode_info = BASICBTFS_INODE(inode);
+    handle_t *handle = journal_current_handle();
+    uint32_t i = 0;
+
+    if (handle && buffer_jbd(bh)) {
+        basicbtfs_mark_dirty(bh);
+        inode_info->i_sync_tid = handle->h_transaction->t_tid;
+        return;
+    }
+
+    if (!shared) {
+        mark_buffer_dirty_inode(bh, inode);
+        return;
+    }
+
+    mark_buffer_dirty(bh);
+
+    for (i = 0; i < inode_info->i_nr_shared_bnos && i < BASICBTFS_FSYNC_SHARED_BLOCKS; i++) {
+        if (inode_info->i_shared_bnos[i] == bh->b_blocknr) return;
+    }
+
+    if (inode_info->i_nr_shared_bnos < BASICBTFS_FSYNC_SHARED_BLOCKS) {
+        inode_info->i_shared_bnos[inode_info->i_nr_shared_bnos] = bh->b_blocknr;
+    }
+
+    inode_info->i_nr_shared_bnos = min_t(uint32_t, inode_info->i_nr_shared_bnos + 1, BASICBTFS_FSYNC_SHARED_BLOCKS + 1);
+}
+
+/*
+ * Copies bits first .. first + len - 1 of an in-memory bitmap into the blocks at block_offset
+ * that hold them. Outside a handle the blocks are only dirtied, sync_fs used to write the
+ * bitmaps as a whole but that would race with the journal.
+ */
+static inline void basicbtfs_journal_bitmap(struct basicbtfs_sb_info *sbi, unsigned long *bitmap, uint32_t block_offset, uint32_t first, uint32_t len) {
+    struct buffer_head *bh = NULL;
+    uint32_t bi = 0;
+
+    if (!sbi->s_journal || len == 0) return;
+
+    for (bi = first / (BASICBTFS_BLOCKSIZE * 8); bi <= (first + len - 1) / (BASICBTFS_BLOCKSIZE * 8); bi++) {
+        bh = basicbtfs_bread(sbi->s_sb, block_offset + bi);
+
+        if (!bh) return;
+
+        memcpy(bh->b_data, (void *) bitmap + bi * BASICBTFS_BLOCKSIZE, BASICBTFS_BLOCKSIZE);
+        basicbtfs_mark_dirty(bh);
+        brelse(bh);
+    }
+}
+
+/*
+ * Revokes freed metadata blocks. An older copy of a freed btree node could otherwise still be
+ * in the journal and be replayed over whatever the block holds by then, and a copy in the
+ * running transaction would be checkpointed over it, jbd2_journal_revoke forgets that copy.
+ * File data never goes through the journal and is freed with put_data_blocks, which does not
+ * come here. A revoked block that is reused as metadata has its revoke cancelled when it gets
+ * write access, so no block is revoked twice in one transaction.
+ */
+static inline void basicbtfs_journal_revoke(struct basicbtfs_sb_info *sbi, uint32_t bno, uint32_t len) {
+    handle_t *handle = NULL;
+    struct buffer_head *bh = NULL;
+    uint32_t i = 0;
+    int ret = 0;
+
+    if (!sbi->s_journal) return;
+
+    handle = journal_current_handle();
+
+    if (!handle) return;
+
+    for (i = bno; i < bno + len; i++) {
+        /* jbd2 drops the reference when it forgets the buffer, not when it fails */
+        bh = sb_find_get_block(sbi->s_sb, i);
+        ret = jbd2_journal_revoke(handle, i, bh);
+
+        if (ret < 0) {
+            printk(KERN_ERR "Could not revoke block %u: %d\n", i, ret);
+
+            if (bh) brelse(bh);
+        }
+    }
+}
+
+/* Blocks new handles and empties the journal, for defrag, which moves blocks without one */
+static inline int basicbtfs_journal_lock(struct super_block *sb) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    int ret = 0;
+
+    if (!sbi->s_journal) return 0;
+
+    jbd2_journal_lock_updates(sbi->s_journal);
+    ret = jbd2_journal_flush(sbi->s_journal);
+
+    if (ret < 0) {
+        jbd2_journal_unlock_updates(sbi->s_journal);
+    }
+
+    return ret;
+}
+
+/* Writes what was changed without the journal home before handles can touch the blocks again */
+static inline void basicbtfs_journal_unlock(struct super_block *sb) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+
+    if (!sbi->s_journal) return;
+
+    sync_blockdev(sb->s_bdev);
+    jbd2_journal_unlock_updates(sbi->s_journal);
+}
+
+/* Opens the journal and replays it, before anything else reads metadata from the disk */
+static inline int basicbtfs_journal_load(struct super_block *sb) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    journal_t *journal = NULL;
+    int ret = 0;
+
+    if (!(sbi->s_features & BASICBTFS_FEATURE_JOURNAL)) return 0;
+
+    if (sbi->s_journal_bno == 0 || sbi->s_journal_bno + sbi->s_journal_blocks > sbi->s_nblocks) {
+        printk(KERN_ERR "Journal at %u of %u blocks is outside the disk\n", sbi->s_journal_bno, sbi->s_journal_blocks);
+        return -EINVAL;
+    }
+
+    journal = jbd2_journal_init_dev(sb->s_bdev, sb->s_bdev, sbi->s_journal_bno, sbi->s_journal_blocks, BASICBTFS_BLOCKSIZE);
+
+    if (!journal) {
+        printk(KERN_ERR "Could not open the journal\n");
+        return -EINVAL;
+    }
+
+    journal->j_private = sb;
+    ret = jbd2_journal_load(journal);
+
+    if (ret < 0) {
+        printk(KERN_ERR "Could not load the journal: %d\n", ret);
+        jbd2_journal_destroy(journal);
+        return ret;
+    }
+
+    /* a commit flushes the disk cache, fsync relies on it */
+    journal->j_flags |= JBD2_BARRIER;
+    sbi->s_journal = journal;
+    return 0;
+}
+
+static inline void basicbtfs_journal_destroy(struct super_block *sb) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+
+    if (!sbi->s_journal) return;
+
+    jbd2_journal_destroy(sbi->s_journal);
+    sbi->s_journal = NULL;
+}
+
+#endif
@@ -1,4 +1,8 @@
+#include <dirent.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,6 +10,7 @@
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <linux/fs.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "basicbtfs.h"
@@ -33,7 +38,7 @@ static void my_set_bit(uint64_t *val, int bit, int value) {
     }
 }
 
-static struct superblock *write_superblock(int fd, struct stat *fstats) {
+static struct superblock *write_superblock(int fd, struct stat *fstats, uint32_t features) {
     struct superblock *sb = calloc(1, sizeof(struct superblock));
     if (!sb) {
         return NULL;
@@ -56,6 +61,7 @@ static struct superblock *write_superblock(int fd, struct stat *fstats) {
     sb->info.s_filemap_blocks = htole32(nr_file_map_blocks);
     sb->info.s_nfree_inodes = htole32(nr_inodes - 1);
     sb->info.s_nfree_blocks = htole32(nr_data_blocks - 1);
+    sb->info.s_features = htole32(features);
 
     int ret = write(fd, sb, sizeof(struct superblock));
     if (ret != sizeof(struct superblock)) {
@@ -93,50 +99,47 @@ static int write_ifree_blocks(int fd, struct superblock *sb) {
 static int write_bfree_blocks(int fd, struct superblock *sb)
 {
     uint32_t bits_used = le32toh(sb->info.s_imap_blocks) + le32toh(sb->info.s_bmap_blocks) + le32toh(sb->info.s_inode_blocks) +  le32toh(sb->info.s_filemap_blocks) + 2;
-    uint32_t blocks_used = bits_used / BASICBTFS_BLOCKSIZE;
-    uint32_t used_lines_last = (bits_used % BASICBTFS_BLOCKSIZE) / 64;
-    uint32_t used_lines_rem_last = (bits_used % BASICBTFS_BLOCKSIZE) % 64; // if not all 64 bits all free, this is are the first n not free bits.
+    uint32_t blocks_used = bits_used / (BASICBTFS_BLOCKSIZE * 8);
+    uint32_t used_lines_last = (bits_used % (BASICBTFS_BLOCKSIZE * 8)) / 64;
+    uint32_t used_lines_rem_last = (bits_used % (BASICBTFS_BLOCKSIZE * 8)) % 64; // if not all 64 bits all free, this is are the first n not free bits.
     int ret = 0;
 
     char block[BASICBTFS_BLOCKSIZE];
-    memset(block, 0, BASICBTFS_BLOCKSIZE);
+    memset(block, 0xFF, BASICBTFS_BLOCKSIZE);
 
     uint64_t *bfree = (uint64_t *) block;
 
     uint32_t i = 0;
 
     for (i = 0; i < blocks_used; i++) {
-        if (blocks_used - 1 == i) {
-            memset(bfree, 0, BASICBTFS_BLOCKSIZE);
-            uint32_t i = 0;
-            uint64_t line = 0xffffffffffffffff;
-
-            for (i = 0; i < used_lines_last; i++) {
-                bfree[i] = htole64(line);
-                bits_used -= 64;
-            }
+        ret = write(fd, block, BASICBTFS_BLOCKSIZE);
 
-            uint64_t test = 0;
+        if (ret != BASICBTFS_BLOCKSIZE) {
+            return -1;
+        }
+    }
 
-            for (i = 0; i < used_lines_rem_last; i++) {
-                my_set_bit(&test, i, 1);
-            }
+    if (used_lines_last || used_lines_rem_last) {
+        memset(bfree, 0, BASICBTFS_BLOCKSIZE);
+        uint64_t line = 0xffffffffffffffff;
 
-            bfree[used_lines_last] = htole64(test);
+        for (i = 0; i < used_lines_last; i++) {
+            bfree[i] = htole64(line);
+        }
 
-            ret = write(fd, bfree, BASICBTFS_BLOCKSIZE);
-            if (ret != BASICBTFS_BLOCKSIZE) {
-                return -1;
-            }
+        uint64_t test = 0;
 
-        } else {
-            memset(block, 0xFF, BASICBTFS_BLOCKSIZE);
-            ret = write(fd, block, BASICBTFS_BLOCKSIZE);
+        for (i = 0; i < used_lines_rem_last; i++) {
+            my_set_bit(&test, i, 1);
+        }
 
-            if (ret != BASICBTFS_BLOCKSIZE) {
-                return -1;
-            }
+        bfree[used_lines_last] = htole64(test);
+
+        ret = write(fd, bfree, BASICBTFS_BLOCKSIZE);
+        if (ret != BASICBTFS_BLOCKSIZE) {
+            return -1;
         }
+        blocks_used++;
     }
 
     memset(bfree, 0, BASICBTFS_BLOCKSIZE);
@@ -201,15 +204,741 @@ static int write_inode_blocks(int fd, struct superblock *sb) {
 }
 
 
+/* Zeroes the block of the root directory, fill_super initialises an empty root on first mount */
+static int write_root_block(int fd) {
+    char block[BASICBTFS_BLOCKSIZE];
+    memset(block, 0, BASICBTFS_BLOCKSIZE);
+
+    int ret = write(fd, block, BASICBTFS_BLOCKSIZE);
+    if (ret != BASICBTFS_BLOCKSIZE) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* The first fields of a jbd2 journal superblock, which are big endian */
+struct jbd2_superblock {
+    uint32_t h_magic;
+    uint32_t h_blocktype;
+    uint32_t h_sequence;
+    uint32_t s_blocksize;
+    uint32_t s_maxlen;
+    uint32_t s_first;
+    uint32_t s_sequence;
+    uint32_t s_start;
+    int32_t s_errno;
+    uint32_t s_feature_compat;
+    uint32_t s_feature_incompat;
+    uint32_t s_feature_ro_compat;
+    uint8_t s_uuid[16];
+    uint32_t s_nr_users;
+};
+
+#define JBD2_MAGIC_NUMBER     0xc03b3998
+#define JBD2_SUPERBLOCK_V2    4
+#define JBD2_MIN_JOURNAL_BLOCKS 1024
+
+/*
+ * Reserves the last blocks of the disk for the metadata journal and writes an empty jbd2
+ * journal into them. Small images get a quarter of the disk instead of BASICBTFS_JOURNAL_BLOCKS.
+ */
+static int write_journal(int fd, struct superblock *sb) {
+    char block[BASICBTFS_BLOCKSIZE];
+    struct jbd2_superblock *jsb = (struct jbd2_superblock *) block;
+    uint32_t nr_blocks = le32toh(sb->info.s_nblocks);
+    uint32_t journal_blocks = BASICBTFS_JOURNAL_BLOCKS;
+    uint32_t bmap_offset = 1 + le32toh(sb->info.s_imap_blocks);
+    uint32_t bmap_size = le32toh(sb->info.s_bmap_blocks) * BASICBTFS_BLOCKSIZE;
+    uint32_t journal_bno = 0, i = 0;
+    uint8_t *bmap = NULL;
+
+    if (journal_blocks > nr_blocks / 4) {
+        journal_blocks = nr_blocks / 4;
+    }
+
+    if (journal_blocks < JBD2_MIN_JOURNAL_BLOCKS || journal_blocks > le32toh(sb->info.s_nfree_blocks)) {
+        fprintf(stderr, "the image is too small for a journal\n");
+        return -1;
+    }
+
+    journal_bno = nr_blocks - journal_blocks;
+
+    bmap = malloc(bmap_size);
+    if (!bmap) {
+        return -1;
+    }
+
+    if (pread(fd, bmap, bmap_size, (off_t) bmap_offset * BASICBTFS_BLOCKSIZE) != bmap_size) {
+        free(bmap);
+        return -1;
+    }
+
+    for (i = journal_bno; i < nr_blocks; i++) {
+        bmap[i / 8] |= 1 << (i % 8);
+    }
+
+    if (pwrite(fd, bmap, bmap_size, (off_t) bmap_offset * BASICBTFS_BLOCKSIZE) != bmap_size) {
+        free(bmap);
+        return -1;
+    }
+    free(bmap);
+
+    /* s_start 0 is an empty journal, jbd2 starts logging at s_first */
+    memset(block, 0, BASICBTFS_BLOCKSIZE);
+    jsb->h_magic = htobe32(JBD2_MAGIC_NUMBER);
+    jsb->h_blocktype = htobe32(JBD2_SUPERBLOCK_V2);
+    jsb->s_blocksize = htobe32(BASICBTFS_BLOCKSIZE);
+    jsb->s_maxlen = htobe32(journal_blocks);
+    jsb->s_first = htobe32(1);
+    jsb->s_sequence = htobe32(1);
+    jsb->s_start = 0;
+    jsb->s_nr_users = htobe32(1);
+
+    if (pwrite(fd, block, BASICBTFS_BLOCKSIZE, (off_t) journal_bno * BASICBTFS_BLOCKSIZE) != BASICBTFS_BLOCKSIZE) {
+        return -1;
+    }
+
+    sb->info.s_journal_bno = htole32(journal_bno);
+    sb->info.s_journal_blocks = htole32(journal_blocks);
+    sb->info.s_nfree_blocks = htole32(le32toh(sb->info.s_nfree_blocks) - journal_blocks);
+
+    if (pwrite(fd, sb, sizeof(struct superblock), 0) != sizeof(struct superblock)) {
+        return -1;
+    }
+
+    printf("Journal of %u blocks at block %u\n", journal_blocks, journal_bno);
+    return 0;
+}
+
+/*
+ * Populate mode: copies a directory tree into the fresh image. Everything is laid out
+ * in the order defrag uses: per directory its btree (bulk loaded, root first), its name
+ * list and then every child in hash order. Blocks and inodes are handed out sequentially.
+ */
+struct populate_ctx {
+    int fd;
+    struct superblock *sb;
+    uint8_t *imap;
+    uint8_t *bmap;
+    uint32_t next_ino;
+    uint32_t next_bno;
+    uint32_t fill_factor;
+    bool linked_leaves;
+    uint32_t nr_of_dirs;
+    uint32_t nr_of_files;
+    uint32_t nr_of_nodes;
+    uint32_t max_height;
+    uint64_t nr_of_entries;
+    uint64_t build_ns;
+};
+
+struct populate_entry {
+    char name[BASICBTFS_NAME_LENGTH + 1];
+    uint32_t name_length;
+    struct stat stat_buf;
+    struct basicbtfs_entry entry;
+};
+
+/* Same crc32 as crc32() in the kernel: little endian, seed 0 and no final inversion */
+static uint32_t crc32_le(uint32_t crc, const unsigned char *p, size_t len) {
+    int i;
+
+    while (len--) {
+        crc ^= *p++;
+        for (i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
+        }
+    }
+
+    return crc;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int write_block(int fd, uint32_t bno, void *block) {
+    int ret = pwrite(fd, block, BASICBTFS_BLOCKSIZE, (off_t) bno * BASICBTFS_BLOCKSIZE);
+    if (ret != BASICBTFS_BLOCKSIZE) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static uint32_t alloc_blocks(struct populate_ctx *ctx, uint32_t len) {
+    uint32_t bno = ctx->next_bno, i;
+
+    if (bno + len > le32toh(ctx->sb->info.s_nblocks) || len > le32toh(ctx->sb->info.s_nfree_blocks)) {
+        fprintf(stderr, "not enough free blocks to populate the image\n");
+        return -1;
+    }
+
+    for (i = bno; i < bno + len; i++) {
+        ctx->bmap[i / 8] |= 1 << (i % 8);
+    }
+
+    ctx->next_bno += len;
+    ctx->sb->info.s_nfree_blocks = htole32(le32toh(ctx->sb->info.s_nfree_blocks) - len);
+    return bno;
+}
+
+static uint32_t alloc_inode(struct populate_ctx *ctx) {
+    uint32_t ino = ctx->next_ino;
+
+    if (ino >= le32toh(ctx->sb->info.s_ninodes) || le32toh(ctx->sb->info.s_nfree_inodes) == 0) {
+        fprintf(stderr, "not enough free inodes to populate the image\n");
+        return -1;
+    }
+
+    ctx->imap[ino / 8] |= 1 << (ino % 8);
+    ctx->next_ino++;
+    ctx->sb->info.s_nfree_inodes = htole32(le32toh(ctx->sb->info.s_nfree_inodes) - 1);
+    return ino;
+}
+
+static int write_inode(struct populate_ctx *ctx, uint32_t ino, struct stat *stat_buf, uint32_t nlink, uint32_t size, uint32_t bno) {
+    struct basicbtfs_inode inode;
+    uint32_t inode_block = ino / BASICBTFS_INODES_PER_BLOCK + le32toh(ctx->sb->info.s_imap_blocks) + le32toh(ctx->sb->info.s_bmap_blocks) + 1;
+    off_t offset = (off_t) inode_block * BASICBTFS_BLOCKSIZE + (ino % BASICBTFS_INODES_PER_BLOCK) * sizeof(struct basicbtfs_inode);
+
+    memset(&inode, 0, sizeof(struct basicbtfs_inode));
+    inode.i_mode = htole32(stat_buf->st_mode);
+    inode.i_uid = htole32(stat_buf->st_uid);
+    inode.i_gid = htole32(stat_buf->st_gid);
+    inode.i_size = htole32(size);
+    inode.i_ctime = htole32(stat_buf->st_ctime);
+    inode.i_atime = htole32(stat_buf->st_atime);
+    inode.i_mtime = htole32(stat_buf->st_mtime);
+    inode.i_blocks = htole32(1);
+    inode.i_nlink = htole32(nlink);
+    inode.i_bno = htole32(bno);
+
+    if (pwrite(ctx->fd, &inode, sizeof(struct basicbtfs_inode), offset) != sizeof(struct basicbtfs_inode)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int write_filemap(struct populate_ctx *ctx, uint32_t bno, uint32_t ino, uint32_t cluster_index) {
+    struct basicbtfs_fileblock_info info[BASICBTFS_MAX_BLOCKS_PER_CLUSTER];
+    uint32_t filemap_block = 1 + le32toh(ctx->sb->info.s_imap_blocks) + le32toh(ctx->sb->info.s_bmap_blocks) + le32toh(ctx->sb->info.s_inode_blocks);
+    off_t offset = (off_t) filemap_block * BASICBTFS_BLOCKSIZE + (off_t) bno * sizeof(struct basicbtfs_fileblock_info);
+    uint32_t i;
+
+    for (i = 0; i < BASICBTFS_MAX_BLOCKS_PER_CLUSTER; i++) {
+        info[i].ino = htole32(ino);
+        info[i].cluster_index = htole32(cluster_index);
+    }
+
+    if (pwrite(ctx->fd, info, sizeof(info), offset) != sizeof(info)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int populate_file(struct populate_ctx *ctx, const char *path, struct populate_entry *child) {
+    char block[BASICBTFS_BLOCKSIZE];
+    struct basicbtfs_disk_block *disk_block = (struct basicbtfs_disk_block *) block;
+    struct basicbtfs_cluster_table *cluster_table = &disk_block->block_type.cluster_table;
+    uint32_t nr_of_blocks = div_ceil(child->stat_buf.st_size, BASICBTFS_BLOCKSIZE);
+    uint32_t nr_of_clusters = div_ceil(nr_of_blocks, BASICBTFS_MAX_BLOCKS_PER_CLUSTER);
+    uint32_t table_bno = 0, bno = 0, i = 0, j = 0;
+    ssize_t len = 0;
+    int fd = -1, ret = 0;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror(path);
+        return -1;
+    }
+
+    table_bno = alloc_blocks(ctx, 1);
+    if (table_bno == -1) {
+        close(fd);
+        return -1;
+    }
+
+    memset(block, 0, BASICBTFS_BLOCKSIZE);
+    disk_block->block_type_id = BASICBTFS_BLOCKTYPE_CLUSTER_TABLE;
+    cluster_table->ino = htole32(child->entry.ino);
+
+    for (i = 0; i < nr_of_clusters; i++) {
+        bno = alloc_blocks(ctx, BASICBTFS_MAX_BLOCKS_PER_CLUSTER);
+        if (bno == -1) {
+            close(fd);
+            return -1;
+        }
+
+        cluster_table->table[i].start_bno = htole32(bno);
+        cluster_table->table[i].cluster_length = htole32(BASICBTFS_MAX_BLOCKS_PER_CLUSTER);
+
+        ret = write_filemap(ctx, bno, child->entry.ino, i);
+        if (ret < 0) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    ret = write_block(ctx->fd, table_bno, block);
+    if (ret < 0) {
+        close(fd);
+        return -1;
+    }
+
+    /* Copy the data, the tail of the last cluster stays zeroed */
+    for (i = 0; i < nr_of_clusters; i++) {
+        bno = le32toh(cluster_table->table[i].start_bno);
+
+        for (j = 0; j < BASICBTFS_MAX_BLOCKS_PER_CLUSTER; j++) {
+            char data[BASICBTFS_BLOCKSIZE];
+            memset(data, 0, BASICBTFS_BLOCKSIZE);
+
+            len = read(fd, data, BASICBTFS_BLOCKSIZE);
+            if (len < 0) {
+                perror(path);
+                close(fd);
+                return -1;
+            }
+
+            ret = write_block(ctx->fd, bno + j, data);
+            if (ret < 0) {
+                close(fd);
+                return -1;
+            }
+        }
+    }
+
+    close(fd);
+    ctx->nr_of_files++;
+    return write_inode(ctx, child->entry.ino, &child->stat_buf, 1, child->stat_buf.st_size, table_bno);
+}
+
+/* Writes the name list of a directory and fills in name_bno and block_index of every child */
+static int populate_namelist(struct populate_ctx *ctx, uint32_t dir_ino, struct populate_entry *children, uint32_t nr_of_children, uint32_t *tree_name_bno) {
+    char block[BASICBTFS_BLOCKSIZE];
+    struct basicbtfs_disk_block *disk_block = (struct basicbtfs_disk_block *) block;
+    struct basicbtfs_name_list_hdr *hdr = &disk_block->block_type.name_list_hdr;
+    struct basicbtfs_name_entry *name_entry = NULL;
+    uint32_t nr_of_blocks = 1, used = BASICBTFS_NAME_ENTRY_S_OFFSET, first_bno = 0, bno = 0, i = 0, len = 0;
+
+    /* Count the blocks first, so the list can be allocated as one extent */
+    for (i = 0; i < nr_of_children; i++) {
+        len = children[i].name_length + 1 + sizeof(struct basicbtfs_name_entry);
+        if (BASICBTFS_BLOCKSIZE - used <= len) {
+            nr_of_blocks++;
+            used = BASICBTFS_NAME_ENTRY_S_OFFSET;
+        }
+        used += len;
+    }
+
+    first_bno = alloc_blocks(ctx, nr_of_blocks);
+    if (first_bno == -1) {
+        return -1;
+    }
+
+    bno = first_bno;
+    memset(block, 0, BASICBTFS_BLOCKSIZE);
+    disk_block->block_type_id = BASICBTFS_BLOCKTYPE_NAMETREE;
+    hdr->free_bytes = BASICBTFS_EMPTY_NAME_TREE;
+    hdr->start_unused_area = BASICBTFS_NAME_ENTRY_S_OFFSET;
+    hdr->first_list = true;
+    hdr->prev_block = dir_ino;
+
+    for (i = 0; i < nr_of_children; i++) {
+        len = children[i].name_length + 1 + sizeof(struct basicbtfs_name_entry);
+
+        if (BASICBTFS_BLOCKSIZE - hdr->start_unused_area <= len) {
+            hdr->next_block = bno + 1;
+            if (write_block(ctx->fd, bno, block) < 0) {
+                return -1;
+            }
+
+            memset(block, 0, BASICBTFS_BLOCKSIZE);
+            disk_block->block_type_id = BASICBTFS_BLOCKTYPE_NAMETREE;
+            hdr->free_bytes = BASICBTFS_EMPTY_NAME_TREE;
+            hdr->start_unused_area = BASICBTFS_NAME_ENTRY_S_OFFSET;
+            hdr->first_list = false;
+            hdr->prev_block = bno;
+            bno++;
+        }
+
+        children[i].entry.name_bno = bno;
+        children[i].entry.block_index = hdr->start_unused_area;
+
+        name_entry = (struct basicbtfs_name_entry *) (block + hdr->start_unused_area);
+        name_entry->ino = children[i].entry.ino;
+        name_entry->name_length = children[i].name_length + 1;
+        name_entry->file_type = BASICBTFS_DT_TYPE(children[i].stat_buf.st_mode);
+        memcpy(name_entry + 1, children[i].name, children[i].name_length + 1);
+
+        hdr->free_bytes -= len;
+        hdr->start_unused_area += len;
+        hdr->nr_of_entries++;
+    }
+
+    if (write_block(ctx->fd, bno, block) < 0) {
+        return -1;
+    }
+
+    *tree_name_bno = first_bno;
+    return 0;
+}
+
+/*
+ * Userspace twin of basicbtfs_btree_bulk_load(). The nodes are written into
+ * bnos root_bno .. root_bno + plan->total_nodes - 1, root first. With
+ * plan->linked_leaves the leaves are chained and keep all entries (B+-tree).
+ */
+static int bulk_load_btree(struct populate_ctx *ctx, uint32_t dir_ino, struct basicbtfs_entry *entries, uint32_t nr_of_entries, uint32_t root_bno, uint32_t tree_name_bno, struct basicbtfs_btree_bulk_plan *plan) {
+    char block[BASICBTFS_BLOCKSIZE];
+    struct basicbtfs_disk_block *disk_block = (struct basicbtfs_disk_block *) block;
+    struct basicbtfs_btree_node *node = &disk_block->block_type.btree_node;
+    uint32_t level = 0, index = 0, i = 0, nr_of_keys = 0;
+    uint32_t key_index = 0, child_index = 0, parent_index = 0, parent_children = 0;
+
+    for (level = 0; level < plan->height; level++) {
+        key_index = 0;
+        child_index = 0;
+        parent_index = 0;
+        parent_children = level + 1 < plan->height ? basicbtfs_btree_bulk_nr_of_keys(plan, level + 1, 0) + 1 : 0;
+
+        for (index = 0; index < plan->nr_of_nodes[level]; index++) {
+            memset(block, 0, BASICBTFS_BLOCKSIZE);
+            disk_block->block_type_id = BASICBTFS_BLOCKTYPE_BTREE_NODE;
+
+            nr_of_keys = basicbtfs_btree_bulk_nr_of_keys(plan, level, index);
+            memcpy(node->entries, &entries[key_index], nr_of_keys * sizeof(struct basicbtfs_entry));
+            key_index += nr_of_keys;
+            node->nr_of_keys = nr_of_keys;
+            node->leaf = level == 0;
+
+            if (!node->leaf) {
+                for (i = 0; i <= nr_of_keys; i++) {
+                    node->children[i] = root_bno + plan->first_node[level - 1] + child_index + i;
+                }
+                child_index += nr_of_keys + 1;
+            } else if (plan->linked_leaves) {
+                node->prev_leaf = index > 0 ? root_bno + plan->first_node[0] + index - 1 : 0;
+                node->next_leaf = index + 1 < plan->nr_of_nodes[0] ? root_bno + plan->first_node[0] + index + 1 : 0;
+            }
+
+            if (level + 1 == plan->height) {
+                node->parent = dir_ino;
+                node->root = true;
+                node->tree_name_bno = tree_name_bno;
+                node->nr_of_files = nr_of_entries;
+            } else {
+                node->parent = root_bno + plan->first_node[level + 1] + parent_index;
+
+                if (--parent_children == 0 && parent_index + 1 < plan->nr_of_nodes[level + 1]) {
+                    parent_index++;
+                    parent_children = basicbtfs_btree_bulk_nr_of_keys(plan, level + 1, parent_index) + 1;
+                }
+
+                if (index + 1 < plan->nr_of_nodes[level]) {
+                    entries[index] = entries[key_index];
+
+                    if (!node->leaf || !plan->linked_leaves) {
+                        key_index++;
+                    }
+                }
+            }
+
+            if (write_block(ctx->fd, root_bno + plan->first_node[level] + index, block) < 0) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int compare_name(const void *a, const void *b) {
+    return strcmp(((const struct populate_entry *) a)->name, ((const struct populate_entry *) b)->name);
+}
+
+static int compare_hash(const void *a, const void *b) {
+    uint32_t hash_a = ((const struct populate_entry *) a)->entry.hash;
+    uint32_t hash_b = ((const struct populate_entry *) b)->entry.hash;
+
+    return (hash_a > hash_b) - (hash_a < hash_b);
+}
+
+/* Populates directory dir_ino from path, *root_bno is the preallocated root or 0 to allocate one */
+static int populate_dir(struct populate_ctx *ctx, const char *path, uint32_t dir_ino, uint32_t *root_bno, uint32_t *nr_of_subdirs) {
+    struct populate_entry *children = NULL, *tmp = NULL;
+    struct basicbtfs_entry *entries = NULL;
+    struct basicbtfs_btree_bulk_plan plan;
+    struct dirent *dirent = NULL;
+    char child_path[PATH_MAX];
+    uint32_t nr_of_children = 0, max_children = 0, nr_of_entries = 0, tree_name_bno = 0, i = 0, subdirs = 0;
+    uint64_t start = 0;
+    int ret = -1;
+    DIR *dir = NULL;
+
+    dir = opendir(path);
+    if (!dir) {
+        perror(path);
+        return -1;
+    }
+
+    while ((dirent = readdir(dir)) != NULL) {
+        if (!strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, "..")) {
+            continue;
+        }
+
+        if (nr_of_children == max_children) {
+            max_children = max_children ? 2 * max_children : 64;
+            tmp = realloc(children, max_children * sizeof(struct populate_entry));
+            if (!tmp) {
+                goto out;
+            }
+            children = tmp;
+        }
+
+        tmp = &children[nr_of_children];
+        memset(tmp, 0, sizeof(struct populate_entry));
+        tmp->name_length = strlen(dirent->d_name);
+
+        if (tmp->name_length > BASICBTFS_NAME_LENGTH) {
+            fprintf(stderr, "skipping %s/%s: name too long\n", path, dirent->d_name);
+            continue;
+        }
+
+        memcpy(tmp->name, dirent->d_name, tmp->name_length + 1);
+        snprintf(child_path, PATH_MAX, "%s/%s", path, tmp->name);
+
+        if (lstat(child_path, &tmp->stat_buf)) {
+            perror(child_path);
+            goto out;
+        }
+
+        if (!S_ISREG(tmp->stat_buf.st_mode) && !S_ISDIR(tmp->stat_buf.st_mode)) {
+            fprintf(stderr, "skipping %s: not a regular file or directory\n", child_path);
+            continue;
+        }
+
+        if (S_ISREG(tmp->stat_buf.st_mode) && tmp->stat_buf.st_size > BASICBTFS_FILE_BSIZE) {
+            fprintf(stderr, "skipping %s: larger than %lu bytes\n", child_path, (unsigned long) BASICBTFS_FILE_BSIZE);
+            continue;
+        }
+
+        tmp->entry.hash = crc32_le(0, (const unsigned char *) tmp->name, tmp->name_length);
+        nr_of_children++;
+    }
+
+    /* The btree can not hold two names with the same hash, keep the first one */
+    qsort(children, nr_of_children, sizeof(struct populate_entry), compare_hash);
+
+    for (i = 0; i < nr_of_children; i++) {
+        if (nr_of_entries && children[nr_of_entries - 1].entry.hash == children[i].entry.hash) {
+            fprintf(stderr, "skipping %s/%s: hash collision with %s\n", path, children[i].name, children[nr_of_entries - 1].name);
+            continue;
+        }
+        children[nr_of_entries++] = children[i];
+    }
+    nr_of_children = nr_of_entries;
+
+    /* Names are stored in name order, the btree needs them sorted on hash */
+    qsort(children, nr_of_children, sizeof(struct populate_entry), compare_name);
+
+    for (i = 0; i < nr_of_children; i++) {
+        children[i].entry.ino = alloc_inode(ctx);
+        if (children[i].entry.ino == -1) {
+            goto out;
+        }
+
+        if (S_ISDIR(children[i].stat_buf.st_mode)) {
+            subdirs++;
+        }
+    }
+
+    if (basicbtfs_btree_bulk_plan(&plan, nr_of_entries, ctx->fill_factor, ctx->linked_leaves) < 0) {
+        fprintf(stderr, "%s: too many entries\n", path);
+        goto out;
+    }
+
+    if (*root_bno == 0) {
+        *root_bno = alloc_blocks(ctx, plan.total_nodes);
+    } else if (plan.total_nodes > 1 && alloc_blocks(ctx, plan.total_nodes - 1) != *root_bno + 1) {
+        /* the root of the image is preallocated, the rest of its tree has to follow it */
+        goto out;
+    }
+
+    if (*root_bno == -1) {
+        goto out;
+    }
+
+    if (populate_namelist(ctx, dir_ino, children, nr_of_children, &tree_name_bno) < 0) {
+        goto out;
+    }
+
+    qsort(children, nr_of_children, sizeof(struct populate_entry), compare_hash);
+
+    entries = malloc((nr_of_entries ? nr_of_entries : 1) * sizeof(struct basicbtfs_entry));
+    if (!entries) {
+        goto out;
+    }
+
+    for (i = 0; i < nr_of_entries; i++) {
+        entries[i] = children[i].entry;
+    }
+
+    start = now_ns();
+    if (bulk_load_btree(ctx, dir_ino, entries, nr_of_entries, *root_bno, tree_name_bno, &plan) < 0) {
+        goto out;
+    }
+    ctx->build_ns += now_ns() - start;
+
+    ctx->nr_of_dirs++;
+    ctx->nr_of_entries += nr_of_entries;
+    ctx->nr_of_nodes += plan.total_nodes;
+    if (plan.height > ctx->max_height) {
+        ctx->max_height = plan.height;
+    }
+
+    for (i = 0; i < nr_of_children; i++) {
+        snprintf(child_path, PATH_MAX, "%s/%s", path, children[i].name);
+
+        if (S_ISDIR(children[i].stat_buf.st_mode)) {
+            uint32_t child_subdirs = 0, child_root_bno = 0;
+
+            if (populate_dir(ctx, child_path, children[i].entry.ino, &child_root_bno, &child_subdirs) < 0) {
+                goto out;
+            }
+
+            if (write_inode(ctx, children[i].entry.ino, &children[i].stat_buf, 2 + child_subdirs, BASICBTFS_BLOCKSIZE, child_root_bno) < 0) {
+                goto out;
+            }
+        } else if (populate_file(ctx, child_path, &children[i]) < 0) {
+            goto out;
+        }
+    }
+
+    *nr_of_subdirs = subdirs;
+    ret = 0;
+
+out:
+    free(entries);
+    free(children);
+    closedir(dir);
+    return ret;
+}
+
+static int populate(int fd, struct superblock *sb, const char *srcdir, uint32_t fill_factor) {
+    struct populate_ctx ctx;
+    struct stat stat_buf;
+    uint32_t imap_offset = 1, bmap_offset = 1 + le32toh(sb->info.s_imap_blocks);
+    uint32_t imap_size = le32toh(sb->info.s_imap_blocks) * BASICBTFS_BLOCKSIZE;
+    uint32_t bmap_size = le32toh(sb->info.s_bmap_blocks) * BASICBTFS_BLOCKSIZE;
+    uint32_t root_bno = bmap_offset + le32toh(sb->info.s_bmap_blocks) + le32toh(sb->info.s_inode_blocks) + le32toh(sb->info.s_filemap_blocks);
+    uint32_t nr_of_subdirs = 0;
+    int ret = -1;
+
+    if (stat(srcdir, &stat_buf) || !S_ISDIR(stat_buf.st_mode)) {
+        fprintf(stderr, "%s is not a directory\n", srcdir);
+        return -1;
+    }
+
+    memset(&ctx, 0, sizeof(struct populate_ctx));
+    ctx.fd = fd;
+    ctx.sb = sb;
+    ctx.fill_factor = fill_factor;
+    ctx.linked_leaves = le32toh(sb->info.s_features) & BASICBTFS_FEATURE_BPTREE;
+    ctx.next_ino = 1;
+    ctx.next_bno = root_bno + 1;
+    ctx.imap = malloc(imap_size);
+    ctx.bmap = malloc(bmap_size);
+
+    if (!ctx.imap || !ctx.bmap) {
+        goto out;
+    }
+
+    /* Start from the bitmaps mkfs has just written */
+    if (pread(fd, ctx.imap, imap_size, (off_t) imap_offset * BASICBTFS_BLOCKSIZE) != imap_size ||
+        pread(fd, ctx.bmap, bmap_size, (off_t) bmap_offset * BASICBTFS_BLOCKSIZE) != bmap_size) {
+        goto out;
+    }
+
+    if (populate_dir(&ctx, srcdir, 0, &root_bno, &nr_of_subdirs) < 0) {
+        goto out;
+    }
+
+    stat_buf.st_mode = S_IFDIR | (stat_buf.st_mode & 07777);
+    if (write_inode(&ctx, 0, &stat_buf, 2 + nr_of_subdirs, BASICBTFS_BLOCKSIZE, root_bno) < 0) {
+        goto out;
+    }
+
+    sb->info.s_unused_area = htole32(ctx.next_bno);
+
+    if (pwrite(fd, ctx.imap, imap_size, (off_t) imap_offset * BASICBTFS_BLOCKSIZE) != imap_size ||
+        pwrite(fd, ctx.bmap, bmap_size, (off_t) bmap_offset * BASICBTFS_BLOCKSIZE) != bmap_size ||
+        pwrite(fd, sb, sizeof(struct superblock), 0) != sizeof(struct superblock)) {
+        goto out;
+    }
+
+    printf("Populated %u directories and %u files (%lu entries) from %s\n", ctx.nr_of_dirs, ctx.nr_of_files, (unsigned long) ctx.nr_of_entries, srcdir);
+    printf("Btree build: %u nodes, max height %u, fill factor %u%%, %.3f ms\n", ctx.nr_of_nodes, ctx.max_height, fill_factor, ctx.build_ns / 1e6);
+    ret = 0;
+
+out:
+    free(ctx.imap);
+    free(ctx.bmap);
+    return ret;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-b] [-j] [-d srcdir] [-f fill_factor] image\n", prog);
+    fprintf(stderr, "  -b              use B+-tree directories with linked leaves (hash ordered readdir)\n");
+    fprintf(stderr, "  -j              journal metadata changes, the journal takes the last %d blocks of the disk\n", BASICBTFS_JOURNAL_BLOCKS);
+    fprintf(stderr, "  -d srcdir       populate the new filesystem with the contents of srcdir\n");
+    fprintf(stderr, "  -f fill_factor  percentage of each btree node to fill in populate mode (50-100, default %d)\n", BASICBTFS_BTREE_FILL_FACTOR);
+}
+
 int main(int argc, char **argv)
 {
-    if (argc != 2) {
-        perror("Not correct amount of arguments\n");
+    const char *srcdir = NULL;
+    uint32_t fill_factor = BASICBTFS_BTREE_FILL_FACTOR;
+    uint32_t features = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "bjd:f:")) != -1) {
+        switch (opt) {
+        case 'b':
+            features |= BASICBTFS_FEATURE_BPTREE;
+            break;
+        case 'j':
+            features |= BASICBTFS_FEATURE_JOURNAL;
+            break;
+        case 'd':
+            srcdir = optarg;
+            break;
+        case 'f':
+            fill_factor = atoi(optarg);
+            if (fill_factor < 50 || fill_factor > 100) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind != 1) {
+        usage(argv[0]);
         return EXIT_FAILURE;
     }
 
     /* Open disk image */
-    int fd = open(argv[1], O_RDWR);
+    int fd = open(argv[optind], O_RDWR);
     if (fd == -1) {
         perror("could not open disk\n");
         return EXIT_FAILURE;
@@ -234,7 +963,7 @@ int main(int argc, char **argv)
         stat_buf.st_size = blk_size;
     }
 
-    struct superblock *sb = write_superblock(fd, &stat_buf);
+    struct superblock *sb = write_superblock(fd, &stat_buf, features);
     if (!sb) {
         perror("write_superblock() failed:");
         close(fd);
@@ -273,6 +1002,34 @@ int main(int argc, char **argv)
         return EXIT_FAILURE;
     }
 
+    ret = write_root_block(fd);
+    if (ret) {
+        perror("write_root_block() failed");
+        free(sb);
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    if (features & BASICBTFS_FEATURE_JOURNAL) {
+        ret = write_journal(fd, sb);
+        if (ret) {
+            perror("write_journal() failed");
+            free(sb);
+            close(fd);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (srcdir) {
+        ret = populate(fd, sb, srcdir, fill_factor);
+        if (ret) {
+            fprintf(stderr, "populating from %s failed\n", srcdir);
+            free(sb);
+            close(fd);
+            return EXIT_FAILURE;
+        }
+    }
+
     free(sb);
     close(fd);
     return ret;
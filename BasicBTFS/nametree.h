@@ -9,94 +9,129 @@
 
 #include "basicbtfs.h"
 #include "bitmap.h"
+#include "btree.h"
+#include "bptree.h"
 #include "cache.h"
-
-static inline int basicbtfs_nametree_emit_block(struct buffer_head *bh, int *total_nr_entries, int *current_index, struct dir_context *ctx, loff_t start_pos) {
+#include "init.h"
+#include "stats.h"
+
+/*
+ * Emits the names of the name list starting at name_bno. With resume set it continues at the
+ * cursor, otherwise ctx->pos - 2 names are skipped first, whole blocks at a time where possible.
+ */
+static inline int basicbtfs_nametree_iterate_name(struct super_block *sb, uint32_t name_bno, struct dir_context *ctx, struct basicbtfs_dir_cursor *cursor, bool resume) {
+    struct buffer_head *bh = NULL;
     struct basicbtfs_name_list_hdr *name_list_hdr = NULL;
-    struct basicbtfs_name_entry *cur_entry = NULL;
     struct basicbtfs_disk_block *disk_block = NULL;
-    char *block = NULL;
-    char *filename = NULL;
-    int i = 0;
+    uint32_t offset = BASICBTFS_NAME_ENTRY_S_OFFSET;
+    loff_t skip = ctx->pos - 2;
 
-    
-    disk_block = (struct basicbtfs_disk_block *) bh->b_data;
-    name_list_hdr = &disk_block->block_type.name_list_hdr;
+    if (resume) {
+        name_bno = cursor->name_bno;
+        offset = cursor->offset;
+        skip = 0;
+    }
 
-    block = (char *) bh->b_data;
-    block += BASICBTFS_NAME_ENTRY_S_OFFSET;
-    cur_entry = (struct basicbtfs_name_entry *) block;
-    *total_nr_entries += name_list_hdr->nr_of_entries;
+    while (name_bno != 0) {
+        bh = basicbtfs_bread(sb, name_bno);
 
-    if (start_pos < *total_nr_entries) {
-        for (i = 0; i < name_list_hdr->nr_of_entries; i++) {
-            block += sizeof(struct basicbtfs_name_entry);
-            if (cur_entry->ino != 0) {
-                filename = kzalloc(sizeof(char) * cur_entry->name_length, GFP_KERNEL);
-                strncpy(filename, block, cur_entry->name_length);
-                if (!dir_emit(ctx, filename, cur_entry->name_length - 1, cur_entry->ino, DT_UNKNOWN)) {
-                    printk(KERN_INFO "No files available anymore\n");
-                    kfree(filename);
-                    brelse(bh);
-                    return 1;
-                }
-                ctx->pos++;
-                kfree(filename);
-            } else {
-                i--;
+        if (!bh) return -EIO;
+
+        disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+        name_list_hdr = &disk_block->block_type.name_list_hdr;
+
+        if (skip >= name_list_hdr->nr_of_entries) {
+            skip -= name_list_hdr->nr_of_entries;
+        } else {
+            if (skip > 0) {
+                offset = basicbtfs_cache_block_offset(bh->b_data, skip);
+                skip = 0;
             }
 
-            block += cur_entry->name_length;
-            cur_entry = (struct basicbtfs_name_entry *) block;
-            *current_index += 1;
+            if (basicbtfs_cache_emit_block(bh->b_data, name_bno, offset, ctx, cursor)) {
+                brelse(bh);
+                return 0;
+            }
         }
+
+        offset = BASICBTFS_NAME_ENTRY_S_OFFSET;
+        name_bno = name_list_hdr->next_block;
+        brelse(bh);
     }
+
+    cursor->name_bno = 0;
     return 0;
 }
 
-static inline int basicbtfs_nametree_iterate_name(struct super_block *sb, uint32_t name_bno, struct dir_context *ctx, loff_t start_pos) {
-    struct buffer_head *bh = NULL;
-    struct basicbtfs_name_list_hdr *name_list_hdr = NULL;
-    struct basicbtfs_disk_block *disk_block = NULL;
-    uint32_t next_bno;
-    uint32_t current_index = 0;
-    uint32_t total_nr_entries = 0;
-    int ret = 0;
-    
-    bh = sb_bread(sb, name_bno);
-
-    if (!bh) return -EIO;
+static inline int basicbtfs_nametree_update_namelist_info(struct super_block *sb, uint32_t root_bno, uint32_t hash, uint32_t name_bno, uint32_t block_index) {
+    if (BASICBTFS_HAS_BPTREE(sb)) {
+        return basicbtfs_bptree_update_namelist_info(sb, root_bno, hash, name_bno, block_index);
+    }
 
-    disk_block = (struct basicbtfs_disk_block *) bh->b_data;
-    name_list_hdr = &disk_block->block_type.name_list_hdr;
-    ret = basicbtfs_nametree_emit_block(bh, &total_nr_entries, &current_index, ctx, start_pos);
+    return basicbtfs_btree_node_update_namelist_info(sb, root_bno, hash, 0, name_bno, block_index);
+}
 
-    if (ret == 1) {
-        return 0;
+/*
+ * Finds room for a record of rec_len bytes in a name list block: the unused area at the end
+ * first, then the holes left behind by deleted names. Neighbouring holes are merged on the way
+ * and a hole that is larger than needed is split, as long as the rest still holds an empty
+ * record. Returns the offset of the room in the block or 0 if there is none.
+ */
+static inline uint32_t basicbtfs_nametree_find_slot(struct buffer_head *bh, uint32_t rec_len) {
+    struct basicbtfs_disk_block *disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+    struct basicbtfs_name_list_hdr *name_list_hdr = &disk_block->block_type.name_list_hdr;
+    struct basicbtfs_name_entry *cur_entry = NULL, *next_entry = NULL;
+    char *block = (char *) bh->b_data;
+    uint32_t pos = BASICBTFS_NAME_ENTRY_S_OFFSET, len = 0;
+
+    if (name_list_hdr->free_bytes < rec_len) return 0;
+
+    if ((BASICBTFS_BLOCKSIZE - name_list_hdr->start_unused_area) > rec_len) {
+        return name_list_hdr->start_unused_area;
     }
 
+    while (pos < name_list_hdr->start_unused_area) {
+        cur_entry = (struct basicbtfs_name_entry *) (block + pos);
+        len = sizeof(struct basicbtfs_name_entry) + cur_entry->name_length;
 
-    while (name_list_hdr->next_block != 0) {
-        next_bno = name_list_hdr->next_block;
-        brelse(bh);
+        if (cur_entry->ino != 0) {
+            pos += len;
+            continue;
+        }
 
-        bh = sb_bread(sb, next_bno);
+        while (pos + len < name_list_hdr->start_unused_area) {
+            next_entry = (struct basicbtfs_name_entry *) (block + pos + len);
 
-        if (!bh) return -EIO;
+            if (next_entry->ino != 0) break;
 
-        disk_block = (struct basicbtfs_disk_block *) bh->b_data;
-        name_list_hdr = &disk_block->block_type.name_list_hdr;
-        ret = basicbtfs_nametree_emit_block(bh, &total_nr_entries, &current_index, ctx, start_pos);
+            cur_entry->name_length += sizeof(struct basicbtfs_name_entry) + next_entry->name_length;
+            len = sizeof(struct basicbtfs_name_entry) + cur_entry->name_length;
+        }
 
-        if (ret == 1) {
-            return 0;
+        /* a hole at the end goes back to the unused area */
+        if (pos + len == name_list_hdr->start_unused_area) {
+            name_list_hdr->start_unused_area = pos;
+            return (BASICBTFS_BLOCKSIZE - pos) > rec_len ? pos : 0;
         }
+
+        if (len == rec_len) {
+            return pos;
+        }
+
+        if (len > rec_len + sizeof(struct basicbtfs_name_entry)) {
+            next_entry = (struct basicbtfs_name_entry *) (block + pos + rec_len);
+            next_entry->ino = 0;
+            next_entry->name_length = len - rec_len - sizeof(struct basicbtfs_name_entry);
+            return pos;
+        }
+
+        pos += len;
     }
-    
+
     return 0;
 }
 
-static inline int basicbtfs_nametree_insert_entry_in_list(struct buffer_head *bh, uint32_t name_bno, struct dentry *dentry, struct basicbtfs_entry *dir_entry ) {
+static inline int basicbtfs_nametree_insert_entry_in_list(struct buffer_head *bh, uint32_t name_bno, const struct qstr *name, uint8_t file_type, struct basicbtfs_entry *dir_entry, uint32_t pos) {
     char *block = NULL, *filename = NULL;
     struct basicbtfs_name_entry *name_entry = NULL;
     struct basicbtfs_name_list_hdr *name_list_hdr = NULL;
@@ -106,77 +141,138 @@ static inline int basicbtfs_nametree_insert_entry_in_list(struct buffer_head *bh
     name_list_hdr = &disk_block->block_type.name_list_hdr;
     block = (char *) bh->b_data;
     
-    block += name_list_hdr->start_unused_area;
-    dir_entry->block_index = name_list_hdr->start_unused_area;
+    block += pos;
+    dir_entry->block_index = pos;
     dir_entry->name_bno = name_bno;
     name_entry = (struct basicbtfs_name_entry *) block;
     name_entry->ino = dir_entry->ino;
-    name_entry->name_length = dentry->d_name.len + 1;
-    name_list_hdr->free_bytes -= (sizeof(struct basicbtfs_name_entry) + dentry->d_name.len + 1);
-    name_list_hdr->start_unused_area += (sizeof(struct basicbtfs_name_entry) + dentry->d_name.len + 1);
+    name_entry->name_length = name->len + 1;
+    name_entry->file_type = file_type;
+    name_list_hdr->free_bytes -= (sizeof(struct basicbtfs_name_entry) + name->len + 1);
+
+    if (pos == name_list_hdr->start_unused_area) {
+        name_list_hdr->start_unused_area += (sizeof(struct basicbtfs_name_entry) + name->len + 1);
+    }
+
     name_entry += 1;
     filename = (char *) name_entry;
-    strncpy(filename, (char *)dentry->d_name.name, dentry->d_name.len);
-    filename[dentry->d_name.len] = '\0';
-    printk("inserted filename: %s | %d | %d\n", filename, dir_entry->name_bno, dir_entry->block_index);
+    strncpy(filename, (char *)name->name, name->len);
+    filename[name->len] = '\0';
     name_list_hdr->nr_of_entries++;
     return 0;
 }
 
-static inline int basicbtfs_nametree_insert_name(struct super_block *sb, uint32_t name_bno, struct basicbtfs_entry *dir_entry, struct dentry *dentry, uint32_t dir_bno, uint32_t nr_of_blocks) {
-    struct buffer_head *bh = NULL;
-    struct basicbtfs_name_list_hdr *name_list_hdr = NULL;
+/*
+ * Inserts the name in the first block if it has room, otherwise starts at the free_hint of the
+ * first block and walks on from there. When none of BASICBTFS_NAMELIST_MAX_WALK blocks has room
+ * a new block is linked in after the last one looked at, so an insert dirties a bounded number
+ * of blocks, see basicbtfs_dir_credits. The hint is moved to the block the name ended up in.
+ */
+static inline int basicbtfs_nametree_insert_name(struct super_block *sb, uint32_t name_bno, struct basicbtfs_entry *dir_entry, const struct qstr *name, uint8_t file_type, uint32_t dir_bno) {
+    struct buffer_head *bh = NULL, *bh_first = NULL;
+    struct basicbtfs_name_list_hdr *name_list_hdr = NULL, *first_hdr = NULL;
     struct basicbtfs_disk_block *disk_block = NULL;
-    uint32_t cur_bno = name_bno, prev_bno = cur_bno;
-    
-    bh = sb_bread(sb, cur_bno);
+    uint32_t rec_len = sizeof(struct basicbtfs_name_entry) + name->len + 1;
+    uint32_t cur_bno = name_bno, new_bno = 0, next_bno = 0, pos = 0, walked = 0;
 
-    if (!bh) return -EIO;
+    basicbtfs_stat_inc(BASICBTFS_SB(sb), BASICBTFS_STAT_NAME_INSERTS);
+    basicbtfs_stat_inc(BASICBTFS_SB(sb), BASICBTFS_STAT_NAME_BLOCKS_WALKED);
+    bh_first = basicbtfs_bread(sb, name_bno);
 
-    disk_block = (struct basicbtfs_disk_block *) bh->b_data;
-    name_list_hdr = &disk_block->block_type.name_list_hdr;
-    if ((BASICBTFS_BLOCKSIZE - name_list_hdr->start_unused_area) > dentry->d_name.len + 1 + sizeof(struct basicbtfs_name_entry)) {
-        basicbtfs_nametree_insert_entry_in_list(bh, cur_bno, dentry, dir_entry);
-        mark_buffer_dirty(bh);
-        basicbtfs_cache_update_block(sb, dir_bno, (struct basicbtfs_block *) bh->b_data, cur_bno);
-        brelse(bh);
+    if (!bh_first) return -EIO;
+
+    disk_block = (struct basicbtfs_disk_block *) bh_first->b_data;
+    first_hdr = &disk_block->block_type.name_list_hdr;
+    pos = basicbtfs_nametree_find_slot(bh_first, rec_len);
+
+    if (pos != 0) {
+        basicbtfs_nametree_insert_entry_in_list(bh_first, name_bno, name, file_type, dir_entry, pos);
+        basicbtfs_mark_dirty(bh_first);
+        brelse(bh_first);
         return 0;
     }
 
-    while (name_list_hdr->next_block != 0) {
-        prev_bno = cur_bno;
-        cur_bno = name_list_hdr->next_block;
-        brelse(bh);
+    /* find_slot may have merged holes even when none was large enough */
+    basicbtfs_mark_dirty(bh_first);
 
-        bh = sb_bread(sb, cur_bno);
+    if (first_hdr->free_hint != 0) {
+        cur_bno = first_hdr->free_hint;
+    }
 
-        if (!bh) return -EIO;
+    while (true) {
+        basicbtfs_stat_inc(BASICBTFS_SB(sb), BASICBTFS_STAT_NAME_BLOCKS_WALKED);
+        bh = basicbtfs_bread(sb, cur_bno);
+
+        if (!bh) {
+            brelse(bh_first);
+            return -EIO;
+        }
 
         disk_block = (struct basicbtfs_disk_block *) bh->b_data;
         name_list_hdr = &disk_block->block_type.name_list_hdr;
 
-        if ((BASICBTFS_BLOCKSIZE - name_list_hdr->start_unused_area) > dentry->d_name.len + 1 + sizeof(struct basicbtfs_name_entry)) {
-            basicbtfs_nametree_insert_entry_in_list(bh, cur_bno, dentry, dir_entry);
-            mark_buffer_dirty(bh);
-            basicbtfs_cache_update_block(sb, dir_bno, (struct basicbtfs_block *) bh->b_data, cur_bno);
+        /* a stale hint is not worth failing the insert for */
+        if (disk_block->block_type_id != BASICBTFS_BLOCKTYPE_NAMETREE) {
+            brelse(bh);
+            first_hdr->free_hint = 0;
+            cur_bno = name_bno;
+            continue;
+        }
+
+        pos = basicbtfs_nametree_find_slot(bh, rec_len);
+
+        if (pos != 0) {
+            basicbtfs_nametree_insert_entry_in_list(bh, cur_bno, name, file_type, dir_entry, pos);
+            basicbtfs_mark_dirty(bh);
             brelse(bh);
+
+            first_hdr->free_hint = cur_bno;
+            basicbtfs_mark_dirty(bh_first);
+            brelse(bh_first);
             return 0;
         }
+
+        basicbtfs_mark_dirty(bh);
+
+        if (name_list_hdr->next_block == 0 || ++walked >= BASICBTFS_NAMELIST_MAX_WALK) break;
+
+        cur_bno = name_list_hdr->next_block;
+        brelse(bh);
     }
 
-    name_list_hdr->next_block = get_free_blocks(BASICBTFS_SB(sb), 1);
+    new_bno = get_free_blocks(BASICBTFS_SB(sb), 1);
 
-    if (name_list_hdr->next_block == -1) {
+    if (new_bno == -1) {
+        brelse(bh);
+        brelse(bh_first);
         return -ENOSPC;
     }
 
-    cur_bno = name_list_hdr->next_block;
-    mark_buffer_dirty(bh);
+    next_bno = name_list_hdr->next_block;
+    name_list_hdr->next_block = new_bno;
+    basicbtfs_mark_dirty(bh);
     brelse(bh);
 
-    bh = sb_bread(sb, cur_bno);
+    if (next_bno != 0) {
+        bh = basicbtfs_bread(sb, next_bno);
 
-    if (!bh) return -EIO;
+        if (!bh) {
+            brelse(bh_first);
+            return -EIO;
+        }
+
+        disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+        disk_block->block_type.name_list_hdr.prev_block = new_bno;
+        basicbtfs_mark_dirty(bh);
+        brelse(bh);
+    }
+
+    bh = basicbtfs_bread(sb, new_bno);
+
+    if (!bh) {
+        brelse(bh_first);
+        return -EIO;
+    }
 
     disk_block = (struct basicbtfs_disk_block *) bh->b_data;
     memset(disk_block, 0, sizeof(struct basicbtfs_disk_block));
@@ -185,34 +281,112 @@ static inline int basicbtfs_nametree_insert_name(struct super_block *sb, uint32_
     name_list_hdr->free_bytes = BASICBTFS_EMPTY_NAME_TREE;
     name_list_hdr->start_unused_area = BASICBTFS_BLOCKSIZE - BASICBTFS_EMPTY_NAME_TREE;
 
-    name_list_hdr->prev_block = prev_bno;
-    name_list_hdr->next_block = 0;
+    name_list_hdr->prev_block = cur_bno;
+    name_list_hdr->next_block = next_bno;
     name_list_hdr->nr_of_entries = 0;
 
-    if ((BASICBTFS_BLOCKSIZE - name_list_hdr->start_unused_area) > dentry->d_name.len + 1 +  sizeof(struct basicbtfs_name_entry)) {
-        basicbtfs_nametree_insert_entry_in_list(bh, cur_bno, dentry, dir_entry);
-        mark_buffer_dirty(bh);
-        
-        if (nr_of_blocks < BASICBTFS_MAX_CACHE_BLOCKS_PER_DIR) {
-            basicbtfs_cache_add_name_block(sb, dir_bno, (struct basicbtfs_block *)bh->b_data, cur_bno);
+    basicbtfs_nametree_insert_entry_in_list(bh, new_bno, name, file_type, dir_entry, name_list_hdr->start_unused_area);
+    basicbtfs_mark_dirty(bh);
+    basicbtfs_cache_pin_block(sb, cur_bno, new_bno);
+    brelse(bh);
+
+    first_hdr->free_hint = new_bno;
+    basicbtfs_mark_dirty(bh_first);
+    brelse(bh_first);
+    return 0;
+}
+
+/*
+ * Slides the names of a block to the front, so its holes become one unused area at the end,
+ * and points the directory entries of the moved names at their new place.
+ */
+static inline int basicbtfs_nametree_compact_block(struct super_block *sb, struct buffer_head *bh, uint32_t name_bno, uint32_t dir_bno) {
+    struct basicbtfs_disk_block *disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+    struct basicbtfs_name_list_hdr *name_list_hdr = &disk_block->block_type.name_list_hdr;
+    struct basicbtfs_name_entry *cur_entry = NULL;
+    char *block = (char *) bh->b_data;
+    uint32_t pos = BASICBTFS_NAME_ENTRY_S_OFFSET, new_pos = BASICBTFS_NAME_ENTRY_S_OFFSET, len = 0;
+
+    while (pos < name_list_hdr->start_unused_area) {
+        cur_entry = (struct basicbtfs_name_entry *) (block + pos);
+        len = sizeof(struct basicbtfs_name_entry) + cur_entry->name_length;
+
+        if (cur_entry->ino != 0) {
+            if (pos != new_pos) {
+                memmove(block + new_pos, block + pos, len);
+                cur_entry = (struct basicbtfs_name_entry *) (block + new_pos);
+                basicbtfs_nametree_update_namelist_info(sb, dir_bno, get_hash_from_block((char *) (cur_entry + 1), cur_entry->name_length - 1), name_bno, new_pos);
+            }
+
+            new_pos += len;
         }
-        brelse(bh);
-        return 0;
+
+        pos += len;
     }
 
-    brelse(bh);
-    return -1;
+    name_list_hdr->start_unused_area = new_pos;
+    return 0;
+}
+
+/* Takes an empty block, which is never the first one, out of the list and frees it */
+static inline int basicbtfs_nametree_free_block(struct super_block *sb, struct buffer_head *bh, uint32_t name_bno, uint32_t dir_bno, struct basicbtfs_name_list_hdr *first_hdr) {
+    struct basicbtfs_disk_block *disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+    struct basicbtfs_name_list_hdr *name_list_hdr = &disk_block->block_type.name_list_hdr;
+    struct basicbtfs_disk_block *disk_block_link = NULL;
+    struct buffer_head *bh_link = NULL;
+
+    bh_link = basicbtfs_bread(sb, name_list_hdr->prev_block);
+
+    if (!bh_link) return -EIO;
+
+    disk_block_link = (struct basicbtfs_disk_block *) bh_link->b_data;
+    disk_block_link->block_type.name_list_hdr.next_block = name_list_hdr->next_block;
+    basicbtfs_mark_dirty(bh_link);
+    brelse(bh_link);
+
+    if (name_list_hdr->next_block != 0) {
+        bh_link = basicbtfs_bread(sb, name_list_hdr->next_block);
+
+        if (!bh_link) return -EIO;
+
+        disk_block_link = (struct basicbtfs_disk_block *) bh_link->b_data;
+        disk_block_link->block_type.name_list_hdr.prev_block = name_list_hdr->prev_block;
+        basicbtfs_mark_dirty(bh_link);
+        brelse(bh_link);
+    }
+
+    if (first_hdr->free_hint == name_bno) {
+        first_hdr->free_hint = name_list_hdr->prev_block;
+    }
+
+    basicbtfs_cache_unpin_block(sb, name_bno);
+    put_blocks(BASICBTFS_SB(sb), name_bno, 1);
+    return 0;
 }
 
+/*
+ * Marks the name as deleted. A block without names is taken out of the list, a block whose
+ * names take less than BASICBTFS_NAMELIST_COMPACT_PERCENT of it is compacted. Either way the
+ * free_hint ends up at a block with room, so the next insert does not have to walk the list.
+ */
 static inline int basicbtfs_nametree_delete_name(struct super_block *sb, uint32_t name_bno, uint32_t block_index, uint32_t dir_bno) {
-    struct buffer_head *bh = NULL;
+    struct buffer_head *bh = NULL, *bh_first = NULL;
     char *block = NULL;
     struct basicbtfs_name_entry *name_entry = NULL;
-    struct basicbtfs_name_list_hdr *name_list_hdr = NULL;
+    struct basicbtfs_name_list_hdr *name_list_hdr = NULL, *first_hdr = NULL;
     struct basicbtfs_disk_block *disk_block = NULL;
-    uint32_t old_free_bytes = 0;
+    uint32_t first_bno = 0, live_bytes = 0;
+    int ret = 0;
 
-    bh = sb_bread(sb, name_bno);
+    bh = basicbtfs_bread(sb, dir_bno);
+
+    if (!bh) return -EIO;
+
+    disk_block = (struct basicbtfs_disk_block *) bh->b_data;
+    first_bno = disk_block->block_type.btree_node.tree_name_bno;
+    brelse(bh);
+
+    bh = basicbtfs_bread(sb, name_bno);
 
     if (!bh) return -EIO;
 
@@ -222,17 +396,41 @@ static inline int basicbtfs_nametree_delete_name(struct super_block *sb, uint32_
     block += block_index;
     name_entry = (struct basicbtfs_name_entry *) block;
     name_entry->ino = 0;
-    old_free_bytes = name_list_hdr->free_bytes;
     name_list_hdr->free_bytes += (sizeof(struct basicbtfs_name_entry) + name_entry->name_length);
+    name_list_hdr->nr_of_entries--;
+    basicbtfs_mark_dirty(bh);
 
-    block += sizeof(struct basicbtfs_name_entry);
+    bh_first = basicbtfs_bread(sb, first_bno);
 
-    name_list_hdr->nr_of_entries--;
+    if (!bh_first) {
+        brelse(bh);
+        return -EIO;
+    }
 
-    mark_buffer_dirty(bh);
-    basicbtfs_cache_update_block(sb, dir_bno, (struct basicbtfs_block *)bh->b_data, name_bno);
-    brelse(bh);
+    disk_block = (struct basicbtfs_disk_block *) bh_first->b_data;
+    first_hdr = &disk_block->block_type.name_list_hdr;
 
+    if (!name_list_hdr->first_list && name_list_hdr->nr_of_entries == 0) {
+        ret = basicbtfs_nametree_free_block(sb, bh, name_bno, dir_bno, first_hdr);
+        basicbtfs_mark_dirty(bh_first);
+        brelse(bh_first);
+        brelse(bh);
+        return ret;
+    }
+
+    live_bytes = BASICBTFS_EMPTY_NAME_TREE - name_list_hdr->free_bytes;
+
+    if (live_bytes * 100 < BASICBTFS_EMPTY_NAME_TREE * BASICBTFS_NAMELIST_COMPACT_PERCENT) {
+        basicbtfs_nametree_compact_block(sb, bh, name_bno, dir_bno);
+    }
+
+    if (first_hdr->free_hint != name_bno) {
+        first_hdr->free_hint = name_bno;
+        basicbtfs_mark_dirty(bh_first);
+    }
+
+    brelse(bh_first);
+    brelse(bh);
     return 0;
 }
 
@@ -248,7 +446,7 @@ static inline int basicbtfs_nametree_iterate_name_debug(struct super_block *sb,
     uint32_t total_nr_entries = 0;
     int i = 0;
     
-    bh = sb_bread(sb, name_bno);
+    bh = basicbtfs_bread(sb, name_bno);
 
     if (!bh) return -EIO;
 
@@ -280,7 +478,7 @@ static inline int basicbtfs_nametree_iterate_name_debug(struct super_block *sb,
         next_bno = name_list_hdr->next_block;
         brelse(bh);
 
-        bh = sb_bread(sb, next_bno);
+        bh = basicbtfs_bread(sb, next_bno);
 
         if (!bh) return -EIO;
 
@@ -0,0 +1,70 @@
+#ifndef BASICBTFS_STATS_H
+#define BASICBTFS_STATS_H
+
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
+
+#include "basicbtfs.h"
+
+/*
+ * Statistics of a mount. Every cpu counts in its own copy of struct basicbtfs_stats, so the
+ * hot paths never share a cache line, the copies are summed up when sysfs reads them.
+ */
+static inline void basicbtfs_stat_add(struct basicbtfs_sb_info *sbi, enum basicbtfs_stat_item item, uint64_t value) {
+    if (sbi->s_stats) this_cpu_add(sbi->s_stats->count[item], value);
+}
+
+static inline void basicbtfs_stat_inc(struct basicbtfs_sb_info *sbi, enum basicbtfs_stat_item item) {
+    basicbtfs_stat_add(sbi, item, 1);
+}
+
+/* Counts a call that started at start, from ktime_get_ns, in its latency bucket */
+static inline void basicbtfs_stat_latency(struct basicbtfs_sb_info *sbi, enum basicbtfs_lat_item item, uint64_t start) {
+    uint64_t ns = ktime_get_ns() - start;
+    uint32_t bucket = ns ? min_t(uint32_t, ilog2(ns), BASICBTFS_LAT_BUCKETS - 1) : 0;
+
+    if (sbi->s_stats) this_cpu_inc(sbi->s_stats->latency[item][bucket]);
+}
+
+/* Counts a btree node a lookup is about to read as a hit when it is in memory already */
+static inline void basicbtfs_stat_node(struct super_block *sb, sector_t bno) {
+    struct buffer_head *bh = sb_find_get_block(sb, bno);
+
+    if (bh && buffer_uptodate(bh)) {
+        basicbtfs_stat_inc(BASICBTFS_SB(sb), BASICBTFS_STAT_NODE_HITS);
+    } else {
+        basicbtfs_stat_inc(BASICBTFS_SB(sb), BASICBTFS_STAT_NODE_MISSES);
+    }
+
+    if (bh) brelse(bh);
+}
+
+static inline uint64_t basicbtfs_stat_sum(struct basicbtfs_sb_info *sbi, enum basicbtfs_stat_item item) {
+    uint64_t sum = 0;
+    int cpu = 0;
+
+    for_each_possible_cpu(cpu) sum += per_cpu_ptr(sbi->s_stats, cpu)->count[item];
+
+    return sum;
+}
+
+static inline uint64_t basicbtfs_stat_sum_latency(struct basicbtfs_sb_info *sbi, enum basicbtfs_lat_item item, uint32_t bucket) {
+    uint64_t sum = 0;
+    int cpu = 0;
+
+    for_each_possible_cpu(cpu) sum += per_cpu_ptr(sbi->s_stats, cpu)->latency[item][bucket];
+
+    return sum;
+}
+
+/* Clears the histograms, a call counted on another cpu at the same time may survive it */
+static inline void basicbtfs_stat_reset_latency(struct basicbtfs_sb_info *sbi) {
+    int cpu = 0;
+
+    for_each_possible_cpu(cpu) memset(per_cpu_ptr(sbi->s_stats, cpu)->latency, 0, sizeof(sbi->s_stats->latency));
+}
+
+#endif /* BASICBTFS_STATS_H */
@@ -2,6 +2,9 @@
 #include <linux/fs.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/parser.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/statfs.h>
 
@@ -10,18 +13,15 @@
 #include "init.h"
 #include "bitmap.h"
 #include "cache.h"
-#include "btreecache.h"
+#include "bloom.h"
+#include "journal.h"
+#include "stats.h"
 
 static struct kmem_cache *basicbtfs_inode_cache;
 static struct kmem_cache *basicbtfs_btree_dir_cache;
-static struct kmem_cache *basicbtfs_btree_cache_node_data;
-static struct kmem_cache *basicbtfs_nametree_hdr_cache;
+static struct kmem_cache *basicbtfs_cached_block_cache;
 static struct kmem_cache *basicbtfs_nametree_data_cache;
-static struct kmem_cache *basicbtfs_file_cache;
 
-bool should_defrag = true;
-bool defrag_now = false;
-uint32_t nr_of_inode_operations = 0;
 
 int basicbtfs_init_btree_dir_cache(void) {
     basicbtfs_btree_dir_cache = kmem_cache_create("basicbtfs_btree_dir_cache", sizeof(struct basicbtfs_btree_dir_cache_list), 0, 0, NULL);
@@ -30,17 +30,10 @@ int basicbtfs_init_btree_dir_cache(void) {
     return 0;
 }
 
-int basicbtfs_init_btree_node_data_cache(void) {
-    basicbtfs_btree_cache_node_data = kmem_cache_create("basicbtfs_btree_node_data_cache", sizeof(struct basicbtfs_btree_node_cache), 0, 0, NULL);
+int basicbtfs_init_cached_block_cache(void) {
+    basicbtfs_cached_block_cache = kmem_cache_create("basicbtfs_cached_block_cache", sizeof(struct basicbtfs_cached_block), 0, 0, NULL);
 
-    if (!basicbtfs_btree_cache_node_data) return -ENOMEM;
-    return 0;
-}
-
-int basicbtfs_init_nametree_hdr_cache(void) {
-    basicbtfs_nametree_hdr_cache = kmem_cache_create("basicbtfs_nametree_hdr_cache", sizeof(struct basicbtfs_name_tree_cache), 0, 0, NULL);
-
-    if (!basicbtfs_nametree_hdr_cache) return -ENOMEM;
+    if (!basicbtfs_cached_block_cache) return -ENOMEM;
     return 0;
 }
 
@@ -51,13 +44,6 @@ int basicbtfs_init_nametree_data_cache(void) {
     return 0;
 }
 
-int basicbtfs_init_file_cache(void) {
-    basicbtfs_file_cache = kmem_cache_create("basicbtfs_file_cache", sizeof(struct basicbtfs_block), 0, 0, NULL);
-
-    if (!basicbtfs_file_cache) return -ENOMEM;
-    return 0;
-}
-
 int basicbtfs_init_inode_cache(void) {
     basicbtfs_inode_cache = kmem_cache_create("basicbtfs_cache", sizeof(struct basicbtfs_inode_info), 0, 0, NULL);
 
@@ -69,12 +55,8 @@ void basicbtfs_destroy_inode_cache(void) {
     kmem_cache_destroy(basicbtfs_inode_cache);
 }
 
-void basicbtfs_destroy_btree_node_data_cache(void) {
-    kmem_cache_destroy(basicbtfs_btree_cache_node_data);
-}
-
-void basicbtfs_destroy_nametree_hdr_cache(void) {
-    kmem_cache_destroy(basicbtfs_nametree_hdr_cache);
+void basicbtfs_destroy_cached_block_cache(void) {
+    kmem_cache_destroy(basicbtfs_cached_block_cache);
 }
 
 void basicbtfs_destroy_nametree_data_cache(void) {
@@ -85,15 +67,14 @@ void basicbtfs_destroy_btree_dir_cache(void) {
     kmem_cache_destroy(basicbtfs_btree_dir_cache);
 }
 
-void basicbtfs_destroy_file_cache(void) {
-    kmem_cache_destroy(basicbtfs_file_cache);
-}
-
 static void basicbtfs_put_super(struct super_block *sb) {
     struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
     if (sbi) {
+        basicbtfs_journal_destroy(sb);
+        basicbtfs_cache_destroy(sb);
         kfree(sbi->s_ifree_bitmap);
         kfree(sbi->s_bfree_bitmap);
+        free_percpu(sbi->s_stats);
         kfree(sbi);
     }
 }
@@ -103,21 +84,19 @@ static struct inode *basicbtfs_alloc_inode(struct super_block *sb) {
     if (!ci) return NULL;
 
     inode_init_once(&ci->vfs_inode);
+    ci->i_bloom = NULL;
+    ci->i_sync_tid = 0;
+    ci->i_nr_shared_bnos = 0;
+    ci->i_churn = 0;
+    init_rwsem(&ci->i_defrag_sem);
     return &ci->vfs_inode;
 }
 
-struct basicbtfs_btree_node_cache *basicbtfs_alloc_btree_node_data(struct super_block *sb) {
-    struct basicbtfs_btree_node_cache *cache_node = kmem_cache_alloc(basicbtfs_btree_cache_node_data, GFP_KERNEL);
-    if (!cache_node) return NULL;
+struct basicbtfs_cached_block *basicbtfs_alloc_cached_block(struct super_block *sb) {
+    struct basicbtfs_cached_block *cached_block = kmem_cache_alloc(basicbtfs_cached_block_cache, GFP_KERNEL);
+    if (!cached_block) return NULL;
 
-    return cache_node;
-}
-
-struct basicbtfs_name_tree_cache *basicbtfs_alloc_nametree_hdr(struct super_block *sb) {
-    struct basicbtfs_name_tree_cache *cache_node = kmem_cache_alloc(basicbtfs_nametree_hdr_cache, GFP_KERNEL);
-    if (!cache_node) return NULL;
-
-    return cache_node;
+    return cached_block;
 }
 
 struct basicbtfs_btree_dir_cache_list *basicbtfs_alloc_btree_dir(struct super_block *sb) {
@@ -127,14 +106,12 @@ struct basicbtfs_btree_dir_cache_list *basicbtfs_alloc_btree_dir(struct super_bl
     return cache_dir;
 }
 
-struct basicbtfs_block *basicbtfs_alloc_file(struct super_block *sb) {
-    struct basicbtfs_block *cache_file_block = kmem_cache_alloc(basicbtfs_file_cache, GFP_KERNEL);
-    if (!cache_file_block) return NULL;
-
-    return cache_file_block;
-}
-
-static int basicbtfs_write_inode(struct inode *inode, struct writeback_control *wbc) {
+/*
+ * Copies the inode into its inode table block and dirties it. The block is only written right
+ * away for a data integrity write, otherwise the block device writeback takes it along with
+ * the other inodes in the same block that were changed meanwhile.
+ */
+static int basicbtfs_update_disk_inode(struct inode *inode, bool sync) {
     struct basicbtfs_inode *disk_inode;
     struct super_block *sb = inode->i_sb;
     struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
@@ -145,7 +122,7 @@ static int basicbtfs_write_inode(struct inode *inode, struct writeback_control *
 
     if (ino >= sbi->s_ninodes) return 0;
 
-    bh = sb_bread(sb, inode_block);
+    bh = basicbtfs_bread(sb, inode_block);
 
     if (!bh) return -EIO;
 
@@ -153,43 +130,106 @@ static int basicbtfs_write_inode(struct inode *inode, struct writeback_control *
     disk_inode += inode_bi;
 
     write_from_vfs_inode_to_disk(disk_inode, inode);
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
+    basicbtfs_mark_dirty(bh);
+
+    if (sync && !sbi->s_journal) {
+        sync_dirty_buffer(bh);
+
+        if (buffer_req(bh) && !buffer_uptodate(bh)) {
+            brelse(bh);
+            return -EIO;
+        }
+    }
+
     brelse(bh);
 
     return 0;
 }
 
+/*
+ * With a journal every mark_inode_dirty puts the inode in the running transaction. On a
+ * lazytime mount a change of only the timestamps is left in memory, it is written together
+ * with the next real change, on fsync or when the inode is evicted.
+ */
+static void basicbtfs_dirty_inode(struct inode *inode, int flags) {
+    struct super_block *sb = inode->i_sb;
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    handle_t *handle = NULL;
+
+    if (!sbi->s_journal || flags == I_DIRTY_TIME) return;
+
+    handle = basicbtfs_journal_start(sb, 1);
+
+    if (IS_ERR(handle)) {
+        printk(KERN_ERR "Could not journal inode %lu: %ld\n", inode->i_ino, PTR_ERR(handle));
+        return;
+    }
+
+    if (basicbtfs_update_disk_inode(inode, false) == 0) {
+        BASICBTFS_INODE(inode)->i_sync_tid = handle->h_transaction->t_tid;
+    }
+
+    basicbtfs_journal_stop(handle);
+}
+
+/*
+ * Without a journal only a data integrity write for a single inode, as fsync does, waits for
+ * the inode table block. Background writeback just dirties it and sync(2) writes all of them
+ * from the block device after sync_fs. With a journal the inode is in the journal already,
+ * a data integrity write only waits for the commit of its transaction, which every other
+ * inode changed in the same transaction shares. sync(2) commits once from sync_fs.
+ */
+static int basicbtfs_write_inode(struct inode *inode, struct writeback_control *wbc) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(inode->i_sb);
+    u64 start = ktime_get_ns();
+    int ret = 0;
+
+    if (!sbi->s_journal) {
+        ret = basicbtfs_update_disk_inode(inode, wbc->sync_mode == WB_SYNC_ALL && !wbc->for_sync);
+    } else if (wbc->sync_mode == WB_SYNC_ALL && !wbc->for_sync) {
+        ret = jbd2_complete_transaction(sbi->s_journal, BASICBTFS_INODE(inode)->i_sync_tid);
+    }
+
+    basicbtfs_stat_latency(sbi, BASICBTFS_LAT_WRITE_INODE, start);
+    return ret;
+}
+
+/* Drops the buffers fsync would have written for the inode, the buffer cache still has them */
+static void basicbtfs_evict_inode(struct inode *inode) {
+    truncate_inode_pages_final(&inode->i_data);
+    invalidate_inode_buffers(inode);
+    clear_inode(inode);
+}
+
 static void basicbtfs_destroy_inode(struct inode *inode) {
     struct basicbtfs_inode_info *ci = BASICBTFS_INODE(inode);
+    basicbtfs_bloom_free(inode);
     kmem_cache_free(basicbtfs_inode_cache, ci);
 }
 
-void basicbtfs_destroy_btree_node_data(struct basicbtfs_btree_node_cache *cache_node) {
-    kmem_cache_free(basicbtfs_btree_cache_node_data, cache_node);
-}
-
-void basicbtfs_destroy_nametree_hdr(struct basicbtfs_name_tree_cache *cache_node) {
-    kmem_cache_free(basicbtfs_nametree_hdr_cache, cache_node);
+void basicbtfs_destroy_cached_block(struct basicbtfs_cached_block *cached_block) {
+    kmem_cache_free(basicbtfs_cached_block_cache, cached_block);
 }
 
 void basicbtfs_destroy_btree_dir(struct basicbtfs_btree_dir_cache_list *cache_dir) {
     kmem_cache_free(basicbtfs_btree_dir_cache, cache_dir);
 }
 
-void basicbtfs_destroy_file_block(struct basicbtfs_block *cache_file_block) {
-    kmem_cache_free(basicbtfs_file_cache, cache_file_block);
-}
-
 static int basicbtfs_sync_fs(struct super_block *sb, int wait)
 {
     struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
     int ret = 0;
 
     /* Flush superblock */
-    printk("basicbtfs_sync_fs() 0: %d\n", 0);
     ret = flush_superblock(sb, wait);
     if (ret < 0) return ret;
+
+    /* the bitmap blocks are kept up to date through the journal */
+    if (sbi->s_journal) {
+        if (!wait) return 0;
+        return jbd2_journal_force_commit(sbi->s_journal);
+    }
+
     ret = flush_bitmap(sb, sbi->s_ifree_bitmap, sbi->s_imap_blocks, 1, wait);
     if (ret < 0) return ret;
     ret = flush_bitmap(sb, sbi->s_bfree_bitmap, sbi->s_bmap_blocks, sbi->s_imap_blocks + 1, wait);
@@ -214,17 +254,28 @@ static int basicbtfs_statfs(struct dentry *dentry, struct kstatfs *stat)
     return 0;
 }
 
+static int basicbtfs_show_options(struct seq_file *seq, struct dentry *root) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(root->d_sb);
+
+    if (sbi->s_relaxed_delete) {
+        seq_printf(seq, ",relaxed_delete,low_water=%u", sbi->s_low_water);
+    }
+
+    return 0;
+}
+
 static struct super_operations basicftfs_super_ops = {
     .put_super = basicbtfs_put_super,
     .alloc_inode = basicbtfs_alloc_inode,
     .destroy_inode = basicbtfs_destroy_inode,
+    .dirty_inode = basicbtfs_dirty_inode,
     .write_inode = basicbtfs_write_inode,
+    .evict_inode = basicbtfs_evict_inode,
     .sync_fs = basicbtfs_sync_fs,
     .statfs = basicbtfs_statfs,
+    .show_options = basicbtfs_show_options,
 };
 
-struct list_head dir_cache_list = LIST_HEAD_INIT(dir_cache_list);
-
 int init_super_block(struct super_block *sb) {
     int ret = 0;
     sb->s_magic = BASICBTFS_MAGIC_NUMBER;
@@ -243,8 +294,33 @@ int init_sbi(struct super_block *sb, struct basicbtfs_sb_info *csb, struct basic
     sbi->s_nfree_inodes = csb->s_nfree_inodes;
     sbi->s_nfree_blocks = csb->s_nfree_blocks;
     sbi->s_cache_dir_entries = 0;
+    INIT_LIST_HEAD(&sbi->s_dir_cache);
+    mutex_init(&sbi->s_dir_cache_lock);
     sbi->s_filemap_blocks = csb->s_filemap_blocks;
     sbi->s_unused_area = csb->s_unused_area;
+    sbi->s_features = csb->s_features;
+    sbi->s_journal_bno = csb->s_journal_bno;
+    sbi->s_journal_blocks = csb->s_journal_blocks;
+    sbi->s_journal = NULL;
+    init_rwsem(&sbi->s_defrag_lock);
+    sbi->s_defrag_task = NULL;
+    sbi->s_defrag_state = BASICBTFS_BGDEFRAG_IDLE;
+    sbi->s_defrag_ino = 0;
+    sbi->s_defrag_threshold = BASICBTFS_DEFRAG_THRESHOLD;
+    sbi->s_defrag_delay_ms = BASICBTFS_DEFRAG_DELAY_MS;
+    sbi->s_defrag_rate = BASICBTFS_DEFRAG_RATE;
+    sbi->s_defrag_moved_blocks = 0;
+    sbi->s_defrag_passes = 0;
+    sbi->s_defrag_mode = BASICBTFS_DEFRAG_MODE_PLAN;
+    sbi->s_defrag_queue = NULL;
+    sbi->s_defrag_dir_churn = BASICBTFS_DEFRAG_DIR_CHURN;
+    sbi->s_defrag_file_extents = BASICBTFS_DEFRAG_FILE_EXTENTS;
+    sbi->s_defrag_max_cost = BASICBTFS_DEFRAG_MAX_COST;
+    sbi->s_defrag_targeted = 0;
+    sbi->s_defrag_skipped = 0;
+    sbi->s_stats = NULL;
+    sbi->s_debugfs = NULL;
+    sbi->s_sb = sb;
     sb->s_fs_info = sbi;
     return 0;
 }
@@ -281,6 +357,56 @@ int init_filemap(struct super_block *sb, struct basicbtfs_fileblock_info *filema
     return 0;
 }
 
+enum {
+    Opt_relaxed_delete, Opt_low_water, Opt_err
+};
+
+static const match_table_t tokens = {
+    {Opt_relaxed_delete, "relaxed_delete"},
+    {Opt_low_water, "low_water=%u"},
+    {Opt_err, NULL}
+};
+
+/*
+ * relaxed_delete: tolerate underfull btree nodes on unlink, a node is only merged or
+ * refilled once it holds less than low_water keys (1 .. BASICBTFS_MIN_DEGREE - 1).
+ * Defrag packs the directory trees again.
+ */
+static int basicbtfs_parse_options(char *options, struct basicbtfs_sb_info *sbi) {
+    substring_t args[MAX_OPT_ARGS];
+    char *p = NULL;
+    int token = 0, low_water = 0;
+
+    sbi->s_relaxed_delete = false;
+    sbi->s_low_water = BASICBTFS_BTREE_LOW_WATER;
+
+    if (!options) return 0;
+
+    while ((p = strsep(&options, ",")) != NULL) {
+        if (!*p) continue;
+
+        token = match_token(p, tokens, args);
+
+        switch (token) {
+            case Opt_relaxed_delete:
+                sbi->s_relaxed_delete = true;
+                break;
+            case Opt_low_water:
+                if (match_int(&args[0], &low_water) || low_water < 1 || low_water >= BASICBTFS_MIN_DEGREE) {
+                    printk(KERN_ERR "low_water should be between 1 and %d\n", BASICBTFS_MIN_DEGREE - 1);
+                    return -EINVAL;
+                }
+                sbi->s_low_water = low_water;
+                break;
+            default:
+                printk(KERN_ERR "Unknown mount option %s\n", p);
+                return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
 /* Fill the struct superblock from partition superblock */
 int basicbtfs_fill_super(struct super_block *sb, void *data, int silent)
 {
@@ -290,7 +416,6 @@ int basicbtfs_fill_super(struct super_block *sb, void *data, int silent)
     struct inode *root_inode = NULL;
     struct basicbtfs_btree_node *node = NULL;
     struct basicbtfs_disk_block *disk_block = NULL;
-    struct basicbtfs_btree_node_cache *node_cache = NULL;
     struct basicbtfs_name_list_hdr *list_hdr = NULL;
     int ret = 0;
     int tmp_degree = 80;
@@ -317,38 +442,58 @@ int basicbtfs_fill_super(struct super_block *sb, void *data, int silent)
         brelse(bh);
         return -ENOMEM;
     }
-    should_defrag = true;
-    nr_of_inode_operations = 0;
     init_sbi(sb, csb, sbi);
     brelse(bh);
 
+    ret = basicbtfs_parse_options(data, sbi);
+
+    if (ret < 0) {
+        sb->s_fs_info = NULL;
+        kfree(sbi);
+        return ret;
+    }
+
+    /* replays the journal, the bitmaps and everything after them are read afterwards */
+    ret = basicbtfs_journal_load(sb);
+
+    if (ret < 0) {
+        sb->s_fs_info = NULL;
+        kfree(sbi);
+        return ret;
+    }
+
     sbi->s_ifree_bitmap = kzalloc(sbi->s_imap_blocks * BASICBTFS_BLOCKSIZE, GFP_KERNEL);
     if (!sbi->s_ifree_bitmap) {
-        kfree(sbi);
         printk("not sufficient memory for ifree bitmap\n");
-        return -ENOMEM;
+        ret = -ENOMEM;
+        goto out_journal;
     }
 
     ret = init_bitmap(sb, sbi->s_ifree_bitmap, sbi->s_imap_blocks, 1);
 
-    if (ret < 0) return ret;
+    if (ret < 0) goto out_bitmaps;
 
     sbi->s_bfree_bitmap = kzalloc(sbi->s_bmap_blocks * BASICBTFS_BLOCKSIZE, GFP_KERNEL);
     if (!sbi->s_bfree_bitmap) {
         printk("not sufficient memory for bfree bitmap\n");
-        kfree(sbi->s_ifree_bitmap);
-        kfree(sbi);
-        return -ENOMEM;
+        ret = -ENOMEM;
+        goto out_bitmaps;
     }
 
-    init_bitmap(sb, sbi->s_bfree_bitmap, sbi->s_bmap_blocks, sbi->s_imap_blocks + 1);
+    ret = init_bitmap(sb, sbi->s_bfree_bitmap, sbi->s_bmap_blocks, sbi->s_imap_blocks + 1);
+
+    if (ret < 0) goto out_bitmaps;
+
+    /* the counters in the superblock are not journaled, after a crash only the bitmaps are right */
+    if (sbi->s_journal) {
+        sbi->s_nfree_inodes = sbi->s_ninodes - bitmap_weight(sbi->s_ifree_bitmap, sbi->s_ninodes);
+        sbi->s_nfree_blocks = sbi->s_nblocks - bitmap_weight(sbi->s_bfree_bitmap, sbi->s_nblocks);
+    }
 
     root_inode = basicbtfs_iget(sb, 0);
     if (IS_ERR(root_inode)) {
-        kfree(sbi->s_bfree_bitmap);
-        kfree(sbi->s_ifree_bitmap);
-        kfree(sbi);
-        return PTR_ERR(root_inode);
+        ret = PTR_ERR(root_inode);
+        goto out_bitmaps;
     }
 
     inode_init_owner(root_inode, NULL, root_inode->i_mode);
@@ -356,64 +501,89 @@ int basicbtfs_fill_super(struct super_block *sb, void *data, int silent)
 
     bh = sb_bread(sb, BASICBTFS_INODE(root_inode)->i_bno);
 
-    if (!bh) return -EIO;
+    if (!bh) {
+        ret = -EIO;
+        goto out_root;
+    }
 
     disk_block = (struct basicbtfs_disk_block *) bh->b_data;
-    disk_block->block_type_id = BASICBTFS_BLOCKTYPE_BTREE_NODE;
     node = &disk_block->block_type.btree_node;
+
+    /* Keep a root directory that was populated by mkfs or during a previous mount */
+    if (disk_block->block_type_id == BASICBTFS_BLOCKTYPE_BTREE_NODE && node->root && node->tree_name_bno != 0) {
+        brelse(bh);
+        goto cache_root;
+    }
+
+    memset(disk_block, 0, BASICBTFS_BLOCKSIZE);
+    disk_block->block_type_id = BASICBTFS_BLOCKTYPE_BTREE_NODE;
     node->leaf = true;
     node->root = true;
     node->nr_of_keys = 0;
     node->nr_of_files = 0;
     node->parent = root_inode->i_ino;
+    node->tree_name_bno = get_free_blocks(BASICBTFS_SB(sb), 1);
 
-    if (node->tree_name_bno == 0) {
-        node->tree_name_bno = get_free_blocks(BASICBTFS_SB(sb), 1);
-
-        if (node->tree_name_bno == -1) {
-            return -ENOSPC;
-        }
-        bh_name_table = sb_bread(sb, node->tree_name_bno);
-
-        if (!bh_name_table) {
-            brelse(bh);
-            put_blocks(BASICBTFS_SB(sb), node->tree_name_bno, 1);
-            return -EIO;
-        }
-        disk_block = (struct basicbtfs_disk_block *) bh_name_table->b_data;
-        memset(disk_block, 0, sizeof(struct basicbtfs_disk_block));
-        disk_block->block_type_id =BASICBTFS_BLOCKTYPE_NAMETREE;
-        list_hdr = &disk_block->block_type.name_list_hdr;
-
-        list_hdr->free_bytes = BASICBTFS_EMPTY_NAME_TREE;
-        list_hdr->start_unused_area = BASICBTFS_BLOCKSIZE - BASICBTFS_EMPTY_NAME_TREE;
-        list_hdr->first_list = true;
-        list_hdr->prev_block = root_inode->i_ino;
-        list_hdr->next_block = 0;
-        list_hdr->nr_of_entries = 0;
-        mark_buffer_dirty(bh_name_table);
-        brelse(bh_name_table);
+    if (node->tree_name_bno == -1) {
+        brelse(bh);
+        ret = -ENOSPC;
+        goto out_root;
     }
+    bh_name_table = sb_bread(sb, node->tree_name_bno);
 
-    node_cache = (struct basicbtfs_btree_node_cache *)basicbtfs_alloc_file(sb);
-    basicbtfs_btree_node_cache_init(sb, node_cache, true);
-
-    if (sbi->s_cache_dir_entries < BASICBTFS_MAX_CACHE_DIR_ENTRIES ) {
-        basicbtfs_cache_add_dir(sb, BASICBTFS_INODE(root_inode)->i_bno, node_cache, (struct basicbtfs_block *)bh_name_table->b_data, node->tree_name_bno);
+    if (!bh_name_table) {
+        brelse(bh);
+        put_blocks(BASICBTFS_SB(sb), node->tree_name_bno, 1);
+        ret = -EIO;
+        goto out_root;
     }
-
+    disk_block = (struct basicbtfs_disk_block *) bh_name_table->b_data;
+    memset(disk_block, 0, sizeof(struct basicbtfs_disk_block));
+    disk_block->block_type_id =BASICBTFS_BLOCKTYPE_NAMETREE;
+    list_hdr = &disk_block->block_type.name_list_hdr;
+
+    list_hdr->free_bytes = BASICBTFS_EMPTY_NAME_TREE;
+    list_hdr->start_unused_area = BASICBTFS_BLOCKSIZE - BASICBTFS_EMPTY_NAME_TREE;
+    list_hdr->first_list = true;
+    list_hdr->prev_block = root_inode->i_ino;
+    list_hdr->next_block = 0;
+    list_hdr->nr_of_entries = 0;
+    mark_buffer_dirty(bh_name_table);
+    brelse(bh_name_table);
     mark_buffer_dirty(bh);
     brelse(bh);
 
+cache_root:
+    basicbtfs_cache_add_dir(sb, BASICBTFS_INODE(root_inode)->i_bno);
+
+
+    /* d_make_root drops the root inode when it fails */
     sb->s_root = d_make_root(root_inode);
 
     if (!sb->s_root) {
-        iput(root_inode);
-        kfree(sbi->s_bfree_bitmap);
-        kfree(sbi->s_ifree_bitmap);
-        kfree(sbi);
-        return -ENOMEM;
+        basicbtfs_cache_destroy(sb);
+        ret = -ENOMEM;
+        goto out_bitmaps;
+    }
+
+    /* the filesystem works without these, it is just not counted or defragmented in the background */
+    sbi->s_stats = alloc_percpu(struct basicbtfs_stats);
+
+    if (basicbtfs_sysfs_register(sb) == 0) {
+        basicbtfs_bgdefrag_start(sb);
     }
 
     return 0;
+
+    /* everything after the journal load, the journal is destroyed before sbi goes */
+out_root:
+    iput(root_inode);
+out_bitmaps:
+    kfree(sbi->s_bfree_bitmap);
+    kfree(sbi->s_ifree_bitmap);
+out_journal:
+    basicbtfs_journal_destroy(sb);
+    sb->s_fs_info = NULL;
+    kfree(sbi);
+    return ret;
 }
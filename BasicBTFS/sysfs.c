@@ -0,0 +1,430 @@
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/kobject.h>
+#include <linux/module.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/string.h>
+#include <linux/sysfs.h>
+
+#include "basicbtfs.h"
+#include "defrag.h"
+#include "stats.h"
+
+/*
+ * /sys/fs/basicbtfs/<dev>, one directory per mounted filesystem:
+ *
+ *   defrag            state of the background defragmenter, idle, running or paused.
+ *                     Writing start, pause, resume or cancel controls it.
+ *   defrag_threshold  fragmentation score at which a pass starts on its own, 0 never does
+ *   defrag_delay_ms   pause between two inodes of a pass
+ *   defrag_rate       blocks per second a pass moves at most, 0 is unlimited
+ *   frag_score        free blocks in the allocated part of the disk, in percent
+ *   defrag_progress   inode the pass is at, blocks moved and passes done since mount
+ *   defrag_mode       how BASICBTFS_IOC_DEFRAG packs the disk, plan or swap
+ *   defrag_dir_churn  operations on a directory after which it is queued, 0 never queues
+ *   defrag_file_extents  scattered clusters a file gets before it is queued, 0 never queues
+ *   defrag_max_cost   blocks a queued inode may copy per run it gets rid of, 0 is unlimited
+ *   defrag_queue      inodes queued now, and the queued ones defragmented or skipped since mount
+ *   stats             counters since mount, one "name value" per line
+ *   latency           latency histograms since mount, one line per operation with the
+ *                     calls per log2 bucket of nanoseconds as "bucket:calls", empty buckets left out
+ *
+ * /sys/kernel/debug/basicbtfs/<dev>:
+ *
+ *   latency           the same histograms with the p50, p99 and p99.9 of every operation and
+ *                     the range of every bucket, without the page limit of sysfs. Writing
+ *                     anything to it resets the histograms.
+ */
+static struct kset *basicbtfs_kset;
+static struct dentry *basicbtfs_debugfs_root;
+
+struct basicbtfs_attr {
+    struct attribute attr;
+    ssize_t (*show)(struct basicbtfs_sb_info *sbi, char *buf);
+    ssize_t (*store)(struct basicbtfs_sb_info *sbi, const char *buf, size_t len);
+};
+
+static const char *basicbtfs_defrag_states[] = {
+    [BASICBTFS_BGDEFRAG_IDLE] = "idle",
+    [BASICBTFS_BGDEFRAG_RUNNING] = "running",
+    [BASICBTFS_BGDEFRAG_PAUSED] = "paused",
+};
+
+static ssize_t basicbtfs_defrag_show(struct basicbtfs_sb_info *sbi, char *buf) {
+    return sprintf(buf, "%s\n", basicbtfs_defrag_states[sbi->s_defrag_state]);
+}
+
+static ssize_t basicbtfs_defrag_store(struct basicbtfs_sb_info *sbi, const char *buf, size_t len) {
+    if (sysfs_streq(buf, "start") || sysfs_streq(buf, "resume")) {
+        sbi->s_defrag_state = BASICBTFS_BGDEFRAG_RUNNING;
+    } else if (sysfs_streq(buf, "pause")) {
+        if (sbi->s_defrag_state == BASICBTFS_BGDEFRAG_RUNNING) sbi->s_defrag_state = BASICBTFS_BGDEFRAG_PAUSED;
+    } else if (sysfs_streq(buf, "cancel")) {
+        sbi->s_defrag_state = BASICBTFS_BGDEFRAG_IDLE;
+        sbi->s_defrag_ino = 0;
+    } else {
+        return -EINVAL;
+    }
+
+    if (sbi->s_defrag_task) wake_up_process(sbi->s_defrag_task);
+
+    return len;
+}
+
+static const char *basicbtfs_defrag_modes[] = {
+    [BASICBTFS_DEFRAG_MODE_PLAN] = "plan",
+    [BASICBTFS_DEFRAG_MODE_SWAP] = "swap",
+};
+
+static ssize_t basicbtfs_defrag_mode_show(struct basicbtfs_sb_info *sbi, char *buf) {
+    return sprintf(buf, "%s\n", basicbtfs_defrag_modes[sbi->s_defrag_mode]);
+}
+
+static ssize_t basicbtfs_defrag_mode_store(struct basicbtfs_sb_info *sbi, const char *buf, size_t len) {
+    if (sysfs_streq(buf, "plan")) {
+        sbi->s_defrag_mode = BASICBTFS_DEFRAG_MODE_PLAN;
+    } else if (sysfs_streq(buf, "swap")) {
+        sbi->s_defrag_mode = BASICBTFS_DEFRAG_MODE_SWAP;
+    } else {
+        return -EINVAL;
+    }
+
+    return len;
+}
+
+static ssize_t basicbtfs_uint_store(uint32_t *value, const char *buf, size_t len) {
+    uint32_t tmp = 0;
+    int ret = kstrtou32(buf, 0, &tmp);
+
+    if (ret < 0) return ret;
+
+    *value = tmp;
+    return len;
+}
+
+static ssize_t basicbtfs_defrag_threshold_show(struct basicbtfs_sb_info *sbi, char *buf) {
+    return sprintf(buf, "%u\n", sbi->s_defrag_threshold);
+}
+
+static ssize_t basicbtfs_defrag_threshold_store(struct basicbtfs_sb_info *sbi, const char *buf, size_t len) {
+    return basicbtfs_uint_store(&sbi->s_defrag_threshold, buf, len);
+}
+
+static ssize_t basicbtfs_defrag_delay_ms_show(struct basicbtfs_sb_info *sbi, char *buf) {
+    return sprintf(buf, "%u\n", sbi->s_defrag_delay_ms);
+}
+
+static ssize_t basicbtfs_defrag_delay_ms_store(struct basicbtfs_sb_info *sbi, const char *buf, size_t len) {
+    return basicbtfs_uint_store(&sbi->s_defrag_delay_ms, buf, len);
+}
+
+static ssize_t basicbtfs_defrag_rate_show(struct basicbtfs_sb_info *sbi, char *buf) {
+    return sprintf(buf, "%u\n", sbi->s_defrag_rate);
+}
+
+static ssize_t basicbtfs_defrag_rate_store(struct basicbtfs_sb_info *sbi, const char *buf, size_t len) {
+    return basicbtfs_uint_store(&sbi->s_defrag_rate, buf, len);
+}
+
+static ssize_t basicbtfs_frag_score_show(struct basicbtfs_sb_info *sbi, char *buf) {
+    return sprintf(buf, "%u\n", basicbtfs_defrag_score(sbi));
+}
+
+static ssize_t basicbtfs_defrag_progress_show(struct basicbtfs_sb_info *sbi, char *buf) {
+    return sprintf(buf, "ino %u/%u moved_blocks %llu passes %u\n", sbi->s_defrag_ino, sbi->s_ninodes, (unsigned long long) sbi->s_defrag_moved_blocks, sbi->s_defrag_passes);
+}
+
+static ssize_t basicbtfs_defrag_dir_churn_show(struct basicbtfs_sb_info *sbi, char *buf) {
+    return sprintf(buf, "%u\n", sbi->s_defrag_dir_churn);
+}
+
+static ssize_t basicbtfs_defrag_dir_churn_store(struct basicbtfs_sb_info *sbi, const char *buf, size_t len) {
+    return basicbtfs_uint_store(&sbi->s_defrag_dir_churn, buf, len);
+}
+
+static ssize_t basicbtfs_defrag_file_extents_show(struct basicbtfs_sb_info *sbi, char *buf) {
+    return sprintf(buf, "%u\n", sbi->s_defrag_file_extents);
+}
+
+static ssize_t basicbtfs_defrag_file_extents_store(struct basicbtfs_sb_info *sbi, const char *buf, size_t len) {
+    return basicbtfs_uint_store(&sbi->s_defrag_file_extents, buf, len);
+}
+
+static ssize_t basicbtfs_defrag_max_cost_show(struct basicbtfs_sb_info *sbi, char *buf) {
+    return sprintf(buf, "%u\n", sbi->s_defrag_max_cost);
+}
+
+static ssize_t basicbtfs_defrag_max_cost_store(struct basicbtfs_sb_info *sbi, const char *buf, size_t len) {
+    return basicbtfs_uint_store(&sbi->s_defrag_max_cost, buf, len);
+}
+
+static ssize_t basicbtfs_defrag_queue_show(struct basicbtfs_sb_info *sbi, char *buf) {
+    uint32_t queued = sbi->s_defrag_queue ? bitmap_weight(sbi->s_defrag_queue, sbi->s_ninodes) : 0;
+
+    return sprintf(buf, "queued %u targeted %u skipped %u\n", queued, sbi->s_defrag_targeted, sbi->s_defrag_skipped);
+}
+
+static const char *basicbtfs_stat_names[] = {
+    [BASICBTFS_STAT_LOOKUPS] = "lookups",
+    [BASICBTFS_STAT_BLOOM_NEGATIVES] = "bloom_negatives",
+    [BASICBTFS_STAT_CACHE_NEGATIVES] = "cache_negatives",
+    [BASICBTFS_STAT_NODE_HITS] = "node_hits",
+    [BASICBTFS_STAT_NODE_MISSES] = "node_misses",
+    [BASICBTFS_STAT_SPLITS] = "splits",
+    [BASICBTFS_STAT_MERGES] = "merges",
+    [BASICBTFS_STAT_NAME_INSERTS] = "name_inserts",
+    [BASICBTFS_STAT_NAME_BLOCKS_WALKED] = "name_blocks_walked",
+    [BASICBTFS_STAT_BLOCKS_ALLOCATED] = "blocks_allocated",
+    [BASICBTFS_STAT_BLOCKS_FREED] = "blocks_freed",
+    [BASICBTFS_STAT_BITMAP_SCANS] = "bitmap_scans",
+    [BASICBTFS_STAT_BITMAP_SCANNED] = "bitmap_scanned",
+    [BASICBTFS_STAT_DEFRAG_MOVES] = "defrag_moves",
+    [BASICBTFS_STAT_DEFRAG_MOVED_BLOCKS] = "defrag_moved_blocks",
+    [BASICBTFS_STAT_GET_BLOCKS] = "get_blocks",
+};
+
+static const char *basicbtfs_lat_names[] = {
+    [BASICBTFS_LAT_LOOKUP] = "lookup",
+    [BASICBTFS_LAT_INSERT] = "insert",
+    [BASICBTFS_LAT_GET_BLOCK] = "get_block",
+    [BASICBTFS_LAT_ALLOC] = "alloc",
+    [BASICBTFS_LAT_CREATE] = "create",
+    [BASICBTFS_LAT_UNLINK] = "unlink",
+    [BASICBTFS_LAT_RENAME] = "rename",
+    [BASICBTFS_LAT_ITERATE] = "iterate",
+    [BASICBTFS_LAT_WRITE_INODE] = "write_inode",
+};
+
+static ssize_t basicbtfs_stats_show(struct basicbtfs_sb_info *sbi, char *buf) {
+    ssize_t len = 0;
+    int i = 0;
+
+    if (!sbi->s_stats) return -ENOMEM;
+
+    for (i = 0; i < BASICBTFS_NR_STATS; i++) {
+        len += scnprintf(buf + len, PAGE_SIZE - len, "%s %llu\n", basicbtfs_stat_names[i], (unsigned long long) basicbtfs_stat_sum(sbi, i));
+    }
+
+    return len;
+}
+
+static ssize_t basicbtfs_latency_show(struct basicbtfs_sb_info *sbi, char *buf) {
+    uint64_t calls = 0;
+    ssize_t len = 0;
+    int i = 0, bucket = 0;
+
+    if (!sbi->s_stats) return -ENOMEM;
+
+    for (i = 0; i < BASICBTFS_NR_LATS; i++) {
+        len += scnprintf(buf + len, PAGE_SIZE - len, "%s", basicbtfs_lat_names[i]);
+
+        for (bucket = 0; bucket < BASICBTFS_LAT_BUCKETS; bucket++) {
+            calls = basicbtfs_stat_sum_latency(sbi, i, bucket);
+
+            if (calls) len += scnprintf(buf + len, PAGE_SIZE - len, " %d:%llu", bucket, (unsigned long long) calls);
+        }
+
+        len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+    }
+
+    return len;
+}
+
+#define BASICBTFS_ATTR_RW(_name) \
+    static struct basicbtfs_attr basicbtfs_attr_##_name = __ATTR(_name, 0644, basicbtfs_##_name##_show, basicbtfs_##_name##_store)
+#define BASICBTFS_ATTR_RO(_name) \
+    static struct basicbtfs_attr basicbtfs_attr_##_name = __ATTR(_name, 0444, basicbtfs_##_name##_show, NULL)
+
+BASICBTFS_ATTR_RW(defrag);
+BASICBTFS_ATTR_RW(defrag_threshold);
+BASICBTFS_ATTR_RW(defrag_delay_ms);
+BASICBTFS_ATTR_RW(defrag_rate);
+BASICBTFS_ATTR_RO(frag_score);
+BASICBTFS_ATTR_RO(defrag_progress);
+BASICBTFS_ATTR_RW(defrag_mode);
+BASICBTFS_ATTR_RW(defrag_dir_churn);
+BASICBTFS_ATTR_RW(defrag_file_extents);
+BASICBTFS_ATTR_RW(defrag_max_cost);
+BASICBTFS_ATTR_RO(defrag_queue);
+BASICBTFS_ATTR_RO(stats);
+BASICBTFS_ATTR_RO(latency);
+
+static struct attribute *basicbtfs_attrs[] = {
+    &basicbtfs_attr_defrag.attr,
+    &basicbtfs_attr_defrag_threshold.attr,
+    &basicbtfs_attr_defrag_delay_ms.attr,
+    &basicbtfs_attr_defrag_rate.attr,
+    &basicbtfs_attr_frag_score.attr,
+    &basicbtfs_attr_defrag_progress.attr,
+    &basicbtfs_attr_defrag_mode.attr,
+    &basicbtfs_attr_defrag_dir_churn.attr,
+    &basicbtfs_attr_defrag_file_extents.attr,
+    &basicbtfs_attr_defrag_max_cost.attr,
+    &basicbtfs_attr_defrag_queue.attr,
+    &basicbtfs_attr_stats.attr,
+    &basicbtfs_attr_latency.attr,
+    NULL,
+};
+
+static ssize_t basicbtfs_attr_show(struct kobject *kobj, struct attribute *attr, char *buf) {
+    struct basicbtfs_sb_info *sbi = container_of(kobj, struct basicbtfs_sb_info, s_kobj);
+    struct basicbtfs_attr *basicbtfs_attr = container_of(attr, struct basicbtfs_attr, attr);
+
+    return basicbtfs_attr->show(sbi, buf);
+}
+
+static ssize_t basicbtfs_attr_store(struct kobject *kobj, struct attribute *attr, const char *buf, size_t len) {
+    struct basicbtfs_sb_info *sbi = container_of(kobj, struct basicbtfs_sb_info, s_kobj);
+    struct basicbtfs_attr *basicbtfs_attr = container_of(attr, struct basicbtfs_attr, attr);
+
+    if (!basicbtfs_attr->store) return -EIO;
+
+    return basicbtfs_attr->store(sbi, buf, len);
+}
+
+/* sbi is freed by put_super, the directory only has to be gone by then */
+static void basicbtfs_sb_release(struct kobject *kobj) {
+    struct basicbtfs_sb_info *sbi = container_of(kobj, struct basicbtfs_sb_info, s_kobj);
+
+    complete(&sbi->s_kobj_unregister);
+}
+
+static const struct sysfs_ops basicbtfs_attr_ops = {
+    .show = basicbtfs_attr_show,
+    .store = basicbtfs_attr_store,
+};
+
+static struct kobj_type basicbtfs_sb_ktype = {
+    .default_attrs = basicbtfs_attrs,
+    .sysfs_ops = &basicbtfs_attr_ops,
+    .release = basicbtfs_sb_release,
+};
+
+/* Bucket the calls up to the given parts per 10000 of all calls fall in */
+static int basicbtfs_latency_percentile(uint64_t *calls, uint64_t total, uint64_t per_10000) {
+    uint64_t seen = 0;
+    int bucket = 0;
+
+    for (bucket = 0; bucket < BASICBTFS_LAT_BUCKETS - 1; bucket++) {
+        seen += calls[bucket];
+
+        if (seen * 10000 >= total * per_10000) break;
+    }
+
+    return bucket;
+}
+
+static int basicbtfs_latency_debug_show(struct seq_file *m, void *v) {
+    struct basicbtfs_sb_info *sbi = m->private;
+    uint64_t calls[BASICBTFS_LAT_BUCKETS];
+    uint64_t total = 0;
+    int i = 0, bucket = 0;
+
+    for (i = 0; i < BASICBTFS_NR_LATS; i++) {
+        total = 0;
+
+        for (bucket = 0; bucket < BASICBTFS_LAT_BUCKETS; bucket++) {
+            calls[bucket] = basicbtfs_stat_sum_latency(sbi, i, bucket);
+            total += calls[bucket];
+        }
+
+        seq_printf(m, "%s: %llu calls", basicbtfs_lat_names[i], (unsigned long long) total);
+
+        if (total) {
+            seq_printf(m, ", p50 < %llu ns, p99 < %llu ns, p99.9 < %llu ns",
+                1ULL << (basicbtfs_latency_percentile(calls, total, 5000) + 1),
+                1ULL << (basicbtfs_latency_percentile(calls, total, 9900) + 1),
+                1ULL << (basicbtfs_latency_percentile(calls, total, 9990) + 1));
+        }
+
+        seq_puts(m, "\n");
+
+        for (bucket = 0; bucket < BASICBTFS_LAT_BUCKETS; bucket++) {
+            if (!calls[bucket]) continue;
+
+            if (bucket == BASICBTFS_LAT_BUCKETS - 1) {
+                seq_printf(m, "    %12llu ns and up %12llu\n", 1ULL << bucket, (unsigned long long) calls[bucket]);
+            } else {
+                seq_printf(m, "    %12llu - %12llu ns %12llu\n", 1ULL << bucket, (1ULL << (bucket + 1)) - 1, (unsigned long long) calls[bucket]);
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int basicbtfs_latency_debug_open(struct inode *inode, struct file *file) {
+    return single_open(file, basicbtfs_latency_debug_show, inode->i_private);
+}
+
+static ssize_t basicbtfs_latency_debug_write(struct file *file, const char __user *buf, size_t len, loff_t *ppos) {
+    struct seq_file *m = file->private_data;
+
+    basicbtfs_stat_reset_latency(m->private);
+    return len;
+}
+
+static const struct file_operations basicbtfs_latency_debug_fops = {
+    .owner = THIS_MODULE,
+    .open = basicbtfs_latency_debug_open,
+    .read = seq_read,
+    .write = basicbtfs_latency_debug_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/* debugfs is optional, the mount does not care whether this works */
+static void basicbtfs_debugfs_register(struct super_block *sb) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+
+    if (!sbi->s_stats) return;
+
+    sbi->s_debugfs = debugfs_create_dir(sb->s_id, basicbtfs_debugfs_root);
+    debugfs_create_file("latency", 0600, sbi->s_debugfs, sbi, &basicbtfs_latency_debug_fops);
+}
+
+int basicbtfs_sysfs_register(struct super_block *sb) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+    int ret = 0;
+
+    init_completion(&sbi->s_kobj_unregister);
+    sbi->s_kobj.kset = basicbtfs_kset;
+    ret = kobject_init_and_add(&sbi->s_kobj, &basicbtfs_sb_ktype, NULL, "%s", sb->s_id);
+
+    if (ret) {
+        printk(KERN_ERR "Could not create /sys/fs/basicbtfs/%s: %d\n", sb->s_id, ret);
+        kobject_put(&sbi->s_kobj);
+        wait_for_completion(&sbi->s_kobj_unregister);
+        return ret;
+    }
+
+    basicbtfs_debugfs_register(sb);
+    return ret;
+}
+
+void basicbtfs_sysfs_unregister(struct super_block *sb) {
+    struct basicbtfs_sb_info *sbi = BASICBTFS_SB(sb);
+
+    if (!sbi->s_kobj.state_in_sysfs) return;
+
+    debugfs_remove_recursive(sbi->s_debugfs);
+    kobject_del(&sbi->s_kobj);
+    kobject_put(&sbi->s_kobj);
+    wait_for_completion(&sbi->s_kobj_unregister);
+}
+
+int basicbtfs_sysfs_init(void) {
+    basicbtfs_kset = kset_create_and_add("basicbtfs", NULL, fs_kobj);
+
+    if (!basicbtfs_kset) return -ENOMEM;
+
+    basicbtfs_debugfs_root = debugfs_create_dir("basicbtfs", NULL);
+    return 0;
+}
+
+void basicbtfs_sysfs_exit(void) {
+    debugfs_remove_recursive(basicbtfs_debugfs_root);
+    kset_unregister(basicbtfs_kset);
+}
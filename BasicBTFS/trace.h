@@ -0,0 +1,212 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM basicbtfs
+
+#if !defined(BASICBTFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define BASICBTFS_TRACE_H
+
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/dcache.h>
+#include <linux/ktime.h>
+#include <linux/tracepoint.h>
+
+/*
+ * Tracepoints of the hot paths, under /sys/kernel/tracing/events/basicbtfs. They cost a patched
+ * out branch while disabled. The VFS entry points pass the start they already took for their
+ * latency histogram, see stats.h, so they read the clock either way. Other callers take the
+ * start with BASICBTFS_TRACE_START, which only reads the clock when trace_<event>_enabled(),
+ * duration is 0 when the event got enabled in the middle of the call.
+ */
+#define BASICBTFS_TRACE_START(event) (trace_##event##_enabled() ? ktime_get_ns() : 0)
+#define BASICBTFS_TRACE_DURATION(start) ((start) ? ktime_get_ns() - (start) : 0)
+
+DECLARE_EVENT_CLASS(basicbtfs_namespace_class,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, int ret, u64 start),
+    TP_ARGS(dir, dentry, ret, start),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, dir)
+        __field(unsigned long, ino)
+        __field(int, ret)
+        __field(u64, duration)
+        __string(name, dentry->d_name.name)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __entry->ino = d_inode(dentry) ? d_inode(dentry)->i_ino : 0;
+        __entry->ret = ret;
+        __entry->duration = BASICBTFS_TRACE_DURATION(start);
+        __assign_str(name, dentry->d_name.name);
+    ),
+
+    TP_printk("dev %d,%d dir %lu name %s ino %lu ret %d duration %llu ns",
+        MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir, __get_str(name),
+        __entry->ino, __entry->ret, __entry->duration)
+);
+
+/* create and mkdir, ino is the new inode */
+DEFINE_EVENT(basicbtfs_namespace_class, basicbtfs_create,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, int ret, u64 start),
+    TP_ARGS(dir, dentry, ret, start)
+);
+
+/* ino is 0 for a negative lookup */
+DEFINE_EVENT(basicbtfs_namespace_class, basicbtfs_lookup,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, int ret, u64 start),
+    TP_ARGS(dir, dentry, ret, start)
+);
+
+DEFINE_EVENT(basicbtfs_namespace_class, basicbtfs_unlink,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, int ret, u64 start),
+    TP_ARGS(dir, dentry, ret, start)
+);
+
+/* bno is 0 for a hole that was not allocated */
+TRACE_EVENT(basicbtfs_get_block,
+    TP_PROTO(struct inode *inode, sector_t iblock, struct buffer_head *bh, int create, int ret, u64 start),
+    TP_ARGS(inode, iblock, bh, create, ret, start),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, ino)
+        __field(sector_t, iblock)
+        __field(sector_t, bno)
+        __field(int, create)
+        __field(int, ret)
+        __field(u64, duration)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = inode->i_sb->s_dev;
+        __entry->ino = inode->i_ino;
+        __entry->iblock = iblock;
+        __entry->bno = buffer_mapped(bh) ? bh->b_blocknr : 0;
+        __entry->create = create;
+        __entry->ret = ret;
+        __entry->duration = BASICBTFS_TRACE_DURATION(start);
+    ),
+
+    TP_printk("dev %d,%d ino %lu iblock %llu bno %llu create %d ret %d duration %llu ns",
+        MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+        (unsigned long long) __entry->iblock, (unsigned long long) __entry->bno,
+        __entry->create, __entry->ret, __entry->duration)
+);
+
+/* a new cluster of a file, the duration includes zeroing it */
+TRACE_EVENT(basicbtfs_alloc,
+    TP_PROTO(struct inode *inode, uint32_t cluster_index, int bno, uint32_t len, u64 start),
+    TP_ARGS(inode, cluster_index, bno, len, start),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, ino)
+        __field(uint32_t, cluster_index)
+        __field(int, bno)
+        __field(uint32_t, len)
+        __field(u64, duration)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = inode->i_sb->s_dev;
+        __entry->ino = inode->i_ino;
+        __entry->cluster_index = cluster_index;
+        __entry->bno = bno;
+        __entry->len = len;
+        __entry->duration = BASICBTFS_TRACE_DURATION(start);
+    ),
+
+    TP_printk("dev %d,%d ino %lu cluster %u bno %d len %u duration %llu ns",
+        MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->cluster_index,
+        __entry->bno, __entry->len, __entry->duration)
+);
+
+/* len blocks copied from src to dst by one of the defrag passes */
+TRACE_EVENT(basicbtfs_defrag_move,
+    TP_PROTO(struct super_block *sb, uint32_t src, uint32_t dst, uint32_t len, int ret, u64 start),
+    TP_ARGS(sb, src, dst, len, ret, start),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(uint32_t, src)
+        __field(uint32_t, dst)
+        __field(uint32_t, len)
+        __field(int, ret)
+        __field(u64, duration)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->src = src;
+        __entry->dst = dst;
+        __entry->len = len;
+        __entry->ret = ret;
+        __entry->duration = BASICBTFS_TRACE_DURATION(start);
+    ),
+
+    TP_printk("dev %d,%d src %u dst %u len %u ret %d duration %llu ns",
+        MAJOR(__entry->dev), MINOR(__entry->dev), __entry->src, __entry->dst,
+        __entry->len, __entry->ret, __entry->duration)
+);
+
+/* a directory tree repacked by the bulk loader, only traced once the old tree is freed */
+TRACE_EVENT(basicbtfs_btree_rebuild,
+    TP_PROTO(struct inode *inode, uint32_t nr_of_entries, uint32_t nr_of_nodes, uint32_t height),
+    TP_ARGS(inode, nr_of_entries, nr_of_nodes, height),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, ino)
+        __field(uint32_t, nr_of_entries)
+        __field(uint32_t, nr_of_nodes)
+        __field(uint32_t, height)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = inode->i_sb->s_dev;
+        __entry->ino = inode->i_ino;
+        __entry->nr_of_entries = nr_of_entries;
+        __entry->nr_of_nodes = nr_of_nodes;
+        __entry->height = height;
+    ),
+
+    TP_printk("dev %d,%d dir %lu entries %u nodes %u height %u",
+        MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+        __entry->nr_of_entries, __entry->nr_of_nodes, __entry->height)
+);
+
+/* a whole-disk defrag run, planned is 0 for the swap mode, which moves without a plan */
+TRACE_EVENT(basicbtfs_defrag_disk,
+    TP_PROTO(struct super_block *sb, uint32_t planned, int ret, uint32_t unused_before, uint32_t unused_after),
+    TP_ARGS(sb, planned, ret, unused_before, unused_after),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(uint32_t, planned)
+        __field(int, ret)
+        __field(uint32_t, unused_before)
+        __field(uint32_t, unused_after)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->planned = planned;
+        __entry->ret = ret;
+        __entry->unused_before = unused_before;
+        __entry->unused_after = unused_after;
+    ),
+
+    TP_printk("dev %d,%d planned %u ret %d unused area %u -> %u",
+        MAJOR(__entry->dev), MINOR(__entry->dev), __entry->planned, __entry->ret,
+        __entry->unused_before, __entry->unused_after)
+);
+
+#endif /* BASICBTFS_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>
@@ -0,0 +1,49 @@
+#!/usr/bin/env bash
+#!/bin/bash
+
+# Metadata benchmark of Linux FAT, create, stat, readdir, a mixed workload, rename and
+# unlink of FILES empty files in a flat and in a deep tree, see ../metadata_benchmark.py.
+# Every tree and number of files starts on a fresh filesystem. 10M files take a while,
+# pass them explicitly: FILES="10000 100000 1000000 10000000" ./benchmark_metadata.sh.
+# A tree the filesystem cannot hold, FAT caps a directory at 65536 entries,
+# ends its create phase early, the errors column of the csv says so.
+# Results end up in ../Results/tmpfs/metadata/linfatfsmd/metadata.csv
+
+OUT_DIR=Results/tmpfs/metadata/linfatfsmd
+CSV=../$OUT_DIR/metadata.csv
+ROOT_DIR="test/mnt"
+FILES=${FILES:-"10000 100000 1000000"}
+RUNS=${RUNS:-3}
+
+init() {
+    mkdir -p test
+    sudo mount -t tmpfs -o size=20G tmpfs test
+    mkdir $ROOT_DIR
+    dd if=/dev/zero of=test/test.img bs=1 count=0 seek=15G
+}
+
+mount_fs() {
+    mkfs.fat test/test.img > /dev/null
+    sudo mount -o loop -t vfat test/test.img $ROOT_DIR
+}
+
+sudo rm -rf ../$OUT_DIR
+mkdir -p ../$OUT_DIR
+../metadata_benchmark.py --header > $CSV
+
+init
+
+for tree in flat deep;
+do
+    for files in $FILES;
+    do
+        for (( run=0 ; run<$RUNS ; run++ ));
+        do
+            mount_fs
+            sudo ../metadata_benchmark.py $ROOT_DIR linfatfsmd $tree $files $run | tee -a $CSV
+            sudo umount $ROOT_DIR
+        done
+    done
+done
+
+./clean.sh
@@ -221,6 +221,123 @@ def plot():
     plot_fig_avg(df_lat, "size", "r_lat_mean", "Read_Latency", configs_lat, "Latency [\u03bcsec]")
     plot_fig_avg(df_lat, "size", "w_lat_mean", "Write_Latency", configs_lat, "Latency [\u03bcsec]")
 
+def handle_metadata():
+    bench_dir = os.path.join('tmpfs', 'metadata')
+    frames = []
+
+    for dirname in sorted(os.listdir(bench_dir)):
+        csv_file = os.path.join(bench_dir, dirname, 'metadata.csv')
+
+        if os.path.isfile(csv_file):
+            frames.append(pandas.read_csv(csv_file))
+            print("Succesfully processed file %s" % csv_file)
+
+    df = pandas.concat(frames)
+    df.to_csv(os.path.join("csv", "metadata.csv"), index=False)
+    return df
+
+# One figure per tree shape and metric, one subplot per phase of metadata_benchmark.py
+def plot_metadata(df):
+    configs_md = {"btfsmd" : "BasicBtreeFS",
+                  "btfsnocachemd" : "BasicBtreeFSNoCache",
+                  "ftfsmd" : "BasicLinkFS",
+                  "linbtrfsmd" : "Linux BTRFS",
+                  "linfatfsmd" : "Linux FAT/MSDOS"}
+    phases = ["create", "stat", "readdir", "mixed", "rename", "unlink"]
+    metrics = {"ops_per_s" : "Operations [1/s]", "p99_us" : "p99 latency [\u03bcsec]"}
+
+    df = df.groupby(['config', 'tree', 'files', 'phase'], as_index=False).mean(numeric_only=True)
+
+    for tree in df["tree"].unique():
+        for metric, ylabel in metrics.items():
+            fig, axes = plt.subplots(2, 3, figsize=(15, 8))
+
+            for ax, phase in zip(axes.flat, phases):
+                for config, label in configs_md.items():
+                    cur_df = df[(df["config"] == config) & (df["tree"] == tree) & (df["phase"] == phase)]
+
+                    if len(cur_df):
+                        ax.plot(cur_df["files"], cur_df[metric], label=label, marker='o')
+
+                ax.set_xscale('log')
+                ax.set_title(phase)
+                ax.set_xlabel("Files")
+                ax.set_ylabel(ylabel)
+
+            axes.flat[0].legend()
+            fig.tight_layout()
+            fig.savefig("Metadata_%s_%s.pdf" % (tree, metric), bbox_inches='tight')
+            plt.close(fig)
+
+# tmpfs/scale/<config>/<files>_<read percentage>/<jobs>/<run>.output, see benchmark_scale.sh
+def handle_scale():
+    bench_dir = os.path.join('tmpfs', 'scale')
+    header = ['config', 'files', 'mix', 'jobs', 'run', 'r_bw', 'r_iops', 'w_bw', 'w_iops']
+
+    with open(os.path.join("csv", "scale.csv"), 'w', encoding='UTF8', newline='') as csvfile:
+        writer = csv.writer(csvfile, delimiter=',')
+        writer.writerow(header)
+
+        for config in sorted(os.listdir(bench_dir)):
+            for combination in sorted(os.listdir(os.path.join(bench_dir, config))):
+                files, mix = combination.split("_")
+
+                for jobs in os.listdir(os.path.join(bench_dir, config, combination)):
+                    jobs_dir = os.path.join(bench_dir, config, combination, jobs)
+
+                    for filename in sorted(os.listdir(jobs_dir)):
+                        file = os.path.join(jobs_dir, filename)
+
+                        if not file.endswith(".output"):
+                            continue
+
+                        try:
+                            with open(file) as f:
+                                cur_data = json.load(f)
+                                writer.writerow([config, files, int(mix), int(jobs), filename[:-len(".output")],
+                                                 get_read_bw(cur_data), get_read_iops(cur_data),
+                                                 get_write_bw(cur_data), get_write_iops(cur_data)])
+                            print("Succesfully processed file %s" % file)
+                        except json.decoder.JSONDecodeError:
+                            print("something went wrong opening file %s" % file)
+
+    return pandas.read_csv(os.path.join("csv", "scale.csv"))
+
+# Throughput against the number of fio jobs, one figure per file layout, one subplot per read percentage
+def plot_scale(df):
+    configs_scale = {"btfsscale" : "BasicBtreeFS",
+                     "btfsnocachescale" : "BasicBtreeFSNoCache",
+                     "ftfsscale" : "BasicLinkFS",
+                     "linbtrfsscale" : "Linux BTRFS",
+                     "linfatfsscale" : "Linux FAT/MSDOS"}
+
+    # fio reports bw in KiB/s, group_reporting sums it over the jobs
+    df["bw"] = (df["r_bw"] + df["w_bw"]) / 1024
+    df = df.groupby(['config', 'files', 'mix', 'jobs'], as_index=False).mean(numeric_only=True)
+
+    for files in df["files"].unique():
+        mixes = sorted(df["mix"].unique(), reverse=True)
+        fig, axes = plt.subplots(1, len(mixes), figsize=(5 * len(mixes), 4), squeeze=False)
+
+        for ax, mix in zip(axes.flat, mixes):
+            for config, label in configs_scale.items():
+                cur_df = df[(df["config"] == config) & (df["files"] == files) & (df["mix"] == mix)].sort_values("jobs")
+
+                if len(cur_df):
+                    ax.plot(cur_df["jobs"], cur_df["bw"], label=label, marker='o')
+
+            ax.set_xscale('log', base=2)
+            ax.set_xticks(sorted(df["jobs"].unique()))
+            ax.set_xticklabels(sorted(df["jobs"].unique()))
+            ax.set_title("%s files, %d%% reads" % (files, mix))
+            ax.set_xlabel("Jobs")
+            ax.set_ylabel("Throughput [MiB/s]")
+
+        axes.flat[0].legend()
+        fig.tight_layout()
+        fig.savefig("Scale_%s.pdf" % files, bbox_inches='tight')
+        plt.close(fig)
+
 
 if __name__=="__main__":
 
@@ -232,4 +349,10 @@ if __name__=="__main__":
     handle_benchmark(lat_dir, header)
     plot()
 
+    if os.path.isdir(os.path.join('tmpfs', 'metadata')):
+        plot_metadata(handle_metadata())
+
+    if os.path.isdir(os.path.join('tmpfs', 'scale')):
+        plot_scale(handle_scale())
+
 
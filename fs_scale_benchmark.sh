@@ -0,0 +1,24 @@
+#!/usr/bin/env bash
+#!/bin/bash
+
+cd BasicBTFS
+
+./clean.sh && ./benchmark_scale.sh && ./clean.sh
+
+cd ../BasicBTFSNC
+
+./clean.sh && ./benchmark_scale.sh && ./clean.sh
+
+cd ../BasicFATFS
+
+./clean.sh && ./benchmark_scale.sh && ./clean.sh
+
+cd ../BTRFS
+
+./clean.sh && ./benchmark_scale.sh && ./clean.sh
+
+cd ../FATFS
+
+./clean.sh && ./benchmark_scale.sh && ./clean.sh
+
+cd ..
\ No newline at end of file
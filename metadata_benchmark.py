@@ -0,0 +1,187 @@
+#!/usr/bin/env python3
+
+# Metadata workload shared by the benchmark_metadata.sh script of every filesystem. On an
+# empty mounted filesystem it creates a tree of empty files and times, phase by phase:
+#
+#   create   open(O_CREAT) and close of every file
+#   stat     stat of every file, in random order
+#   readdir  listing of every directory
+#   mixed    an mdtest/fs_mark style mix of stat, create, unlink, rename and readdir, the
+#            readdir only lists the first READDIR_PAGE entries, as ls | head would
+#   rename   rename of every file within its directory
+#   unlink   removal of every file
+#
+# The tree is either flat, all files in one directory, or deep, the files spread over every
+# directory of a tree with BRANCHING subdirectories per directory, DEPTH levels down, the way
+# mdtest -b -z does. The caches are dropped before every phase but create, so stat and readdir
+# go to the disk. Random choices come from a fixed seed, two runs do the same operations.
+#
+# A phase stops at the first error of create, a full directory or filesystem, the ones after
+# it run on the files that made it. Every phase is one csv row on stdout:
+#   ./metadata_benchmark.py --header
+#   sudo ./metadata_benchmark.py <mountpoint> <config> <flat|deep> <files> <run>
+
+import array
+import os
+import random
+import sys
+import time
+
+BRANCHING = 10
+DEPTH = 3
+MIXED_OPS = 100000
+READDIR_PAGE = 128
+MIXED_WEIGHTS = [("stat", 40), ("create", 20), ("unlink", 20), ("rename", 10), ("readdir", 10)]
+SEED = 42
+
+HEADER = "config,tree,files,run,phase,ops,errors,seconds,ops_per_s,p50_us,p99_us,p999_us"
+
+def drop_caches():
+    os.sync()
+    with open("/proc/sys/vm/drop_caches", "w") as f:
+        f.write("3\n")
+
+def make_tree(root, tree):
+    dirs = [os.path.join(root, tree)]
+    os.mkdir(dirs[0])
+
+    if tree == "deep":
+        level = dirs
+
+        for depth in range(DEPTH):
+            next_level = []
+
+            for parent in level:
+                for b in range(BRANCHING):
+                    next_level.append(os.path.join(parent, "dir_%d" % b))
+                    os.mkdir(next_level[-1])
+
+            dirs += next_level
+            level = next_level
+
+    return dirs
+
+class Phase:
+    def __init__(self, name):
+        self.name = name
+        self.latency = array.array("Q")
+        self.errors = 0
+        self.start = time.perf_counter()
+
+    def time(self, op, *args):
+        start = time.perf_counter_ns()
+
+        try:
+            op(*args)
+        except OSError:
+            self.errors += 1
+            return False
+
+        self.latency.append(time.perf_counter_ns() - start)
+        return True
+
+    def row(self, prefix):
+        seconds = time.perf_counter() - self.start
+        ops = len(self.latency)
+        latency = sorted(self.latency)
+        percentile = lambda q: latency[min(int(ops * q), ops - 1)] / 1000 if ops else 0
+
+        return "%s,%s,%d,%d,%f,%f,%f,%f,%f" % (prefix, self.name, ops, self.errors, seconds,
+            ops / seconds if seconds else 0, percentile(0.5), percentile(0.99), percentile(0.999))
+
+def create(path):
+    os.close(os.open(path, os.O_CREAT | os.O_WRONLY, 0o644))
+
+def readdir(path, limit=None):
+    with os.scandir(path) as it:
+        for i, entry in enumerate(it):
+            if i + 1 == limit: break
+
+def run(root, config, tree, files, run_nr):
+    prefix = "%s,%s,%d,%d" % (config, tree, files, run_nr)
+    rng = random.Random(SEED)
+    dirs = make_tree(root, tree)
+    live = []
+
+    phase = Phase("create")
+
+    for i in range(files):
+        path = os.path.join(dirs[i % len(dirs)], "file_%d" % i)
+
+        if not phase.time(create, path): break
+
+        live.append(path)
+
+    print(phase.row(prefix), flush=True)
+
+    drop_caches()
+    phase = Phase("stat")
+    order = list(range(len(live)))
+    rng.shuffle(order)
+
+    for i in order:
+        phase.time(os.stat, live[i])
+
+    print(phase.row(prefix), flush=True)
+
+    drop_caches()
+    phase = Phase("readdir")
+
+    for path in dirs:
+        phase.time(readdir, path)
+
+    print(phase.row(prefix), flush=True)
+
+    drop_caches()
+    phase = Phase("mixed")
+    ops = [op for op, weight in MIXED_WEIGHTS for _ in range(weight)]
+
+    for k in range(MIXED_OPS):
+        op = rng.choice(ops) if live else "create"
+
+        if op == "stat":
+            phase.time(os.stat, rng.choice(live))
+        elif op == "create":
+            path = os.path.join(rng.choice(dirs), "mixed_%d" % k)
+
+            if phase.time(create, path): live.append(path)
+        elif op == "unlink":
+            i = rng.randrange(len(live))
+            live[i], live[-1] = live[-1], live[i]
+            phase.time(os.unlink, live.pop())
+        elif op == "rename":
+            i = rng.randrange(len(live))
+            path = os.path.join(os.path.dirname(live[i]), "moved_%d" % k)
+
+            if phase.time(os.rename, live[i], path): live[i] = path
+        else:
+            phase.time(readdir, rng.choice(dirs), READDIR_PAGE)
+
+    print(phase.row(prefix), flush=True)
+
+    drop_caches()
+    phase = Phase("rename")
+
+    for i in range(len(live)):
+        path = os.path.join(os.path.dirname(live[i]), "renamed_%d" % i)
+
+        if phase.time(os.rename, live[i], path): live[i] = path
+
+    print(phase.row(prefix), flush=True)
+
+    drop_caches()
+    phase = Phase("unlink")
+
+    for path in live:
+        phase.time(os.unlink, path)
+
+    print(phase.row(prefix), flush=True)
+
+if __name__ == "__main__":
+    if len(sys.argv) == 2 and sys.argv[1] == "--header":
+        print(HEADER)
+    elif len(sys.argv) == 6:
+        run(sys.argv[1], sys.argv[2], sys.argv[3], int(sys.argv[4]), int(sys.argv[5]))
+    else:
+        print("usage: %s --header | <mountpoint> <config> <flat|deep> <files> <run>" % sys.argv[0], file=sys.stderr)
+        sys.exit(1)